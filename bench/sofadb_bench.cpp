@@ -0,0 +1,331 @@
+#include <benchmark/benchmark.h>
+#include <stdlib.h>
+#include "engine.h"
+#include "database.h"
+#include "conflict.h"
+#include "storage_interface.h"
+
+using namespace sofadb;
+
+/**
+	Synthetic corpora shaped after the documents we actually store:
+	- small: ~250 bytes, a user profile
+	- medium: ~6KB, a blog post with its comments
+	- large: ~150KB, a track with its tag statistics
+	Generation is deterministic, so the numbers are comparable between
+	runs and machines.
+  */
+enum corpus_size_e { corpus_small, corpus_medium, corpus_large };
+static const char *corpus_names[] = {"small", "medium", "large"};
+static const size_t corpus_docs = 64;
+
+class corpus_rng
+{
+	uint64_t state_;
+public:
+	corpus_rng(uint64_t seed) : state_(seed*2654435761ULL+1) {}
+
+	uint64_t next()
+	{
+		state_^=state_<<13;
+		state_^=state_>>7;
+		state_^=state_<<17;
+		return state_;
+	}
+	int64_t range(int64_t lo, int64_t hi)
+	{
+		return lo+int64_t(next()%uint64_t(hi-lo));
+	}
+	jstring_t word()
+	{
+		static const char *words[] = {"lorem", "ipsum", "dolor", "sit",
+			"amet", "consectetur", "adipiscing", "elit", "sed", "do",
+			"eiusmod", "tempor", "incididunt", "ut", "labore", "magna",
+			"été", "naïve", "\"quoted\"", "tab\there"};
+		return words[next()%(sizeof(words)/sizeof(words[0]))];
+	}
+	jstring_t text(size_t words)
+	{
+		jstring_t res;
+		for(size_t f=0;f<words;++f)
+		{
+			if (f)
+				res.push_back(' ');
+			res+=word();
+		}
+		return res;
+	}
+};
+
+static json_value make_user(corpus_rng &rng, size_t idx)
+{
+	json_value res(submap_d);
+	res["type"]=json_value(jstring_t("user"));
+	res["name"]=json_value("user "+int_to_string(idx));
+	res["email"]=json_value("user"+int_to_string(idx)+"@example.com");
+	res["age"]=json_value(rng.range(18, 90));
+	res["active"]=json_value(rng.next()%2==0);
+	res["score"]=json_value(rng.range(0, 100000)/100.0);
+	res["tags"]=json_value(sublist_d);
+	for(int f=rng.range(1, 5);f>0;--f)
+		res["tags"].get_sublist().push_back(json_value(rng.word()));
+	return res;
+}
+
+static json_value make_post(corpus_rng &rng, size_t idx)
+{
+	json_value res(submap_d);
+	res["type"]=json_value(jstring_t("post"));
+	res["title"]=json_value(rng.text(8));
+	res["body"]=json_value(rng.text(300));
+	res["created_at"]=json_value(int64_t(1300000000+idx*3600));
+	res["author"]=make_user(rng, idx);
+	res["comments"]=json_value(sublist_d);
+	for(int f=rng.range(10, 30);f>0;--f)
+	{
+		json_value comment(submap_d);
+		comment["author"]=json_value("user "+int_to_string(rng.range(0, 1000)));
+		comment["text"]=json_value(rng.text(rng.range(5, 30)));
+		comment["likes"]=json_value(rng.range(0, 500));
+		res["comments"].get_sublist().push_back(std::move(comment));
+	}
+	return res;
+}
+
+static json_value make_track(corpus_rng &rng, size_t idx)
+{
+	json_value res(submap_d);
+	res["type"]=json_value(jstring_t("track"));
+	res["metadata"]=json_value(submap_d);
+	res["metadata"]["track_id"]=json_value("TR"+int_to_string(idx));
+	res["metadata"]["title"]=json_value(rng.text(4));
+	res["metadata"]["year"]=json_value(rng.range(1950, 2013));
+	res["metadata"]["duration"]=json_value(rng.range(60000, 600000)/1000.0);
+	res["tags"]=json_value(sublist_d);
+	for(int f=0;f<3000;++f)
+	{
+		json_value tag(sublist_d);
+		tag.get_sublist().push_back(json_value(rng.text(2)));
+		tag.get_sublist().push_back(json_value(rng.range(0, 100)));
+		res["tags"].get_sublist().push_back(std::move(tag));
+	}
+	return res;
+}
+
+struct corpus_t
+{
+	std::vector<json_value> docs_;
+	std::vector<jstring_t> texts_;
+	size_t bytes_;
+};
+
+static const corpus_t& get_corpus(int size)
+{
+	static corpus_t corpora[3];
+	corpus_t &res=corpora[size];
+	if (!res.docs_.empty())
+		return res;
+
+	corpus_rng rng(size+1);
+	res.bytes_=0;
+	for(size_t f=0;f<corpus_docs;++f)
+	{
+		switch(size)
+		{
+			case corpus_small: res.docs_.push_back(make_user(rng, f)); break;
+			case corpus_medium: res.docs_.push_back(make_post(rng, f)); break;
+			default: res.docs_.push_back(make_track(rng, f)); break;
+		}
+		res.texts_.push_back(json_to_string(res.docs_.back()));
+		res.bytes_+=res.texts_.back().size();
+	}
+	return res;
+}
+
+static void label_corpus(benchmark::State &state, const corpus_t &corpus,
+						 size_t processed)
+{
+	state.SetLabel(corpus_names[state.range(0)]);
+	state.SetItemsProcessed(processed);
+	state.SetBytesProcessed(processed*(corpus.bytes_/corpus.docs_.size()));
+}
+
+static void BM_string_to_json(benchmark::State &state)
+{
+	const corpus_t &corpus=get_corpus(state.range(0));
+	size_t idx=0;
+	for(auto _ : state)
+	{
+		json_value res=string_to_json(corpus.texts_[idx++%corpus_docs]);
+		benchmark::DoNotOptimize(res);
+	}
+	label_corpus(state, corpus, idx);
+}
+BENCHMARK(BM_string_to_json)->DenseRange(corpus_small, corpus_large);
+
+static void BM_json_to_string(benchmark::State &state)
+{
+	const corpus_t &corpus=get_corpus(state.range(0));
+	size_t idx=0;
+	jstring_t res;
+	for(auto _ : state)
+	{
+		res.clear();
+		json_to_string(res, corpus.docs_[idx++%corpus_docs]);
+		benchmark::DoNotOptimize(res);
+	}
+	label_corpus(state, corpus, idx);
+}
+BENCHMARK(BM_json_to_string)->DenseRange(corpus_small, corpus_large);
+
+static void BM_json_copy(benchmark::State &state)
+{
+	const corpus_t &corpus=get_corpus(state.range(0));
+	size_t idx=0;
+	for(auto _ : state)
+	{
+		json_value copy=corpus.docs_[idx++%corpus_docs];
+		benchmark::DoNotOptimize(copy);
+	}
+	label_corpus(state, corpus, idx);
+}
+BENCHMARK(BM_json_copy)->DenseRange(corpus_small, corpus_large);
+
+static void BM_json_compare(benchmark::State &state)
+{
+	//Equal documents, so the whole tree is compared
+	const corpus_t &corpus=get_corpus(state.range(0));
+	const std::vector<json_value> copies=corpus.docs_;
+	size_t idx=0;
+	for(auto _ : state)
+	{
+		const size_t cur=idx++%corpus_docs;
+		bool res=corpus.docs_[cur]==copies[cur];
+		benchmark::DoNotOptimize(res);
+	}
+	label_corpus(state, corpus, idx);
+}
+BENCHMARK(BM_json_compare)->DenseRange(corpus_small, corpus_large);
+
+static void BM_revision_parse(benchmark::State &state)
+{
+	std::vector<jstring_t> revs;
+	corpus_rng rng(42);
+	for(size_t f=0;f<corpus_docs;++f)
+	{
+		char buf[64];
+		snprintf(buf, sizeof(buf), "%d-%016llx%016llx", int(rng.range(1, 2000)),
+				 (unsigned long long)rng.next(), (unsigned long long)rng.next());
+		revs.push_back(buf);
+	}
+	size_t idx=0;
+	for(auto _ : state)
+	{
+		revision_num_t rev(revs[idx++%corpus_docs]);
+		benchmark::DoNotOptimize(rev);
+	}
+	state.SetItemsProcessed(idx);
+}
+BENCHMARK(BM_revision_parse);
+
+static void BM_resolver_merge(benchmark::State &state)
+{
+	//A revlog with the given number of conflicts, the merged revision is
+	//one of them so every iteration does the full work without growing it
+	corpus_rng rng(7);
+	json_value log;
+	revlog_wrapper w(log);
+	w.init();
+	for(int f=1;f<=10;++f)
+		w.add_rev_info(revision_num_t(f, "ffffffffffffffffffffffffffffffff"),
+					   true, false);
+	revision_num_t loser;
+	for(int64_t f=0;f<state.range(0);++f)
+	{
+		char buf[64];
+		snprintf(buf, sizeof(buf), "%d-%016llx%016llx", int(rng.range(1, 10)),
+				 (unsigned long long)rng.next(), (unsigned long long)rng.next());
+		loser=revision_num_t(buf);
+		resolver(&log).merge(loser, sublist_t());
+	}
+	if (loser.empty())
+		loser=revision_num_t("1-00000000000000000000000000000000");
+
+	for(auto _ : state)
+	{
+		resolver(&log).merge(loser, sublist_t());
+		benchmark::DoNotOptimize(log);
+	}
+	state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_resolver_merge)->Arg(0)->Arg(16)->Arg(256);
+
+class engine_fixture : public benchmark::Fixture
+{
+public:
+	boost::shared_ptr<DbEngine> engine_;
+	database_ptr db_;
+	storage_ptr_t stg_;
+
+	virtual void SetUp(const benchmark::State &)
+	{
+		jstring_t templ("/tmp/sofa_bench_XXXXXX");
+		if (!mkdtemp(&templ[0]))
+			throw std::runtime_error("Can't create a temporary directory");
+		engine_.reset(new DbEngine(templ, true));
+		db_=engine_->create_a_database("bench");
+		stg_=engine_->create_storage(false);
+	}
+
+	virtual void TearDown(const benchmark::State &)
+	{
+		stg_.reset();
+		db_.reset();
+		engine_.reset();
+	}
+};
+
+BENCHMARK_DEFINE_F(engine_fixture, BM_database_put)(benchmark::State &state)
+{
+	const corpus_t &corpus=get_corpus(state.range(0));
+	size_t idx=0;
+	for(auto _ : state)
+	{
+		put_result_t res=db_->put(stg_.get(), "doc"+int_to_string(idx),
+			revision_num_t(), corpus.docs_[idx%corpus_docs]);
+		++idx;
+		benchmark::DoNotOptimize(res);
+	}
+	label_corpus(state, corpus, idx);
+}
+BENCHMARK_REGISTER_F(engine_fixture, BM_database_put)
+	->DenseRange(corpus_small, corpus_large);
+
+BENCHMARK_DEFINE_F(engine_fixture, BM_database_get)(benchmark::State &state)
+{
+	const corpus_t &corpus=get_corpus(state.range(0));
+	const size_t docs=1000;
+	batch_storage_ptr_t batch=engine_->create_batch_storage();
+	for(size_t f=0;f<docs;++f)
+		db_->put(batch.get(), "doc"+int_to_string(f), revision_num_t(),
+				 corpus.docs_[f%corpus_docs]);
+	batch->commit(false);
+
+	corpus_rng rng(3);
+	size_t idx=0;
+	for(auto _ : state)
+	{
+		json_value content;
+		revision_t rev;
+		if (!db_->get(stg_.get(), "doc"+int_to_string(rng.next()%docs), 0,
+					  &content, &rev))
+			state.SkipWithError("Missing document");
+		++idx;
+		benchmark::DoNotOptimize(content);
+	}
+	label_corpus(state, corpus, idx);
+}
+BENCHMARK_REGISTER_F(engine_fixture, BM_database_get)
+	->DenseRange(corpus_small, corpus_large);
+
+BENCHMARK_MAIN();
@@ -0,0 +1,323 @@
+#include "attachment.h"
+#include "storage_interface.h"
+#include "errors.h"
+#include <openssl/md5.h>
+#include <openssl/evp.h>
+#include <zlib.h>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+
+using namespace sofadb;
+
+//Same level CouchDB uses by default
+static const int compression_level = 8;
+//Deflate window bits with the gzip wrapper, so stored blobs can be
+//served with Content-Encoding: gzip as they are
+static const int gzip_window_bits = 16+15;
+
+bool sofadb::is_compressible_type(const jstring_t &content_type)
+{
+	jstring_t type=content_type.substr(0, content_type.find(';'));
+	type.erase(type.find_last_not_of(" \t")+1);
+	std::transform(type.begin(), type.end(), type.begin(), ::tolower);
+
+	return type.compare(0, 5, "text/")==0 ||
+			type=="application/javascript" ||
+			type=="application/json" ||
+			type=="application/xml";
+}
+
+static jstring_t md5_to_hex(const uint8_t *md5)
+{
+	static const char alphabet[17]="0123456789abcdef";
+	jstring_t res;
+	res.resize(MD5_DIGEST_LENGTH*2);
+	for(int f=0;f<MD5_DIGEST_LENGTH;++f)
+	{
+		res[f*2]=alphabet[md5[f]/16];
+		res[f*2+1]=alphabet[md5[f]%16];
+	}
+	return res;
+}
+
+static void hex_to_md5(const jstring_t &hex, uint8_t *md5)
+{
+	if (hex.size()!=MD5_DIGEST_LENGTH*2 ||
+			hex.find_first_not_of("0123456789abcdef")!=jstring_t::npos)
+		err(result_code_t::sError) << "Invalid attachment digest " << hex;
+	for(int f=0;f<MD5_DIGEST_LENGTH;++f)
+	{
+		const char hi=hex[f*2], lo=hex[f*2+1];
+		md5[f]=(hi<='9' ? hi-'0' : hi-'a'+10)*16 +
+				(lo<='9' ? lo-'0' : lo-'a'+10);
+	}
+}
+
+static void append_chunk_index(jstring_t &out, uint32_t idx)
+{
+	//Big-endian so the chunks are iterated in order
+	for(int f=3;f>=0;--f)
+		out.push_back(static_cast<char>(idx >> (8*f)));
+}
+
+//Unique for the lifetime of the storage: start time plus a counter
+static jstring_t make_blob_id()
+{
+	static std::atomic<uint64_t> counter(
+		std::chrono::system_clock::now().time_since_epoch().count());
+	uint64_t id=counter++;
+	static const char alphabet[17]="0123456789abcdef";
+	jstring_t res(16, '0');
+	for(int f=15;f>=0;--f, id>>=4)
+		res[f]=alphabet[id & 0xF];
+	return res;
+}
+
+json_value sofadb::attachments_to_json(const attachment_vector_t &atts)
+{
+	//[[name, content_type, md5, length, encoded_length, compressed], ...]
+	json_value res(sublist_d);
+	sublist_t &lst=res.get_sublist();
+	lst.reserve(atts.size());
+	for(auto i=atts.begin(), iend=atts.end(); i!=iend; ++i)
+	{
+		json_value att(sublist_d);
+		sublist_t &fields=att.get_sublist();
+		fields.reserve(6);
+		fields.push_back(json_value(i->name_));
+		fields.push_back(json_value(i->content_type_));
+		fields.push_back(json_value(md5_to_hex(i->md5_)));
+		fields.push_back(json_value(int64_t(i->length_)));
+		fields.push_back(json_value(int64_t(i->encoded_length_)));
+		fields.push_back(json_value(i->compressed_));
+		lst.push_back(std::move(att));
+	}
+	return res;
+}
+
+void sofadb::attachments_from_json(const json_value &val,
+								   attachment_vector_t &res)
+{
+	res.clear();
+	if (val.type()==nil_d)
+		return; //No attachments
+	const sublist_t &lst=val.get_sublist();
+	res.resize(lst.size());
+	for(size_t f=0;f<lst.size();++f)
+	{
+		const sublist_t &fields=lst[f].get_sublist();
+		inline_attachment_t &att=res[f];
+		att.name_=fields.at(0).get_str();
+		att.content_type_=fields.at(1).get_str();
+		hex_to_md5(fields.at(2).get_str(), att.md5_);
+		att.length_=fields.at(3).get_int();
+		att.encoded_length_=fields.at(4).get_int();
+		att.compressed_=fields.at(5).get_bool();
+	}
+}
+
+struct attachment_writer::state_t
+{
+	EVP_MD_CTX *md5_;
+	z_stream zstream_;
+	bool compressing_;
+
+	state_t() : md5_(EVP_MD_CTX_new()), zstream_(), compressing_() {}
+	~state_t()
+	{
+		EVP_MD_CTX_free(md5_);
+	}
+};
+
+attachment_writer::attachment_writer(storage_t *ifc, const jstring_t &prefix,
+	const jstring_t &name, const jstring_t &content_type) :
+	ifc_(ifc), prefix_(prefix), blob_id_(make_blob_id()),
+	state_(new state_t()), chunks_()
+{
+	info_.name_=name;
+	info_.content_type_=content_type;
+	info_.compressed_=is_compressible_type(content_type);
+
+	if (!state_->md5_ || !EVP_DigestInit_ex(state_->md5_, EVP_md5(), 0))
+		err(result_code_t::sError) << "Can't initialize the digest";
+	if (info_.compressed_)
+	{
+		if (deflateInit2(&state_->zstream_, compression_level, Z_DEFLATED,
+						 gzip_window_bits, 8, Z_DEFAULT_STRATEGY)!=Z_OK)
+			err(result_code_t::sError) << "Can't initialize compression";
+		state_->compressing_=true;
+	}
+}
+
+attachment_writer::~attachment_writer()
+{
+	if (state_->compressing_)
+		deflateEnd(&state_->zstream_);
+}
+
+void attachment_writer::write(const char *data, size_t len)
+{
+	EVP_DigestUpdate(state_->md5_, data, len);
+	info_.length_+=len;
+	if (info_.compressed_)
+		compress(data, len, false);
+	else
+		pending_.append(data, len);
+	flush_chunks(false);
+}
+
+void attachment_writer::compress(const char *data, size_t len, bool finish)
+{
+	z_stream &zs=state_->zstream_;
+	zs.next_in=reinterpret_cast<Bytef*>(const_cast<char*>(data));
+	zs.avail_in=len;
+	char buf[16*1024];
+	for(;;)
+	{
+		zs.next_out=reinterpret_cast<Bytef*>(buf);
+		zs.avail_out=sizeof(buf);
+		const int res=deflate(&zs, finish ? Z_FINISH : Z_NO_FLUSH);
+		if (res==Z_STREAM_ERROR)
+			err(result_code_t::sError) << "Attachment compression failed";
+		pending_.append(buf, sizeof(buf)-zs.avail_out);
+		if (finish ? res==Z_STREAM_END : zs.avail_out!=0)
+			break;
+	}
+}
+
+void attachment_writer::flush_chunks(bool all)
+{
+	size_t pos=0;
+	while(pending_.size()-pos>=attachment_chunk_size ||
+		  (all && pos<pending_.size()))
+	{
+		const size_t ln=std::min(attachment_chunk_size, pending_.size()-pos);
+		jstring_t key=prefix_+"b"+blob_id_;
+		append_chunk_index(key, chunks_++);
+		ifc_->put(key, pending_.substr(pos, ln));
+		info_.encoded_length_+=ln;
+		pos+=ln;
+	}
+	pending_.erase(0, pos);
+}
+
+inline_attachment_t attachment_writer::finish()
+{
+	if (info_.compressed_)
+	{
+		compress(0, 0, true);
+		deflateEnd(&state_->zstream_);
+		state_->compressing_=false;
+	}
+	flush_chunks(true);
+	EVP_DigestFinal_ex(state_->md5_, info_.md5_, 0);
+
+	const jstring_t manifest_key=prefix_+"m"+md5_to_hex(info_.md5_);
+	jstring_t existing;
+	if (ifc_->try_get(manifest_key, &existing))
+	{
+		//The same content is already stored, possibly with a different
+		//encoding, so the descriptor follows the stored copy
+		for(uint32_t f=0;f<chunks_;++f)
+		{
+			jstring_t key=prefix_+"b"+blob_id_;
+			append_chunk_index(key, f);
+			ifc_->remove(key);
+		}
+		json_value manifest=string_to_json(existing);
+		info_.encoded_length_=manifest["encoded_length"].get_int();
+		info_.compressed_=manifest["compressed"].get_bool();
+		return info_;
+	}
+
+	json_value manifest(submap_d);
+	manifest["blob"]=json_value(blob_id_);
+	manifest["length"]=json_value(int64_t(info_.length_));
+	manifest["encoded_length"]=json_value(int64_t(info_.encoded_length_));
+	manifest["compressed"]=json_value(info_.compressed_);
+	ifc_->put(manifest_key, json_to_string(manifest));
+
+	VLOG_MACRO(2) << "Stored attachment " << info_.name_ << " of "
+				  << info_.length_ << " bytes in " << chunks_ << " chunks"
+				  << std::endl;
+	return info_;
+}
+
+struct attachment_reader::state_t
+{
+	z_stream zstream_;
+};
+
+attachment_reader::attachment_reader(storage_t *ifc, const jstring_t &prefix,
+	const inline_attachment_t &att, bool decode) : compressed_()
+{
+	const jstring_t md5=md5_to_hex(att.md5_);
+	jstring_t manifest_str;
+	if (!ifc->try_get(prefix+"m"+md5, &manifest_str))
+		err(result_code_t::sNotFound) << "Attachment " << att.name_
+									  << " (md5 " << md5 << ") is missing";
+	json_value manifest=string_to_json(manifest_str);
+	compressed_=manifest["compressed"].get_bool();
+	blob_prefix_=prefix+"b"+manifest["blob"].get_str();
+
+	if (compressed_ && decode)
+	{
+		state_.reset(new state_t());
+		if (inflateInit2(&state_->zstream_, gzip_window_bits)!=Z_OK)
+		{
+			state_.reset();
+			err(result_code_t::sError) << "Can't initialize decompression";
+		}
+	}
+
+	it_=ifc->iterate();
+	it_->seek(blob_prefix_);
+}
+
+attachment_reader::~attachment_reader()
+{
+	if (state_.get())
+		inflateEnd(&state_->zstream_);
+}
+
+bool attachment_reader::next(jstring_t &out)
+{
+	out.clear();
+	//Chunk keys are the blob prefix and a 4-byte index
+	while(it_->valid())
+	{
+		const jstring_t key=it_->key();
+		if (key.size()!=blob_prefix_.size()+4 ||
+				key.compare(0, blob_prefix_.size(), blob_prefix_)!=0)
+			break;
+		jstring_t chunk=it_->value();
+		it_->next();
+		if (!state_.get())
+		{
+			out.swap(chunk);
+			return true;
+		}
+
+		z_stream &zs=state_->zstream_;
+		zs.next_in=reinterpret_cast<Bytef*>(&chunk[0]);
+		zs.avail_in=chunk.size();
+		char buf[16*1024];
+		for(;;)
+		{
+			zs.next_out=reinterpret_cast<Bytef*>(buf);
+			zs.avail_out=sizeof(buf);
+			const int res=inflate(&zs, Z_NO_FLUSH);
+			if (res==Z_BUF_ERROR && !zs.avail_in)
+				break; //Needs the next chunk
+			if (res!=Z_OK && res!=Z_STREAM_END)
+				err(result_code_t::sError) << "Corrupted attachment";
+			out.append(buf, sizeof(buf)-zs.avail_out);
+			if (res==Z_STREAM_END || (!zs.avail_in && zs.avail_out))
+				break;
+		}
+		if (!out.empty())
+			return true;
+	}
+	return false;
+}
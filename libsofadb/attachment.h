@@ -0,0 +1,100 @@
+#ifndef ATTACHMENT_H
+#define ATTACHMENT_H
+
+#include "common.h"
+#include "native_json.h"
+#include "database.h"
+
+namespace sofadb {
+	class storage_t;
+	class storage_iterator_t;
+
+	/**
+		Attachment blobs are stored apart from the documents, under the
+		database's SD_ATTACHMENT_DB prefix:
+		- 'm'+md5 -> {"blob": id, "length": N, "encoded_length": N,
+		  "compressed": bool} - the manifest, keyed by the hex MD5 of
+		  the original content
+		- 'b'+blob id+chunk index -> up to attachment_chunk_size bytes of
+		  the stored (possibly gzipped) content
+
+		The MD5 is only known after the whole blob has been written, so
+		chunks go under a fresh blob id and the manifest is written last.
+		If a manifest for the same content already exists, the new chunks
+		are dropped and all revisions share the first copy.
+	  */
+	const size_t attachment_chunk_size = 64*1024;
+
+	//The CouchDB rule: text/*, application/javascript, application/json
+	//and application/xml are stored compressed
+	SOFADB_PUBLIC bool is_compressible_type(const jstring_t &content_type);
+
+	SOFADB_PUBLIC json_value attachments_to_json(
+		const attachment_vector_t &atts);
+	SOFADB_PUBLIC void attachments_from_json(const json_value &val,
+											 attachment_vector_t &res);
+
+	/**
+		Streams a blob into the storage chunk by chunk, compressing it on
+		the way if the content type calls for it. Nothing but the current
+		chunk is held in memory.
+	  */
+	class attachment_writer
+	{
+		struct state_t;
+		storage_t *ifc_;
+		jstring_t prefix_, blob_id_;
+		inline_attachment_t info_;
+		std::auto_ptr<state_t> state_;
+		jstring_t pending_;
+		uint32_t chunks_;
+	public:
+		SOFADB_PUBLIC attachment_writer(storage_t *ifc, const jstring_t &prefix,
+			const jstring_t &name, const jstring_t &content_type);
+		SOFADB_PUBLIC ~attachment_writer();
+
+		SOFADB_PUBLIC void write(const char *data, size_t len);
+		void write(const jstring_t &data) { write(data.data(), data.size()); }
+
+		//Writes the manifest and returns the descriptor to be stored
+		//with a revision
+		SOFADB_PUBLIC inline_attachment_t finish();
+	private:
+		attachment_writer(const attachment_writer&);
+		attachment_writer& operator = (const attachment_writer&);
+
+		void compress(const char *data, size_t len, bool finish);
+		void flush_chunks(bool all);
+	};
+
+	/**
+		Reads a blob back chunk by chunk. Compressed blobs are inflated
+		unless 'decode' is false, in which case the gzip stream is
+		returned as is.
+	  */
+	class attachment_reader
+	{
+		struct state_t;
+		jstring_t blob_prefix_;
+		std::auto_ptr<storage_iterator_t> it_;
+		std::auto_ptr<state_t> state_;
+		bool compressed_;
+	public:
+		SOFADB_PUBLIC attachment_reader(storage_t *ifc, const jstring_t &prefix,
+			const inline_attachment_t &att, bool decode=true);
+		SOFADB_PUBLIC ~attachment_reader();
+
+		//True if next() returns gzipped data
+		bool encoded() const { return compressed_ && !state_.get(); }
+
+		//Replaces 'out' with the next piece of the content, returns false
+		//at the end of the blob
+		SOFADB_PUBLIC bool next(jstring_t &out);
+	private:
+		attachment_reader(const attachment_reader&);
+		attachment_reader& operator = (const attachment_reader&);
+	};
+
+}; //namespace sofadb
+
+#endif //ATTACHMENT_H
@@ -0,0 +1,501 @@
+#include "binary_json.h"
+#include "errors.h"
+#include <limits>
+#include <string.h>
+
+using namespace sofadb;
+
+static void put_fixed(jstring_t &out, uint64_t val, size_t width)
+{
+	char buf[8];
+	for(size_t f=0;f<width;++f)
+		buf[f] = static_cast<char>(val >> (8*f));
+	out.append(buf, width);
+}
+
+static void patch_fixed(jstring_t &out, size_t pos, uint32_t val)
+{
+	for(size_t f=0;f<4;++f)
+		out[pos+f] = static_cast<char>(val >> (8*f));
+}
+
+static void put_varint(jstring_t &out, uint64_t val)
+{
+	char buf[10];
+	size_t ln=0;
+	while(val >= 0x80)
+	{
+		buf[ln++] = static_cast<char>(val | 0x80);
+		val >>= 7;
+	}
+	buf[ln++] = static_cast<char>(val);
+	out.append(buf, ln);
+}
+
+/**
+	Keeps track of the open containers so their element counts and
+	payload sizes can be patched in when they are closed.
+  */
+class binary_writer
+{
+	jstring_t &out_;
+	//Offset of the container header and the number of elements so far
+	std::vector<std::pair<size_t, uint32_t> > open_;
+public:
+	binary_writer(jstring_t &out) : out_(out)
+	{
+		out_.push_back(static_cast<char>(binary_json_marker));
+	}
+
+	void write_null()
+	{
+		begin_value();
+		out_.push_back(bin_null);
+	}
+
+	void write_bool(bool b)
+	{
+		begin_value();
+		out_.push_back(b ? bin_true : bin_false);
+	}
+
+	void write_int(int64_t i)
+	{
+		begin_value();
+		if (i>=std::numeric_limits<int8_t>::min() &&
+				i<=std::numeric_limits<int8_t>::max())
+		{
+			out_.push_back(bin_int8);
+			put_fixed(out_, i, 1);
+		} else if (i>=std::numeric_limits<int16_t>::min() &&
+				   i<=std::numeric_limits<int16_t>::max())
+		{
+			out_.push_back(bin_int16);
+			put_fixed(out_, i, 2);
+		} else if (i>=std::numeric_limits<int32_t>::min() &&
+				   i<=std::numeric_limits<int32_t>::max())
+		{
+			out_.push_back(bin_int32);
+			put_fixed(out_, i, 4);
+		} else
+		{
+			out_.push_back(bin_int64);
+			put_fixed(out_, i, 8);
+		}
+	}
+
+	void write_double(double d)
+	{
+		begin_value();
+		uint64_t bits;
+		memcpy(&bits, &d, sizeof(bits));
+		out_.push_back(bin_double);
+		put_fixed(out_, bits, 8);
+	}
+
+	void write_string(binary_tag_e tag, const char *str, size_t ln)
+	{
+		begin_value();
+		out_.push_back(tag);
+		put_varint(out_, ln);
+		out_.append(str, ln);
+	}
+
+	void start(binary_tag_e tag)
+	{
+		begin_value();
+		out_.push_back(tag);
+		open_.push_back(std::make_pair(out_.size(), uint32_t()));
+		out_.append(8, '\0'); //Count and size are patched in end()
+	}
+
+	void end()
+	{
+		assert(!open_.empty());
+		const std::pair<size_t, uint32_t> top=open_.back();
+		open_.pop_back();
+
+		const size_t payload=out_.size()-top.first-8;
+		if (payload > std::numeric_limits<uint32_t>::max())
+			err(result_code_t::sError) << "Document is too big";
+		patch_fixed(out_, top.first, top.second);
+		patch_fixed(out_, top.first+4, payload);
+	}
+
+private:
+	void begin_value()
+	{
+		if (!open_.empty())
+			++open_.back().second;
+	}
+};
+
+struct binary_printer
+{
+	binary_writer &writer_;
+	binary_printer(binary_writer &writer) : writer_(writer) {}
+
+	void operator()()
+	{
+		writer_.write_null();
+	}
+	void operator()(bool b)
+	{
+		writer_.write_bool(b);
+	}
+	void operator()(int64_t i)
+	{
+		writer_.write_int(i);
+	}
+	void operator()(double d)
+	{
+		writer_.write_double(d);
+	}
+	void operator()(const jstring_t &s)
+	{
+		writer_.write_string(bin_string, s.data(), s.length());
+	}
+	void operator()(const bignum_t &b)
+	{
+		writer_.write_string(bin_bignum, b.digits_.data(), b.digits_.length());
+	}
+	void operator()(const submap_t &map)
+	{
+		writer_.start(bin_map);
+		for(auto i=map.begin(), iend=map.end();i!=iend;++i)
+		{
+			writer_.write_string(bin_string, i->first.data(),
+								 i->first.length());
+			i->second.apply_visitor(*this);
+		}
+		writer_.end();
+	}
+	void operator()(const sublist_t &lst)
+	{
+		writer_.start(bin_list);
+		for(auto i = lst.begin(), iend=lst.end(); i!=iend; ++i)
+			i->apply_visitor(*this);
+		writer_.end();
+	}
+	void operator()(const graft_t &lst)
+	{
+		lst.grafted().apply_visitor(*this);
+	}
+};
+
+void sofadb::json_to_binary(jstring_t &append_to, const json_value &val)
+{
+	binary_writer writer(append_to);
+	binary_printer vis(writer);
+	val.apply_visitor(vis);
+}
+
+class binary_json_stream : public json_stream
+{
+	binary_writer writer_;
+public:
+	binary_json_stream(jstring_t &str) : writer_(str)
+	{
+	}
+
+	virtual ~binary_json_stream() {}
+
+	virtual void write_null()
+	{
+		writer_.write_null();
+	}
+
+	virtual void write_bool(bool val)
+	{
+		writer_.write_bool(val);
+	}
+
+	virtual void write_int(int64_t i)
+	{
+		writer_.write_int(i);
+	}
+
+	virtual void write_double(double d)
+	{
+		writer_.write_double(d);
+	}
+
+	virtual void write_string(const char *str, size_t ln)
+	{
+		writer_.write_string(bin_string, str, ln);
+	}
+
+	virtual void write_digits(const char *str, size_t ln)
+	{
+		writer_.write_string(bin_bignum, str, ln);
+	}
+
+	virtual void start_map()
+	{
+		writer_.start(bin_map);
+	}
+
+	virtual void end_map()
+	{
+		writer_.end();
+	}
+
+	virtual void start_list()
+	{
+		writer_.start(bin_list);
+	}
+
+	virtual void end_list()
+	{
+		writer_.end();
+	}
+
+	virtual void write_json(const json_value &val)
+	{
+		binary_printer p(writer_);
+		val.apply_visitor(p);
+	}
+};
+
+std::auto_ptr<json_stream> sofadb::make_binary_stream(jstring_t &append_to)
+{
+	return std::auto_ptr<json_stream>(new binary_json_stream(append_to));
+}
+
+json_value sofadb::binary_to_json(const char *data, size_t len)
+{
+	binary_reader reader(data, len);
+	json_value res;
+	reader.read(res);
+	return std::move(res);
+}
+
+binary_reader::binary_reader(const char *data, size_t len) :
+	pos_(reinterpret_cast<const unsigned char*>(data)), end_(pos_+len)
+{
+	if (!is_binary_json(data, len))
+		corrupted();
+	if (take() != binary_json_marker)
+		err(result_code_t::sError) << "Unsupported binary document version";
+}
+
+void binary_reader::corrupted() const
+{
+	err(result_code_t::sError) << "Corrupted binary document";
+}
+
+unsigned char binary_reader::take()
+{
+	if (pos_==end_)
+		corrupted();
+	return *pos_++;
+}
+
+const unsigned char* binary_reader::take(size_t sz)
+{
+	if (size_t(end_-pos_) < sz)
+		corrupted();
+	const unsigned char *res=pos_;
+	pos_+=sz;
+	return res;
+}
+
+uint64_t binary_reader::read_varint()
+{
+	uint64_t res=0;
+	for(int shift=0; shift<64; shift+=7)
+	{
+		unsigned char ch=take();
+		res |= uint64_t(ch & 0x7F) << shift;
+		if (!(ch & 0x80))
+			return res;
+	}
+	corrupted();
+	return 0;
+}
+
+uint64_t binary_reader::read_fixed(size_t width)
+{
+	const unsigned char *data=take(width);
+	uint64_t res=0;
+	for(size_t f=0;f<width;++f)
+		res |= uint64_t(data[f]) << (8*f);
+	return res;
+}
+
+uint32_t binary_reader::read_container_header()
+{
+	uint32_t count=read_fixed(4);
+	uint32_t size=read_fixed(4);
+	//Every element takes at least a byte, so a corrupted count can't
+	//make the readers preallocate more than the payload
+	if (size_t(end_-pos_) < size || count > size)
+		corrupted();
+	return count;
+}
+
+json_disc binary_reader::peek_type() const
+{
+	if (pos_==end_)
+		corrupted();
+	switch(*pos_)
+	{
+		case bin_null: return nil_d;
+		case bin_false:
+		case bin_true: return bool_d;
+		case bin_int8:
+		case bin_int16:
+		case bin_int32:
+		case bin_int64: return int_d;
+		case bin_double: return double_d;
+		case bin_string: return string_d;
+		case bin_bignum: return big_int_d;
+		case bin_map: return submap_d;
+		case bin_list: return sublist_d;
+		default:
+			corrupted();
+	}
+	return nil_d;
+}
+
+json_value binary_reader::read()
+{
+	json_value res;
+	read(res);
+	return std::move(res);
+}
+
+void binary_reader::read(json_value &res)
+{
+	unsigned char tag=take();
+	switch(tag)
+	{
+		case bin_null:
+			res.as_nil();
+			break;
+		case bin_false:
+		case bin_true:
+			res = json_value(tag==bin_true);
+			break;
+		case bin_int8:
+			res = json_value(int64_t(int8_t(read_fixed(1))));
+			break;
+		case bin_int16:
+			res = json_value(int64_t(int16_t(read_fixed(2))));
+			break;
+		case bin_int32:
+			res = json_value(int64_t(int32_t(read_fixed(4))));
+			break;
+		case bin_int64:
+			res = json_value(int64_t(read_fixed(8)));
+			break;
+		case bin_double:
+		{
+			uint64_t bits=read_fixed(8);
+			double d;
+			memcpy(&d, &bits, sizeof(d));
+			res = json_value(d);
+			break;
+		}
+		case bin_string:
+		case bin_bignum:
+		{
+			size_t ln=read_varint();
+			const char *data=reinterpret_cast<const char*>(take(ln));
+			if (tag==bin_string)
+				res = json_value(jstring_t(data, ln));
+			else
+				res = json_value(bignum_t(jstring_t(data, ln)));
+			break;
+		}
+		case bin_map:
+		{
+			uint32_t count=read_container_header();
+			if (count%2)
+				corrupted();
+			res = json_value(submap_d);
+			submap_t &map=res.get_submap();
+			for(uint32_t f=0;f<count;f+=2)
+			{
+				//Keys are written in the map's order, so the end of the
+				//map is always the right insertion hint.
+				auto pos=map.insert(map.end(),
+					std::make_pair(read_string(), json_value()));
+				read(pos->second);
+			}
+			break;
+		}
+		case bin_list:
+		{
+			uint32_t count=read_container_header();
+			res = json_value(sublist_d);
+			sublist_t &lst=res.get_sublist();
+			lst.resize(count);
+			for(uint32_t f=0;f<count;++f)
+				read(lst[f]);
+			break;
+		}
+		default:
+			corrupted();
+	}
+}
+
+void binary_reader::skip()
+{
+	unsigned char tag=take();
+	switch(tag)
+	{
+		case bin_null:
+		case bin_false:
+		case bin_true:
+			break;
+		case bin_int8:
+			take(1);
+			break;
+		case bin_int16:
+			take(2);
+			break;
+		case bin_int32:
+			take(4);
+			break;
+		case bin_int64:
+		case bin_double:
+			take(8);
+			break;
+		case bin_string:
+		case bin_bignum:
+			take(read_varint());
+			break;
+		case bin_map:
+		case bin_list:
+			read_fixed(4);
+			take(read_fixed(4));
+			break;
+		default:
+			corrupted();
+	}
+}
+
+size_t binary_reader::enter()
+{
+	unsigned char tag=take();
+	if (tag!=bin_map && tag!=bin_list)
+		corrupted();
+	return read_container_header();
+}
+
+bool binary_reader::read_bool()
+{
+	unsigned char tag=take();
+	if (tag!=bin_true && tag!=bin_false)
+		corrupted();
+	return tag==bin_true;
+}
+
+jstring_t binary_reader::read_string()
+{
+	if (take()!=bin_string)
+		corrupted();
+	size_t ln=read_varint();
+	return jstring_t(reinterpret_cast<const char*>(take(ln)), ln);
+}
@@ -0,0 +1,106 @@
+#ifndef BINARY_JSON_H
+#define BINARY_JSON_H
+
+#include "common.h"
+#include "native_json.h"
+#include "json_stream.h"
+
+namespace sofadb {
+
+	/**
+		Compact binary encoding of json_value used for document bodies
+		at rest. The buffer starts with a version marker byte followed by
+		a single tagged value:
+		- null/false/true - just the tag
+		- int8/int16/int32/int64 - the tag and a little-endian integer of
+		  the smallest width that holds the value
+		- double - the tag and 8 bytes of the IEEE representation
+		- string/bignum - the tag, a varint byte length and the bytes
+		- map/list - the tag, a 4-byte element count, a 4-byte payload
+		  size and the payload. Maps store alternating key strings and
+		  values.
+
+		Container sizes let readers skip subtrees without looking at
+		them, and string lengths mean decoding never scans for
+		delimiters. Legacy JSON records start with '[' or '{', so the
+		marker byte (0xF0 | version) tells the formats apart.
+	  */
+	enum binary_tag_e
+	{
+		bin_null = 0x00,
+		bin_false = 0x01,
+		bin_true = 0x02,
+		bin_int8 = 0x03,
+		bin_int16 = 0x04,
+		bin_int32 = 0x05,
+		bin_int64 = 0x06,
+		bin_double = 0x07,
+		bin_string = 0x08,
+		bin_bignum = 0x09,
+		bin_map = 0x0A,
+		bin_list = 0x0B,
+	};
+
+	const unsigned char binary_json_version = 1;
+	const unsigned char binary_json_marker = 0xF0 | binary_json_version;
+
+	inline bool is_binary_json(const char *data, size_t len)
+	{
+		return len>0 && (static_cast<unsigned char>(data[0]) & 0xF0) == 0xF0;
+	}
+	inline bool is_binary_json(const jstring_t &str)
+	{
+		return is_binary_json(str.data(), str.size());
+	}
+
+	SOFADB_PUBLIC void json_to_binary(jstring_t &append_to,
+									  const json_value &val);
+	SOFADB_PUBLIC json_value binary_to_json(const char *data, size_t len);
+	inline json_value binary_to_json(const jstring_t &str)
+	{
+		return binary_to_json(str.data(), str.size());
+	}
+
+	/**
+		Writes the binary format through the json_stream interface. The
+		marker byte is written when the stream is created.
+	  */
+	SOFADB_PUBLIC std::auto_ptr<json_stream> make_binary_stream(
+		jstring_t &append_to);
+
+	/**
+		Pull reader over a binary buffer. Containers can be entered to
+		read their elements one by one or skipped as a whole.
+	  */
+	class binary_reader
+	{
+		const unsigned char *pos_, *end_;
+	public:
+		SOFADB_PUBLIC binary_reader(const char *data, size_t len);
+
+		bool at_end() const { return pos_==end_; }
+		SOFADB_PUBLIC json_disc peek_type() const;
+
+		//Reads the next value completely
+		SOFADB_PUBLIC json_value read();
+		SOFADB_PUBLIC void read(json_value &res);
+		//Skips the next value, containers are skipped in O(1)
+		SOFADB_PUBLIC void skip();
+		//Enters a map or a list and returns the number of its elements
+		//(keys and values are counted separately for maps)
+		SOFADB_PUBLIC size_t enter();
+
+		SOFADB_PUBLIC bool read_bool();
+		SOFADB_PUBLIC jstring_t read_string();
+	private:
+		unsigned char take();
+		const unsigned char* take(size_t sz);
+		uint64_t read_varint();
+		uint64_t read_fixed(size_t width);
+		uint32_t read_container_header();
+		void corrupted() const;
+	};
+
+}; //namespace sofadb
+
+#endif //BINARY_JSON_H
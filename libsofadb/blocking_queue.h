@@ -0,0 +1,71 @@
+#ifndef BLOCKING_QUEUE_H
+#define BLOCKING_QUEUE_H
+
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+
+namespace utils {
+
+	/**
+		Bounded multi-producer/multi-consumer queue. Producers block while
+		the queue is full, consumers block while it's empty. Once closed,
+		consumers drain the remaining items and then get 'false'.
+	  */
+	template<class T> class blocking_queue
+	{
+		std::deque<T> items_;
+		size_t capacity_;
+		bool closed_;
+		std::mutex mutex_;
+		std::condition_variable not_empty_, not_full_;
+	public:
+		blocking_queue(size_t capacity) : capacity_(capacity), closed_(false)
+		{
+		}
+
+		//Returns false if the queue has been closed
+		bool push(T &&val)
+		{
+			std::unique_lock<std::mutex> lock(mutex_);
+			while(items_.size()>=capacity_ && !closed_)
+				not_full_.wait(lock);
+			if (closed_)
+				return false;
+			items_.push_back(std::move(val));
+			not_empty_.notify_one();
+			return true;
+		}
+
+		//Returns false if the queue is closed and drained
+		bool pop(T &res)
+		{
+			std::unique_lock<std::mutex> lock(mutex_);
+			while(items_.empty() && !closed_)
+				not_empty_.wait(lock);
+			if (items_.empty())
+				return false;
+			res = std::move(items_.front());
+			items_.pop_front();
+			not_full_.notify_one();
+			return true;
+		}
+
+		void close()
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			closed_ = true;
+			not_empty_.notify_all();
+			not_full_.notify_all();
+		}
+
+		size_t size()
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			return items_.size();
+		}
+	};
+
+}; //namespace utils
+
+#endif //BLOCKING_QUEUE_H
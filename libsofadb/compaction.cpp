@@ -0,0 +1,103 @@
+#include "compaction.h"
+#include "engine.h"
+#include <time.h>
+
+using namespace sofadb;
+
+bool sofadb::is_in_quiet_window(const compaction_options_t &opts, int hour)
+{
+	const int start=opts.window_start_hour_, end=opts.window_end_hour_;
+	if (start==end)
+		return true;
+	if (start<end)
+		return hour>=start && hour<end;
+	return hour>=start || hour<end; //Wraps around midnight
+}
+
+static int local_hour()
+{
+	const time_t now=time(NULL);
+	struct tm parts;
+	localtime_r(&now, &parts);
+	return parts.tm_hour;
+}
+
+compaction_scheduler::compaction_scheduler(DbEngine *engine,
+	const compaction_options_t &opts) :
+	engine_(engine), opts_(opts), stop_(false)
+{
+	thread_=std::thread([this]{ run(); });
+}
+
+compaction_scheduler::~compaction_scheduler()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		stop_=true;
+	}
+	wakeup_.notify_all();
+	thread_.join();
+}
+
+bool compaction_scheduler::should_stop() const
+{
+	return stop_ || !is_in_quiet_window(opts_, local_hour());
+}
+
+void compaction_scheduler::compact_one(const jstring_t &name)
+{
+	const auto now=std::chrono::steady_clock::now();
+	auto last=last_run_.find(name);
+	if (last!=last_run_.end() && now-last->second<
+			std::chrono::seconds(opts_.interval_sec_))
+		return;
+
+	//Null if it has been deleted since it was listed
+	database_ptr db=engine_->open_database(name);
+	if (!db || db->compact_running())
+		return; //Deleted, or somebody has started it manually
+	compaction_stats_t stats=engine_->compact(db, opts_,
+		[this]{ return should_stop(); });
+	if (stats.completed_)
+		last_run_[name]=now;
+	VLOG_MACRO(1) << "Compacted " << name << ": pruned "
+				  << stats.revisions_pruned_ << " revisions, "
+				  << stats.bytes_pruned_ << " bytes in "
+				  << stats.seconds_ << "s" << std::endl;
+}
+
+void compaction_scheduler::run()
+{
+	while(!stop_)
+	{
+		if (!should_stop())
+		{
+			std::vector<jstring_t> names;
+			try
+			{
+				names=engine_->database_names();
+			} catch(const std::exception &ex)
+			{
+				LOG(ERROR) << "Scheduled compaction failed: " << ex.what();
+			}
+			for(auto i=names.begin(), iend=names.end(); i!=iend; ++i)
+			{
+				if (should_stop())
+					break;
+				//A failing database doesn't hold back the others
+				try
+				{
+					compact_one(*i);
+				} catch(const std::exception &ex)
+				{
+					LOG(ERROR) << "Scheduled compaction of " << *i
+							   << " failed: " << ex.what();
+				}
+			}
+		}
+
+		std::unique_lock<std::mutex> lock(mutex_);
+		wakeup_.wait_for(lock, std::chrono::seconds(opts_.check_interval_sec_),
+						 [this]{ return bool(stop_); });
+	}
+}
@@ -0,0 +1,110 @@
+#ifndef COMPACTION_H
+#define COMPACTION_H
+
+#include "common.h"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <thread>
+
+namespace sofadb {
+	class DbEngine;
+
+	struct compaction_options_t
+	{
+		//Budget for the compaction I/O, 0 means no limit
+		uint64_t max_bytes_per_sec_;
+		//The quiet window in local hours, [start, end). It may wrap
+		//around midnight, equal hours allow compaction at any time.
+		int window_start_hour_, window_end_hour_;
+		//Minimal time between two compactions of a database
+		unsigned interval_sec_;
+		//How often the scheduler looks for work
+		unsigned check_interval_sec_;
+
+		compaction_options_t() : max_bytes_per_sec_(16*1024*1024),
+			window_start_hour_(2), window_end_hour_(6),
+			interval_sec_(24*3600), check_interval_sec_(60) {}
+	};
+
+	struct compaction_stats_t
+	{
+		uint64_t docs_, revisions_pruned_, bytes_scanned_, bytes_pruned_;
+		//Ranges handed to leveldb's CompactRange
+		uint64_t ranges_compacted_;
+		double seconds_;
+		//False if the compaction has been stopped halfway
+		bool completed_;
+
+		compaction_stats_t() : docs_(), revisions_pruned_(),
+			bytes_scanned_(), bytes_pruned_(), ranges_compacted_(),
+			seconds_(), completed_() {}
+	};
+
+	//Should the compaction stop now?
+	typedef std::function<bool ()> stop_callback_t;
+
+	SOFADB_PUBLIC bool is_in_quiet_window(const compaction_options_t &opts,
+										  int hour);
+
+	/**
+		Spreads the I/O over time: consume() sleeps for as long as it
+		takes to bring the average rate down to the limit.
+	  */
+	class io_throttle_t
+	{
+		uint64_t bytes_per_sec_, consumed_;
+		std::chrono::steady_clock::time_point start_;
+	public:
+		explicit io_throttle_t(uint64_t bytes_per_sec) :
+			bytes_per_sec_(bytes_per_sec), consumed_(),
+			start_(std::chrono::steady_clock::now())
+		{
+		}
+
+		void consume(uint64_t bytes)
+		{
+			consumed_+=bytes;
+			if (!bytes_per_sec_)
+				return;
+			const auto due=start_+std::chrono::microseconds(
+				consumed_*1000000/bytes_per_sec_);
+			if (due>std::chrono::steady_clock::now())
+				std::this_thread::sleep_until(due);
+		}
+	};
+
+	/**
+		Compacts every database of the engine once per interval, during
+		the quiet window only. A compaction still running when the window
+		closes is stopped and starts over in the next window.
+	  */
+	class compaction_scheduler
+	{
+		DbEngine *engine_;
+		compaction_options_t opts_;
+		std::map<jstring_t, std::chrono::steady_clock::time_point> last_run_;
+
+		std::mutex mutex_;
+		std::condition_variable wakeup_;
+		std::atomic<bool> stop_;
+		std::thread thread_;
+	public:
+		SOFADB_PUBLIC compaction_scheduler(DbEngine *engine,
+										   const compaction_options_t &opts);
+		//Stops the current compaction and waits for the thread
+		SOFADB_PUBLIC ~compaction_scheduler();
+	private:
+		compaction_scheduler(const compaction_scheduler&);
+		compaction_scheduler& operator = (const compaction_scheduler&);
+
+		void run();
+		void compact_one(const jstring_t &name);
+		bool should_stop() const;
+	};
+
+}; //namespace sofadb
+
+#endif //COMPACTION_H
@@ -1,20 +1,179 @@
 #include "conflict.h"
-#include <set>
-#include <functional>
+#include "metrics.h"
+#include <algorithm>
+#include <iterator>
 
 using namespace sofadb;
 
-typedef std::reference_wrapper<const jstring_t> jstring_ref_t;
+static bool revision_less(const revision_num_t &l, const revision_num_t &r)
+{
+	if (l.num()!=r.num())
+		return l.num()<r.num();
+	return l.uniq()<r.uniq();
+}
+
+static int hex_digit(char ch)
+{
+	if (ch>='0' && ch<='9')
+		return ch-'0';
+	if (ch>='a' && ch<='f')
+		return ch-'a'+10;
+	return -1;
+}
+
+bool conflict_set_t::pack(const revision_num_t &rev, packed_rev_t *res)
+{
+	//Only the lowercase form round-trips
+	const jstring_t &uniq=rev.uniq();
+	if (uniq.size()!=2*sizeof(res->hash_))
+		return false;
+	for(size_t f=0;f<sizeof(res->hash_);++f)
+	{
+		int hi=hex_digit(uniq[2*f]), lo=hex_digit(uniq[2*f+1]);
+		if (hi<0 || lo<0)
+			return false;
+		res->hash_[f]=static_cast<unsigned char>(hi*16+lo);
+	}
+	res->num_=rev.num();
+	return true;
+}
 
-namespace std {
-	template<> struct less<jstring_ref_t>
+revision_num_t conflict_set_t::unpack(const packed_rev_t &rev)
+{
+	static const char alphabet[17]="0123456789abcdef";
+	jstring_t uniq;
+	uniq.resize(2*sizeof(rev.hash_));
+	for(size_t f=0;f<sizeof(rev.hash_);++f)
 	{
-		bool operator()(const jstring_ref_t& l, const jstring_ref_t& r) const
-		{
-			return l.get() < r.get();
-		}
-	};
-}; //namespace std
+		uniq[2*f]=alphabet[rev.hash_[f]/16];
+		uniq[2*f+1]=alphabet[rev.hash_[f]%16];
+	}
+	return revision_num_t(rev.num_, std::move(uniq));
+}
+
+conflict_set_t::conflict_set_t(const sublist_t &revs)
+{
+	packed_.reserve(revs.size());
+	for(auto i=revs.begin(), iend=revs.end(); i!=iend; ++i)
+		add(revision_num_t(i->get_str()));
+	normalize();
+}
+
+conflict_set_t::conflict_set_t(const revision_list_t &revs)
+{
+	packed_.reserve(revs.size());
+	for(auto i=revs.begin(), iend=revs.end(); i!=iend; ++i)
+		add(*i);
+	normalize();
+}
+
+void conflict_set_t::add(const revision_num_t &rev)
+{
+	packed_rev_t packed;
+	if (pack(rev, &packed))
+		packed_.push_back(packed);
+	else
+		other_.push_back(rev);
+}
+
+void conflict_set_t::normalize()
+{
+	//Stored sets are already sorted, so loading them doesn't sort
+	if (!std::is_sorted(packed_.begin(), packed_.end()))
+		std::sort(packed_.begin(), packed_.end());
+	packed_.erase(std::unique(packed_.begin(), packed_.end()), packed_.end());
+
+	if (!std::is_sorted(other_.begin(), other_.end(), &revision_less))
+		std::sort(other_.begin(), other_.end(), &revision_less);
+	other_.erase(std::unique(other_.begin(), other_.end()), other_.end());
+}
+
+bool conflict_set_t::contains(const revision_num_t &rev) const
+{
+	packed_rev_t packed;
+	if (pack(rev, &packed))
+		return std::binary_search(packed_.begin(), packed_.end(), packed);
+	return std::binary_search(other_.begin(), other_.end(), rev,
+							  &revision_less);
+}
+
+void conflict_set_t::insert(const revision_num_t &rev)
+{
+	packed_rev_t packed;
+	if (pack(rev, &packed))
+	{
+		auto pos=std::lower_bound(packed_.begin(), packed_.end(), packed);
+		if (pos==packed_.end() || !(*pos==packed))
+			packed_.insert(pos, packed);
+	} else
+	{
+		auto pos=std::lower_bound(other_.begin(), other_.end(), rev,
+								  &revision_less);
+		if (pos==other_.end() || *pos!=rev)
+			other_.insert(pos, rev);
+	}
+}
+
+bool conflict_set_t::remove(const revision_num_t &rev)
+{
+	packed_rev_t packed;
+	if (pack(rev, &packed))
+	{
+		auto pos=std::lower_bound(packed_.begin(), packed_.end(), packed);
+		if (pos==packed_.end() || !(*pos==packed))
+			return false;
+		packed_.erase(pos);
+	} else
+	{
+		auto pos=std::lower_bound(other_.begin(), other_.end(), rev,
+								  &revision_less);
+		if (pos==other_.end() || *pos!=rev)
+			return false;
+		other_.erase(pos);
+	}
+	return true;
+}
+
+void conflict_set_t::merge(const conflict_set_t &other)
+{
+	if (!other.packed_.empty())
+	{
+		std::vector<packed_rev_t> res;
+		res.reserve(packed_.size()+other.packed_.size());
+		std::set_union(packed_.begin(), packed_.end(), other.packed_.begin(),
+					   other.packed_.end(), std::back_inserter(res));
+		packed_.swap(res);
+	}
+	if (!other.other_.empty())
+	{
+		revision_list_t res;
+		res.reserve(other_.size()+other.other_.size());
+		std::set_union(other_.begin(), other_.end(), other.other_.begin(),
+					   other.other_.end(), std::back_inserter(res),
+					   &revision_less);
+		other_.swap(res);
+	}
+}
+
+void conflict_set_t::store(sublist_t &revs) const
+{
+	revs.clear();
+	revs.reserve(size());
+	for(auto i=packed_.begin(), iend=packed_.end(); i!=iend; ++i)
+		revs.push_back(json_value(unpack(*i).full_string()));
+	for(auto i=other_.begin(), iend=other_.end(); i!=iend; ++i)
+		revs.push_back(json_value(i->full_string()));
+}
+
+revision_list_t conflict_set_t::revisions() const
+{
+	revision_list_t res;
+	res.reserve(size());
+	for(auto i=packed_.begin(), iend=packed_.end(); i!=iend; ++i)
+		res.push_back(unpack(*i));
+	res.insert(res.end(), other_.begin(), other_.end());
+	return res;
+}
 
 /** Yes, that's the whole conflict resolution protocol. It's that simple.
   */
@@ -34,66 +193,73 @@ bool resolver::is_left_rev_winning(const revision_num_t &left,
 	return left.uniq() < right.uniq();
 }
 
-
 void resolver::merge(const revision_num_t &new_rev,
-		   const sublist_t &new_rev_conflicts)
+		   const sublist_t &new_rev_conflicts, bool deleted)
 {
-	revlog_wrapper wrapper(*rev_log_);
-	revision_num_t cur_rev = wrapper.top_rev_id();
-	sublist_t& conflicts=wrapper.get_conflicts();
-
-	//Reserve space
-	conflicts.reserve(conflicts.size()+new_rev_conflicts.size()+2);
-
-	//We use references to optimize the checking for visited strings.
-	//It's safe because 'conflicts' sublist is guaranteed not to be
-	//reallocated as we've reserved enough space.
-	std::set<jstring_ref_t> visited;
-	for(auto i=conflicts.begin(), iend=conflicts.end(); i!=iend; ++i)
-		visited.insert(std::cref(i->get_str()));
-
-	//Merge conflict lists
-	for(auto i=new_rev_conflicts.begin(), iend=new_rev_conflicts.end();
-		i!=iend; ++i)
+	if (!new_rev_conflicts.empty())
 	{
-		const jstring_t &new_conf_str=i->get_str();
-		if (visited.find(std::cref(new_conf_str))!=visited.end())
-			continue; //The conflict is already there - skip it
-		conflicts.push_back(new_conf_str);
-		visited.insert(std::cref(conflicts.back().get_str()));
+		//Merge conflict lists
+		sublist_t &conflicts=revlog_wrapper(*rev_log_).get_conflicts();
+		conflict_set_t merged(conflicts);
+		merged.merge(conflict_set_t(new_rev_conflicts));
+		merged.store(conflicts);
 	}
 
-	const std::string &new_rev_str=new_rev.full_string();
-	const std::string &cur_rev_str=cur_rev.full_string();
-
-	//First, check if we're losing
-	if (is_left_rev_winning(cur_rev, new_rev))
-	{
-		//The current revision is winning, so just add the new revision
-		//and its conflicts to the current list of conflicts
+	revision_list_t live, dead;
+	(deleted ? dead : live).push_back(new_rev);
+	merge_batch(live, dead);
+}
 
-		//Since the current version is winning it can't be in the
-		//list of conflicts.
-		assert(visited.find(cur_rev_str)==visited.end());
+void resolver::merge_batch(const revision_list_t &live,
+						   const revision_list_t &deleted)
+{
+	scoped_timer timer(metric_merge);
+	revlog_wrapper wrapper(*rev_log_);
+	sublist_t &lst=rev_log_->get_sublist();
+	conflict_set_t conflicts(lst.at(0).get_sublist());
+	conflict_set_t dead(lst.at(1).get_sublist());
 
-		//Add the new version to the list of conflicts. It can already be
-		//there if we're doing a repeated merge.
-		if (visited.find(new_rev_str)==visited.end())
-			conflicts.push_back(new_rev_str);
-	} else
+	//A live leaf always beats a deleted one, so the deleted revisions
+	//only compete when there's no live revision left at all
+	const revision_num_t cur_rev=wrapper.top_rev_id();
+	const bool cur_deleted=wrapper.top_quad().size()>3 &&
+			wrapper.top_quad()[3].get_bool();
+	revision_num_t winner;
+	bool winner_deleted=false;
+	if (!cur_deleted)
+		winner=cur_rev;
+	else
 	{
-		//The new revision is winning, make the current revision
-		//to be conflicting.
-		wrapper.add_rev_info(new_rev, true, false);
-
-		//The new version can't be amongst the conflicts!
-		assert(visited.find(new_rev_str)==visited.end());
+		//Logs written before this rule could have a deleted top revision
+		//that shadows live conflicts, they compete too
+		revision_list_t stored=conflicts.revisions();
+		for(auto i=stored.begin(), iend=stored.end(); i!=iend; ++i)
+			if (winner.empty() || is_left_rev_winning(*i, winner))
+				winner=*i;
+	}
+	for(auto i=live.begin(), iend=live.end(); i!=iend; ++i)
+		if (winner.empty() || is_left_rev_winning(*i, winner))
+			winner=*i;
+	if (winner.empty())
+	{
+		winner=cur_rev, winner_deleted=true;
+		for(auto i=deleted.begin(), iend=deleted.end(); i!=iend; ++i)
+			if (is_left_rev_winning(*i, winner))
+				winner=*i;
+	}
 
-		//Add the new version to the list of conflicts. It can already be
-		//there if we're doing a repeated merge.
-		if (visited.find(cur_rev_str)==visited.end())
-			conflicts.push_back(cur_rev_str);
+	//Everything joins the conflicts in a single pass and the winner
+	//is taken out again. Repeated merges are no-ops.
+	conflicts.merge(conflict_set_t(live));
+	dead.merge(conflict_set_t(deleted));
+	conflicts.remove(winner);
+	dead.remove(winner);
+	if (winner!=cur_rev)
+	{
+		(cur_deleted ? dead : conflicts).insert(cur_rev);
+		wrapper.add_rev_info(winner, true, winner_deleted);
 	}
 
-	//That's all, folks!
+	conflicts.store(lst.at(0).get_sublist());
+	dead.store(lst.at(1).get_sublist());
 }
@@ -3,9 +3,65 @@
 
 #include "common.h"
 #include "database.h"
+#include <string.h>
 
 namespace sofadb {
-	typedef std::vector<revision_num_t> revision_list_t;
+
+	/**
+		Sorted set of conflicting revisions. Revisions with MD5 hashes
+		(which is what compute_revision produces) are packed into 20
+		bytes - the number and the raw hash, so a set of them is a single
+		flat array. Revisions with other ids are kept aside in their
+		parsed form.
+
+		All operations keep the arrays sorted, merging two sets is a
+		single linear pass.
+	  */
+	class conflict_set_t
+	{
+		struct packed_rev_t
+		{
+			uint32_t num_;
+			unsigned char hash_[16];
+
+			bool operator < (const packed_rev_t &o) const
+			{
+				if (num_!=o.num_)
+					return num_<o.num_;
+				return memcmp(hash_, o.hash_, sizeof(hash_))<0;
+			}
+			bool operator == (const packed_rev_t &o) const
+			{
+				return num_==o.num_ &&
+						memcmp(hash_, o.hash_, sizeof(hash_))==0;
+			}
+		};
+
+		std::vector<packed_rev_t> packed_;
+		revision_list_t other_;
+	public:
+		conflict_set_t() {}
+		//Loads the revision strings of a revlog's conflicts list
+		SOFADB_PUBLIC explicit conflict_set_t(const sublist_t &revs);
+		SOFADB_PUBLIC explicit conflict_set_t(const revision_list_t &revs);
+
+		size_t size() const { return packed_.size()+other_.size(); }
+		bool empty() const { return size()==0; }
+
+		SOFADB_PUBLIC bool contains(const revision_num_t &rev) const;
+		SOFADB_PUBLIC void insert(const revision_num_t &rev);
+		SOFADB_PUBLIC bool remove(const revision_num_t &rev);
+		SOFADB_PUBLIC void merge(const conflict_set_t &other);
+
+		//Writes the revision strings in the set order
+		SOFADB_PUBLIC void store(sublist_t &revs) const;
+		SOFADB_PUBLIC revision_list_t revisions() const;
+	private:
+		static bool pack(const revision_num_t &rev, packed_rev_t *res);
+		static revision_num_t unpack(const packed_rev_t &rev);
+		void add(const revision_num_t &rev);
+		void normalize();
+	};
 
 	class resolver
 	{
@@ -16,8 +72,18 @@ namespace sofadb {
 		static bool is_left_rev_winning(
 			const revision_num_t &left, const revision_num_t &right);
 
-		void merge(const revision_num_t &new_rev,
-				   const sublist_t &new_rev_conflicts);
+		//Deleted revisions that lose are kept amongst deleted conflicts
+		SOFADB_PUBLIC void merge(const revision_num_t &new_rev,
+			const sublist_t &new_rev_conflicts, bool deleted=false);
+
+		/**
+			Merges all incoming revisions of a document in one pass. The
+			best live revision becomes the new top revision, deleted ones
+			win only if no live revision is left. The rest join the
+			conflicts.
+		  */
+		SOFADB_PUBLIC void merge_batch(const revision_list_t &live,
+									   const revision_list_t &deleted);
 	};
 };
 
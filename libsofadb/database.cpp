@@ -1,12 +1,19 @@
 #include "database.h"
 #include "storage_interface.h"
 #include "json_stream.h"
+#include "binary_json.h"
 #include <openssl/md5.h>
+#include <openssl/evp.h>
 #include <time.h>
 #include <boost/lexical_cast.hpp>
 #include "scope_guard.h"
 #include "errors.h"
 #include "conflict.h"
+#include "attachment.h"
+#include "metrics.h"
+#include <algorithm>
+#include <limits>
+#include <set>
 
 #include <iostream>
 using namespace sofadb;
@@ -59,38 +66,43 @@ revision_num_t::revision_num_t(const jstring_t &rev)
 	}
 }
 
-revision_num_t Database::compute_revision(const revision_num_t &prev,
-										const jstring_t &body)
-{
-	static const char alphabet[17]="0123456789abcdef";
-	//TODO: attachments
-
-	unsigned char res[MD5_DIGEST_LENGTH+1]={0};
-	MD5((const unsigned char*)body.data(), body.size(), res);
-
-	jstring_t str_res;
-	str_res.resize(MD5_DIGEST_LENGTH*2);
-	for(int f=0;f<MD5_DIGEST_LENGTH;++f)
-	{
-		str_res[f*2]=alphabet[res[f]/16];
-		str_res[f*2+1]=alphabet[res[f]%16];
-	}
-	return revision_num_t(prev.num()+1, std::move(str_res));
-}
-
-Database::Database(const jstring_t &name)
-	: closed_(false), name_(name), json_meta_(submap_d)
+Database::Database(const jstring_t &name, revision_hash_e hash)
+	: closed_(false), name_(name), json_meta_(submap_d), update_seq_(0),
+	  pending_seqs_(new pending_seqs_t()),
+	  indexes_(new field_index_list_t()), revision_hash_(hash),
+	  compact_running_(false), hot_(false)
 {
 	//Instance start time is in nanoseconds
 	json_meta_["instance_start_time"].as_int() = int64_t(time(NULL))*100000;
 	json_meta_["db_name"] = name;
+	if (hash==revision_hash_blake2b)
+		json_meta_["revision_hash"] = jstring_t("blake2b");
 }
 
 Database::Database(json_value &&meta)
-	: closed_(false)
+	: closed_(false), update_seq_(0), pending_seqs_(new pending_seqs_t()),
+	  indexes_(new field_index_list_t()),
+	  revision_hash_(revision_hash_md5), compact_running_(false), hot_(false)
 {
 	json_meta_ = std::move(meta);
 	name_ = json_meta_["db_name"].get_str();
+	auto hash=json_meta_.get_submap().find("revision_hash");
+	if (hash!=json_meta_.get_submap().end())
+	{
+		if (hash->second.get_str()=="blake2b")
+			revision_hash_=revision_hash_blake2b;
+		else if (hash->second.get_str()!="md5")
+			err(result_code_t::sError) << "Unknown revision hash "
+				<< hash->second.get_str() << " of the database " << name_;
+	}
+}
+
+json_value Database::get_info() const
+{
+	json_value res=json_meta_;
+	res["update_seq"]=json_value(int64_t(update_seq_));
+	res["compact_running"]=json_value(bool(compact_running_));
+	return res;
 }
 
 void Database::check_closed()
@@ -116,6 +128,13 @@ std::pair<json_value, json_value>
 	return std::make_pair(std::move(sanitized), std::move(special));
 }
 
+static bool timed_try_get(storage_t *ifc, const jstring_t &key,
+						  jstring_t *res, metric_e metric)
+{
+	scoped_timer timer(metric);
+	return ifc->try_get(key, res);
+}
+
 bool Database::get_revlog(storage_t *ifc,
 					   const jstring_t &path_base, json_value &res)
 {
@@ -134,9 +153,11 @@ bool Database::get_revlog(storage_t *ifc,
 
 put_result_t Database::put(storage_t *ifc,
 				   const jstring_t &id, const revision_num_t& old_rev,
-				   const json_value &content, bool do_merge)
+				   const json_value &content, bool do_merge,
+				   const attachment_vector_t *atts)
 {
 	check_closed();
+	scoped_timer put_timer(metric_put);
 	//Ok. That gets interesting!
 	//Let's roll!
 	put_result_t put_res;
@@ -144,7 +165,11 @@ put_result_t Database::put(storage_t *ifc,
 	//Check if there is an old revision with this ID
 	const std::string doc_rev_path_base=make_path(id);
 
-	bool has_prev = get_revlog(ifc, doc_rev_path_base, put_res.rev_log_);
+	bool has_prev;
+	{
+		scoped_timer timer(metric_put_revlog_read);
+		has_prev = get_revlog(ifc, doc_rev_path_base, put_res.rev_log_);
+	}
 	bool need_to_merge = false;
 	if (has_prev)
 	{
@@ -156,6 +181,7 @@ put_result_t Database::put(storage_t *ifc,
 			if (!do_merge)
 			{
 				put_res.code_ = UPDATE_CONFLICT;
+				add_to_counter(counter_put_conflicts);
 				return std::move(put_res);
 			}
 			need_to_merge = true;
@@ -163,7 +189,7 @@ put_result_t Database::put(storage_t *ifc,
 	}
 	//Update or create a document!
 	put_res.assigned_rev_ = store_data(ifc, doc_rev_path_base, old_rev,
-						  false, content);
+						  false, content, 0, atts);
 	assert(!put_res.assigned_rev_.empty());
 
 	//Format the revlog
@@ -185,7 +211,17 @@ put_result_t Database::put(storage_t *ifc,
 	}
 
 	//Write the revlog info
-	ifc->put(doc_rev_path_base, json_to_string(put_res.rev_log_));
+	{
+		scoped_timer timer(metric_put_revlog_write);
+		ifc->put(doc_rev_path_base, json_to_string(put_res.rev_log_));
+	}
+	record_change(ifc, id);
+	if (need_to_merge)
+		update_conflicts_index(ifc, id, put_res.rev_log_);
+
+	//Indexes follow the winning revision only
+	if (revlog_wrapper(put_res.rev_log_).top_rev_id()==put_res.assigned_rev_)
+		update_indexes(ifc, id, &content);
 
 	VLOG_MACRO(1) << "Created document " << id << " in the database "
 				  << name_ << " revid=" << put_res.assigned_rev_ << " at "
@@ -194,40 +230,941 @@ put_result_t Database::put(storage_t *ifc,
 	return std::move(put_res);
 }
 
+static bool has_revision(const json_value &log, const revision_num_t &rev)
+{
+	const sublist_t &lst=log.get_sublist();
+	//Conflicts and deleted conflicts
+	for(size_t f=0;f<2;++f)
+	{
+		const sublist_t &conflicts=lst.at(f).get_sublist();
+		for(auto i=conflicts.begin(), iend=conflicts.end(); i!=iend; ++i)
+			if (i->get_str()==rev.full_string())
+				return true;
+	}
+	//Revisions of the winning branch
+	for(size_t f=2;f<lst.size();++f)
+	{
+		const sublist_t &quad=lst[f].get_sublist();
+		if (quad.at(0).get_int()==rev.num() &&
+				quad.at(1).get_str()==rev.uniq())
+			return true;
+	}
+	return false;
+}
+
+static void collect_leaves(json_value &log, revision_list_t &res)
+{
+	res.push_back(revlog_wrapper(log).top_rev_id());
+	const sublist_t &lst=log.get_sublist();
+	for(size_t f=0;f<2;++f)
+	{
+		const sublist_t &conflicts=lst.at(f).get_sublist();
+		for(auto c=conflicts.begin(), cend=conflicts.end(); c!=cend; ++c)
+			res.push_back(revision_num_t(c->get_str()));
+	}
+}
+
+bool Database::get_leaves(storage_t *ifc, const jstring_t &id,
+						  revision_list_t &res)
+{
+	json_value log;
+	if (!get_revlog(ifc, make_path(id), log))
+		return false;
+	collect_leaves(log, res);
+	return true;
+}
+
+bool Database::get_replicated(storage_t *ifc, const jstring_t &id,
+	const revision_num_t &rev, foreign_doc_t &res, size_t max_history)
+{
+	revision_t info;
+	if (!get(ifc, id, &rev, &res.content_, &info))
+		return false;
+	res.id_=id;
+	res.rev_=rev;
+	res.deleted_=info.deleted_;
+
+	res.history_.clear();
+	revision_num_t parent=info.previous_rev_;
+	while(!parent.empty() && res.history_.size()<max_history)
+	{
+		res.history_.push_back(parent);
+		if (!get(ifc, id, &parent, 0, &info))
+			break; //Only the ID of this one is known
+		parent=info.previous_rev_;
+	}
+	return true;
+}
+
+void Database::revs_diff(storage_t *ifc, std::vector<revs_diff_t> &entries)
+{
+	check_closed();
+
+	std::vector<std::pair<jstring_t, revs_diff_t*> > order;
+	order.reserve(entries.size());
+	for(auto i=entries.begin(), iend=entries.end(); i!=iend; ++i)
+	{
+		i->missing_.clear();
+		i->possible_ancestors_.clear();
+		order.push_back(std::make_pair(make_path(i->id_), &*i));
+	}
+	std::sort(order.begin(), order.end());
+
+	std::auto_ptr<storage_iterator_t> it=ifc->iterate();
+	for(auto i=order.begin(), iend=order.end(); i!=iend; ++i)
+	{
+		revs_diff_t &entry=*i->second;
+		it->seek(i->first);
+		const bool found=it->valid() && it->key()==i->first;
+		json_value log;
+		if (found)
+			log=string_to_json(it->value());
+
+		uint32_t max_missing=0;
+		for(auto r=entry.revs_.begin(), rend=entry.revs_.end(); r!=rend; ++r)
+		{
+			if (found && has_revision(log, *r))
+				continue;
+			entry.missing_.push_back(*r);
+			max_missing=std::max(max_missing, r->num());
+		}
+		if (!found || entry.missing_.empty())
+			continue;
+
+		//Leaves older than the missing revisions might be their ancestors
+		revision_list_t leaves;
+		collect_leaves(log, leaves);
+		for(auto l=leaves.begin(), lend=leaves.end(); l!=lend; ++l)
+			if (l->num()<max_missing)
+				entry.possible_ancestors_.push_back(*l);
+	}
+}
+
+put_result_t Database::put_replicated(storage_t *ifc, const foreign_doc_t &doc)
+{
+	check_closed();
+	const foreign_doc_t *ptr=&doc;
+	put_result_t put_res;
+	merge_replicated(ifc, &ptr, 1, &put_res);
+	return std::move(put_res);
+}
+
+static bool erase_revision(revision_list_t &lst, const revision_num_t &rev)
+{
+	auto pos=std::find(lst.begin(), lst.end(), rev);
+	if (pos==lst.end())
+		return false;
+	lst.erase(pos);
+	return true;
+}
+
+void Database::merge_replicated(storage_t *ifc, const foreign_doc_t *const *docs,
+								size_t count, put_result_t *results)
+{
+	assert(count>0);
+	const jstring_t &id=docs[0]->id_;
+	const jstring_t path_base=make_path(id);
+	json_value log;
+	bool has_prev=get_revlog(ifc, path_base, log);
+	revlog_wrapper w(log);
+	const json_value old_conflicts=w.get_conflicts();
+	const revision_num_t old_top=has_prev ? w.top_rev_id() : revision_num_t();
+
+	//Revisions that don't continue the winning branch are collected
+	//and merged in together once all of them are known
+	revision_list_t live, dead, written;
+	bool shadows_conflicts=false;
+	for(size_t f=0;f<count;++f)
+	{
+		const foreign_doc_t &doc=*docs[f];
+		put_result_t &put_res=results[f];
+		put_res.code_=UPDATE_OK;
+		put_res.assigned_rev_=revision_num_t();
+		if (doc.id_.empty() || doc.rev_.empty())
+			err(result_code_t::sError)
+					<< "Replicated documents need an id and a revision";
+		assert(doc.id_==id);
+
+		if (has_prev && (has_revision(log, doc.rev_) || std::find(
+				written.begin(), written.end(), doc.rev_)!=written.end()))
+			continue; //Already replicated
+		put_res.assigned_rev_=doc.rev_;
+		written.push_back(doc.rev_);
+
+		const revision_num_t &parent=doc.history_.empty() ?
+					revision_num_t::empty_revision : doc.history_.front();
+		store_data(ifc, path_base, parent, doc.deleted_, doc.content_,
+				   &doc.rev_);
+
+		auto top=has_prev ? std::find(doc.history_.begin(),
+			doc.history_.end(), w.top_rev_id()) : doc.history_.end();
+		if (!has_prev || top!=doc.history_.end())
+		{
+			//A new document or a continuation of the winning branch, the
+			//ancestors we don't have are recorded as unavailable
+			for(auto i=top; i!=doc.history_.begin();)
+				w.add_rev_info(*--i, false, false);
+			w.add_rev_info(doc.rev_, true, doc.deleted_);
+			has_prev=true;
+			//Deleting the winner hands the document over to the best
+			//live conflict, the resolver sorts it out below
+			if (doc.deleted_ && !w.get_conflicts().empty())
+			{
+				shadows_conflicts=true;
+				put_res.code_=UPDATE_CONFLICT_LOST;
+			}
+			continue;
+		}
+
+		//The new revision supersedes its ancestors amongst the conflicts
+		sublist_t &lst=log.get_sublist();
+		for(size_t l=0;l<2;++l)
+		{
+			sublist_t &conflicts=lst.at(l).get_sublist();
+			conflicts.erase(std::remove_if(conflicts.begin(), conflicts.end(),
+				[&](const json_value &c)
+				{
+					return std::find(doc.history_.begin(), doc.history_.end(),
+						revision_num_t(c.get_str()))!=doc.history_.end();
+				}), conflicts.end());
+		}
+		for(auto i=doc.history_.begin(), iend=doc.history_.end(); i!=iend; ++i)
+			if (!erase_revision(live, *i))
+				erase_revision(dead, *i);
+		(doc.deleted_ ? dead : live).push_back(doc.rev_);
+		put_res.code_=UPDATE_CONFLICT_LOST;
+	}
+	if (written.empty())
+	{
+		results[count-1].rev_log_=std::move(log);
+		return;
+	}
+
+	if (!live.empty() || !dead.empty() || shadows_conflicts)
+		resolver(&log).merge_batch(live, dead);
+
+	const revision_num_t top=w.top_rev_id();
+	const foreign_doc_t *winner=0;
+	for(size_t f=0;f<count;++f)
+	{
+		if (results[f].code_==UPDATE_CONFLICT_LOST && docs[f]->rev_==top)
+			results[f].code_=UPDATE_CONFLICT_WON;
+		if (!results[f].assigned_rev_.empty() && docs[f]->rev_==top)
+			winner=docs[f];
+	}
+
+	{
+		scoped_timer timer(metric_put_revlog_write);
+		ifc->put(path_base, json_to_string(log));
+	}
+	record_change(ifc, id);
+	if (json_value(w.get_conflicts())!=old_conflicts)
+		update_conflicts_index(ifc, id, log);
+	if (winner)
+		update_indexes(ifc, id, winner->deleted_ ? 0 : &winner->content_);
+	else if (top!=old_top)
+	{
+		//A stored conflict took over from a deleted winner
+		json_value content;
+		revision_t rev;
+		if (get(ifc, id, &top, &content, &rev))
+			update_indexes(ifc, id, rev.deleted_ ? 0 : &content);
+	}
+
+	VLOG_MACRO(1) << "Replicated " << count << " revisions of the document "
+				  << id << " into the database " << name_ << std::endl;
+	results[count-1].rev_log_=std::move(log);
+}
+
+size_t Database::bulk_put_replicated(batch_storage_t *ifc,
+	const std::vector<foreign_doc_t> &docs, bool sync)
+{
+	check_closed();
+
+	//Revisions of the same document are merged together, so its revlog
+	//is read and written once per batch
+	std::vector<const foreign_doc_t*> order;
+	order.reserve(docs.size());
+	for(auto i=docs.begin(), iend=docs.end(); i!=iend; ++i)
+		order.push_back(&*i);
+	std::stable_sort(order.begin(), order.end(),
+		[](const foreign_doc_t *l, const foreign_doc_t *r)
+		{
+			return l->id_<r->id_;
+		});
+
+	std::vector<put_result_t> results(order.size());
+	for(size_t f=0;f<order.size();)
+	{
+		size_t end=f+1;
+		while(end<order.size() && order[end]->id_==order[f]->id_)
+			++end;
+		merge_replicated(ifc, &order[f], end-f, &results[f]);
+		f=end;
+	}
+	ifc->commit(sync);
+
+	size_t res=0;
+	for(auto i=results.begin(), iend=results.end(); i!=iend; ++i)
+		if (!i->assigned_rev_.empty())
+			++res;
+	return res;
+}
+
 class optionaly_pooled_alloc
 {
 
 };
 
-revision_num_t Database::store_data(storage_t *ifc,
-									const jstring_t &doc_data_path_base,
-									const revision_num_t &prev_rev_,
-									bool deleted,
-									const json_value &content)
+static void write_stored_doc(json_stream *str, bool deleted,
+							 const revision_num_t &prev_rev,
+							 const json_value &content,
+							 const attachment_vector_t *atts)
 {
-	jstring_t body;
-	body.reserve(128);
-
-	//Format is [deleted, prev_rev, attachments, content]
-	std::auto_ptr<json_stream> str=make_stream(body, false);
+	//Format is [deleted, prev_rev, attachments, content]. Documents
+	//without attachments keep null there, so their revision IDs
+	//don't change.
 	str->start_list();
 	str->write_bool(deleted);
-	str->write_string(prev_rev_.full_string());
-	//TODO: attachments
-	str->write_null();
+	str->write_string(prev_rev.full_string());
+	if (atts && !atts->empty())
+		str->write_json(attachments_to_json(*atts));
+	else
+		str->write_null();
 	str->write_json(content);
 	str->end_list();
+}
+
+/**
+	Hashes the canonical text of a document as it's being serialized, the
+	text itself is never accumulated.
+  */
+class revision_hasher : public json_sink_t
+{
+	EVP_MD_CTX *ctx_;
+public:
+	revision_hasher(revision_hash_e hash) : ctx_(EVP_MD_CTX_new())
+	{
+		const EVP_MD *md=hash==revision_hash_blake2b ?
+					EVP_blake2b512() : EVP_md5();
+		if (!ctx_ || !EVP_DigestInit_ex(ctx_, md, 0))
+		{
+			EVP_MD_CTX_free(ctx_);
+			err(result_code_t::sError) << "Can't initialize the digest";
+		}
+	}
+	virtual ~revision_hasher()
+	{
+		EVP_MD_CTX_free(ctx_);
+	}
+
+	virtual void append(const char *data, size_t ln)
+	{
+		EVP_DigestUpdate(ctx_, data, ln);
+	}
+
+	//Digests longer than MD5 are truncated to its 16 bytes, so all the
+	//ids have the same shape
+	jstring_t finish()
+	{
+		static const char alphabet[17]="0123456789abcdef";
+		unsigned char res[EVP_MAX_MD_SIZE];
+		unsigned int ln=0;
+		EVP_DigestFinal_ex(ctx_, res, &ln);
+		ln=std::min(ln, (unsigned int)MD5_DIGEST_LENGTH);
+
+		jstring_t str_res;
+		str_res.resize(ln*2);
+		for(unsigned int f=0;f<ln;++f)
+		{
+			str_res[f*2]=alphabet[res[f]/16];
+			str_res[f*2+1]=alphabet[res[f]%16];
+		}
+		return str_res;
+	}
+};
 
-	revision_num_t rev=compute_revision(prev_rev_, body);
+revision_num_t Database::compute_revision(const revision_num_t &prev,
+	bool deleted, const json_value &content, const attachment_vector_t *atts,
+	jstring_t *stored)
+{
+	scoped_timer timer(metric_put_encode);
+	revision_hasher hasher(revision_hash_);
+	{
+		std::auto_ptr<json_stream> text=make_sink_stream(&hasher);
+		if (stored)
+		{
+			//The binary form comes out of the same walk
+			std::auto_ptr<json_stream> binary=make_binary_stream(*stored);
+			write_stored_doc(make_tee_stream(text.get(), binary.get()).get(),
+							 deleted, prev, content, atts);
+		} else
+			write_stored_doc(text.get(), deleted, prev, content, atts);
+	}
+	return revision_num_t(prev.num()+1, hasher.finish());
+}
+
+revision_num_t Database::store_data(storage_t *ifc,
+									const jstring_t &doc_data_path_base,
+									const revision_num_t &prev_rev_,
+									bool deleted,
+									const json_value &content,
+									const revision_num_t *foreign_rev,
+									const attachment_vector_t *atts)
+{
+	//The revision is always computed over the canonical JSON form so
+	//that revision IDs stay compatible with CouchDB, but the document
+	//itself is stored in the binary form. Both come from a single walk
+	//of the document. Foreign revisions keep their IDs.
+	jstring_t stored;
+	stored.reserve(128);
+	revision_num_t rev;
+	if (foreign_rev)
+	{
+		rev=*foreign_rev;
+		scoped_timer timer(metric_put_serialize);
+		write_stored_doc(make_binary_stream(stored).get(),
+						 deleted, prev_rev_, content, atts);
+	} else
+		rev=compute_revision(prev_rev_, deleted, content, atts, &stored);
 
 	//Write the document
 	std::string doc_data_path=doc_data_path_base+rev.full_string();
-	ifc->put(doc_data_path, body);
-
-	//TODO: attachments
+	scoped_timer timer(metric_put_write);
+	ifc->put(doc_data_path, stored);
 	return rev;
 }
 
+jstring_t Database::make_attachment_prefix() const
+{
+	jstring_t res;
+	res.reserve(name_.size() + 8);
+	res.append(SD_ATTACHMENT_DB "/");
+	res.append(name_);
+	res.append(DB_SEPARATOR);
+	return res;
+}
+
+std::auto_ptr<attachment_writer> Database::create_attachment(storage_t *ifc,
+	const jstring_t &name, const jstring_t &content_type)
+{
+	check_closed();
+	return std::auto_ptr<attachment_writer>(new attachment_writer(
+		ifc, make_attachment_prefix(), name, content_type));
+}
+
+std::auto_ptr<attachment_reader> Database::open_attachment(storage_t *ifc,
+	const inline_attachment_t &att, bool decode)
+{
+	check_closed();
+	return std::auto_ptr<attachment_reader>(new attachment_reader(
+		ifc, make_attachment_prefix(), att, decode));
+}
+
+static void append_seq(jstring_t &out, uint64_t seq)
+{
+	//Big-endian, so that keys are ordered by the sequence
+	char buf[8];
+	for(int f=0;f<8;++f)
+		buf[f] = static_cast<char>(seq >> (56-8*f));
+	out.append(buf, 8);
+}
+
+static uint64_t parse_seq(const char *data)
+{
+	uint64_t res=0;
+	for(int f=0;f<8;++f)
+		res = (res<<8) | static_cast<unsigned char>(data[f]);
+	return res;
+}
+
+jstring_t Database::make_seq_path(char kind) const
+{
+	//The by-sequence index has two parts: 's'+seq -> id and
+	//'i'+id -> seq, the latter is used to drop superseded entries.
+	//The conflicts index 'c'+id -> [conflicts] lives next to them.
+	jstring_t res;
+	res.reserve(name_.size() + 32);
+	res.append(SD_SEQ_DB"/");
+	res.append(name_);
+	res.append(DB_SEPARATOR);
+	res.push_back(kind);
+	return res;
+}
+
+void Database::record_change(storage_t *ifc, const jstring_t &id)
+{
+	//Assigned and registered together, so that no later sequence can be
+	//seen committed while this one is not registered yet
+	uint64_t seq;
+	{
+		std::lock_guard<std::mutex> lock(pending_seqs_->mutex_);
+		seq=++update_seq_;
+		pending_seqs_->seqs_.insert(seq);
+	}
+
+	jstring_t by_id=make_seq_path('i');
+	by_id.append(id);
+	jstring_t old_seq;
+	if (ifc->try_get(by_id, &old_seq) && old_seq.size()==8)
+		ifc->remove(make_seq_path('s')+old_seq);
+
+	jstring_t seq_str;
+	append_seq(seq_str, seq);
+	ifc->put(make_seq_path('s')+seq_str, id);
+	ifc->put(by_id, seq_str);
+
+	boost::shared_ptr<pending_seqs_t> pending=pending_seqs_;
+	ifc->on_commit([pending, seq]
+	{
+		std::lock_guard<std::mutex> lock(pending->mutex_);
+		pending->seqs_.erase(seq);
+	});
+}
+
+uint64_t Database::committed_seq()
+{
+	std::lock_guard<std::mutex> lock(pending_seqs_->mutex_);
+	if (pending_seqs_->seqs_.empty())
+		return update_seq_;
+	return *pending_seqs_->seqs_.begin()-1;
+}
+
+void Database::update_conflicts_index(storage_t *ifc, const jstring_t &id,
+									  const json_value &log)
+{
+	const json_value &conflicts=log.get_sublist().at(0);
+	jstring_t key=make_seq_path('c');
+	key.append(id);
+	if (conflicts.get_sublist().empty())
+		ifc->remove(key);
+	else
+		ifc->put(key, json_to_string(conflicts));
+}
+
+void Database::conflicts_from_revlog(const json_value &log,
+									 doc_conflicts_t &res)
+{
+	const sublist_t &lst=log.get_sublist();
+	const sublist_t &quad=lst.back().get_sublist();
+	res.winner_=revision_num_t(quad.at(0).get_int(), quad.at(1).get_str());
+	res.deleted_=quad.size()>3 && quad[3].get_bool();
+
+	revision_list_t *dest[2]={&res.conflicts_, &res.deleted_conflicts_};
+	for(size_t f=0;f<2;++f)
+	{
+		const sublist_t &conflicts=lst.at(f).get_sublist();
+		dest[f]->clear();
+		dest[f]->reserve(conflicts.size());
+		for(auto i=conflicts.begin(), iend=conflicts.end(); i!=iend; ++i)
+			dest[f]->push_back(revision_num_t(i->get_str()));
+	}
+}
+
+bool Database::get_conflicts(storage_t *ifc, const jstring_t &id,
+							 doc_conflicts_t &res)
+{
+	check_closed();
+	jstring_t version_log;
+	if (!ifc->try_get(make_path(id), &version_log))
+		return false;
+	conflicts_from_revlog(string_to_json(version_log), res);
+	return true;
+}
+
+void Database::conflicted_docs(storage_t *ifc, const jstring_t &start_id,
+							   const conflict_callback_t &fn)
+{
+	check_closed();
+	const jstring_t prefix=make_seq_path('c');
+
+	std::auto_ptr<storage_iterator_t> it=ifc->iterate();
+	revision_list_t conflicts;
+	for(it->seek(prefix+start_id); it->valid(); it->next())
+	{
+		const jstring_t key=it->key();
+		if (key.compare(0, prefix.size(), prefix)!=0)
+			break;
+
+		json_value lst=string_to_json(it->value());
+		conflicts.clear();
+		const sublist_t &revs=lst.get_sublist();
+		for(auto i=revs.begin(), iend=revs.end(); i!=iend; ++i)
+			conflicts.push_back(revision_num_t(i->get_str()));
+		if (!fn(key.substr(prefix.size()), conflicts))
+			break;
+	}
+}
+
+//Reads [deleted, prev_rev] of a stored revision, returns false if it
+//has been pruned
+static bool read_stored_header(const jstring_t &val, bool &deleted,
+							   jstring_t &prev_rev)
+{
+	if (!is_binary_json(val))
+	{
+		json_value serialized=string_to_json(val);
+		const sublist_t &lst=serialized.get_sublist();
+		deleted=lst.at(0).get_bool();
+		prev_rev=lst.at(1).get_str();
+		return true;
+	}
+	binary_reader reader(val.data(), val.size());
+	const size_t fields=reader.enter();
+	deleted=reader.read_bool();
+	prev_rev=reader.read_string();
+	return fields!=2;
+}
+
+struct stored_body_t
+{
+	jstring_t rev_, prev_rev_;
+	bool deleted_, pruned_;
+	size_t size_;
+};
+
+prune_stats_t Database::prune_revisions(batch_storage_t *ifc,
+										const prune_progress_t &progress)
+{
+	check_closed();
+	//Stubs per committed batch and bytes read between progress reports
+	const size_t batch_keys=1000;
+	const uint64_t batch_bytes=4*1024*1024;
+
+	const jstring_t prefix=database_key_prefix(SD_DATA_DB, name_);
+	prune_stats_t res;
+	jstring_t doc_base, key;
+	std::vector<stored_body_t> bodies;
+	size_t pending=0;
+	uint64_t scanned=0;
+
+	auto prune_doc=[&]()
+	{
+		if (bodies.empty())
+			return;
+		//The revlog is read after the bodies, so every revision found to
+		//be superseded below had been stored before it was read
+		json_value log;
+		if (!get_revlog(ifc, doc_base, log))
+			return;
+		++res.docs_;
+
+		revision_list_t leaves;
+		collect_leaves(log, leaves);
+		std::set<jstring_t> leaf_set, ancestors;
+		for(auto i=leaves.begin(), iend=leaves.end(); i!=iend; ++i)
+			leaf_set.insert(i->full_string());
+		//Older revisions of the winning branch...
+		const sublist_t &lst=log.get_sublist();
+		for(size_t f=2;f+1<lst.size();++f)
+		{
+			const sublist_t &quad=lst[f].get_sublist();
+			ancestors.insert(revision_num_t(quad.at(0).get_int(),
+											quad.at(1).get_str()).full_string());
+		}
+		//...and whatever the parent links of the leaves lead to
+		std::map<jstring_t, const stored_body_t*> by_rev;
+		for(auto i=bodies.begin(), iend=bodies.end(); i!=iend; ++i)
+			by_rev[i->rev_]=&*i;
+		for(auto i=leaf_set.begin(), iend=leaf_set.end(); i!=iend; ++i)
+		{
+			auto pos=by_rev.find(*i);
+			while(pos!=by_rev.end() && !pos->second->prev_rev_.empty() &&
+				  ancestors.insert(pos->second->prev_rev_).second)
+				pos=by_rev.find(pos->second->prev_rev_);
+		}
+
+		for(auto i=bodies.begin(), iend=bodies.end(); i!=iend; ++i)
+		{
+			if (i->pruned_ || leaf_set.count(i->rev_) ||
+					!ancestors.count(i->rev_))
+				continue;
+			jstring_t stub;
+			std::auto_ptr<json_stream> str=make_binary_stream(stub);
+			str->start_list();
+			str->write_bool(i->deleted_);
+			str->write_string(i->prev_rev_);
+			str->end_list();
+			str.reset();
+			ifc->put(doc_base+i->rev_, stub);
+			++res.revisions_;
+			res.bytes_pruned_+=i->size_;
+			++pending;
+		}
+		bodies.clear();
+	};
+
+	std::auto_ptr<storage_iterator_t> it=ifc->iterate();
+	for(it->seek(prefix); it->valid(); it->next())
+	{
+		key=it->key();
+		if (key.compare(0, prefix.size(), prefix)!=0)
+			break;
+		const jstring_t val=it->value();
+		scanned+=key.size()+val.size();
+
+		if (key[key.size()-1]==REV_SEPARATOR[0])
+		{
+			//A revlog, the bodies of the document follow it
+			prune_doc();
+			doc_base=key;
+		} else if (!doc_base.empty() &&
+				   key.compare(0, doc_base.size(), doc_base)==0 &&
+				   key.find(REV_SEPARATOR[0], doc_base.size())==jstring_t::npos)
+		{
+			stored_body_t body;
+			body.rev_=key.substr(doc_base.size());
+			body.pruned_=!read_stored_header(val, body.deleted_,
+											 body.prev_rev_);
+			body.size_=val.size();
+			bodies.push_back(std::move(body));
+		}
+
+		if (pending>=batch_keys || scanned>=batch_bytes)
+		{
+			ifc->commit(false);
+			res.bytes_scanned_+=scanned;
+			pending=0;
+			const uint64_t bytes=scanned;
+			scanned=0;
+			if (!progress(key, bytes))
+			{
+				prune_doc();
+				ifc->commit(false);
+				return res;
+			}
+		}
+	}
+	prune_doc();
+	ifc->commit(false);
+	res.bytes_scanned_+=scanned;
+	progress(key, scanned);
+	res.completed_=true;
+	return res;
+}
+
+void Database::load_update_seq(storage_t *ifc)
+{
+	const jstring_t prefix=make_seq_path('s');
+	const jstring_t after=make_seq_path('s'+1);
+
+	std::auto_ptr<storage_iterator_t> it=ifc->iterate();
+	it->seek(after);
+	if (it->valid())
+		it->prev();
+	else
+		it->seek_to_last();
+
+	if (it->valid())
+	{
+		const jstring_t key=it->key();
+		if (key.size()==prefix.size()+8 &&
+				key.compare(0, prefix.size(), prefix)==0)
+			update_seq_=parse_seq(key.data()+prefix.size());
+	}
+}
+
+void Database::changes_since(storage_t *ifc, uint64_t since,
+							 const change_callback_t &fn)
+{
+	scan_changes(ifc, since, committed_seq(), fn);
+}
+
+void Database::scan_changes(storage_t *ifc, uint64_t since, uint64_t last,
+							const change_callback_t &fn)
+{
+	const jstring_t prefix=make_seq_path('s');
+	jstring_t start=prefix;
+	append_seq(start, since+1);
+
+	std::auto_ptr<storage_iterator_t> it=ifc->iterate();
+	for(it->seek(start); it->valid(); it->next())
+	{
+		const jstring_t key=it->key();
+		if (key.size()!=prefix.size()+8 ||
+				key.compare(0, prefix.size(), prefix)!=0)
+			break;
+		const uint64_t seq=parse_seq(key.data()+prefix.size());
+		if (seq>last || !fn(seq, it->value()))
+			break;
+	}
+}
+
+jstring_t Database::make_index_def_path(const jstring_t &name) const
+{
+	jstring_t res;
+	res.reserve(name_.size() + name.size() + 16);
+	res.append(SD_SYSTEM_DB"/");
+	res.append(name_);
+	res.append(DB_SEPARATOR "index" DB_SEPARATOR);
+	res.append(name);
+	return res;
+}
+
+boost::shared_ptr<const field_index_list_t> Database::index_snapshot()
+{
+	std::lock_guard<std::mutex> lock(indexes_mutex_);
+	return indexes_;
+}
+
+void Database::update_indexes(storage_t *ifc, const jstring_t &id,
+							  const json_value *content)
+{
+	boost::shared_ptr<const field_index_list_t> idx=index_snapshot();
+	for(auto i=idx->begin(), iend=idx->end(); i!=iend; ++i)
+		(*i)->update(ifc, id, content);
+}
+
+field_index_list_t Database::indexes()
+{
+	return *index_snapshot();
+}
+
+static std::vector<jstring_t> index_fields(const json_value &def)
+{
+	std::vector<jstring_t> res;
+	const sublist_t &lst=def.get_submap().at("fields").get_sublist();
+	for(auto i=lst.begin(), iend=lst.end(); i!=iend; ++i)
+		res.push_back(i->get_str());
+	return res;
+}
+
+void Database::load_indexes(storage_t *ifc)
+{
+	const jstring_t prefix=make_index_def_path("");
+	boost::shared_ptr<field_index_list_t> res(new field_index_list_t());
+
+	std::auto_ptr<storage_iterator_t> it=ifc->iterate();
+	for(it->seek(prefix); it->valid(); it->next())
+	{
+		const jstring_t key=it->key();
+		if (key.compare(0, prefix.size(), prefix)!=0)
+			break;
+		res->push_back(field_index_ptr(new field_index_t(name_,
+			key.substr(prefix.size()), index_fields(string_to_json(
+				it->value())))));
+	}
+
+	std::lock_guard<std::mutex> lock(indexes_mutex_);
+	indexes_=res;
+}
+
+void Database::create_index(storage_t *ifc, const jstring_t &name,
+							const std::vector<jstring_t> &fields)
+{
+	check_closed();
+	field_index_ptr index(new field_index_t(name_, name, fields));
+	{
+		std::lock_guard<std::mutex> lock(indexes_mutex_);
+		for(auto i=indexes_->begin(), iend=indexes_->end(); i!=iend; ++i)
+		{
+			if ((*i)->name()!=name)
+				continue;
+			if ((*i)->fields()==fields)
+				return;
+			err(result_code_t::sError) << "Index " << name
+									   << " already exists";
+		}
+		boost::shared_ptr<field_index_list_t> lst(
+			new field_index_list_t(*indexes_));
+		lst->push_back(index);
+		indexes_=lst;
+	}
+
+	json_value def(submap_d);
+	sublist_t &lst=def["fields"].as_sublist();
+	for(auto i=fields.begin(), iend=fields.end(); i!=iend; ++i)
+		lst.push_back(json_value(*i));
+	ifc->put(make_index_def_path(name), json_to_string(def));
+
+	//Documents written from now on are indexed by put, the existing ones
+	//are indexed here, including the uncommitted ones of this storage
+	scan_changes(ifc, 0, std::numeric_limits<uint64_t>::max(),
+		[&](uint64_t, const jstring_t &id) -> bool
+	{
+		json_value content;
+		revision_t rev;
+		if (get(ifc, id, 0, &content, &rev) && !rev.deleted_)
+			index->update(ifc, id, &content);
+		return true;
+	});
+}
+
+void Database::drop_index(storage_t *ifc, const jstring_t &name)
+{
+	field_index_ptr index;
+	{
+		std::lock_guard<std::mutex> lock(indexes_mutex_);
+		boost::shared_ptr<field_index_list_t> lst(new field_index_list_t());
+		for(auto i=indexes_->begin(), iend=indexes_->end(); i!=iend; ++i)
+		{
+			if ((*i)->name()==name)
+				index=*i;
+			else
+				lst->push_back(*i);
+		}
+		if (!index)
+			err(result_code_t::sNotFound) << "No index " << name;
+		indexes_=lst;
+	}
+	ifc->remove(make_index_def_path(name));
+	index->clear(ifc);
+}
+
+void Database::find(storage_t *ifc, const json_value &selector,
+	size_t limit, std::vector<std::pair<jstring_t, json_value> > &res,
+	find_plan_t *plan)
+{
+	check_closed();
+	const selector_t sel(selector);
+	find_plan_t used;
+	if (limit)
+	{
+		//The selector is always rechecked, the index only narrows the set
+		//of candidate documents
+		auto visit=[&](const jstring_t &id) -> bool
+		{
+			json_value content;
+			revision_t rev;
+			if (get(ifc, id, 0, &content, &rev) && !rev.deleted_ &&
+					sel.matches(content))
+				res.push_back(std::make_pair(id, std::move(content)));
+			return res.size()<limit;
+		};
+
+		field_index_ptr index;
+		jstring_t lower, upper;
+		if (plan_find(*index_snapshot(), sel, &used, &index, &lower, &upper))
+			index->scan(ifc, lower, upper, visit);
+		else
+			scan_changes(ifc, 0, std::numeric_limits<uint64_t>::max(),
+				[&](uint64_t, const jstring_t &id)
+			{
+				return visit(id);
+			});
+	}
+	if (plan)
+		*plan=used;
+}
+
+jstring_t sofadb::database_key_prefix(const char *space,
+									  const jstring_t &db_name)
+{
+	jstring_t res(space);
+	if (res==SD_DATA_DB)
+	{
+		res.append("/", 2);
+		res.append(db_name);
+		res.append(DB_SEPARATOR, 2);
+	} else
+	{
+		res.append("/");
+		res.append(db_name);
+		res.append(DB_SEPARATOR);
+	}
+	return res;
+}
+
 jstring_t Database::make_path(const jstring_t &id)
 {
 	//Optimized, so it's ugly.
@@ -247,6 +1184,7 @@ bool Database::get(storage_t *ifc,
 				   json_value *content, revision_t *rev, json_value *rev_log)
 {
 	assert(content || rev || rev_log); //At least something must be present!
+	scoped_timer get_timer(metric_get);
 	jstring_t path_base = make_path(id);
 
 	revision_num_t num;
@@ -255,21 +1193,24 @@ bool Database::get(storage_t *ifc,
 		//We need to query the revision history either if we are interested
 		//in it or if we don't know it.
 		jstring_t version_log;
-		if (!ifc->try_get(path_base, &version_log))
+		if (!timed_try_get(ifc, path_base, &version_log,
+						   metric_get_revlog_read))
+		{
+			add_to_counter(counter_get_misses);
 			return false;
+		}
 
 		json_value log = string_to_json(version_log);
+		//Get the last revision before the log is handed out
+		if (!rev_num)
+			num = revlog_wrapper(log).top_rev_id();
+		else
+			num = *rev_num;
+
 		if (rev_log)
 			*rev_log = std::move(log);
 		if (!content && !rev) //We're not interested in further info
 			return true;
-
-		//Otherwise get the last revision
-		if (!rev_num)
-		{
-			num = revlog_wrapper(log).top_rev_id();
-		} else
-			num = *rev_num;
 	} else
 	{
 		assert(rev_num);
@@ -277,7 +1218,8 @@ bool Database::get(storage_t *ifc,
 	}
 
 	jstring_t val;
-	if (!ifc->try_get(path_base+num.full_string(), &val))
+	if (!timed_try_get(ifc, path_base+num.full_string(), &val,
+					   metric_get_body_read))
 	{
 		//Note, previous version used MVCC snapshots. However, it's
 		//not strictly necessary here - stored documents are immutable and
@@ -288,21 +1230,72 @@ bool Database::get(storage_t *ifc,
 			VLOG_MACRO(1) << "Pruned database during document retreival, ID="
 						  << id
 						  << std::endl;
+		add_to_counter(counter_get_misses);
 		return false; //Revision was not found :(
 	}
 
-	json_value serialized=string_to_json(val);
-	sublist_t &lst = serialized.get_sublist();
-	//Format is [deleted, prev_rev, attachments, content]
+	scoped_timer decode_timer(metric_get_decode);
+	if (!is_binary_json(val))
+	{
+		//Legacy JSON-formatted document
+		json_value serialized=string_to_json(val);
+		sublist_t &lst = serialized.get_sublist();
+		//Format is [deleted, prev_rev, attachments, content]
+		if (content)
+			*content = std::move(lst.at(3));
+
+		if (rev)
+		{
+			rev->id_ = id;
+			rev->deleted_ = lst.at(0).get_bool();
+			rev->previous_rev_ = revision_num_t(lst.at(1).get_str());
+			attachments_from_json(lst.at(2), rev->atts_);
+			rev->rev_ = num;
+		}
+		return true;
+	}
+
+	binary_reader reader(val.data(), val.size());
+	const size_t fields=reader.enter();
+	if (fields!=4 && fields!=2)
+		err(result_code_t::sError) << "Corrupted document " << id;
+	//Format is [deleted, prev_rev, attachments, content], pruned
+	//revisions only keep [deleted, prev_rev]
+	bool deleted=reader.read_bool();
+	jstring_t prev_rev=reader.read_string();
+	if (fields==2)
+	{
+		if (content)
+		{
+			add_to_counter(counter_get_misses);
+			return false;
+		}
+		if (rev)
+		{
+			rev->id_ = id;
+			rev->deleted_ = deleted;
+			rev->previous_rev_ = revision_num_t(prev_rev);
+			rev->atts_.clear();
+			rev->rev_ = num;
+		}
+		return true;
+	}
+	if (rev && reader.peek_type()!=nil_d)
+		attachments_from_json(reader.read(), rev->atts_);
+	else
+	{
+		if (rev)
+			rev->atts_.clear();
+		reader.skip();
+	}
 	if (content)
-		*content = std::move(lst.at(3));
+		reader.read(*content);
 
 	if (rev)
 	{
 		rev->id_ = id;
-		rev->deleted_ = lst.at(0).get_bool();
-		rev->previous_rev_ = revision_num_t(lst.at(1).get_str());
-		//serialized["atts"] = json_value(); //TODO: attachments
+		rev->deleted_ = deleted;
+		rev->previous_rev_ = revision_num_t(prev_rev);
 		rev->rev_ = num;
 	}
 
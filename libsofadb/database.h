@@ -4,9 +4,19 @@
 #include "common.h"
 #include "native_json.h"
 #include "boilerplate.hpp"
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <set>
+#include <string.h>
+#include "field_index.h"
 
 #define SD_SYSTEM_DB "_sys"
 #define SD_DATA_DB "_data"
+#define SD_SEQ_DB "_seq"
+#define SD_VIEW_DB "_view"
+#define SD_INDEX_DB "_idx"
+#define SD_ATTACHMENT_DB "_att"
 #define DB_SEPARATOR "!"
 #define REV_SEPARATOR "@"
 
@@ -22,11 +32,23 @@ namespace leveldb {
 
 namespace sofadb {
 	class storage_t;
+	class batch_storage_t;
+	class attachment_writer;
+	class attachment_reader;
 
-	class inline_attachment_t
+	struct inline_attachment_t
 	{
 		jstring_t name_, content_type_;
-		uint8_t md5_[16];
+		uint8_t md5_[16]; //Of the original content
+		uint64_t length_;
+		//Stored size, differs from the length for compressed blobs
+		uint64_t encoded_length_;
+		bool compressed_;
+
+		inline_attachment_t() : length_(), encoded_length_(), compressed_()
+		{
+			memset(md5_, 0, sizeof(md5_));
+		}
 	};
 	typedef std::vector<inline_attachment_t> attachment_vector_t;
 
@@ -138,6 +160,34 @@ namespace sofadb {
 			revision_t, (id_)(deleted_)(previous_rev_)(atts_)(rev_))
 	};
 
+	typedef std::vector<revision_num_t> revision_list_t;
+
+	/**
+		A revision created elsewhere, as written by replicators with
+		new_edits=false. It keeps its revision ID and carries its history.
+	  */
+	struct foreign_doc_t
+	{
+		jstring_t id_;
+		revision_num_t rev_;
+		//Known ancestors of the revision, the parent first
+		revision_list_t history_;
+		bool deleted_;
+		json_value content_;
+
+		foreign_doc_t() : deleted_() {}
+	};
+
+	//An entry of a revs_diff request, 'missing_' and
+	//'possible_ancestors_' are filled by Database::revs_diff
+	struct revs_diff_t
+	{
+		jstring_t id_;
+		revision_list_t revs_;
+		revision_list_t missing_;
+		revision_list_t possible_ancestors_;
+	};
+
 	enum update_status_e { UPDATE_OK, UPDATE_CONFLICT,
 						UPDATE_CONFLICT_WON, UPDATE_CONFLICT_LOST };
 
@@ -168,18 +218,91 @@ namespace sofadb {
 		"committed_update_seq":34
 		}
 	*/
+	typedef std::function<bool (uint64_t seq, const jstring_t &id)>
+		change_callback_t;
+
+	//Hash of revision ids, chosen when a database is created. MD5 keeps
+	//the ids compatible with CouchDB, BLAKE2b is faster on big documents.
+	enum revision_hash_e
+	{
+		revision_hash_md5,
+		revision_hash_blake2b,
+	};
+
+	//Conflict state of a document as recorded in its revlog
+	struct doc_conflicts_t
+	{
+		revision_num_t winner_;
+		bool deleted_;
+		revision_list_t conflicts_;
+		revision_list_t deleted_conflicts_;
+
+		doc_conflicts_t() : deleted_() {}
+	};
+	typedef std::function<bool (const jstring_t &id,
+		const revision_list_t &conflicts)> conflict_callback_t;
+
+	/**
+		Prefix of all the keys of a database in one of the SD_* key
+		spaces. Document keys have always carried the terminating NULs
+		of the literals they are built from, so their layout is kept for
+		the existing stores.
+	  */
+	SOFADB_PUBLIC jstring_t database_key_prefix(const char *space,
+												const jstring_t &db_name);
+
+	struct prune_stats_t
+	{
+		uint64_t docs_, revisions_, bytes_scanned_, bytes_pruned_;
+		//False if the pass has been stopped by the progress callback
+		bool completed_;
+
+		prune_stats_t() : docs_(), revisions_(), bytes_scanned_(),
+			bytes_pruned_(), completed_() {}
+	};
+	//Called after every committed batch with the last visited key and
+	//the bytes read since the previous call, returns false to stop
+	typedef std::function<bool (const jstring_t &last_key,
+		uint64_t bytes)> prune_progress_t;
+
 	class Database
 	{
-		bool closed_;
+		std::atomic<bool> closed_;
 		json_value json_meta_;
 		jstring_t name_;
-
-		Database(const jstring_t &name);
+		//The last assigned update sequence, it's recovered from the
+		//by-sequence index when the database is opened
+		std::atomic<uint64_t> update_seq_;
+		//Sequences assigned to changes that aren't committed yet. It is
+		//shared with the commit hooks, which may outlive the database.
+		struct pending_seqs_t
+		{
+			std::mutex mutex_;
+			std::set<uint64_t> seqs_;
+		};
+		boost::shared_ptr<pending_seqs_t> pending_seqs_;
+		//Field indexes, the list is replaced as a whole so puts can use
+		//a snapshot of it without holding the lock
+		boost::shared_ptr<const field_index_list_t> indexes_;
+		std::mutex indexes_mutex_;
+		revision_hash_e revision_hash_;
+		std::atomic<bool> compact_running_;
+		//Set once the engine has handed the database out
+		std::atomic<bool> hot_;
+
+		Database(const jstring_t &name, revision_hash_e hash);
 		Database(json_value &&meta);
 
 		friend class DbEngine;
 	public:
 		const json_value& get_meta() const {return json_meta_;}
+		const jstring_t& name() const {return name_;}
+		revision_hash_e revision_hash() const {return revision_hash_;}
+		uint64_t update_seq() const {return update_seq_;}
+		bool compact_running() const {return compact_running_;}
+		bool closed() const {return closed_;}
+		//The metadata with the live fields filled in
+		SOFADB_PUBLIC json_value get_info() const;
 
 		bool operator == (const Database &other) const
 		{
@@ -193,9 +316,58 @@ namespace sofadb {
 							   revision_t *rev=0,
 							   json_value *rev_log=0);
 
+		//The attachments must have been written with create_attachment,
+		//a revision only carries their descriptors
 		SOFADB_PUBLIC put_result_t put(storage_t *ifc,
 			const jstring_t &id, const revision_num_t& old_rev,
-			const json_value &content, bool do_merge = false);
+			const json_value &content, bool do_merge = false,
+			const attachment_vector_t *atts = 0);
+
+		/**
+			Attachment blobs are written and read as streams of chunks.
+			Identical blobs are stored once per database no matter how many
+			revisions refer to them.
+		  */
+		SOFADB_PUBLIC std::auto_ptr<attachment_writer> create_attachment(
+			storage_t *ifc, const jstring_t &name,
+			const jstring_t &content_type);
+		SOFADB_PUBLIC std::auto_ptr<attachment_reader> open_attachment(
+			storage_t *ifc, const inline_attachment_t &att,
+			bool decode=true);
+
+		/**
+			Finds the revisions that are not present in the database. The
+			revlogs are visited in the key order with a single iterator,
+			so checking a batch of documents is one pass over the data.
+		  */
+		SOFADB_PUBLIC void revs_diff(storage_t *ifc,
+									 std::vector<revs_diff_t> &entries);
+
+		//Leaf revisions of the document: the winner and the conflicts
+		SOFADB_PUBLIC bool get_leaves(storage_t *ifc, const jstring_t &id,
+									  revision_list_t &res);
+
+		/**
+			Reads a revision with its history for replication. The
+			history follows the stored parents up to 'max_history'
+			entries and ends with the first parent that isn't stored.
+		  */
+		SOFADB_PUBLIC bool get_replicated(storage_t *ifc, const jstring_t &id,
+			const revision_num_t &rev, foreign_doc_t &res,
+			size_t max_history=1000);
+
+		/**
+			Inserts a foreign revision with its history. Known revisions
+			are skipped and reported with an empty 'assigned_rev_'.
+			Revisions continuing the winning branch extend it, the rest
+			are merged in through the resolver.
+		  */
+		SOFADB_PUBLIC put_result_t put_replicated(storage_t *ifc,
+												  const foreign_doc_t &doc);
+		//Writes the documents in one batch, returns the number of the
+		//inserted revisions
+		SOFADB_PUBLIC size_t bulk_put_replicated(batch_storage_t *ifc,
+			const std::vector<foreign_doc_t> &docs, bool sync);
 
 		/*
 		SOFADB_PUBLIC revision_t remove(
@@ -207,22 +379,111 @@ namespace sofadb {
 			leveldb::batch_ptr_t batch=leveldb::batch_ptr_t());
 		*/
 
+		/**
+			Calls 'fn' for each document changed after the 'since'
+			sequence, in the sequence order. Every document is reported
+			once, with the sequence of its latest change. Iteration stops
+			when 'fn' returns false.
+
+			Sequences are assigned before the changes commit, so the
+			iteration stops below the first uncommitted one. The last
+			reported sequence is then safe to resume from.
+		  */
+		SOFADB_PUBLIC void changes_since(storage_t *ifc, uint64_t since,
+										 const change_callback_t &fn);
+
+		/**
+			Reads the winning revision and the conflicts of a document
+			from its revlog alone, no revision body is fetched.
+		  */
+		SOFADB_PUBLIC bool get_conflicts(storage_t *ifc, const jstring_t &id,
+										 doc_conflicts_t &res);
+		SOFADB_PUBLIC static void conflicts_from_revlog(const json_value &log,
+														doc_conflicts_t &res);
+
+		/**
+			Calls 'fn' for each document with live conflicts, in the id
+			order starting at 'start_id'. Only the conflicts index is read.
+			Iteration stops when 'fn' returns false.
+		  */
+		SOFADB_PUBLIC void conflicted_docs(storage_t *ifc,
+			const jstring_t &start_id, const conflict_callback_t &fn);
+
+		/**
+			Replaces the bodies of the superseded revisions with stubs that
+			keep only the parent link, so the history is still there for
+			replication. Only the revisions that are ancestors of a leaf
+			are pruned, the bodies of puts in flight are never touched.
+			Reading the content of a pruned revision fails as if it was
+			missing.
+		  */
+		SOFADB_PUBLIC prune_stats_t prune_revisions(batch_storage_t *ifc,
+			const prune_progress_t &progress);
+
+		/**
+			Creates a field index and fills it with the existing documents.
+			Creating an index that already exists with the same fields is
+			a no-op.
+		  */
+		SOFADB_PUBLIC void create_index(storage_t *ifc, const jstring_t &name,
+										const std::vector<jstring_t> &fields);
+		SOFADB_PUBLIC void drop_index(storage_t *ifc, const jstring_t &name);
+		SOFADB_PUBLIC field_index_list_t indexes();
+
+		/**
+			Finds up to 'limit' live documents matching the Mango selector.
+			Uses the best matching field index if there's one, otherwise
+			scans all documents. The way the query has been executed is
+			reported in 'plan'.
+		  */
+		SOFADB_PUBLIC void find(storage_t *ifc, const json_value &selector,
+			size_t limit, std::vector<std::pair<jstring_t, json_value> > &res,
+			find_plan_t *plan=0);
+
 		std::pair<json_value, json_value>
 			sanitize_and_get_reserved_words(const json_value &tp);
+
+		//Key prefix of the document's revlog, revisions are stored under
+		//this prefix followed by the revision string.
+		SOFADB_PUBLIC jstring_t make_path(const jstring_t &id);
 	private:
 		void check_closed();
 
+		void load_update_seq(storage_t *ifc);
+		void record_change(storage_t *ifc, const jstring_t &id);
+		//The last sequence with all the changes up to it committed
+		uint64_t committed_seq();
+		void scan_changes(storage_t *ifc, uint64_t since, uint64_t last,
+						  const change_callback_t &fn);
+		jstring_t make_seq_path(char kind) const;
+		void update_conflicts_index(storage_t *ifc, const jstring_t &id,
+									const json_value &log);
+
+		void load_indexes(storage_t *ifc);
+		void update_indexes(storage_t *ifc, const jstring_t &id,
+							const json_value *content);
+		//Inserts foreign revisions of a single document
+		void merge_replicated(storage_t *ifc, const foreign_doc_t *const *docs,
+							  size_t count, put_result_t *results);
+		jstring_t make_index_def_path(const jstring_t &name) const;
+		boost::shared_ptr<const field_index_list_t> index_snapshot();
+
 		bool get_revlog(storage_t *ifc,
 					 const jstring_t &path_base, json_value &res);
 		revision_num_t store_data(storage_t *ifc,
 								  const jstring_t &doc_data_path_base,
 								  const revision_num_t &prev_rev,
 								  bool deleted,
-								  const json_value &content);
-
-		jstring_t make_path(const jstring_t &id);
-		revision_num_t compute_revision(
-			const revision_num_t &prev, const jstring_t &body);
+								  const json_value &content,
+								  const revision_num_t *foreign_rev=0,
+								  const attachment_vector_t *atts=0);
+		jstring_t make_attachment_prefix() const;
+
+		//Also appends the binary form of the document to 'stored' if
+		//it's given, from the same walk of the document
+		revision_num_t compute_revision(const revision_num_t &prev,
+			bool deleted, const json_value &content,
+			const attachment_vector_t *atts, jstring_t *stored=0);
 	};
 
 	/**
@@ -0,0 +1,196 @@
+#include "dump_reader.h"
+#include "errors.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+
+using namespace sofadb;
+
+static bool is_space(char c)
+{
+	return c==' ' || c=='\n' || c=='\r' || c=='\t';
+}
+
+dump_reader::dump_reader(const jstring_t &filename, dump_format_e format) :
+	fd_(-1), data_(), size_(), pos_(), format_(format),
+	started_(), finished_()
+{
+	fd_ = open(filename.c_str(), O_RDONLY);
+	if (fd_<0)
+		err(result_code_t::sError) << "Can't open " << filename << ": "
+								   << strerror(errno);
+
+	struct stat st;
+	if (fstat(fd_, &st))
+	{
+		close(fd_);
+		err(result_code_t::sError) << "Can't stat " << filename << ": "
+								   << strerror(errno);
+	}
+	size_ = st.st_size;
+	if (!size_)
+	{
+		close(fd_);
+		err(result_code_t::sError) << "Premature end of " << filename;
+	}
+
+	void *data=mmap(0, size_, PROT_READ, MAP_PRIVATE, fd_, 0);
+	if (data==MAP_FAILED)
+	{
+		close(fd_);
+		err(result_code_t::sError) << "Can't map " << filename << ": "
+								   << strerror(errno);
+	}
+	madvise(data, size_, MADV_SEQUENTIAL);
+	data_ = static_cast<const char*>(data);
+
+	if (format_==dump_auto)
+	{
+		skip_whitespace();
+		format_ = pos_<size_ && data_[pos_]=='[' ? dump_json_array
+												 : dump_ndjson;
+		pos_ = 0;
+	}
+}
+
+dump_reader::~dump_reader()
+{
+	munmap(const_cast<char*>(data_), size_);
+	close(fd_);
+}
+
+void dump_reader::skip_whitespace()
+{
+	while(pos_<size_ && is_space(data_[pos_]))
+		++pos_;
+}
+
+void dump_reader::skip_value()
+{
+	//Only the nesting and the string boundaries are tracked here, the
+	//actual validation happens when the element is parsed.
+	size_t depth=0;
+	while(pos_<size_)
+	{
+		const char c=data_[pos_];
+		if (c=='"')
+		{
+			++pos_;
+			while(pos_<size_)
+			{
+				const char *quote=static_cast<const char*>(
+							memchr(data_+pos_, '"', size_-pos_));
+				if (!quote)
+				{
+					pos_=size_;
+					break;
+				}
+				//Count the escapes in front of the quote
+				size_t slashes=0;
+				for(const char *p=quote-1;p>=data_+pos_ && *p=='\\';--p)
+					++slashes;
+				pos_=quote-data_+1;
+				if (slashes%2==0)
+					break;
+			}
+			continue;
+		}
+
+		if (c=='{' || c=='[')
+			++depth;
+		else if (c=='}' || c==']')
+		{
+			if (!depth)
+				return;
+			--depth;
+		} else if (c==',' && !depth)
+			return;
+		++pos_;
+	}
+}
+
+void dump_reader::seek(size_t offset)
+{
+	if (offset>size_)
+		err(result_code_t::sError) << "Offset " << offset
+								   << " is past the end of the dump";
+	pos_=offset;
+	//Any offset after an array element is inside the array
+	started_=offset>0;
+	finished_=false;
+}
+
+bool dump_reader::next_line(const char **elem, size_t *len)
+{
+	skip_whitespace();
+	if (pos_>=size_)
+	{
+		finished_=true;
+		return false;
+	}
+
+	const size_t start=pos_;
+	const char *eol=static_cast<const char*>(
+				memchr(data_+pos_, '\n', size_-pos_));
+	pos_=eol ? eol-data_ : size_;
+
+	size_t end=pos_;
+	while(end>start && is_space(data_[end-1]))
+		--end;
+	*elem=data_+start;
+	*len=end-start;
+	return true;
+}
+
+bool dump_reader::next(const char **elem, size_t *len)
+{
+	if (finished_)
+		return false;
+	if (format_==dump_ndjson)
+		return next_line(elem, len);
+
+	skip_whitespace();
+	if (pos_>=size_)
+		err(result_code_t::sError) << "Premature end of the dump";
+
+	if (!started_)
+	{
+		if (data_[pos_]!='[')
+			err(result_code_t::sError) << "The dump is not a JSON array";
+		++pos_;
+		started_=true;
+		skip_whitespace();
+		if (pos_<size_ && data_[pos_]==']')
+		{
+			finished_=true;
+			return false;
+		}
+	} else
+	{
+		if (data_[pos_]==']')
+		{
+			finished_=true;
+			return false;
+		}
+		if (data_[pos_]!=',')
+			err(result_code_t::sError) << "Unexpected char '"
+									   << data_[pos_] << "' at " << pos_;
+		++pos_;
+		skip_whitespace();
+	}
+
+	const size_t start=pos_;
+	skip_value();
+	if (pos_>=size_)
+		err(result_code_t::sError) << "Premature end of the dump";
+
+	size_t end=pos_;
+	while(end>start && is_space(data_[end-1]))
+		--end;
+	*elem=data_+start;
+	*len=end-start;
+	return true;
+}
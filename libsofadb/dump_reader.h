@@ -0,0 +1,60 @@
+#ifndef DUMP_READER_H
+#define DUMP_READER_H
+
+#include "common.h"
+
+namespace sofadb {
+
+	enum dump_format_e
+	{
+		dump_auto,
+		//A single top-level array of documents
+		dump_json_array,
+		//One document per line
+		dump_ndjson,
+	};
+
+	/**
+		Splits a JSON dump into the raw texts of its documents without
+		parsing them. The file is mmap'ed, so elements are returned as
+		pointers into the mapping that stay valid for the lifetime of
+		the reader. This allows to hand elements over to other threads
+		for parsing.
+	  */
+	class dump_reader
+	{
+		int fd_;
+		const char *data_;
+		size_t size_, pos_;
+		dump_format_e format_;
+		bool started_, finished_;
+	public:
+		//dump_auto picks the array format if the first non-space
+		//character is '[' and NDJSON otherwise
+		SOFADB_PUBLIC dump_reader(const jstring_t &filename,
+								  dump_format_e format=dump_auto);
+		SOFADB_PUBLIC ~dump_reader();
+
+		//Returns false after the last element
+		SOFADB_PUBLIC bool next(const char **elem, size_t *len);
+
+		//Continues reading from the offset returned by position() after
+		//an element, used to resume interrupted imports
+		SOFADB_PUBLIC void seek(size_t offset);
+
+		//Offset right after the last returned element
+		size_t position() const { return pos_; }
+		size_t size() const { return size_; }
+		dump_format_e format() const { return format_; }
+	private:
+		dump_reader(const dump_reader&);
+		dump_reader& operator = (const dump_reader&);
+
+		void skip_whitespace();
+		void skip_value();
+		bool next_line(const char **elem, size_t *len);
+	};
+
+}; //namespace sofadb
+
+#endif //DUMP_READER_H
@@ -1,5 +1,6 @@
 #include "engine.h"
 #include "database.h"
+#include "storage_backend.h"
 
 #include "leveldb/db.h"
 #include <openssl/md5.h>
@@ -8,19 +9,85 @@
 #include "errors.h"
 
 #include <iostream>
+#include <sstream>
+#include <fstream>
+#include <chrono>
+#include <errno.h>
+#include <string.h>
 using namespace sofadb;
 using namespace leveldb;
 
-class db_storage_t : public storage_t
+class backend_storage_t : public storage_t
 {
-	WriteOptions wo_;
-	ReadOptions ro_;
-	leveldb::db_ptr_t db_;
+	storage_backend_ptr_t backend_;
+	bool sync_;
 public:
-	db_storage_t(leveldb::db_ptr_t db, bool sync) : db_(db)
+	backend_storage_t(storage_backend_ptr_t backend, bool sync) :
+		backend_(backend), sync_(sync)
 	{
-		wo_.sync = sync;
-		ro_.verify_checksums = false;
+	}
+
+	virtual bool try_get(const jstring_t &key, jstring_t *res,
+						 snapshot_t *snap)
+	{
+		return backend_->get(key, res, snap);
+	}
+
+	virtual void put(const jstring_t &key, const jstring_t &val)
+	{
+		backend_->put(key, val, sync_);
+	}
+
+	virtual void remove(const jstring_t &key)
+	{
+		backend_->remove(key, sync_);
+	}
+
+	virtual std::auto_ptr<storage_iterator_t> iterate()
+	{
+		return backend_->iterate();
+	}
+
+	virtual snapshot_t* snapshot()
+	{
+		return backend_->snapshot();
+	}
+
+	virtual void release_snapshot(snapshot_t *snap)
+	{
+		backend_->release_snapshot(snap);
+	}
+
+	virtual void on_commit(const std::function<void ()> &fn)
+	{
+		fn();
+	}
+};
+
+/**
+	Accumulates writes in a map that is applied at once on commit, reads
+	see the uncommitted writes - the revlog of a document put twice in
+	a batch must not be lost.
+  */
+class db_batch_storage_t : public batch_storage_t
+{
+	friend class batch_iterator_t;
+
+	storage_backend_ptr_t backend_;
+	pending_map_t pending_;
+	//Incremented on commits, iterators use it to notice that the pending
+	//map has been cleared under them
+	size_t generation_;
+	std::vector<std::function<void ()> > on_commit_;
+public:
+	db_batch_storage_t(storage_backend_ptr_t backend) :
+		backend_(backend), generation_()
+	{
+	}
+
+	~db_batch_storage_t()
+	{
+		run_commit_hooks();
 	}
 
 	virtual bool try_get(const jstring_t &key, jstring_t *res,
@@ -28,17 +95,44 @@ public:
 	{
 		assert(!snap);
 
-		Status st = db_->Get(ro_, key, res);
-		if (st.IsNotFound())
-			return false;
-		if (!st.ok())
-			DbEngine::check(st);
-		return true;
+		auto pos=pending_.find(key);
+		if (pos!=pending_.end())
+		{
+			if (pos->second.removed_)
+				return false;
+			*res=pos->second.value_;
+			return true;
+		}
+		return backend_->get(key, res);
 	}
 
 	virtual void put(const jstring_t &key, const jstring_t &val)
 	{
-		DbEngine::check(db_->Put(wo_, key, val));
+		pending_write_t &w=pending_[key];
+		w.removed_=false;
+		w.value_=val;
+	}
+
+	virtual void remove(const jstring_t &key)
+	{
+		pending_write_t &w=pending_[key];
+		w.removed_=true;
+		w.value_.clear();
+	}
+
+	virtual std::auto_ptr<storage_iterator_t> iterate();
+
+	virtual void commit(bool sync)
+	{
+		backend_->write(pending_, sync);
+		pending_.clear();
+		++generation_;
+		run_commit_hooks();
+	}
+
+	virtual void on_commit(const std::function<void ()> &fn)
+	{
+		on_commit_.push_back(fn);
 	}
 
 	virtual snapshot_t* snapshot()
@@ -50,30 +144,455 @@ public:
 	{
 		throw std::out_of_range("No snapshots allowed");
 	}
+private:
+	void run_commit_hooks()
+	{
+		std::vector<std::function<void ()> > hooks;
+		hooks.swap(on_commit_);
+		for(auto i=hooks.begin(), iend=hooks.end(); i!=iend; ++i)
+			(*i)();
+	}
+};
+
+/**
+	Merges the pending writes of a batch over the committed state.
+	Pending entries shadow the committed ones with the same key and
+	removals hide them. If the batch is committed while the iterator is
+	in use, the iterator re-seeks from its current key.
+
+	A commit frees the pending map nodes, so the current pending entry
+	is copied and pos_ is only followed after sync().
+  */
+class batch_iterator_t : public storage_iterator_t
+{
+	db_batch_storage_t *owner_;
+	size_t generation_;
+	std::auto_ptr<storage_iterator_t> base_;
+	pending_map_t::const_iterator pos_; //end() if exhausted
+	bool forward_, valid_, from_pending_;
+	//The current entry if it comes from the pending map
+	jstring_t pending_key_, pending_value_;
+public:
+	batch_iterator_t(db_batch_storage_t *owner) :
+		owner_(owner), generation_(owner->generation_),
+		base_(owner->backend_->iterate()), pos_(owner->pending_.end()),
+		forward_(true), valid_(), from_pending_()
+	{
+	}
+
+	virtual bool valid() const
+	{
+		return valid_;
+	}
+
+	virtual void seek(const jstring_t &key)
+	{
+		sync();
+		base_->seek(key);
+		pos_=owner_->pending_.lower_bound(key);
+		forward_=true;
+		settle_forward();
+	}
+
+	virtual void seek_to_last()
+	{
+		sync();
+		base_->seek_to_last();
+		pos_=owner_->pending_.end();
+		step_back();
+		forward_=false;
+		settle_backward();
+	}
+
+	virtual void next()
+	{
+		assert(valid_);
+		const bool resync=sync();
+		if (!forward_ || resync)
+		{
+			//Position both cursors right after the current key
+			const jstring_t cur=key();
+			base_->seek(cur);
+			if (base_->valid() && base_->key()==cur)
+				base_->next();
+			pos_=owner_->pending_.upper_bound(cur);
+			forward_=true;
+		} else if (from_pending_)
+			++pos_;
+		else
+			base_->next();
+		settle_forward();
+	}
+
+	virtual void prev()
+	{
+		assert(valid_);
+		const bool resync=sync();
+		if (forward_ || resync)
+		{
+			//Position both cursors right before the current key
+			const jstring_t cur=key();
+			base_->seek(cur);
+			if (base_->valid())
+				base_->prev();
+			else
+				base_->seek_to_last();
+			pos_=owner_->pending_.lower_bound(cur);
+			step_back();
+			forward_=false;
+		} else if (from_pending_)
+			step_back();
+		else
+			base_->prev();
+		settle_backward();
+	}
+
+	virtual jstring_t key() const
+	{
+		return from_pending_ ? pending_key_ : base_->key();
+	}
+
+	virtual jstring_t value() const
+	{
+		return from_pending_ ? pending_value_ : base_->value();
+	}
+private:
+	//Returns true if the batch has been committed since the last call
+	bool sync()
+	{
+		if (generation_==owner_->generation_)
+			return false;
+		jstring_t cur;
+		if (valid_)
+			cur=key();
+		generation_=owner_->generation_;
+		//The old cursor doesn't see the committed data
+		base_=owner_->backend_->iterate();
+		pos_=owner_->pending_.end();
+		from_pending_=false;
+		if (valid_)
+			base_->seek(cur);
+		return true;
+	}
+
+	void set_pending()
+	{
+		pending_key_=pos_->first;
+		pending_value_=pos_->second.value_;
+		from_pending_=true;
+		valid_=true;
+	}
+
+	void step_back()
+	{
+		if (pos_==owner_->pending_.begin())
+			pos_=owner_->pending_.end();
+		else
+			--pos_;
+	}
+
+	void settle_forward()
+	{
+		const pending_map_t::const_iterator end=owner_->pending_.end();
+		while(true)
+		{
+			const bool has_base=base_->valid();
+			if (pos_!=end && (!has_base || !(base_->key()<pos_->first)))
+			{
+				//The pending write shadows the committed value
+				if (has_base && base_->key()==pos_->first)
+					base_->next();
+				if (pos_->second.removed_)
+				{
+					++pos_;
+					continue;
+				}
+				set_pending();
+				return;
+			}
+			from_pending_=false;
+			valid_=has_base;
+			return;
+		}
+	}
+
+	void settle_backward()
+	{
+		const pending_map_t::const_iterator end=owner_->pending_.end();
+		while(true)
+		{
+			const bool has_base=base_->valid();
+			if (pos_!=end && (!has_base || !(pos_->first<base_->key())))
+			{
+				if (has_base && base_->key()==pos_->first)
+					base_->prev();
+				if (pos_->second.removed_)
+				{
+					step_back();
+					continue;
+				}
+				set_pending();
+				return;
+			}
+			from_pending_=false;
+			valid_=has_base;
+			return;
+		}
+	}
 };
 
-DbEngine::DbEngine(const jstring_t &filename, bool temporary)
+std::auto_ptr<storage_iterator_t> db_batch_storage_t::iterate()
+{
+	return std::auto_ptr<storage_iterator_t>(new batch_iterator_t(this));
+}
+
+//Key range of all the keys starting with the prefix, the prefix ends
+//with the separator so bumping its last byte gives the limit
+static jstring_t prefix_limit(const jstring_t &prefix)
+{
+	jstring_t limit=prefix;
+	limit[limit.size()-1]++;
+	return limit;
+}
+
+static jstring_t make_dbinfo_key(const jstring_t &name)
+{
+	return jstring_t(SD_SYSTEM_DB)+"/"+name+DB_SEPARATOR+"dbinfo";
+}
+
+//Deleted databases are purged at about the rate of the compaction
+static const uint64_t purge_bytes_per_sec = 32*1024*1024;
+//Written into the store's directory, a line per database with the
+//"start limit" pairs of its ranges, the keys in hex
+static const char hot_ranges_file[] = "/HOT_RANGES";
+
+//The memory storage has no directory to keep the ranges in
+static bool can_warm_up(const storage_options_t &opts)
+{
+	return opts.warm_up_ && opts.kind_!=storage_memory;
+}
+
+DbEngine::DbEngine(const jstring_t &filename, bool temporary,
+				   const storage_options_t &opts) :
+	deletions_(), stop_opening_(false), opening_(false)
 {
 	this->filename_ = filename;
 	this->temporary_ = temporary;
+	//A temporary store is gone before it could be warmed up again
+	save_hot_ranges_ = can_warm_up(opts) && !temporary;
+
+	if (opts.kind_==storage_memory)
+		backend_=make_memory_backend();
+	else if (opts.kind_==storage_log)
+		backend_=make_log_backend(filename, temporary, opts);
+	else
+		backend_=make_leveldb_backend(filename, temporary);
 
-	Options opts;
-	opts.create_if_missing = true;
-	opts.paranoid_checks=0;
-	opts.block_size=1024;
-	opts.compression=kSnappyCompression;
-	opts.write_buffer_size = 24*1024*1024;
+	purger_.reset(new database_purger(backend_, purge_bytes_per_sec));
+	const std::vector<jstring_t> unfinished=
+			database_purger::find_pending(backend_.get());
+	for(auto i=unfinished.begin(), iend=unfinished.end(); i!=iend; ++i)
+		purger_->enqueue(*i, database_ptr());
 
-	DB *db;
-	leveldb::Status status = leveldb::DB::Open(opts, filename, &db);
-	this->keystore_.reset(db);
+	if (opts.preload_databases_ || can_warm_up(opts))
+	{
+		opening_=true;
+		opener_=std::thread([this, opts]{ open_in_background(opts); });
+	}
 }
 
 DbEngine::~DbEngine()
 {
-	this->keystore_.reset();
-	if (temporary_)
-		DestroyDB(filename_, Options());
+	stop_opening_=true;
+	if (opener_.joinable())
+		opener_.join();
+	if (save_hot_ranges_)
+	{
+		try
+		{
+			save_hot_ranges();
+		} catch(const std::exception &ex)
+		{
+			LOG(ERROR) << "Can't save the hot ranges of " << filename_
+					   << ": " << ex.what();
+		}
+	}
+	stop_compaction();
+	purger_.reset();
+}
+
+void DbEngine::open_in_background(const storage_options_t &opts)
+{
+	try
+	{
+		const auto start=std::chrono::steady_clock::now();
+		size_t loaded=0;
+		uint64_t warmed=0;
+		if (opts.preload_databases_)
+			loaded=preload_databases();
+		if (can_warm_up(opts))
+			warmed=warm_up(opts.warm_up_bytes_);
+		VLOG_MACRO(1) << "Opened " << filename_ << " in the background: "
+					  << loaded << " databases, " << warmed
+					  << " bytes warmed up in " << std::chrono::duration<double>(
+						std::chrono::steady_clock::now()-start).count()
+					  << "s" << std::endl;
+	} catch(const std::exception &ex)
+	{
+		LOG(ERROR) << "Background opening of " << filename_ << " failed: "
+				   << ex.what();
+	}
+	std::lock_guard<std::mutex> lock(open_mutex_);
+	opening_=false;
+	open_cond_.notify_all();
+}
+
+void DbEngine::wait_for_open()
+{
+	std::unique_lock<std::mutex> lock(open_mutex_);
+	open_cond_.wait(lock, [this]{ return !opening_; });
+}
+
+size_t DbEngine::preload_databases()
+{
+	uint64_t deletions;
+	{
+		guard_t g(mutex_);
+		deletions=deletions_;
+	}
+	//One pass over the dbinfo records, then the handles are set up
+	//without the lock
+	std::vector<std::pair<jstring_t, jstring_t> > infos;
+	scan_dbinfo([&](const jstring_t &name, const jstring_t &dbinfo)
+	{
+		infos.push_back(std::make_pair(name, dbinfo));
+	});
+
+	size_t res=0;
+	storage_ptr_t stg=create_storage(false);
+	for(auto i=infos.begin(), iend=infos.end(); i!=iend && !stop_opening_;
+		++i)
+	{
+		database_ptr existing;
+		if (databases_.find(i->first, existing))
+			continue;
+		database_ptr db(new Database(string_to_json(i->second)));
+		db->load_update_seq(stg.get());
+		db->load_indexes(stg.get());
+
+		guard_t g(mutex_);
+		if (databases_.find(i->first, existing) ||
+				purger_->is_pending(i->first))
+			continue;
+		//The record may be gone since the scan
+		jstring_t out;
+		if (deletions_!=deletions &&
+				!backend_->get(make_dbinfo_key(i->first), &out))
+			continue;
+		databases_.insert(i->first, db);
+		++res;
+	}
+	return res;
+}
+
+static jstring_t to_hex(const jstring_t &in)
+{
+	static const char digits[]="0123456789abcdef";
+	jstring_t res;
+	res.reserve(in.size()*2);
+	for(size_t f=0;f<in.size();++f)
+	{
+		res.push_back(digits[uint8_t(in[f])>>4]);
+		res.push_back(digits[uint8_t(in[f])&15]);
+	}
+	return res;
+}
+
+static bool from_hex(const jstring_t &in, jstring_t &res)
+{
+	if (in.size()%2)
+		return false;
+	res.clear();
+	for(size_t f=0;f<in.size();f+=2)
+	{
+		unsigned byte;
+		if (sscanf(in.c_str()+f, "%2x", &byte)!=1)
+			return false;
+		res.push_back(char(byte));
+	}
+	return true;
+}
+
+uint64_t DbEngine::warm_up(uint64_t max_bytes)
+{
+	std::vector<jstring_t> lines;
+	{
+		std::ifstream in((filename_+hot_ranges_file).c_str());
+		for(jstring_t line; std::getline(in, line);)
+			lines.push_back(line);
+	}
+
+	//Every database gets an equal share of what is left, so the ones
+	//listed first can't take the whole budget
+	uint64_t res=0;
+	for(size_t f=0;f<lines.size() && res<max_bytes && !stop_opening_; ++f)
+	{
+		const uint64_t share_end=res+(max_bytes-res)/(lines.size()-f);
+		std::istringstream parts(lines[f]);
+		jstring_t start_hex, limit_hex, start, limit;
+		while(res<share_end && !stop_opening_ &&
+				parts >> start_hex >> limit_hex)
+		{
+			if (!from_hex(start_hex, start) || !from_hex(limit_hex, limit))
+				break;
+			res+=backend_->warm_range(start, limit, share_end-res);
+		}
+	}
+	return res;
+}
+
+void DbEngine::mark_hot(const database_ptr &db)
+{
+	//The set is only touched the first time
+	if (db->hot_.load(std::memory_order_relaxed) || db->hot_.exchange(true))
+		return;
+	guard_t g(mutex_);
+	hot_.insert(db->name());
+}
+
+void DbEngine::save_hot_ranges()
+{
+	std::set<jstring_t> names;
+	{
+		guard_t g(mutex_);
+		names=hot_;
+	}
+	if (names.empty())
+		return;
+
+	//The attachments are left out, they are big and rarely read in bulk
+	static const char *spaces[]={SD_SYSTEM_DB, SD_SEQ_DB, SD_INDEX_DB,
+								 SD_VIEW_DB, SD_DATA_DB};
+	const jstring_t path=filename_+hot_ranges_file;
+	const jstring_t tmp=path+".tmp";
+	{
+		std::ofstream out(tmp.c_str(), std::ios::trunc);
+		for(auto n=names.begin(), nend=names.end(); n!=nend; ++n)
+		{
+			for(size_t f=0;f<sizeof(spaces)/sizeof(spaces[0]);++f)
+			{
+				const jstring_t start=database_key_prefix(spaces[f], *n);
+				out << (f ? " " : "") << to_hex(start) << ' '
+					<< to_hex(prefix_limit(start));
+			}
+			out << '\n';
+		}
+		if (!out.flush())
+			err(result_code_t::sError) << "Can't write " << tmp;
+	}
+	if (rename(tmp.c_str(), path.c_str()))
+		err(result_code_t::sError) << "Can't rename " << tmp << ": "
+								   << strerror(errno);
 }
 
 void DbEngine::check(const leveldb::Status &status)
@@ -83,39 +602,342 @@ void DbEngine::check(const leveldb::Status &status)
 	err(result_code_t::sError) << status.ToString();
 }
 
-database_ptr DbEngine::create_a_database(const jstring_t &name)
+database_ptr DbEngine::create_a_database(const jstring_t &name,
+										 revision_hash_e hash)
 {
+	database_ptr existing;
+	if (databases_.find(name, existing))
+	{
+		mark_hot(existing);
+		return existing;
+	}
+
 	guard_t g(mutex_);
+	if (databases_.find(name, existing))
+	{
+		mark_hot(existing);
+		return existing;
+	}
 
-	auto pos=databases_.find(name);
-	if (pos!=databases_.end())
-		return pos->second;
+	//The separator would make the key ranges of databases overlap
+	if (name.empty() || name.find(DB_SEPARATOR)!=jstring_t::npos)
+		err(result_code_t::sError) << "Invalid database name: " << name;
+	if (purger_->is_pending(name))
+		err(result_code_t::sConflict) << "Database " << name
+									  << " is being deleted";
 
-	ReadOptions opts;
-	jstring_t db_info=jstring_t(SD_SYSTEM_DB)+"/"+name+DB_SEPARATOR+"dbinfo";
+	jstring_t db_info=make_dbinfo_key(name);
 
 	std::string out;
-	if (keystore_->Get(opts, db_info, &out).ok())
+	if (backend_->get(db_info, &out))
 	{
-		database_ptr res(new Database(string_to_json(out)));
-		databases_[name]=res;
+		database_ptr res=load_database(name, out);
+		mark_hot(res);
 		return res;
 	} else
 	{
-		WriteOptions w;
-		database_ptr res(new Database(name));
-		databases_[name]=res;
-		keystore_->Put(w, db_info,
-					   json_to_string(res->get_meta()));
+		database_ptr res(new Database(name, hash));
+		backend_->put(db_info, json_to_string(res->get_meta()), false);
+		databases_.insert(name, res);
+		mark_hot(res);
 		return res;
 	}
 }
 
+database_ptr DbEngine::open_database(const jstring_t &name)
+{
+	database_ptr existing;
+	if (databases_.find(name, existing))
+		return existing;
+
+	guard_t g(mutex_);
+	if (databases_.find(name, existing))
+		return existing;
+	jstring_t out;
+	if (purger_->is_pending(name) ||
+			!backend_->get(make_dbinfo_key(name), &out))
+		return database_ptr();
+	return load_database(name, out);
+}
+
+database_ptr DbEngine::load_database(const jstring_t &name,
+									 const jstring_t &dbinfo)
+{
+	database_ptr res(new Database(string_to_json(dbinfo)));
+	storage_ptr_t stg=create_storage(false);
+	res->load_update_seq(stg.get());
+	res->load_indexes(stg.get());
+	databases_.insert(name, res);
+	return res;
+}
+
+void DbEngine::delete_database(const jstring_t &name)
+{
+	guard_t g(mutex_);
+	const jstring_t db_info=make_dbinfo_key(name);
+	std::string out;
+	if (!backend_->get(db_info, &out))
+		err(result_code_t::sNotFound) << "Database " << name
+									  << " doesn't exist";
+
+	//The marker survives a crash, the next engine resumes the purge
+	pending_map_t batch;
+	batch[db_info].removed_=true;
+	batch[database_purger::purge_marker_key(name)].removed_=false;
+	backend_->write(batch, true);
+
+	++deletions_;
+	hot_.erase(name);
+	database_ptr db;
+	if (databases_.find(name, db))
+	{
+		db->closed_=true;
+		databases_.erase(name);
+	}
+	purger_->enqueue(name, db);
+}
+
+bool DbEngine::is_being_deleted(const jstring_t &name)
+{
+	return purger_->is_pending(name);
+}
+
+void DbEngine::wait_for_purges()
+{
+	purger_->wait_idle();
+}
+
 void DbEngine::checkpoint()
 {
 }
 
 storage_ptr_t DbEngine::create_storage(bool sync)
 {
-	return storage_ptr_t(new db_storage_t(keystore_, sync));
+	return storage_ptr_t(new backend_storage_t(backend_, sync));
+}
+
+batch_storage_ptr_t DbEngine::create_batch_storage()
+{
+	return batch_storage_ptr_t(new db_batch_storage_t(backend_));
+}
+
+engine_stats_t DbEngine::get_stats()
+{
+	engine_stats_t res;
+	backend_->get_stats(res);
+	{
+		guard_t g(mutex_);
+		res.open_databases_=databases_.size();
+	}
+
+	const std::vector<jstring_t> names=database_names();
+	for(auto n=names.begin(), nend=names.end(); n!=nend; ++n)
+	{
+		const jstring_t &name=*n;
+		static const char *prefixes[]={SD_DATA_DB, SD_SEQ_DB, SD_VIEW_DB,
+									   SD_INDEX_DB, SD_ATTACHMENT_DB};
+		const size_t count=sizeof(prefixes)/sizeof(prefixes[0]);
+		uint64_t sizes[count];
+		for(size_t f=0;f<count;++f)
+		{
+			const jstring_t start=database_key_prefix(prefixes[f], name);
+			sizes[f]=backend_->approximate_size(start, prefix_limit(start));
+		}
+
+		database_size_t &db=res.databases_[name];
+		db.data_=sizes[0];
+		db.seq_=sizes[1];
+		db.view_=sizes[2];
+		db.index_=sizes[3];
+		db.attachments_=sizes[4];
+	}
+	return res;
+}
+
+void DbEngine::scan_dbinfo(const std::function<void (const jstring_t &name,
+	const jstring_t &dbinfo)> &fn)
+{
+	//Databases are listed from their dbinfo records
+	const jstring_t sys_prefix=SD_SYSTEM_DB "/";
+	const jstring_t dbinfo_suffix=DB_SEPARATOR "dbinfo";
+	std::auto_ptr<storage_iterator_t> it=backend_->iterate();
+	for(it->seek(sys_prefix); it->valid(); it->next())
+	{
+		const jstring_t key=it->key();
+		if (key.compare(0, sys_prefix.size(), sys_prefix)!=0)
+			break;
+		if (key.size()<sys_prefix.size()+dbinfo_suffix.size() ||
+				key.compare(key.size()-dbinfo_suffix.size(),
+							dbinfo_suffix.size(), dbinfo_suffix)!=0)
+			continue;
+		//Index definitions named "dbinfo" and the purge markers end the
+		//same way, database names never contain the separator
+		const jstring_t name=key.substr(sys_prefix.size(),
+			key.size()-sys_prefix.size()-dbinfo_suffix.size());
+		if (name.empty() || name.find(DB_SEPARATOR)!=jstring_t::npos)
+			continue;
+		fn(name, it->value());
+	}
+}
+
+std::vector<jstring_t> DbEngine::database_names()
+{
+	std::vector<jstring_t> res;
+	scan_dbinfo([&](const jstring_t &name, const jstring_t &)
+	{
+		res.push_back(name);
+	});
+	return res;
+}
+
+json_value sofadb::engine_stats_to_json(const engine_stats_t &stats)
+{
+	json_value res(submap_d);
+	json_value &levels=res["levels"]=json_value(sublist_d);
+	for(auto i=stats.levels_.begin(), iend=stats.levels_.end(); i!=iend; ++i)
+	{
+		json_value lev(submap_d);
+		lev["level"]=json_value(int64_t(i->level_));
+		lev["files"]=json_value(int64_t(i->files_));
+		lev["size"]=json_value(int64_t(i->size_bytes_));
+		lev["compaction_sec"]=json_value(i->compaction_sec_);
+		lev["compaction_read"]=json_value(int64_t(i->compaction_read_bytes_));
+		lev["compaction_written"]=json_value(
+			int64_t(i->compaction_written_bytes_));
+		levels.get_sublist().push_back(std::move(lev));
+	}
+	res["compaction_read"]=json_value(int64_t(stats.compaction_read_bytes_));
+	res["compaction_written"]=json_value(
+		int64_t(stats.compaction_written_bytes_));
+	res["memtable"]=json_value(int64_t(stats.memtable_bytes_));
+	res["block_cache"]=json_value(int64_t(stats.block_cache_bytes_));
+	res["block_cache_capacity"]=json_value(
+		int64_t(stats.block_cache_capacity_));
+	res["read_amplification"]=json_value(int64_t(stats.read_amplification_));
+	res["writes_slowed"]=json_value(stats.writes_slowed_);
+	res["writes_stopped"]=json_value(stats.writes_stopped_);
+	res["open_databases"]=json_value(int64_t(stats.open_databases_));
+
+	json_value &dbs=res["databases"]=json_value(submap_d);
+	for(auto i=stats.databases_.begin(), iend=stats.databases_.end();
+		i!=iend; ++i)
+	{
+		json_value &db=dbs[i->first]=json_value(submap_d);
+		db["data"]=json_value(int64_t(i->second.data_));
+		db["seq"]=json_value(int64_t(i->second.seq_));
+		db["view"]=json_value(int64_t(i->second.view_));
+		db["index"]=json_value(int64_t(i->second.index_));
+		db["attachments"]=json_value(int64_t(i->second.attachments_));
+		db["total"]=json_value(int64_t(i->second.total()));
+	}
+	return res;
+}
+
+//The store can't throttle the compaction of a range, so the data range is
+//compacted in slices of about this size and the budget is accounted
+//between them
+static const uint64_t compaction_slice_bytes = 32*1024*1024;
+
+compaction_stats_t DbEngine::compact(const database_ptr &db,
+	const compaction_options_t &opts, const stop_callback_t &should_stop)
+{
+	if (db->compact_running_.exchange(true))
+		err(result_code_t::sError) << "Database " << db->name()
+								   << " is already being compacted";
+	struct running_guard_t
+	{
+		Database *db_;
+		~running_guard_t() { db_->compact_running_=false; }
+	} running_guard={db.get()};
+
+	const auto start=std::chrono::steady_clock::now();
+	compaction_stats_t res;
+	io_throttle_t throttle(opts.max_bytes_per_sec_);
+	auto stopped=[&]{ return db->closed() || (should_stop && should_stop()); };
+
+	//Old revisions go first, so that the range compaction drops them.
+	//The slices start at the keys where the pruning pass crossed the
+	//slice size.
+	const jstring_t data_prefix=database_key_prefix(SD_DATA_DB, db->name());
+	std::vector<std::pair<jstring_t, uint64_t> > slices(
+		1, std::make_pair(data_prefix, uint64_t(0)));
+	batch_storage_ptr_t batch=create_batch_storage();
+	prune_stats_t pruned=db->prune_revisions(batch.get(),
+		[&](const jstring_t &last_key, uint64_t bytes) -> bool
+		{
+			throttle.consume(bytes);
+			if (slices.back().second>=compaction_slice_bytes)
+				slices.push_back(std::make_pair(last_key, uint64_t(0)));
+			slices.back().second+=bytes;
+			return !stopped();
+		});
+	res.docs_=pruned.docs_;
+	res.revisions_pruned_=pruned.revisions_;
+	res.bytes_scanned_=pruned.bytes_scanned_;
+	res.bytes_pruned_=pruned.bytes_pruned_;
+
+	res.completed_=pruned.completed_;
+	jstring_t limit;
+	for(size_t f=0;f<slices.size() && res.completed_;++f)
+	{
+		if (stopped())
+		{
+			res.completed_=false;
+			break;
+		}
+		if (f+1<slices.size())
+			limit=slices[f+1].first;
+		else
+			limit=prefix_limit(data_prefix);
+		backend_->compact_range(slices[f].first, limit);
+		++res.ranges_compacted_;
+		//Everything is read and written once more
+		throttle.consume(slices[f].second*2);
+	}
+
+	//The rest of the database's key spaces are much smaller
+	static const char *prefixes[]={SD_SEQ_DB, SD_VIEW_DB, SD_INDEX_DB,
+								   SD_ATTACHMENT_DB};
+	for(size_t f=0;f<sizeof(prefixes)/sizeof(prefixes[0]) && res.completed_;
+		++f)
+	{
+		if (stopped())
+		{
+			res.completed_=false;
+			break;
+		}
+		const jstring_t prefix=database_key_prefix(prefixes[f], db->name());
+		limit=prefix_limit(prefix);
+		const uint64_t size=backend_->approximate_size(prefix, limit);
+		backend_->compact_range(prefix, limit);
+		++res.ranges_compacted_;
+		throttle.consume(size*2);
+	}
+
+	res.seconds_=std::chrono::duration<double>(
+		std::chrono::steady_clock::now()-start).count();
+	VLOG_MACRO(1) << "Compaction of " << db->name()
+				  << (res.completed_ ? " finished" : " stopped")
+				  << " in " << res.seconds_ << "s, pruned "
+				  << res.revisions_pruned_ << " revisions" << std::endl;
+	return res;
+}
+
+void DbEngine::schedule_compaction(const compaction_options_t &opts)
+{
+	stop_compaction();
+	guard_t g(mutex_);
+	if (!scheduler_.get())
+		scheduler_.reset(new compaction_scheduler(this, opts));
+}
+
+void DbEngine::stop_compaction()
+{
+	//The scheduler opens databases under the lock, so it's joined
+	//outside of it
+	std::auto_ptr<compaction_scheduler> old;
+	{
+		guard_t g(mutex_);
+		old=scheduler_;
+	}
 }
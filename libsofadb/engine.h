@@ -3,11 +3,20 @@
 #include "common.h"
 #include <leveldb/db.h>
 #include "storage_interface.h"
+#include "database.h"
+#include "compaction.h"
+#include "purger.h"
+#include "published_map.h"
 
 #include <map>
+#include <set>
+#include <condition_variable>
+#include <functional>
+#include <thread>
 
 namespace leveldb {
 	class DB;
+	class Cache;
 	class Status;
 	class WriteOptions;
 	typedef boost::shared_ptr<DB> db_ptr_t;
@@ -17,32 +26,186 @@ namespace sofadb {
 
 	class Database;
 	typedef boost::shared_ptr<Database> database_ptr;
+	class storage_backend_t;
+
+	enum storage_kind_e
+	{
+		storage_leveldb,
+		//Nothing is written to disk, the data is gone with the engine
+		storage_memory,
+		//Append-only segment files, the keys are indexed in memory
+		storage_log,
+	};
+
+	struct storage_options_t
+	{
+		storage_kind_e kind_;
+		//Log storage: the size at which the segments are sealed, and
+		//the share of dead bytes that makes a sealed one rewritten
+		uint64_t segment_size_;
+		double garbage_ratio_;
+		//Budget and period of the segment compaction
+		uint64_t compaction_bytes_per_sec_;
+		unsigned compaction_check_sec_;
+		//Opens the handles of all the databases on a background thread
+		//right after the engine is created
+		bool preload_databases_;
+		//Reads the key ranges saved by save_hot_ranges() in the
+		//background, up to the byte budget split evenly between the
+		//databases, so that the first requests find them cached. The
+		//ranges are saved again by the destructor of a non-temporary
+		//engine.
+		bool warm_up_;
+		uint64_t warm_up_bytes_;
+
+		storage_options_t(storage_kind_e kind=storage_leveldb) : kind_(kind),
+			segment_size_(32*1024*1024), garbage_ratio_(0.5),
+			compaction_bytes_per_sec_(16*1024*1024),
+			compaction_check_sec_(10), preload_databases_(false),
+			warm_up_(false), warm_up_bytes_(8*1024*1024) {}
+	};
+
+	struct level_stats_t
+	{
+		int level_;
+		uint64_t files_, size_bytes_;
+		//Totals of the compactions that wrote into this level
+		double compaction_sec_;
+		uint64_t compaction_read_bytes_, compaction_written_bytes_;
+
+		level_stats_t() : level_(), files_(), size_bytes_(),
+			compaction_sec_(), compaction_read_bytes_(),
+			compaction_written_bytes_() {}
+	};
+
+	//Approximate on-disk sizes of the key ranges of a database
+	struct database_size_t
+	{
+		uint64_t data_, seq_, view_, index_, attachments_;
+		uint64_t total() const
+		{
+			return data_+seq_+view_+index_+attachments_;
+		}
+	};
+
+	struct engine_stats_t
+	{
+		std::vector<level_stats_t> levels_;
+		uint64_t compaction_read_bytes_, compaction_written_bytes_;
+		uint64_t memtable_bytes_;
+		uint64_t block_cache_bytes_, block_cache_capacity_;
+		//Tables a read may have to probe in the worst case: every
+		//level-0 file plus one per deeper non-empty level
+		uint64_t read_amplification_;
+		//Level-0 file counts at which leveldb delays and stops writes
+		//until the compaction catches up
+		bool writes_slowed_, writes_stopped_;
+		std::map<jstring_t, database_size_t> databases_;
+		//Handles loaded in the engine
+		uint64_t open_databases_;
+		jstring_t raw_stats_;
+
+		engine_stats_t() : compaction_read_bytes_(),
+			compaction_written_bytes_(), memtable_bytes_(),
+			block_cache_bytes_(), block_cache_capacity_(),
+			read_amplification_(), writes_slowed_(), writes_stopped_(),
+			open_databases_() {}
+	};
 
 	class DbEngine
 	{
 		friend class Database;
 
-		leveldb::db_ptr_t keystore_;
+		boost::shared_ptr<storage_backend_t> backend_;
 		bool temporary_;
 		jstring_t filename_;
 
-		std::map<jstring_t, database_ptr> databases_;
+		//Lookups are lock-free, the mutex serializes creation and deletion
+		utils::published_map<jstring_t, database_ptr> databases_;
 		std::recursive_mutex mutex_;
+		std::auto_ptr<compaction_scheduler> scheduler_;
+		std::auto_ptr<database_purger> purger_;
+		//Bumped on deletions, under the mutex
+		uint64_t deletions_;
+		//Databases handed out, their ranges are the hot ones
+		std::set<jstring_t> hot_;
+		bool save_hot_ranges_;
 
+		//The background part of the opening
+		std::thread opener_;
+		std::atomic<bool> stop_opening_;
+		std::mutex open_mutex_;
+		std::condition_variable open_cond_;
+		bool opening_;
 	public:
-		SOFADB_PUBLIC DbEngine(const jstring_t &filename, bool temporary);
+		//The file name is ignored by the memory storage
+		SOFADB_PUBLIC DbEngine(const jstring_t &filename, bool temporary,
+			const storage_options_t &opts=storage_options_t());
 		SOFADB_PUBLIC virtual ~DbEngine();
 
+		//Waits for the preloading and the warm-up of the options
+		SOFADB_PUBLIC void wait_for_open();
+		//Records the key ranges of the databases used so far for the
+		//warm-up of the next engine
+		SOFADB_PUBLIC void save_hot_ranges();
+
 		SOFADB_PUBLIC void checkpoint();
-		SOFADB_PUBLIC database_ptr create_a_database(const jstring_t &name);
+		//The revision hash only applies to new databases, existing ones
+		//keep the one they were created with
+		SOFADB_PUBLIC database_ptr create_a_database(const jstring_t &name,
+			revision_hash_e hash=revision_hash_md5);
+		//Returns null if the database doesn't exist or is being deleted
+		SOFADB_PUBLIC database_ptr open_database(const jstring_t &name);
+		/**
+			Drops the database at once: it's gone from the listings and
+			its handles are closed. The data is purged in the background,
+			until then a database of the same name can't be created.
+		  */
+		SOFADB_PUBLIC void delete_database(const jstring_t &name);
+		SOFADB_PUBLIC bool is_being_deleted(const jstring_t &name);
+		SOFADB_PUBLIC void wait_for_purges();
 
 		SOFADB_PUBLIC storage_ptr_t create_storage(bool sync);
-		//SOFADB_PUBLIC batch_storage_ptr_t create_batch_storage();
+		SOFADB_PUBLIC batch_storage_ptr_t create_batch_storage();
+
+		//Queries the store's properties, cheap enough to be polled
+		SOFADB_PUBLIC engine_stats_t get_stats();
+		//Names of all the databases, including the ones not opened yet
+		SOFADB_PUBLIC std::vector<jstring_t> database_names();
+
+		/**
+			Prunes the bodies of the superseded revisions of the database
+			and then compacts its key ranges, within the I/O budget of
+			the options. Only one compaction of a database may run at a
+			time. 'should_stop' is polled between the batches, a stopped
+			compaction can simply be run again.
+		  */
+		SOFADB_PUBLIC compaction_stats_t compact(const database_ptr &db,
+			const compaction_options_t &opts=compaction_options_t(),
+			const stop_callback_t &should_stop=stop_callback_t());
+		//Starts compacting the databases in the background, replacing
+		//the previous schedule
+		SOFADB_PUBLIC void schedule_compaction(
+			const compaction_options_t &opts);
+		SOFADB_PUBLIC void stop_compaction();
 
 		static void check(const leveldb::Status &status);
+	private:
+		void mark_hot(const database_ptr &db);
+		//Builds the handle from the dbinfo record, under the mutex
+		database_ptr load_database(const jstring_t &name,
+								   const jstring_t &dbinfo);
+		void open_in_background(const storage_options_t &opts);
+		size_t preload_databases();
+		uint64_t warm_up(uint64_t max_bytes);
+		//Calls 'fn' with the name and the record of every database
+		void scan_dbinfo(const std::function<void (const jstring_t &name,
+			const jstring_t &dbinfo)> &fn);
 	};
 
 	typedef boost::shared_ptr<DbEngine> engine_ptr;
+
+	SOFADB_PUBLIC json_value engine_stats_to_json(const engine_stats_t &stats);
 };
 
 #endif // ENGINE_H
@@ -0,0 +1,304 @@
+#include "field_index.h"
+#include "database.h"
+#include "storage_interface.h"
+#include "json_key.h"
+#include "errors.h"
+
+using namespace sofadb;
+
+const json_value* sofadb::find_field(const json_value &doc,
+									 const json_path_t &path)
+{
+	const json_value *cur=&doc;
+	for(auto i=path.begin(), iend=path.end(); i!=iend; ++i)
+	{
+		while(cur->type()==graft_d)
+			cur=&cur->get_graft().grafted();
+		if (cur->type()!=submap_d)
+			return 0;
+		const submap_t &map=cur->get_submap();
+		auto pos=map.find(*i);
+		if (pos==map.end())
+			return 0;
+		cur=&pos->second;
+	}
+	return cur;
+}
+
+field_index_t::field_index_t(const jstring_t &db_name, const jstring_t &name,
+							 const std::vector<jstring_t> &fields) :
+	name_(name), fields_(fields)
+{
+	if (name_.empty() || name_.find(DB_SEPARATOR)!=jstring_t::npos)
+		err(result_code_t::sError) << "Invalid index name: " << name_;
+	if (fields_.empty())
+		err(result_code_t::sError) << "Index " << name_ << " has no fields";
+
+	for(auto i=fields_.begin(), iend=fields_.end(); i!=iend; ++i)
+		paths_.push_back(split_json_path(*i));
+
+	prefix_.append(SD_INDEX_DB"/");
+	prefix_.append(db_name);
+	prefix_.append(DB_SEPARATOR);
+	prefix_.append(name_);
+	prefix_.append(DB_SEPARATOR);
+}
+
+void field_index_t::update(storage_t *ifc, const jstring_t &id,
+						   const json_value *doc) const
+{
+	jstring_t entry;
+	bool indexed=doc!=0;
+	for(auto i=paths_.begin(), iend=paths_.end(); indexed && i!=iend; ++i)
+	{
+		const json_value *val=find_field(*doc, *i);
+		if (val)
+			json_to_key(entry, *val);
+		else
+			indexed=false;
+	}
+	if (indexed)
+		json_to_key(entry, json_value(id));
+
+	const jstring_t back_key=prefix_+'b'+id;
+	jstring_t old;
+	const bool had_entry=ifc->try_get(back_key, &old);
+	if (had_entry)
+	{
+		if (indexed && old==entry)
+			return;
+		ifc->remove(prefix_+'e'+old);
+	}
+
+	if (indexed)
+	{
+		ifc->put(prefix_+'e'+entry, id);
+		ifc->put(back_key, entry);
+	} else if (had_entry)
+		ifc->remove(back_key);
+}
+
+void field_index_t::scan(storage_t *ifc, const jstring_t &lower,
+	const jstring_t &upper,
+	const std::function<bool (const jstring_t &id)> &fn) const
+{
+	const jstring_t entries=prefix_+'e';
+	const jstring_t end=upper.empty() ? prefix_+char('e'+1) : entries+upper;
+
+	std::auto_ptr<storage_iterator_t> it=ifc->iterate();
+	for(it->seek(entries+lower); it->valid(); it->next())
+	{
+		if (!(it->key()<end))
+			break;
+		if (!fn(it->value()))
+			break;
+	}
+}
+
+void field_index_t::clear(storage_t *ifc) const
+{
+	std::auto_ptr<storage_iterator_t> it=ifc->iterate();
+	for(it->seek(prefix_); it->valid(); it->next())
+	{
+		const jstring_t key=it->key();
+		if (key.compare(0, prefix_.size(), prefix_)!=0)
+			break;
+		ifc->remove(key);
+	}
+}
+
+static bool is_operator(const jstring_t &str)
+{
+	return !str.empty() && str[0]=='$';
+}
+
+selector_t::selector_t(const json_value &selector)
+{
+	parse(selector);
+}
+
+void selector_t::parse(const json_value &selector)
+{
+	if (selector.type()!=submap_d)
+		err(result_code_t::sError) << "Selector must be an object";
+
+	const submap_t &map=selector.get_submap();
+	for(auto i=map.begin(), iend=map.end(); i!=iend; ++i)
+	{
+		if (i->first=="$and")
+		{
+			if (i->second.type()!=sublist_d)
+				err(result_code_t::sError) << "$and requires a list";
+			const sublist_t &lst=i->second.get_sublist();
+			for(auto j=lst.begin(), jend=lst.end(); j!=jend; ++j)
+				parse(*j);
+			continue;
+		}
+		if (is_operator(i->first))
+			err(result_code_t::sError) << "Unsupported operator "
+									   << i->first;
+
+		condition_t cond;
+		cond.field_=i->first;
+		cond.path_=split_json_path(i->first);
+
+		//A map of operators, anything else is compared for equality
+		const json_value &val=i->second;
+		if (val.type()!=submap_d || val.get_submap().empty() ||
+				!is_operator(val.get_submap().begin()->first))
+		{
+			cond.op_="$eq";
+			cond.arg_=val;
+			conditions_.push_back(std::move(cond));
+			continue;
+		}
+
+		const submap_t &ops=val.get_submap();
+		for(auto j=ops.begin(), jend=ops.end(); j!=jend; ++j)
+		{
+			if (j->first!="$eq" && j->first!="$ne" && j->first!="$gt" &&
+				j->first!="$gte" && j->first!="$lt" && j->first!="$lte" &&
+				j->first!="$exists")
+				err(result_code_t::sError) << "Unsupported operator "
+										   << j->first;
+			if (j->first=="$exists" && j->second.type()!=bool_d)
+				err(result_code_t::sError) << "$exists requires a boolean";
+			cond.op_=j->first;
+			cond.arg_=j->second;
+			conditions_.push_back(cond);
+		}
+	}
+}
+
+bool selector_t::matches(const json_value &doc) const
+{
+	for(auto i=conditions_.begin(), iend=conditions_.end(); i!=iend; ++i)
+	{
+		const json_value *val=find_field(doc, i->path_);
+		const jstring_t &op=i->op_;
+		if (op=="$exists")
+		{
+			if ((val!=0)!=i->arg_.get_bool())
+				return false;
+			continue;
+		}
+		if (!val)
+			return false;
+
+		bool res;
+		if (op=="$eq")
+			res = *val==i->arg_;
+		else if (op=="$ne")
+			res = !(*val==i->arg_);
+		else if (op=="$gt")
+			res = i->arg_<*val;
+		else if (op=="$gte")
+			res = !(*val<i->arg_);
+		else if (op=="$lt")
+			res = *val<i->arg_;
+		else
+			res = !(i->arg_<*val);
+		if (!res)
+			return false;
+	}
+	return true;
+}
+
+static bool requires_fields(const field_index_t &index,
+	const std::vector<selector_t::condition_t> &conds)
+{
+	const std::vector<jstring_t> &fields=index.fields();
+	for(auto field=fields.begin(); field!=fields.end(); ++field)
+	{
+		bool required=false;
+		for(auto c=conds.begin(); c!=conds.end() && !required; ++c)
+			required = c->field_==*field &&
+				(c->op_!="$exists" || c->arg_.get_bool());
+		if (!required)
+			return false;
+	}
+	return true;
+}
+
+bool sofadb::plan_find(const field_index_list_t &indexes,
+					   const selector_t &selector, find_plan_t *plan,
+					   field_index_ptr *index,
+					   jstring_t *lower, jstring_t *upper)
+{
+	//Rows with the same prefix differ in the encoding of the following
+	//values which never starts with 0xFF
+	const char past_value='\xFF';
+	const std::vector<selector_t::condition_t> &conds=selector.conditions();
+
+	size_t best_score=0;
+	for(auto idx=indexes.begin(), iend=indexes.end(); idx!=iend; ++idx)
+	{
+		//Documents lacking any of the fields are not indexed, so the
+		//index is only usable if the selector requires all of them
+		if (!requires_fields(**idx, conds))
+			continue;
+
+		jstring_t prefix, lo, hi;
+		size_t eq_fields=0;
+		bool range=false;
+
+		const std::vector<jstring_t> &fields=(*idx)->fields();
+		for(auto field=fields.begin(); field!=fields.end(); ++field)
+		{
+			auto eq=conds.begin();
+			for(; eq!=conds.end(); ++eq)
+				if (eq->field_==*field && eq->op_=="$eq")
+					break;
+			if (eq!=conds.end())
+			{
+				json_to_key(prefix, eq->arg_);
+				++eq_fields;
+				continue;
+			}
+
+			//The tightest bounds of the range conditions
+			lo=prefix;
+			hi=prefix.empty() ? jstring_t() : prefix+past_value;
+			for(auto c=conds.begin(); c!=conds.end(); ++c)
+			{
+				if (c->field_!=*field)
+					continue;
+				jstring_t bound=prefix;
+				json_to_key(bound, c->arg_);
+				if (c->op_=="$gt" || c->op_=="$lte")
+					bound.push_back(past_value);
+
+				if (c->op_=="$gt" || c->op_=="$gte")
+				{
+					range=true;
+					if (lo<bound)
+						lo=bound;
+				} else if (c->op_=="$lt" || c->op_=="$lte")
+				{
+					range=true;
+					if (hi.empty() || bound<hi)
+						hi=bound;
+				}
+			}
+			break;
+		}
+
+		if (!range)
+		{
+			lo=prefix;
+			hi=prefix+past_value;
+		}
+		const size_t score=eq_fields*2+(range ? 1 : 0);
+		if (score>best_score)
+		{
+			best_score=score;
+			plan->index_=(*idx)->name();
+			plan->eq_fields_=eq_fields;
+			plan->range_=range;
+			*index=*idx;
+			*lower=lo;
+			*upper=hi;
+		}
+	}
+	return best_score>0;
+}
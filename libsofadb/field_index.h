@@ -0,0 +1,117 @@
+#ifndef FIELD_INDEX_H
+#define FIELD_INDEX_H
+
+#include "common.h"
+#include "native_json.h"
+#include <functional>
+
+namespace sofadb {
+	class storage_t;
+
+	//Finds the value at the path, returns null if it's missing
+	SOFADB_PUBLIC const json_value* find_field(const json_value &doc,
+											   const json_path_t &path);
+
+	/**
+		Secondary index over one or more document fields. Entries live
+		in the SD_INDEX_DB prefix:
+		- idx/e + field values + id -> id, values are encoded with
+		  json_to_key so entries are ordered by the field values
+		- idx/b + id -> the entry key of the document, used to replace
+		  it when the document changes
+
+		Like in Mango, documents that lack any of the fields are not
+		indexed. Entries are written through the same storage as the
+		document, so they are committed in the same batch.
+	  */
+	class field_index_t
+	{
+		jstring_t name_;
+		std::vector<jstring_t> fields_;
+		std::vector<json_path_t> paths_;
+		jstring_t prefix_;
+	public:
+		SOFADB_PUBLIC field_index_t(const jstring_t &db_name,
+			const jstring_t &name, const std::vector<jstring_t> &fields);
+
+		const jstring_t& name() const { return name_; }
+		const std::vector<jstring_t>& fields() const { return fields_; }
+		const std::vector<json_path_t>& paths() const { return paths_; }
+
+		//Replaces the entry of the document, 'doc' is null if the
+		//document is gone
+		SOFADB_PUBLIC void update(storage_t *ifc, const jstring_t &id,
+								  const json_value *doc) const;
+
+		/**
+			Calls 'fn' with document ids of the entries whose encoded
+			values are in [lower, upper), in the index order. Stops when
+			'fn' returns false.
+		  */
+		SOFADB_PUBLIC void scan(storage_t *ifc, const jstring_t &lower,
+			const jstring_t &upper,
+			const std::function<bool (const jstring_t &id)> &fn) const;
+
+		//Removes all entries of the index
+		SOFADB_PUBLIC void clear(storage_t *ifc) const;
+	};
+	typedef boost::shared_ptr<const field_index_t> field_index_ptr;
+	typedef std::vector<field_index_ptr> field_index_list_t;
+
+	/**
+		Mango selector. Supported are implicit and explicit $and of field
+		conditions, where a condition is either a value to compare with
+		or a map of $eq, $ne, $gt, $gte, $lt, $lte and $exists operators.
+	  */
+	class selector_t
+	{
+	public:
+		struct condition_t
+		{
+			jstring_t field_;
+			json_path_t path_;
+			jstring_t op_;
+			json_value arg_;
+		};
+
+		SOFADB_PUBLIC selector_t(const json_value &selector);
+
+		const std::vector<condition_t>& conditions() const
+		{
+			return conditions_;
+		}
+		SOFADB_PUBLIC bool matches(const json_value &doc) const;
+	private:
+		std::vector<condition_t> conditions_;
+		void parse(const json_value &selector);
+	};
+
+	//Describes the way a query has been executed
+	struct find_plan_t
+	{
+		//Empty for full scans
+		jstring_t index_;
+		//Number of leading index fields matched by equality
+		size_t eq_fields_;
+		//Whether the next field is bounded by a range
+		bool range_;
+
+		find_plan_t() : eq_fields_(), range_() {}
+	};
+
+	/**
+		Picks the index with the longest prefix of equality conditions
+		among the indexes whose fields are all required by the selector,
+		with a range condition on the next field counting as a half.
+		Computes the bounds of the scan in the encoded values space.
+		Returns false if no index can be used.
+	  */
+	SOFADB_PUBLIC bool plan_find(const field_index_list_t &indexes,
+								 const selector_t &selector,
+								 find_plan_t *plan,
+								 field_index_ptr *index,
+								 jstring_t *lower, jstring_t *upper);
+
+}; //namespace sofadb
+
+#endif //FIELD_INDEX_H
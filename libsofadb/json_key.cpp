@@ -0,0 +1,506 @@
+#include "json_key.h"
+#include "errors.h"
+#include <string.h>
+#include <stdlib.h>
+
+using namespace sofadb;
+
+static void put_be(jstring_t &out, uint64_t val, size_t width)
+{
+	char buf[8];
+	for(size_t f=0;f<width;++f)
+		buf[f] = static_cast<char>(val >> (8*(width-f-1)));
+	out.append(buf, width);
+}
+
+static void put_key_string(jstring_t &out, const char *str, size_t ln)
+{
+	const char *end=str+ln;
+	while(true)
+	{
+		const char *zero=static_cast<const char*>(memchr(str, 0, end-str));
+		if (!zero)
+			break;
+		out.append(str, zero+1);
+		out.push_back('\xFF');
+		str=zero+1;
+	}
+	out.append(str, end);
+	out.push_back('\0');
+	out.push_back(key_end);
+}
+
+static void put_double(jstring_t &out, double d)
+{
+	if (d==0)
+		d=0; //-0.0 and 0.0 are equal
+	uint64_t bits;
+	memcpy(&bits, &d, sizeof(bits));
+	if (bits>>63)
+		bits=~bits;
+	else
+		bits|=uint64_t(1)<<63;
+	put_be(out, bits, 8);
+}
+
+namespace {
+	//Primary weights of the CouchDB collation, letters of both cases
+	//share the weight
+	struct collation_table_t
+	{
+		unsigned char weight_[256];
+		//Weight to the byte, lowercase for letters
+		unsigned char byte_[256];
+
+		collation_table_t()
+		{
+			memset(byte_, 0, sizeof(byte_));
+			unsigned w=1;
+			auto add=[&](unsigned char ch)
+			{
+				weight_[ch]=w;
+				byte_[w++]=ch;
+			};
+			for(unsigned ch=0;ch<0x20;++ch)
+				if (ch<'\t' || ch>'\r')
+					add(ch);
+			add(0x7F);
+			for(unsigned ch='\t';ch<='\r';++ch)
+				add(ch);
+			add(' ');
+			for(const char *p="_-,;:!?.'\"()[]{}@*/\\&#%`^+<=>|~$";*p;++p)
+				add(*p);
+			for(unsigned ch='0';ch<='9';++ch)
+				add(ch);
+			for(unsigned ch='a';ch<='z';++ch)
+			{
+				weight_[ch-'a'+'A']=w;
+				add(ch);
+			}
+			for(unsigned ch=0x80;ch<0x100;++ch)
+				add(ch);
+			assert(w<0x100);
+		}
+	};
+
+	const collation_table_t& collation_table()
+	{
+		static const collation_table_t table;
+		return table;
+	}
+
+	enum case_flag_e
+	{
+		case_lower = 0x01,
+		case_upper = 0x02,
+	};
+}
+
+static bool is_ascii_letter(unsigned char ch)
+{
+	return (ch>='a' && ch<='z') || (ch>='A' && ch<='Z');
+}
+
+static void put_collated_string(jstring_t &out, const jstring_t &str)
+{
+	const collation_table_t &table=collation_table();
+	jstring_t flags;
+	for(size_t f=0;f<str.size();++f)
+	{
+		const unsigned char ch=str[f];
+		out.push_back(table.weight_[ch]);
+		if (is_ascii_letter(ch))
+			flags.push_back(ch<'a' ? case_upper : case_lower);
+	}
+	out.push_back('\0');
+
+	//Trailing lowercase flags sort below any uppercase, so they can be
+	//replaced by the terminator
+	while(!flags.empty() && flags[flags.size()-1]==case_lower)
+		flags.resize(flags.size()-1);
+	out.append(flags);
+	out.push_back('\0');
+}
+
+static double number_value(const json_value &val)
+{
+	switch(val.type())
+	{
+		case int_d:
+			return double(val.get_int());
+		case double_d:
+			return val.get_double();
+		default:
+			return strtod(val.get_big_int().digits_.c_str(), 0);
+	}
+}
+
+static void put_couchdb_key(jstring_t &out, const json_value &val)
+{
+	switch(val.type())
+	{
+		case nil_d:
+		case bool_d:
+			json_to_key(out, val);
+			break;
+		case int_d:
+		case double_d:
+		case big_int_d:
+			out.push_back(key_number);
+			put_double(out, number_value(val));
+			if (val.type()==double_d)
+				out.push_back('\0');
+			else
+				json_to_key(out, val);
+			break;
+		case string_d:
+			out.push_back(key_collated);
+			put_collated_string(out, val.get_str());
+			break;
+		case submap_d:
+		{
+			out.push_back(key_object);
+			const submap_t &map=val.get_submap();
+			for(auto i=map.begin(), iend=map.end(); i!=iend; ++i)
+			{
+				out.push_back(key_entry);
+				put_collated_string(out, i->first);
+				put_couchdb_key(out, i->second);
+			}
+			out.push_back(key_end);
+			break;
+		}
+		case sublist_d:
+		{
+			out.push_back(key_array);
+			const sublist_t &lst=val.get_sublist();
+			for(auto i=lst.begin(), iend=lst.end(); i!=iend; ++i)
+				put_couchdb_key(out, *i);
+			out.push_back(key_end);
+			break;
+		}
+		case graft_d:
+			put_couchdb_key(out, val.get_graft().grafted());
+			break;
+	}
+}
+
+static void put_bignum(jstring_t &out, const bignum_t &num)
+{
+	const jstring_t &digits=num.digits_;
+	const bool neg=!digits.empty() && digits[0]=='-';
+	const size_t start=neg ? 1 : 0;
+	const uint32_t count=digits.size()-start;
+
+	out.push_back(key_bignum);
+	if (neg)
+	{
+		//Longer negative numbers are smaller, and so are the bigger
+		//digits - invert both.
+		out.push_back('\0');
+		put_be(out, ~count, 4);
+		for(size_t f=start;f<digits.size();++f)
+			out.push_back(~digits[f]);
+	} else
+	{
+		out.push_back('\1');
+		put_be(out, count, 4);
+		out.append(digits, start, jstring_t::npos);
+	}
+}
+
+void sofadb::json_to_key(jstring_t &out, const json_value &val,
+						 key_collation_e collation)
+{
+	if (collation==collate_couchdb)
+	{
+		put_couchdb_key(out, val);
+		return;
+	}
+
+	switch(val.type())
+	{
+		case nil_d:
+			out.push_back(key_null);
+			break;
+		case bool_d:
+			out.push_back(val.get_bool() ? key_true : key_false);
+			break;
+		case int_d:
+			out.push_back(key_int);
+			put_be(out, uint64_t(val.get_int()) ^ (uint64_t(1)<<63), 8);
+			break;
+		case double_d:
+			out.push_back(key_double);
+			put_double(out, val.get_double());
+			break;
+		case string_d:
+			out.push_back(key_string);
+			put_key_string(out, val.get_str().data(), val.get_str().size());
+			break;
+		case big_int_d:
+		{
+			json_value norm=val.normalize_int();
+			if (norm.type()==int_d)
+				json_to_key(out, norm);
+			else
+				put_bignum(out, val.get_big_int());
+			break;
+		}
+		case submap_d:
+		{
+			out.push_back(key_map);
+			const submap_t &map=val.get_submap();
+			for(auto i=map.begin(), iend=map.end(); i!=iend; ++i)
+			{
+				out.push_back(key_entry);
+				put_key_string(out, i->first.data(), i->first.size());
+				json_to_key(out, i->second);
+			}
+			out.push_back(key_end);
+			break;
+		}
+		case sublist_d:
+		{
+			out.push_back(key_list);
+			const sublist_t &lst=val.get_sublist();
+			for(auto i=lst.begin(), iend=lst.end(); i!=iend; ++i)
+				json_to_key(out, *i);
+			out.push_back(key_end);
+			break;
+		}
+		case graft_d:
+			json_to_key(out, val.get_graft().grafted());
+			break;
+	}
+}
+
+namespace {
+	class key_decoder
+	{
+		const unsigned char *pos_, *end_;
+	public:
+		key_decoder(const char *data, size_t len) :
+			pos_(reinterpret_cast<const unsigned char*>(data)),
+			end_(pos_+len)
+		{
+		}
+
+		const char* position() const
+		{
+			return reinterpret_cast<const char*>(pos_);
+		}
+
+		void read(json_value &res)
+		{
+			unsigned char tag=take();
+			switch(tag)
+			{
+				case key_null:
+					res.as_nil();
+					break;
+				case key_false:
+				case key_true:
+					res = json_value(tag==key_true);
+					break;
+				case key_int:
+					res = json_value(int64_t(read_be(8) ^ (uint64_t(1)<<63)));
+					break;
+				case key_double:
+					res = json_value(read_double());
+					break;
+				case key_number:
+				{
+					const double d=read_double();
+					if (peek())
+						read(res);
+					else
+					{
+						take();
+						res = json_value(d);
+					}
+					break;
+				}
+				case key_collated:
+					res = json_value(read_collated());
+					break;
+				case key_object:
+				{
+					res = json_value(submap_d);
+					submap_t &map=res.get_submap();
+					while(take()==key_entry)
+					{
+						auto pos=map.insert(map.end(),
+							std::make_pair(read_collated(), json_value()));
+						read(pos->second);
+					}
+					if (pos_[-1]!=key_end)
+						corrupted();
+					break;
+				}
+				case key_string:
+					res = json_value(read_string());
+					break;
+				case key_bignum:
+					res = json_value(read_bignum());
+					break;
+				case key_map:
+				{
+					res = json_value(submap_d);
+					submap_t &map=res.get_submap();
+					while(take()==key_entry)
+					{
+						auto pos=map.insert(map.end(),
+							std::make_pair(read_string(), json_value()));
+						read(pos->second);
+					}
+					if (pos_[-1]!=key_end)
+						corrupted();
+					break;
+				}
+				case key_list:
+				case key_array:
+				{
+					res = json_value(sublist_d);
+					sublist_t &lst=res.get_sublist();
+					while(peek()!=key_end)
+					{
+						lst.push_back(json_value());
+						read(lst.back());
+					}
+					take();
+					break;
+				}
+				default:
+					corrupted();
+			}
+		}
+	private:
+		void corrupted() const
+		{
+			err(result_code_t::sError) << "Corrupted key";
+		}
+
+		unsigned char peek() const
+		{
+			if (pos_==end_)
+				corrupted();
+			return *pos_;
+		}
+
+		unsigned char take()
+		{
+			unsigned char res=peek();
+			++pos_;
+			return res;
+		}
+
+		uint64_t read_be(size_t width)
+		{
+			if (size_t(end_-pos_)<width)
+				corrupted();
+			uint64_t res=0;
+			for(size_t f=0;f<width;++f)
+				res = (res<<8) | *pos_++;
+			return res;
+		}
+
+		double read_double()
+		{
+			uint64_t bits=read_be(8);
+			if (bits>>63)
+				bits&=~(uint64_t(1)<<63);
+			else
+				bits=~bits;
+			double d;
+			memcpy(&d, &bits, sizeof(d));
+			return d;
+		}
+
+		jstring_t read_collated()
+		{
+			const collation_table_t &table=collation_table();
+			jstring_t res;
+			while(unsigned char w=take())
+			{
+				const unsigned char ch=table.byte_[w];
+				if (!ch && w!=table.weight_[0])
+					corrupted();
+				res.push_back(ch);
+			}
+
+			size_t pos=0;
+			while(unsigned char flag=take())
+			{
+				while(pos<res.size() &&
+					  !is_ascii_letter(static_cast<unsigned char>(res[pos])))
+					++pos;
+				if (pos==res.size() || (flag!=case_lower && flag!=case_upper))
+					corrupted();
+				if (flag==case_upper)
+					res[pos]=res[pos]-'a'+'A';
+				++pos;
+			}
+			return res;
+		}
+
+		jstring_t read_string()
+		{
+			jstring_t res;
+			while(true)
+			{
+				const unsigned char *zero=static_cast<const unsigned char*>(
+							memchr(pos_, 0, end_-pos_));
+				if (!zero || zero+1==end_)
+					corrupted();
+				res.append(reinterpret_cast<const char*>(pos_),
+						   reinterpret_cast<const char*>(zero));
+				pos_=zero+2;
+				if (zero[1]==key_end)
+					return res;
+				if (zero[1]!=0xFF)
+					corrupted();
+				res.push_back('\0');
+			}
+		}
+
+		bignum_t read_bignum()
+		{
+			const bool neg=take()==0;
+			uint32_t count=read_be(4);
+			if (neg)
+				count=~count;
+			if (size_t(end_-pos_)<count)
+				corrupted();
+
+			jstring_t digits;
+			digits.reserve(count+1);
+			if (neg)
+			{
+				digits.push_back('-');
+				for(uint32_t f=0;f<count;++f)
+					digits.push_back(~*pos_++);
+			} else
+			{
+				digits.append(reinterpret_cast<const char*>(pos_), count);
+				pos_+=count;
+			}
+			return bignum_t(std::move(digits));
+		}
+	};
+}
+
+size_t sofadb::key_to_json(const char *data, size_t len, json_value &res)
+{
+	key_decoder dec(data, len);
+	dec.read(res);
+	return dec.position()-data;
+}
+
+json_value sofadb::key_to_json(const jstring_t &key)
+{
+	json_value res;
+	if (key_to_json(key.data(), key.size(), res)!=key.size())
+		err(result_code_t::sError) << "Trailing data after a key";
+	return std::move(res);
+}
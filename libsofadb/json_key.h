@@ -0,0 +1,95 @@
+#ifndef JSON_KEY_H
+#define JSON_KEY_H
+
+#include "common.h"
+#include "native_json.h"
+
+namespace sofadb {
+
+	/**
+		Order-preserving ("memcomparable") encoding of json_value. Byte
+		strings produced by json_to_key compare with memcmp the same way
+		as the source values compare with operator <, so encoded values
+		can be used directly as leveldb keys with the default comparator.
+
+		Each value starts with a type tag, tags are ordered as json_disc:
+		- null/false/true - just the tag
+		- int - 8 big-endian bytes with the sign bit flipped
+		- double - 8 big-endian bytes of the IEEE representation, with
+		  the sign bit flipped for positive and all bits flipped for
+		  negative numbers
+		- string - the bytes with 0x00 escaped as 0x00 0xFF, terminated
+		  by 0x00 0x01
+		- bignum - the sign, the digit count and the digits, inverted for
+		  negative numbers. Bignums in the int64 range are encoded as
+		  ints, the same way operator < normalizes them.
+		- map - 0x02 followed by the key (as a string) and the value for
+		  each entry, terminated by 0x01
+		- list - the elements, terminated by 0x01
+
+		The encoding is self-delimiting, so encoded values can be
+		concatenated to form composite keys.
+
+		collate_couchdb produces keys ordered as CouchDB collates view
+		keys: null < false < true < numbers < strings < arrays < objects.
+		- number - ints, doubles and bignums are ordered by value. The
+		  tag is followed by the double encoding of the value and then
+		  by 0x00 for doubles or the native encoding of the exact value
+		  for the rest, so numbers rounding to the same double are
+		  ordered by their type.
+		- string - a primary weight per byte terminated by 0x00, then the
+		  case flags of the letters (0x01 lower, 0x02 upper, trailing
+		  lowercase flags are omitted) terminated by 0x00. Weights follow
+		  the CouchDB ASCII order: control characters, whitespace,
+		  punctuation, digits and letters with "a" < "A" < "b". Bytes of
+		  non-ASCII characters sort after ASCII in byte order, there's no
+		  full ICU collation.
+		- array/object - like lists and maps, with collated strings
+
+		key_to_json decodes both forms.
+	  */
+	enum key_collation_e
+	{
+		collate_native,
+		collate_couchdb,
+	};
+
+	enum key_tag_e
+	{
+		key_end = 0x01,
+		key_entry = 0x02,
+		key_null = 0x10,
+		key_false = 0x20,
+		key_true = 0x21,
+		key_int = 0x30,
+		key_double = 0x40,
+		key_string = 0x50,
+		key_bignum = 0x60,
+		key_map = 0x70,
+		key_list = 0x80,
+		//CouchDB collation
+		key_number = 0x38,
+		key_collated = 0x58,
+		key_array = 0x68,
+		key_object = 0x78,
+	};
+
+	SOFADB_PUBLIC void json_to_key(jstring_t &append_to, const json_value &val,
+		key_collation_e collation=collate_native);
+	inline jstring_t json_to_key(const json_value &val,
+		key_collation_e collation=collate_native)
+	{
+		jstring_t res;
+		json_to_key(res, val, collation);
+		return res;
+	}
+
+	//Decodes one value and returns the number of consumed bytes
+	SOFADB_PUBLIC size_t key_to_json(const char *data, size_t len,
+									 json_value &res);
+	//Decodes a key that contains exactly one value
+	SOFADB_PUBLIC json_value key_to_json(const jstring_t &key);
+
+}; //namespace sofadb
+
+#endif //JSON_KEY_H
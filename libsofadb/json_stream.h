@@ -51,6 +51,30 @@ namespace sofadb {
 	SOFADB_PUBLIC std::auto_ptr<json_stream> make_stream(
 		jstring_t &append_to, bool pretty=false);
 
+	//Receives the text of a stream piece by piece as it's written
+	class json_sink_t
+	{
+	public:
+		virtual ~json_sink_t() {}
+		virtual void append(const char *data, size_t ln) = 0;
+	};
+
+	/**
+		Compact JSON text stream that hands its output to the sink in
+		small pieces instead of accumulating it. The rest of the output
+		is flushed when a top-level value ends and when the stream is
+		destroyed.
+	  */
+	SOFADB_PUBLIC std::auto_ptr<json_stream> make_sink_stream(
+		json_sink_t *sink);
+
+	/**
+		Forwards everything to both streams, a json_value written to it
+		is walked once. The streams must outlive it.
+	  */
+	SOFADB_PUBLIC std::auto_ptr<json_stream> make_tee_stream(
+		json_stream *first, json_stream *second);
+
 }; //namespace sofadb
 
 #endif //JSON_STREAM_H
@@ -0,0 +1,279 @@
+#include "storage_backend.h"
+
+#include "leveldb/db.h"
+#include "leveldb/write_batch.h"
+#include "leveldb/cache.h"
+#include <sstream>
+#include <stdio.h>
+#include <stdlib.h>
+
+using namespace sofadb;
+using namespace leveldb;
+
+static const size_t block_cache_capacity = 8*1024*1024;
+//kL0_SlowdownWritesTrigger and kL0_StopWritesTrigger of leveldb
+static const uint64_t level0_slowdown_files = 8;
+static const uint64_t level0_stop_files = 12;
+static const int max_levels = 7;
+
+class db_iterator_t : public storage_iterator_t
+{
+	std::auto_ptr<Iterator> it_;
+public:
+	db_iterator_t(Iterator *it) : it_(it) {}
+
+	virtual bool valid() const
+	{
+		if (!it_->Valid())
+		{
+			DbEngine::check(it_->status());
+			return false;
+		}
+		return true;
+	}
+
+	virtual void seek(const jstring_t &key)
+	{
+		it_->Seek(key);
+	}
+
+	virtual void seek_to_last()
+	{
+		it_->SeekToLast();
+	}
+
+	virtual void next()
+	{
+		it_->Next();
+	}
+
+	virtual void prev()
+	{
+		it_->Prev();
+	}
+
+	virtual jstring_t key() const
+	{
+		return it_->key().ToString();
+	}
+
+	virtual jstring_t value() const
+	{
+		return it_->value().ToString();
+	}
+};
+
+class db_snapshot_t : public snapshot_t
+{
+public:
+	const Snapshot *snap_;
+	explicit db_snapshot_t(const Snapshot *snap) : snap_(snap) {}
+};
+
+static void parse_level_sizes(const jstring_t &sstables,
+							  std::vector<level_stats_t> &levels)
+{
+	//"--- level N ---" headers, then a " number:size[...]" line per file
+	std::istringstream in(sstables);
+	jstring_t line;
+	level_stats_t *cur=0;
+	while(std::getline(in, line))
+	{
+		int level;
+		if (sscanf(line.c_str(), "--- level %d ---", &level)==1)
+		{
+			cur=level>=0 && level<int(levels.size()) ? &levels[level] : 0;
+			continue;
+		}
+		unsigned long long number, size;
+		if (cur && sscanf(line.c_str(), " %llu:%llu", &number, &size)==2)
+		{
+			cur->files_++;
+			cur->size_bytes_+=size;
+		}
+	}
+}
+
+static void parse_compaction_stats(const jstring_t &stats,
+								   std::vector<level_stats_t> &levels)
+{
+	//Level  Files Size(MB) Time(sec) Read(MB) Write(MB)
+	std::istringstream in(stats);
+	jstring_t line;
+	while(std::getline(in, line))
+	{
+		int level, files;
+		double size_mb, sec, read_mb, write_mb;
+		if (sscanf(line.c_str(), "%d %d %lf %lf %lf %lf", &level, &files,
+				   &size_mb, &sec, &read_mb, &write_mb)!=6 ||
+				level<0 || level>=int(levels.size()))
+			continue;
+		level_stats_t &lev=levels[level];
+		lev.compaction_sec_=sec;
+		lev.compaction_read_bytes_=uint64_t(read_mb*1048576);
+		lev.compaction_written_bytes_=uint64_t(write_mb*1048576);
+	}
+}
+
+class leveldb_backend_t : public storage_backend_t
+{
+	boost::shared_ptr<Cache> block_cache_;
+	leveldb::db_ptr_t db_;
+	jstring_t filename_;
+	bool temporary_;
+public:
+	leveldb_backend_t(const jstring_t &filename, bool temporary) :
+		filename_(filename), temporary_(temporary)
+	{
+		Options opts;
+		opts.create_if_missing = true;
+		opts.paranoid_checks=0;
+		opts.block_size=1024;
+		opts.compression=kSnappyCompression;
+		opts.write_buffer_size = 24*1024*1024;
+		//The leveldb default size, but owned here so that its usage can
+		//be reported
+		block_cache_.reset(NewLRUCache(block_cache_capacity));
+		opts.block_cache = block_cache_.get();
+
+		DB *db;
+		DbEngine::check(leveldb::DB::Open(opts, filename, &db));
+		db_.reset(db);
+	}
+
+	~leveldb_backend_t()
+	{
+		db_.reset();
+		if (temporary_)
+			DestroyDB(filename_, Options());
+	}
+
+	virtual bool get(const jstring_t &key, jstring_t *res, snapshot_t *snap)
+	{
+		ReadOptions ro;
+		ro.verify_checksums = false;
+		if (snap)
+			ro.snapshot=static_cast<db_snapshot_t*>(snap)->snap_;
+		Status st = db_->Get(ro, key, res);
+		if (st.IsNotFound())
+			return false;
+		if (!st.ok())
+			DbEngine::check(st);
+		return true;
+	}
+
+	virtual void put(const jstring_t &key, const jstring_t &val, bool sync)
+	{
+		WriteOptions wo;
+		wo.sync = sync;
+		DbEngine::check(db_->Put(wo, key, val));
+	}
+
+	virtual void remove(const jstring_t &key, bool sync)
+	{
+		WriteOptions wo;
+		wo.sync = sync;
+		DbEngine::check(db_->Delete(wo, key));
+	}
+
+	virtual void write(const pending_map_t &writes, bool sync)
+	{
+		WriteBatch batch;
+		for(auto i=writes.begin(), iend=writes.end(); i!=iend; ++i)
+			if (i->second.removed_)
+				batch.Delete(i->first);
+			else
+				batch.Put(i->first, i->second.value_);
+		WriteOptions wo;
+		wo.sync = sync;
+		DbEngine::check(db_->Write(wo, &batch));
+	}
+
+	virtual std::auto_ptr<storage_iterator_t> iterate(snapshot_t *snap)
+	{
+		ReadOptions ro;
+		ro.verify_checksums = false;
+		ro.fill_cache = false;
+		if (snap)
+			ro.snapshot=static_cast<db_snapshot_t*>(snap)->snap_;
+		return std::auto_ptr<storage_iterator_t>(
+					new db_iterator_t(db_->NewIterator(ro)));
+	}
+
+	virtual snapshot_t* snapshot()
+	{
+		return new db_snapshot_t(db_->GetSnapshot());
+	}
+
+	virtual void release_snapshot(snapshot_t *snap)
+	{
+		db_->ReleaseSnapshot(static_cast<db_snapshot_t*>(snap)->snap_);
+		delete snap;
+	}
+
+	virtual void compact_range(const jstring_t &start, const jstring_t &limit)
+	{
+		const Slice begin(start), end(limit);
+		db_->CompactRange(&begin, &end);
+	}
+
+	virtual uint64_t approximate_size(const jstring_t &start,
+									  const jstring_t &limit)
+	{
+		const Range range(start, limit);
+		uint64_t size=0;
+		db_->GetApproximateSizes(&range, 1, &size);
+		return size;
+	}
+
+	virtual uint64_t warm_range(const jstring_t &start, const jstring_t &limit,
+								uint64_t max_bytes)
+	{
+		//Unlike iterate(), the blocks are left in the cache
+		ReadOptions ro;
+		ro.verify_checksums = false;
+		std::auto_ptr<Iterator> it(db_->NewIterator(ro));
+		const Slice end(limit);
+		uint64_t res=0;
+		for(it->Seek(start); it->Valid() && res<max_bytes &&
+			it->key().compare(end)<0; it->Next())
+			res+=it->key().size()+it->value().size();
+		DbEngine::check(it->status());
+		return res;
+	}
+
+	virtual void get_stats(engine_stats_t &res)
+	{
+		res.levels_.resize(max_levels);
+		for(int f=0;f<max_levels;++f)
+			res.levels_[f].level_=f;
+
+		jstring_t prop;
+		if (db_->GetProperty("leveldb.sstables", &prop))
+			parse_level_sizes(prop, res.levels_);
+		if (db_->GetProperty("leveldb.stats", &res.raw_stats_))
+			parse_compaction_stats(res.raw_stats_, res.levels_);
+
+		res.read_amplification_=res.levels_[0].files_;
+		for(auto i=res.levels_.begin(), iend=res.levels_.end(); i!=iend; ++i)
+		{
+			res.compaction_read_bytes_+=i->compaction_read_bytes_;
+			res.compaction_written_bytes_+=i->compaction_written_bytes_;
+			if (i->level_>0 && i->files_)
+				res.read_amplification_++;
+		}
+		res.writes_slowed_=res.levels_[0].files_>=level0_slowdown_files;
+		res.writes_stopped_=res.levels_[0].files_>=level0_stop_files;
+
+		if (db_->GetProperty("leveldb.approximate-memory-usage", &prop))
+			res.memtable_bytes_=strtoull(prop.c_str(), 0, 10);
+		res.block_cache_bytes_=block_cache_->TotalCharge();
+		res.block_cache_capacity_=block_cache_capacity;
+	}
+};
+
+storage_backend_ptr_t sofadb::make_leveldb_backend(const jstring_t &filename,
+												   bool temporary)
+{
+	return storage_backend_ptr_t(new leveldb_backend_t(filename, temporary));
+}
@@ -0,0 +1,914 @@
+#include "storage_backend.h"
+#include "compaction.h"
+#include "errors.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdio.h>
+#include <zlib.h>
+
+#include <algorithm>
+#include <condition_variable>
+#include <functional>
+#include <thread>
+
+using namespace sofadb;
+
+//Live records are moved to the active segment in chunks of that size,
+//the writers wait for a chunk at most
+static const uint64_t log_compaction_chunk = 1024*1024;
+static const uint64_t log_footer_magic = 0x31676f6c61666f73ULL; //"sofalog1"
+
+//crc, payload length
+static const size_t frame_header_size = 8;
+//flags, key length, value length
+static const size_t record_header_size = 9;
+//footer offset, footer length, crc, magic
+static const size_t trailer_size = 24;
+
+static void put_u32(jstring_t &out, uint32_t val)
+{
+	out.append(reinterpret_cast<const char*>(&val), sizeof(val));
+}
+
+static void put_u64(jstring_t &out, uint64_t val)
+{
+	out.append(reinterpret_cast<const char*>(&val), sizeof(val));
+}
+
+static uint32_t get_u32(const char *in)
+{
+	uint32_t res;
+	memcpy(&res, in, sizeof(res));
+	return res;
+}
+
+static uint64_t get_u64(const char *in)
+{
+	uint64_t res;
+	memcpy(&res, in, sizeof(res));
+	return res;
+}
+
+static uint32_t checksum(const char *data, size_t size)
+{
+	return crc32(0, reinterpret_cast<const Bytef*>(data), size);
+}
+
+//Where the value of a key is, kept in the index
+struct log_location_t
+{
+	uint32_t segment_;
+	uint32_t size_;
+	uint64_t offset_;
+
+	bool operator == (const log_location_t &other) const
+	{
+		return segment_==other.segment_ && offset_==other.offset_;
+	}
+};
+
+static jstring_t encode_location(const log_location_t &loc)
+{
+	jstring_t res;
+	put_u32(res, loc.segment_);
+	put_u32(res, loc.size_);
+	put_u64(res, loc.offset_);
+	return res;
+}
+
+static log_location_t decode_location(const jstring_t &in)
+{
+	assert(in.size()==16);
+	log_location_t res;
+	res.segment_=get_u32(in.data());
+	res.size_=get_u32(in.data()+4);
+	res.offset_=get_u64(in.data()+8);
+	return res;
+}
+
+struct log_record_t
+{
+	bool removed_;
+	jstring_t key_;
+	uint64_t value_offset_;
+	uint32_t value_size_;
+
+	uint64_t footprint() const
+	{
+		return record_header_size+key_.size()+value_size_;
+	}
+};
+
+//A record to be appended, the value isn't copied
+struct log_write_t
+{
+	const jstring_t *key_;
+	bool removed_;
+	const char *value_;
+	uint32_t value_size_;
+};
+
+/**
+	Segment file: a sequence of frames, one per write batch, and a
+	footer listing the records once the segment is sealed.
+
+	frame:   crc32(payload), payload length, payload
+	payload: (flags, key length, value length, key, value)*
+	footer:  (flags, key length, value length, value offset, key)*
+	trailer: footer offset, footer length, crc32(footer), magic
+
+	The whole segment is mapped, values are read straight from the map.
+	The active segment is mapped for its capacity, the pages past the
+	end of the file are never touched.
+  */
+class log_segment_t
+{
+	int fd_;
+	const char *map_;
+	size_t map_size_;
+	//The footer of the active segment is built as it's written
+	jstring_t footer_;
+public:
+	const uint32_t id_;
+	const jstring_t path_;
+	//End of the frames, writers only
+	uint64_t size_;
+	std::atomic<bool> sealed_;
+	std::atomic<uint64_t> bytes_, dead_bytes_, tombstone_bytes_;
+	//The file is removed along with the last reference
+	std::atomic<bool> obsolete_;
+
+	log_segment_t(uint32_t id, const jstring_t &path) : fd_(-1), map_(),
+		map_size_(), id_(id), path_(path), size_(), sealed_(false),
+		bytes_(), dead_bytes_(), tombstone_bytes_(), obsolete_(false)
+	{
+		fd_=open(path_.c_str(), O_RDWR|O_CREAT, 0644);
+		if (fd_<0)
+			err(result_code_t::sError) << "Can't open " << path_ << ": "
+									   << strerror(errno);
+	}
+
+	~log_segment_t()
+	{
+		if (map_)
+			munmap(const_cast<char*>(map_), map_size_);
+		close(fd_);
+		if (obsolete_)
+			unlink(path_.c_str());
+	}
+
+	uint64_t file_size() const
+	{
+		struct stat st;
+		if (fstat(fd_, &st))
+			err(result_code_t::sError) << "Can't stat " << path_ << ": "
+									   << strerror(errno);
+		return st.st_size;
+	}
+
+	void map(uint64_t capacity)
+	{
+		if (map_)
+			munmap(const_cast<char*>(map_), map_size_);
+		map_=0;
+		map_size_=capacity;
+		if (!map_size_)
+			return;
+		void *data=mmap(0, map_size_, PROT_READ, MAP_SHARED, fd_, 0);
+		if (data==MAP_FAILED)
+			err(result_code_t::sError) << "Can't map " << path_ << ": "
+									   << strerror(errno);
+		map_=static_cast<const char*>(data);
+	}
+
+	uint64_t capacity() const
+	{
+		return map_size_;
+	}
+
+	const char* data(uint64_t offset) const
+	{
+		return map_+offset;
+	}
+
+	//Reads the records from the footer, false if there's no valid one
+	bool load_footer(std::vector<log_record_t> &res)
+	{
+		const uint64_t file=file_size();
+		if (file<trailer_size)
+			return false;
+		char trailer[trailer_size];
+		read_at(trailer, trailer_size, file-trailer_size);
+		const uint64_t offset=get_u64(trailer);
+		const uint32_t size=get_u32(trailer+8);
+		if (get_u64(trailer+16)!=log_footer_magic ||
+				offset+size+trailer_size!=file)
+			return false;
+		jstring_t footer(size, '\0');
+		read_at(&footer[0], size, offset);
+		if (checksum(footer.data(), size)!=get_u32(trailer+12))
+			return false;
+
+		for(size_t pos=0;pos<footer.size();)
+		{
+			log_record_t rec;
+			rec.removed_=footer[pos]!=0;
+			const uint32_t key_size=get_u32(&footer[pos+1]);
+			rec.value_size_=get_u32(&footer[pos+5]);
+			rec.value_offset_=get_u64(&footer[pos+9]);
+			rec.key_.assign(footer, pos+17, key_size);
+			pos+=17+key_size;
+			res.push_back(rec);
+		}
+		size_=offset;
+		sealed_=true;
+		return true;
+	}
+
+	//Decodes the frames from the map, stops at the first torn one.
+	//Returns the end of the last whole frame.
+	uint64_t scan(std::vector<log_record_t> &res, uint64_t limit) const
+	{
+		uint64_t pos=0;
+		while(pos+frame_header_size<=limit)
+		{
+			const uint32_t size=get_u32(data(pos+4));
+			if (!size || pos+frame_header_size+size>limit ||
+					checksum(data(pos+frame_header_size), size)!=
+					get_u32(data(pos)))
+				break;
+			for(uint64_t cur=pos+frame_header_size,
+				end=cur+size;cur<end;)
+			{
+				log_record_t rec;
+				rec.removed_=*data(cur)!=0;
+				const uint32_t key_size=get_u32(data(cur+1));
+				rec.value_size_=get_u32(data(cur+5));
+				rec.key_.assign(data(cur+record_header_size), key_size);
+				rec.value_offset_=cur+record_header_size+key_size;
+				cur=rec.value_offset_+rec.value_size_;
+				res.push_back(rec);
+			}
+			pos+=frame_header_size+size;
+		}
+		return pos;
+	}
+
+	//Drops whatever follows the last whole frame
+	void truncate()
+	{
+		if (ftruncate(fd_, size_))
+			err(result_code_t::sError) << "Can't truncate " << path_ << ": "
+									   << strerror(errno);
+	}
+
+	void add_to_footer(const log_record_t &rec)
+	{
+		footer_.push_back(rec.removed_ ? 1 : 0);
+		put_u32(footer_, rec.key_.size());
+		put_u32(footer_, rec.value_size_);
+		put_u64(footer_, rec.value_offset_);
+		footer_.append(rec.key_);
+	}
+
+	//Returns the offset of the frame
+	uint64_t append(const jstring_t &frame)
+	{
+		write_at(frame.data(), frame.size(), size_);
+		const uint64_t res=size_;
+		size_+=frame.size();
+		return res;
+	}
+
+	void sync()
+	{
+		if (fdatasync(fd_))
+			err(result_code_t::sError) << "Can't sync " << path_ << ": "
+									   << strerror(errno);
+	}
+
+	void seal()
+	{
+		jstring_t trailer;
+		put_u64(trailer, size_);
+		put_u32(trailer, footer_.size());
+		put_u32(trailer, checksum(footer_.data(), footer_.size()));
+		put_u64(trailer, log_footer_magic);
+		write_at(footer_.data(), footer_.size(), size_);
+		write_at(trailer.data(), trailer.size(), size_+footer_.size());
+		sync();
+		jstring_t().swap(footer_);
+		sealed_=true;
+	}
+private:
+	void read_at(char *buf, size_t size, uint64_t offset)
+	{
+		if (pread(fd_, buf, size, offset)!=ssize_t(size))
+			err(result_code_t::sError) << "Can't read " << path_ << ": "
+									   << strerror(errno);
+	}
+
+	void write_at(const char *buf, size_t size, uint64_t offset)
+	{
+		while(size)
+		{
+			const ssize_t res=pwrite(fd_, buf, size, offset);
+			if (res<0)
+				err(result_code_t::sError) << "Can't write " << path_ << ": "
+										   << strerror(errno);
+			buf+=res;
+			size-=res;
+			offset+=res;
+		}
+	}
+};
+
+typedef boost::shared_ptr<log_segment_t> segment_ptr;
+typedef std::map<uint32_t, segment_ptr> segment_map_t;
+
+class log_snapshot_t : public snapshot_t
+{
+public:
+	snapshot_t *index_snap_;
+	segment_map_t segments_;
+};
+
+class log_iterator_t : public storage_iterator_t
+{
+	//The segments the index may point at
+	segment_map_t segments_;
+	std::auto_ptr<storage_iterator_t> index_;
+public:
+	log_iterator_t(const segment_map_t &segments,
+				   std::auto_ptr<storage_iterator_t> index) :
+		segments_(segments), index_(index)
+	{
+	}
+
+	virtual bool valid() const
+	{
+		return index_->valid();
+	}
+
+	virtual void seek(const jstring_t &key)
+	{
+		index_->seek(key);
+	}
+
+	virtual void seek_to_last()
+	{
+		index_->seek_to_last();
+	}
+
+	virtual void next()
+	{
+		index_->next();
+	}
+
+	virtual void prev()
+	{
+		index_->prev();
+	}
+
+	virtual jstring_t key() const
+	{
+		return index_->key();
+	}
+
+	virtual jstring_t value() const
+	{
+		const log_location_t loc=decode_location(index_->value());
+		auto seg=segments_.find(loc.segment_);
+		assert(seg!=segments_.end());
+		return jstring_t(seg->second->data(loc.offset_), loc.size_);
+	}
+};
+
+/**
+	Append-only store: every write batch is one frame appended to the
+	active segment file, and an in-memory ordered index maps the keys
+	to the places of their values. A read is an index lookup and a
+	copy out of the mapped segment, a write is a single append.
+
+	The index is the memory backend, so the snapshots and iterators of
+	the index carry over. It's rebuilt at startup from the footers of
+	the sealed segments, only the active one is scanned.
+
+	A background thread rewrites the live records of the segments that
+	are mostly garbage into the active segment and drops the files.
+	A removal is kept in a tombstone as long as an older segment may
+	hold a value of the key.
+  */
+class log_backend_t : public storage_backend_t
+{
+	jstring_t dir_;
+	bool temporary_;
+	storage_options_t opts_;
+	storage_backend_ptr_t index_;
+
+	//Guards the map only, segments are used through their references
+	std::mutex segments_mutex_;
+	segment_map_t segments_;
+
+	std::mutex write_mutex_;
+	segment_ptr active_;
+	uint32_t next_id_;
+
+	std::mutex compactor_mutex_;
+	std::condition_variable wakeup_;
+	std::atomic<bool> stop_;
+	bool requested_;
+	std::thread compactor_;
+public:
+	log_backend_t(const jstring_t &dir, bool temporary,
+				  const storage_options_t &opts) : dir_(dir),
+		temporary_(temporary), opts_(opts), index_(make_memory_backend()),
+		next_id_(1), stop_(false), requested_(false)
+	{
+		if (mkdir(dir_.c_str(), 0755) && errno!=EEXIST)
+			err(result_code_t::sError) << "Can't create " << dir_ << ": "
+									   << strerror(errno);
+		recover();
+		compactor_=std::thread([this]{ run_compactor(); });
+	}
+
+	~log_backend_t()
+	{
+		{
+			std::lock_guard<std::mutex> lock(compactor_mutex_);
+			stop_=true;
+		}
+		wakeup_.notify_all();
+		compactor_.join();
+
+		if (temporary_)
+			for(auto i=segments_.begin(), iend=segments_.end(); i!=iend; ++i)
+				i->second->obsolete_=true;
+		active_.reset();
+		segments_.clear();
+		if (temporary_)
+			rmdir(dir_.c_str());
+	}
+
+	virtual bool get(const jstring_t &key, jstring_t *res, snapshot_t *snap)
+	{
+		if (snap)
+		{
+			log_snapshot_t *ls=static_cast<log_snapshot_t*>(snap);
+			jstring_t loc;
+			if (!index_->get(key, &loc, ls->index_snap_))
+				return false;
+			read(ls->segments_, decode_location(loc), res);
+			return true;
+		}
+
+		for(;;)
+		{
+			jstring_t loc;
+			if (!index_->get(key, &loc))
+				return false;
+			const log_location_t where=decode_location(loc);
+			segment_ptr seg=find_segment(where.segment_);
+			//Moved by the compactor meanwhile, the index has the new place
+			if (!seg)
+				continue;
+			res->assign(seg->data(where.offset_), where.size_);
+			return true;
+		}
+	}
+
+	virtual void put(const jstring_t &key, const jstring_t &val, bool sync)
+	{
+		pending_map_t writes;
+		pending_write_t &w=writes[key];
+		w.removed_=false;
+		w.value_=val;
+		write(writes, sync);
+	}
+
+	virtual void remove(const jstring_t &key, bool sync)
+	{
+		pending_map_t writes;
+		writes[key].removed_=true;
+		write(writes, sync);
+	}
+
+	virtual void write(const pending_map_t &writes, bool sync)
+	{
+		std::vector<log_write_t> records;
+		records.reserve(writes.size());
+		std::lock_guard<std::mutex> lock(write_mutex_);
+		for(auto i=writes.begin(), iend=writes.end(); i!=iend; ++i)
+		{
+			jstring_t old;
+			const bool existed=index_->get(i->first, &old);
+			//Any older value is already hidden by a tombstone
+			if (!existed && i->second.removed_)
+				continue;
+			if (existed)
+				mark_dead(i->first, decode_location(old));
+
+			log_write_t w;
+			w.key_=&i->first;
+			w.removed_=i->second.removed_;
+			w.value_=i->second.value_.data();
+			w.value_size_=i->second.value_.size();
+			records.push_back(w);
+		}
+		append(records, sync);
+	}
+
+	virtual std::auto_ptr<storage_iterator_t> iterate(snapshot_t *snap)
+	{
+		if (snap)
+		{
+			log_snapshot_t *ls=static_cast<log_snapshot_t*>(snap);
+			return std::auto_ptr<storage_iterator_t>(new log_iterator_t(
+				ls->segments_, index_->iterate(ls->index_snap_)));
+		}
+		//Segments are dropped after the index stops pointing at them,
+		//under this lock
+		std::lock_guard<std::mutex> lock(segments_mutex_);
+		return std::auto_ptr<storage_iterator_t>(
+			new log_iterator_t(segments_, index_->iterate()));
+	}
+
+	virtual snapshot_t* snapshot()
+	{
+		std::auto_ptr<log_snapshot_t> res(new log_snapshot_t());
+		std::lock_guard<std::mutex> lock(segments_mutex_);
+		res->segments_=segments_;
+		res->index_snap_=index_->snapshot();
+		return res.release();
+	}
+
+	virtual void release_snapshot(snapshot_t *snap)
+	{
+		log_snapshot_t *ls=static_cast<log_snapshot_t*>(snap);
+		index_->release_snapshot(ls->index_snap_);
+		delete ls;
+	}
+
+	//The segments are compacted on their own, this only nudges it
+	virtual void compact_range(const jstring_t &start, const jstring_t &limit)
+	{
+		index_->compact_range(start, limit);
+		{
+			std::lock_guard<std::mutex> lock(compactor_mutex_);
+			requested_=true;
+		}
+		wakeup_.notify_all();
+	}
+
+	virtual uint64_t approximate_size(const jstring_t &start,
+									  const jstring_t &limit)
+	{
+		uint64_t res=0;
+		std::auto_ptr<storage_iterator_t> it=index_->iterate();
+		for(it->seek(start); it->valid(); it->next())
+		{
+			const jstring_t key=it->key();
+			if (key>=limit)
+				break;
+			res+=record_header_size+key.size()+
+					decode_location(it->value()).size_;
+		}
+		return res;
+	}
+
+	//Faults the mapped values in
+	virtual uint64_t warm_range(const jstring_t &start, const jstring_t &limit,
+								uint64_t max_bytes)
+	{
+		uint64_t res=0;
+		std::auto_ptr<storage_iterator_t> it=iterate(0);
+		for(it->seek(start); it->valid() && res<max_bytes; it->next())
+		{
+			const jstring_t key=it->key();
+			if (key>=limit)
+				break;
+			res+=key.size()+it->value().size();
+		}
+		return res;
+	}
+
+	virtual void get_stats(engine_stats_t &res)
+	{
+		index_->get_stats(res);
+		std::lock_guard<std::mutex> lock(segments_mutex_);
+		for(auto i=segments_.begin(), iend=segments_.end(); i!=iend; ++i)
+		{
+			char line[128];
+			snprintf(line, sizeof(line), "segment %u%s: %llu bytes, %llu dead, "
+					 "%llu in tombstones\n", i->first,
+					 i->second->sealed_ ? "" : " (active)",
+					 (unsigned long long)i->second->bytes_.load(),
+					 (unsigned long long)i->second->dead_bytes_.load(),
+					 (unsigned long long)i->second->tombstone_bytes_.load());
+			res.raw_stats_.append(line);
+		}
+	}
+private:
+	jstring_t segment_path(uint32_t id) const
+	{
+		char name[32];
+		snprintf(name, sizeof(name), "/%08u.log", id);
+		return dir_+name;
+	}
+
+	segment_ptr find_segment(uint32_t id)
+	{
+		std::lock_guard<std::mutex> lock(segments_mutex_);
+		auto pos=segments_.find(id);
+		return pos==segments_.end() ? segment_ptr() : pos->second;
+	}
+
+	static void read(const segment_map_t &segments, const log_location_t &loc,
+					 jstring_t *res)
+	{
+		auto seg=segments.find(loc.segment_);
+		assert(seg!=segments.end());
+		res->assign(seg->second->data(loc.offset_), loc.size_);
+	}
+
+	void mark_dead(const jstring_t &key, const log_location_t &loc)
+	{
+		segment_ptr seg=find_segment(loc.segment_);
+		if (seg)
+			seg->dead_bytes_+=record_header_size+key.size()+loc.size_;
+	}
+
+	//Writers only. Returns the segment with room for 'size' bytes more.
+	log_segment_t* segment_for(uint64_t size)
+	{
+		if (active_ && active_->size_+size<=active_->capacity())
+			return active_.get();
+		if (active_)
+			active_->seal();
+
+		segment_ptr seg(new log_segment_t(next_id_, segment_path(next_id_)));
+		++next_id_;
+		seg->map(std::max(opts_.segment_size_, size));
+		{
+			std::lock_guard<std::mutex> lock(segments_mutex_);
+			segments_[seg->id_]=seg;
+		}
+		active_=seg;
+		return seg.get();
+	}
+
+	//Writers only. Appends the records in one frame and points the index
+	//at them.
+	void append(const std::vector<log_write_t> &records, bool sync)
+	{
+		if (records.empty())
+			return;
+		jstring_t frame(frame_header_size, '\0');
+		for(auto i=records.begin(), iend=records.end(); i!=iend; ++i)
+		{
+			frame.push_back(i->removed_ ? 1 : 0);
+			put_u32(frame, i->key_->size());
+			put_u32(frame, i->value_size_);
+			frame.append(*i->key_);
+			frame.append(i->value_, i->value_size_);
+		}
+		const uint32_t payload=frame.size()-frame_header_size;
+		const uint32_t crc=checksum(frame.data()+frame_header_size, payload);
+		memcpy(&frame[0], &crc, sizeof(crc));
+		memcpy(&frame[4], &payload, sizeof(payload));
+
+		log_segment_t *seg=segment_for(frame.size());
+		uint64_t pos=seg->append(frame)+frame_header_size;
+		if (sync)
+			seg->sync();
+
+		pending_map_t index;
+		for(auto i=records.begin(), iend=records.end(); i!=iend; ++i)
+		{
+			log_record_t rec;
+			rec.removed_=i->removed_;
+			rec.key_=*i->key_;
+			rec.value_offset_=pos+record_header_size+rec.key_.size();
+			rec.value_size_=i->value_size_;
+			pos=rec.value_offset_+rec.value_size_;
+			seg->add_to_footer(rec);
+			seg->bytes_+=rec.footprint();
+			if (rec.removed_)
+				seg->tombstone_bytes_+=rec.footprint();
+
+			pending_write_t &w=index[rec.key_];
+			w.removed_=rec.removed_;
+			if (!rec.removed_)
+			{
+				const log_location_t loc={seg->id_, rec.value_size_,
+										  rec.value_offset_};
+				w.value_=encode_location(loc);
+			}
+		}
+		index_->write(index, false);
+	}
+
+	void recover()
+	{
+		std::vector<uint32_t> ids;
+		if (DIR *dir=opendir(dir_.c_str()))
+		{
+			while(struct dirent *entry=readdir(dir))
+			{
+				unsigned id;
+				char tail;
+				if (sscanf(entry->d_name, "%u.lo%c", &id, &tail)==2 &&
+						tail=='g')
+					ids.push_back(id);
+			}
+			closedir(dir);
+		}
+		std::sort(ids.begin(), ids.end());
+
+		for(size_t f=0;f<ids.size();++f)
+		{
+			segment_ptr seg(new log_segment_t(ids[f], segment_path(ids[f])));
+			std::vector<log_record_t> records;
+			if (!seg->load_footer(records))
+			{
+				//Torn by a crash: the last frame may be partial and a
+				//sealed segment may lack its footer
+				seg->map(seg->file_size());
+				seg->size_=seg->scan(records, seg->capacity());
+				seg->truncate();
+				for(auto r=records.begin(), rend=records.end(); r!=rend; ++r)
+					seg->add_to_footer(*r);
+				if (f+1<ids.size())
+					seg->seal();
+			}
+			seg->map(seg->sealed_ ? seg->size_ :
+					 std::max(opts_.segment_size_, seg->size_));
+			segments_[seg->id_]=seg;
+			replay(seg.get(), records);
+			if (!seg->sealed_)
+				active_=seg;
+			next_id_=ids[f]+1;
+		}
+	}
+
+	void replay(log_segment_t *seg, const std::vector<log_record_t> &records)
+	{
+		pending_map_t index;
+		for(auto r=records.begin(), rend=records.end(); r!=rend; ++r)
+		{
+			seg->bytes_+=r->footprint();
+			if (r->removed_)
+				seg->tombstone_bytes_+=r->footprint();
+
+			//The value this record replaces, if any
+			jstring_t old;
+			auto pending=index.find(r->key_);
+			if (pending!=index.end())
+			{
+				if (!pending->second.removed_)
+					old=pending->second.value_;
+			} else
+				index_->get(r->key_, &old);
+			if (!old.empty())
+				mark_dead(r->key_, decode_location(old));
+
+			pending_write_t &w=index[r->key_];
+			w.removed_=r->removed_;
+			w.value_.clear();
+			if (!r->removed_)
+			{
+				const log_location_t loc={seg->id_, r->value_size_,
+										  r->value_offset_};
+				w.value_=encode_location(loc);
+			}
+		}
+		index_->write(index, false);
+	}
+
+	void run_compactor()
+	{
+		std::unique_lock<std::mutex> lock(compactor_mutex_);
+		while(!stop_)
+		{
+			requested_=false;
+			lock.unlock();
+			try
+			{
+				while(!stop_)
+				{
+					segment_ptr seg=pick_garbage();
+					if (!seg || !compact_segment(seg))
+						break;
+				}
+			} catch(const std::exception &ex)
+			{
+				LOG(ERROR) << "Compaction of " << dir_ << " failed: "
+						   << ex.what();
+			}
+			lock.lock();
+			wakeup_.wait_for(lock, std::chrono::seconds(
+				opts_.compaction_check_sec_),
+				[this]{ return stop_ || requested_; });
+		}
+	}
+
+	//The oldest sealed segment that is mostly garbage
+	segment_ptr pick_garbage()
+	{
+		std::lock_guard<std::mutex> lock(segments_mutex_);
+		bool oldest=true;
+		for(auto i=segments_.begin(), iend=segments_.end(); i!=iend; ++i)
+		{
+			const log_segment_t &seg=*i->second;
+			if (!seg.sealed_)
+				break;
+			//Tombstones of the oldest segment have nothing left to hide
+			const uint64_t garbage=seg.dead_bytes_+
+					(oldest ? uint64_t(seg.tombstone_bytes_) : 0);
+			if (seg.bytes_ && garbage>=seg.bytes_*opts_.garbage_ratio_)
+				return i->second;
+			oldest=false;
+		}
+		return segment_ptr();
+	}
+
+	//Returns false if it has been stopped halfway
+	bool compact_segment(const segment_ptr &seg)
+	{
+		std::vector<log_record_t> records;
+		seg->scan(records, seg->size_);
+		bool oldest;
+		{
+			std::lock_guard<std::mutex> lock(segments_mutex_);
+			oldest=segments_.begin()->first==seg->id_;
+		}
+
+		io_throttle_t throttle(opts_.compaction_bytes_per_sec_);
+		uint64_t moved=0;
+		for(size_t f=0;f<records.size();)
+		{
+			if (stop_)
+				return false;
+			uint64_t chunk=0;
+			{
+				std::lock_guard<std::mutex> lock(write_mutex_);
+				std::vector<log_write_t> live;
+				for(;f<records.size() && chunk<log_compaction_chunk;++f)
+				{
+					const log_record_t &rec=records[f];
+					chunk+=rec.footprint();
+					jstring_t cur;
+					const bool indexed=index_->get(rec.key_, &cur);
+					if (rec.removed_)
+					{
+						//A newer value shadows the older ones anyway
+						if (oldest || indexed)
+							continue;
+					} else
+					{
+						const log_location_t here={seg->id_, rec.value_size_,
+												   rec.value_offset_};
+						if (!indexed || !(decode_location(cur)==here))
+							continue;
+					}
+					log_write_t w;
+					w.key_=&rec.key_;
+					w.removed_=rec.removed_;
+					w.value_=seg->data(rec.value_offset_);
+					w.value_size_=rec.value_size_;
+					live.push_back(w);
+					moved+=rec.footprint();
+				}
+				append(live, false);
+			}
+			throttle.consume(chunk);
+		}
+
+		{
+			//The copies must be durable before the originals are gone
+			std::lock_guard<std::mutex> lock(write_mutex_);
+			if (active_)
+				active_->sync();
+		}
+		{
+			std::lock_guard<std::mutex> lock(segments_mutex_);
+			segments_.erase(seg->id_);
+		}
+		seg->obsolete_=true;
+		VLOG_MACRO(1) << "Compacted the segment " << seg->path_ << ", moved "
+					  << moved << " of " << seg->bytes_ << " bytes"
+					  << std::endl;
+		return true;
+	}
+};
+
+storage_backend_ptr_t sofadb::make_log_backend(const jstring_t &dir,
+	bool temporary, const storage_options_t &opts)
+{
+	return storage_backend_ptr_t(new log_backend_t(dir, temporary, opts));
+}
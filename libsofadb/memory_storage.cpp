@@ -0,0 +1,619 @@
+#include "storage_backend.h"
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <mutex>
+#include <new>
+#include <set>
+#include <thread>
+
+using namespace sofadb;
+
+//The skiplist of leveldb's memtable
+static const int max_height = 12;
+static const uint32_t branching = 4;
+//Readers that can be in flight at once, more of them wait for a slot
+static const size_t reader_slots = 1024;
+//Overwritten keys are trimmed of their old versions in groups of that size
+static const size_t trim_batch = 256;
+//Marks a slot being taken by a reader that hasn't picked its sequence yet
+static const uint64_t claimed_seq = ~uint64_t(0);
+
+/**
+	Versions of a key are chained from the newest to the oldest. Only the
+	link to the older versions ever changes, when they get trimmed.
+  */
+struct mem_version_t
+{
+	const uint64_t seq_;
+	const bool removed_;
+	const jstring_t value_;
+	std::atomic<mem_version_t*> older_;
+
+	mem_version_t(uint64_t seq, bool removed, const jstring_t &value,
+				  mem_version_t *older) :
+		seq_(seq), removed_(removed), value_(value), older_(older) {}
+
+	size_t footprint() const
+	{
+		return sizeof(mem_version_t)+value_.size();
+	}
+};
+
+struct mem_node_t
+{
+	const jstring_t key_;
+	std::atomic<mem_version_t*> versions_;
+	const int height_;
+	//height_ links, the node is allocated with room for them
+	std::atomic<mem_node_t*> next_[1];
+
+	static mem_node_t* create(const jstring_t &key, int height)
+	{
+		void *mem=operator new(sizeof(mem_node_t)+
+							   sizeof(std::atomic<mem_node_t*>)*(height-1));
+		return new(mem) mem_node_t(key, height);
+	}
+
+	//Returns the number of the released bytes
+	static size_t destroy(mem_node_t *node)
+	{
+		size_t res=node->footprint();
+		for(mem_version_t *v=node->versions_.load(std::memory_order_relaxed);
+			v;)
+		{
+			mem_version_t *older=v->older_.load(std::memory_order_relaxed);
+			res+=v->footprint();
+			delete v;
+			v=older;
+		}
+		node->~mem_node_t();
+		operator delete(node);
+		return res;
+	}
+
+	mem_node_t* next(int level) const
+	{
+		return next_[level].load(std::memory_order_acquire);
+	}
+
+	void set_next(int level, mem_node_t *node)
+	{
+		next_[level].store(node, std::memory_order_release);
+	}
+
+	//The newest version written at 'seq' or before
+	const mem_version_t* visible(uint64_t seq) const
+	{
+		const mem_version_t *v=versions_.load(std::memory_order_acquire);
+		while(v && v->seq_>seq)
+			v=v->older_.load(std::memory_order_acquire);
+		return v;
+	}
+
+	size_t footprint() const
+	{
+		return sizeof(mem_node_t)+
+				sizeof(std::atomic<mem_node_t*>)*(height_-1)+key_.size();
+	}
+private:
+	mem_node_t(const jstring_t &key, int height) :
+		key_(key), versions_(0), height_(height)
+	{
+		for(int f=0;f<height;++f)
+			next_[f].store(0, std::memory_order_relaxed);
+	}
+};
+
+class mem_snapshot_t : public snapshot_t
+{
+public:
+	const uint64_t seq_;
+	const std::multiset<uint64_t>::iterator pos_;
+
+	mem_snapshot_t(uint64_t seq, std::multiset<uint64_t>::iterator pos) :
+		seq_(seq), pos_(pos) {}
+};
+
+/**
+	Ordered in-memory store, for the data that doesn't need to survive
+	the engine. It's the skiplist of leveldb's memtable: writers are
+	serialized by a mutex while readers never lock. Every write is
+	stamped with a sequence number and the keys keep chains of their
+	versions, so a batch becomes visible at once and snapshots and
+	iterators see the store as of their sequence.
+
+	Readers announce their sequence in a slot for as long as they hold
+	pointers into the list. The writers trim the versions that are
+	older than what the oldest reader and snapshot can see, and the
+	removed keys are unlinked by compact_range(), which waits until the
+	readers that could still stand on them are gone.
+  */
+class memory_backend_t : public storage_backend_t
+{
+	struct reader_slot_t
+	{
+		//0 if the slot is free
+		std::atomic<uint64_t> seq_;
+		//Changes every time the slot is taken
+		std::atomic<uint64_t> generation_;
+		char padding_[64-2*sizeof(uint64_t)];
+	};
+
+	mem_node_t *head_;
+	std::atomic<int> height_;
+	//The last sequence readers may see, writes past it are in flight
+	std::atomic<uint64_t> visible_seq_;
+	std::atomic<uint64_t> bytes_;
+	reader_slot_t slots_[reader_slots];
+
+	std::mutex snapshots_mutex_;
+	std::multiset<uint64_t> snapshots_;
+
+	std::mutex write_mutex_;
+	uint64_t last_seq_;
+	uint32_t random_;
+	std::vector<mem_node_t*> overwritten_;
+public:
+	memory_backend_t() : head_(mem_node_t::create(jstring_t(), max_height)),
+		height_(1), visible_seq_(1), bytes_(), last_seq_(1),
+		random_(0xdeadbeef)
+	{
+		//Sequence 0 marks the free slots, so the writes start at 2
+		for(size_t f=0;f<reader_slots;++f)
+		{
+			slots_[f].seq_.store(0, std::memory_order_relaxed);
+			slots_[f].generation_.store(0, std::memory_order_relaxed);
+		}
+	}
+
+	~memory_backend_t()
+	{
+		for(mem_node_t *node=head_; node;)
+		{
+			mem_node_t *next=node->next(0);
+			mem_node_t::destroy(node);
+			node=next;
+		}
+	}
+
+	//Returns the slot, 'seq' is set to the sequence the reader may see
+	size_t pin(uint64_t &seq)
+	{
+		const size_t start=std::hash<std::thread::id>()(
+			std::this_thread::get_id());
+		for(size_t f=0;;++f)
+		{
+			if (f && f%reader_slots==0)
+				std::this_thread::yield();
+			const size_t idx=(start+f)%reader_slots;
+			reader_slot_t &slot=slots_[idx];
+			uint64_t expected=0;
+			if (slot.seq_.load(std::memory_order_relaxed)!=0 ||
+					!slot.seq_.compare_exchange_strong(expected, claimed_seq))
+				continue;
+			slot.generation_.fetch_add(1);
+			//The sequence must still be the visible one after it has been
+			//announced, or a writer could have missed it while trimming
+			for(;;)
+			{
+				seq=visible_seq_.load();
+				slot.seq_.store(seq);
+				if (visible_seq_.load()==seq)
+					return idx;
+			}
+		}
+	}
+
+	void unpin(size_t slot)
+	{
+		slots_[slot].seq_.store(0, std::memory_order_release);
+	}
+
+	mem_node_t* find_greater_or_equal(const jstring_t &key,
+									  mem_node_t **prev) const
+	{
+		mem_node_t *x=head_;
+		for(int level=height_.load(std::memory_order_relaxed)-1;;)
+		{
+			mem_node_t *next=x->next(level);
+			if (next && next->key_<key)
+				x=next;
+			else
+			{
+				if (prev)
+					prev[level]=x;
+				if (!level)
+					return next;
+				--level;
+			}
+		}
+	}
+
+	//Returns 0 if there's no such node
+	mem_node_t* find_less_than(const jstring_t &key) const
+	{
+		mem_node_t *x=head_;
+		for(int level=height_.load(std::memory_order_relaxed)-1;;)
+		{
+			mem_node_t *next=x->next(level);
+			if (next && next->key_<key)
+				x=next;
+			else if (!level)
+				return x==head_ ? 0 : x;
+			else
+				--level;
+		}
+	}
+
+	mem_node_t* find_last() const
+	{
+		mem_node_t *x=head_;
+		for(int level=height_.load(std::memory_order_relaxed)-1;;)
+		{
+			mem_node_t *next=x->next(level);
+			if (next)
+				x=next;
+			else if (!level)
+				return x==head_ ? 0 : x;
+			else
+				--level;
+		}
+	}
+
+	virtual bool get(const jstring_t &key, jstring_t *res, snapshot_t *snap)
+	{
+		uint64_t seq;
+		const size_t slot=pin(seq);
+		if (snap)
+			seq=static_cast<mem_snapshot_t*>(snap)->seq_;
+		const mem_node_t *node=find_greater_or_equal(key, 0);
+		const mem_version_t *v=0;
+		if (node && node->key_==key)
+			v=node->visible(seq);
+		const bool found=v && !v->removed_;
+		if (found)
+			*res=v->value_;
+		unpin(slot);
+		return found;
+	}
+
+	virtual void put(const jstring_t &key, const jstring_t &val, bool)
+	{
+		std::lock_guard<std::mutex> lock(write_mutex_);
+		const uint64_t seq=++last_seq_;
+		apply(key, false, val, seq);
+		publish(seq);
+	}
+
+	virtual void remove(const jstring_t &key, bool)
+	{
+		std::lock_guard<std::mutex> lock(write_mutex_);
+		const uint64_t seq=++last_seq_;
+		apply(key, true, jstring_t(), seq);
+		publish(seq);
+	}
+
+	virtual void write(const pending_map_t &writes, bool)
+	{
+		std::lock_guard<std::mutex> lock(write_mutex_);
+		const uint64_t seq=++last_seq_;
+		for(auto i=writes.begin(), iend=writes.end(); i!=iend; ++i)
+			apply(i->first, i->second.removed_, i->second.value_, seq);
+		publish(seq);
+	}
+
+	virtual std::auto_ptr<storage_iterator_t> iterate(snapshot_t *snap);
+
+	virtual snapshot_t* snapshot()
+	{
+		//The slot protects the versions until the snapshot is registered
+		uint64_t seq;
+		const size_t slot=pin(seq);
+		std::multiset<uint64_t>::iterator pos;
+		{
+			std::lock_guard<std::mutex> lock(snapshots_mutex_);
+			pos=snapshots_.insert(seq);
+		}
+		unpin(slot);
+		return new mem_snapshot_t(seq, pos);
+	}
+
+	virtual void release_snapshot(snapshot_t *snap)
+	{
+		{
+			std::lock_guard<std::mutex> lock(snapshots_mutex_);
+			snapshots_.erase(static_cast<mem_snapshot_t*>(snap)->pos_);
+		}
+		delete snap;
+	}
+
+	/**
+		Unlinks the removed keys of the range. The memory is released
+		once the readers that were in flight are done, so the caller
+		must not hold an iterator of this store.
+	  */
+	virtual void compact_range(const jstring_t &start, const jstring_t &limit)
+	{
+		std::vector<mem_node_t*> unlinked;
+		{
+			std::lock_guard<std::mutex> lock(write_mutex_);
+			const uint64_t oldest=oldest_visible();
+			trim_overwritten(oldest);
+
+			mem_node_t *prev[max_height];
+			mem_node_t *node=find_greater_or_equal(start, prev);
+			while(node && node->key_<limit)
+			{
+				mem_node_t *next=node->next(0);
+				trim(node, oldest);
+				const mem_version_t *newest=
+						node->versions_.load(std::memory_order_relaxed);
+				if (newest->removed_ && newest->seq_<=oldest)
+				{
+					//Readers standing on the node still get off it
+					//through its own links
+					for(int f=0;f<node->height_;++f)
+						prev[f]->set_next(f, node->next(f));
+					unlinked.push_back(node);
+				} else
+				{
+					for(int f=0;f<node->height_;++f)
+						prev[f]=node;
+				}
+				node=next;
+			}
+		}
+		if (unlinked.empty())
+			return;
+
+		wait_for_readers();
+		for(auto i=unlinked.begin(), iend=unlinked.end(); i!=iend; ++i)
+			bytes_-=mem_node_t::destroy(*i);
+	}
+
+	virtual uint64_t approximate_size(const jstring_t &start,
+									  const jstring_t &limit)
+	{
+		uint64_t seq, res=0;
+		const size_t slot=pin(seq);
+		for(const mem_node_t *node=find_greater_or_equal(start, 0);
+			node && node->key_<limit; node=node->next(0))
+		{
+			const mem_version_t *v=node->visible(seq);
+			if (v && !v->removed_)
+				res+=node->key_.size()+v->value_.size();
+		}
+		unpin(slot);
+		return res;
+	}
+
+	//Everything is in memory already
+	virtual uint64_t warm_range(const jstring_t&, const jstring_t&, uint64_t)
+	{
+		return 0;
+	}
+
+	virtual void get_stats(engine_stats_t &res)
+	{
+		//Everything is in the 'memtable'
+		res.memtable_bytes_=bytes_.load(std::memory_order_relaxed);
+	}
+private:
+	int random_height()
+	{
+		int height=1;
+		while(height<max_height)
+		{
+			//The Park-Miller generator of leveldb's util/random.h
+			random_=uint32_t(uint64_t(random_)*16807%2147483647);
+			if (random_%branching)
+				break;
+			++height;
+		}
+		return height;
+	}
+
+	//Writers only
+	void apply(const jstring_t &key, bool removed, const jstring_t &value,
+			   uint64_t seq)
+	{
+		mem_node_t *prev[max_height];
+		mem_node_t *node=find_greater_or_equal(key, prev);
+		if (node && node->key_==key)
+		{
+			mem_version_t *v=new mem_version_t(seq, removed, value,
+				node->versions_.load(std::memory_order_relaxed));
+			bytes_+=v->footprint();
+			node->versions_.store(v, std::memory_order_release);
+			overwritten_.push_back(node);
+			return;
+		}
+		if (removed)
+			return;
+
+		const int height=random_height();
+		const int cur_height=height_.load(std::memory_order_relaxed);
+		for(int f=cur_height;f<height;++f)
+			prev[f]=head_;
+		//Readers that see the new height before the links just go down
+		//from the head
+		if (height>cur_height)
+			height_.store(height, std::memory_order_relaxed);
+
+		node=mem_node_t::create(key, height);
+		mem_version_t *v=new mem_version_t(seq, false, value, 0);
+		node->versions_.store(v, std::memory_order_relaxed);
+		bytes_+=node->footprint()+v->footprint();
+		for(int f=0;f<height;++f)
+		{
+			node->next_[f].store(prev[f]->next_[f].load(
+				std::memory_order_relaxed), std::memory_order_relaxed);
+			prev[f]->set_next(f, node);
+		}
+	}
+
+	void publish(uint64_t seq)
+	{
+		visible_seq_.store(seq);
+		if (overwritten_.size()>=trim_batch)
+			trim_overwritten(oldest_visible());
+	}
+
+	//The oldest sequence a reader or a snapshot may still see
+	uint64_t oldest_visible()
+	{
+		//Readers announced after the scan of their slot see at least
+		//the sequence loaded here. The snapshots are checked last: a
+		//snapshot registered after that is still in its reader slot.
+		uint64_t res=visible_seq_.load();
+		for(size_t f=0;f<reader_slots;++f)
+		{
+			const uint64_t seq=slots_[f].seq_.load();
+			if (seq && seq<res)
+				res=seq;
+		}
+		std::lock_guard<std::mutex> lock(snapshots_mutex_);
+		if (!snapshots_.empty() && *snapshots_.begin()<res)
+			res=*snapshots_.begin();
+		return res;
+	}
+
+	void trim_overwritten(uint64_t oldest)
+	{
+		for(auto i=overwritten_.begin(), iend=overwritten_.end(); i!=iend; ++i)
+			trim(*i, oldest);
+		overwritten_.clear();
+	}
+
+	//Drops the versions hidden from every reader by a newer one
+	void trim(mem_node_t *node, uint64_t oldest)
+	{
+		mem_version_t *v=node->versions_.load(std::memory_order_relaxed);
+		while(v && v->seq_>oldest)
+			v=v->older_.load(std::memory_order_relaxed);
+		if (!v)
+			return;
+		mem_version_t *dropped=v->older_.load(std::memory_order_relaxed);
+		v->older_.store(0, std::memory_order_relaxed);
+		while(dropped)
+		{
+			mem_version_t *older=dropped->older_.load(
+				std::memory_order_relaxed);
+			bytes_-=dropped->footprint();
+			delete dropped;
+			dropped=older;
+		}
+	}
+
+	//Waits for the readers that were in flight at the time of the call
+	void wait_for_readers()
+	{
+		std::vector<uint64_t> generations(reader_slots);
+		std::vector<bool> busy(reader_slots);
+		for(size_t f=0;f<reader_slots;++f)
+		{
+			busy[f]=slots_[f].seq_.load()!=0;
+			generations[f]=slots_[f].generation_.load();
+		}
+		for(size_t f=0;f<reader_slots;++f)
+			while(busy[f] && slots_[f].seq_.load()!=0 &&
+				  slots_[f].generation_.load()==generations[f])
+				std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+};
+
+/**
+	Sees the store as of its creation, or of the snapshot. The slot is
+	held for the lifetime of the iterator.
+  */
+class mem_iterator_t : public storage_iterator_t
+{
+	memory_backend_t *owner_;
+	size_t slot_;
+	uint64_t seq_;
+	const mem_node_t *node_;
+	const mem_version_t *version_;
+public:
+	mem_iterator_t(memory_backend_t *owner, snapshot_t *snap) :
+		owner_(owner), node_(), version_()
+	{
+		slot_=owner_->pin(seq_);
+		if (snap)
+			seq_=static_cast<mem_snapshot_t*>(snap)->seq_;
+	}
+
+	~mem_iterator_t()
+	{
+		owner_->unpin(slot_);
+	}
+
+	virtual bool valid() const
+	{
+		return node_!=0;
+	}
+
+	virtual void seek(const jstring_t &key)
+	{
+		node_=owner_->find_greater_or_equal(key, 0);
+		settle_forward();
+	}
+
+	virtual void seek_to_last()
+	{
+		node_=owner_->find_last();
+		settle_backward();
+	}
+
+	virtual void next()
+	{
+		assert(node_);
+		node_=node_->next(0);
+		settle_forward();
+	}
+
+	virtual void prev()
+	{
+		assert(node_);
+		node_=owner_->find_less_than(node_->key_);
+		settle_backward();
+	}
+
+	virtual jstring_t key() const
+	{
+		return node_->key_;
+	}
+
+	virtual jstring_t value() const
+	{
+		return version_->value_;
+	}
+private:
+	bool settle()
+	{
+		version_=node_->visible(seq_);
+		return version_ && !version_->removed_;
+	}
+
+	void settle_forward()
+	{
+		while(node_ && !settle())
+			node_=node_->next(0);
+	}
+
+	void settle_backward()
+	{
+		while(node_ && !settle())
+			node_=owner_->find_less_than(node_->key_);
+	}
+};
+
+std::auto_ptr<storage_iterator_t> memory_backend_t::iterate(snapshot_t *snap)
+{
+	return std::auto_ptr<storage_iterator_t>(new mem_iterator_t(this, snap));
+}
+
+storage_backend_ptr_t sofadb::make_memory_backend()
+{
+	return storage_backend_ptr_t(new memory_backend_t());
+}
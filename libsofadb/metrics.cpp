@@ -0,0 +1,223 @@
+#include "metrics.h"
+#include <atomic>
+#include <mutex>
+#include <algorithm>
+
+using namespace sofadb;
+
+static const char *metric_names[metric_count_] = {
+	"put",
+	"put.revlog_read",
+	"put.encode",
+	"put.serialize",
+	"put.write",
+	"put.revlog_write",
+	"get",
+	"get.revlog_read",
+	"get.body_read",
+	"get.decode",
+	"merge",
+	"json.parse",
+	"json.serialize",
+	"server.request",
+};
+
+static const char *counter_names[counter_count_] = {
+	"put.conflicts",
+	"get.misses",
+	"json.parse_bytes",
+	"json.serialize_bytes",
+	"server.errors",
+};
+
+static size_t bucket_of(uint64_t ns)
+{
+	if (ns<histogram_sub_buckets)
+		return ns;
+	const size_t pow=63-__builtin_clzll(ns);
+	const size_t sub=(ns>>(pow-2)) & (histogram_sub_buckets-1);
+	return std::min((pow-1)*histogram_sub_buckets+sub, histogram_buckets-1);
+}
+
+static uint64_t bucket_upper_bound(size_t idx)
+{
+	if (idx<histogram_sub_buckets)
+		return idx;
+	const size_t pow=idx/histogram_sub_buckets+1;
+	const size_t sub=idx%histogram_sub_buckets;
+	return (uint64_t(1)<<pow)+(sub+1)*(uint64_t(1)<<(pow-2))-1;
+}
+
+/**
+	Only the owning thread writes into a block, so plain relaxed loads and
+	stores are enough and no read-modify-write is ever issued.
+  */
+struct thread_block_t
+{
+	std::atomic<uint64_t> buckets_[metric_count_][histogram_buckets];
+	std::atomic<uint64_t> sums_[metric_count_];
+	std::atomic<uint64_t> counters_[counter_count_];
+
+	thread_block_t()
+	{
+		for(size_t m=0;m<metric_count_;++m)
+		{
+			for(size_t b=0;b<histogram_buckets;++b)
+				buckets_[m][b].store(0, std::memory_order_relaxed);
+			sums_[m].store(0, std::memory_order_relaxed);
+		}
+		for(size_t c=0;c<counter_count_;++c)
+			counters_[c].store(0, std::memory_order_relaxed);
+	}
+
+	static void bump(std::atomic<uint64_t> &val, uint64_t delta)
+	{
+		val.store(val.load(std::memory_order_relaxed)+delta,
+				  std::memory_order_relaxed);
+	}
+};
+
+class metrics_registry
+{
+	std::mutex mutex_;
+	std::vector<thread_block_t*> live_;
+	//Totals of the threads that are gone
+	thread_block_t retired_;
+public:
+	static metrics_registry& instance()
+	{
+		//Never destroyed, threads may exit after the static destructors
+		static metrics_registry *res=new metrics_registry();
+		return *res;
+	}
+
+	void attach(thread_block_t *block)
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		live_.push_back(block);
+	}
+
+	void detach(thread_block_t *block)
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		add_block(retired_, *block);
+		live_.erase(std::remove(live_.begin(), live_.end(), block),
+					live_.end());
+	}
+
+	void snapshot(thread_block_t &res)
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		add_block(res, retired_);
+		for(auto i=live_.begin(), iend=live_.end(); i!=iend; ++i)
+			add_block(res, **i);
+	}
+private:
+	static void add_block(thread_block_t &to, const thread_block_t &from)
+	{
+		for(size_t m=0;m<metric_count_;++m)
+		{
+			for(size_t b=0;b<histogram_buckets;++b)
+				thread_block_t::bump(to.buckets_[m][b],
+					from.buckets_[m][b].load(std::memory_order_relaxed));
+			thread_block_t::bump(to.sums_[m],
+				from.sums_[m].load(std::memory_order_relaxed));
+		}
+		for(size_t c=0;c<counter_count_;++c)
+			thread_block_t::bump(to.counters_[c],
+				from.counters_[c].load(std::memory_order_relaxed));
+	}
+};
+
+struct thread_slot_t
+{
+	thread_block_t *block_;
+
+	thread_slot_t() : block_(new thread_block_t())
+	{
+		metrics_registry::instance().attach(block_);
+	}
+	~thread_slot_t()
+	{
+		metrics_registry::instance().detach(block_);
+		delete block_;
+	}
+};
+
+static thread_local thread_slot_t thread_slot;
+
+void sofadb::record_latency(metric_e metric, uint64_t ns)
+{
+	thread_block_t *block=thread_slot.block_;
+	thread_block_t::bump(block->buckets_[metric][bucket_of(ns)], 1);
+	thread_block_t::bump(block->sums_[metric], ns);
+}
+
+void sofadb::add_to_counter(counter_e counter, uint64_t val)
+{
+	thread_block_t::bump(thread_slot.block_->counters_[counter], val);
+}
+
+uint64_t histogram_snapshot_t::percentile(double q) const
+{
+	if (!count_)
+		return 0;
+	const uint64_t rank=std::max(uint64_t(1), uint64_t(q*count_+0.5));
+	uint64_t seen=0;
+	for(size_t f=0;f<buckets_.size();++f)
+	{
+		seen+=buckets_[f];
+		if (seen>=rank)
+			return bucket_upper_bound(f);
+	}
+	return bucket_upper_bound(buckets_.size()-1);
+}
+
+metrics_snapshot_t sofadb::take_metrics_snapshot()
+{
+	std::auto_ptr<thread_block_t> total(new thread_block_t());
+	metrics_registry::instance().snapshot(*total);
+
+	metrics_snapshot_t res;
+	res.histograms_.resize(metric_count_);
+	for(size_t m=0;m<metric_count_;++m)
+	{
+		histogram_snapshot_t &hist=res.histograms_[m];
+		hist.name_=metric_names[m];
+		hist.count_=0;
+		hist.sum_ns_=total->sums_[m].load(std::memory_order_relaxed);
+		hist.buckets_.resize(histogram_buckets);
+		for(size_t b=0;b<histogram_buckets;++b)
+		{
+			hist.buckets_[b]=total->buckets_[m][b].load(
+						std::memory_order_relaxed);
+			hist.count_+=hist.buckets_[b];
+		}
+	}
+	for(size_t c=0;c<counter_count_;++c)
+		res.counters_.push_back(std::make_pair(counter_names[c],
+			total->counters_[c].load(std::memory_order_relaxed)));
+	return res;
+}
+
+json_value sofadb::metrics_to_json(const metrics_snapshot_t &snap)
+{
+	json_value res(submap_d);
+	json_value &hists=res["histograms"]=json_value(submap_d);
+	for(auto i=snap.histograms_.begin(), iend=snap.histograms_.end();
+		i!=iend; ++i)
+	{
+		json_value &hist=hists[i->name_]=json_value(submap_d);
+		hist["count"]=json_value(int64_t(i->count_));
+		hist["mean"]=json_value(int64_t(i->mean()));
+		hist["p50"]=json_value(int64_t(i->percentile(0.5)));
+		hist["p90"]=json_value(int64_t(i->percentile(0.9)));
+		hist["p99"]=json_value(int64_t(i->percentile(0.99)));
+		hist["p999"]=json_value(int64_t(i->percentile(0.999)));
+	}
+	json_value &counters=res["counters"]=json_value(submap_d);
+	for(auto i=snap.counters_.begin(), iend=snap.counters_.end();
+		i!=iend; ++i)
+		counters[i->first]=json_value(int64_t(i->second));
+	return res;
+}
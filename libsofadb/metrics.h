@@ -0,0 +1,108 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include "common.h"
+#include "native_json.h"
+#include <chrono>
+
+namespace sofadb {
+
+	/**
+		Latency histograms of the hot paths. The set is fixed so that
+		recording is an array access rather than a lookup.
+	  */
+	enum metric_e
+	{
+		metric_put,
+		metric_put_revlog_read,
+		//Hashing a local revision, its stored form comes out of the same
+		//walk of the document
+		metric_put_encode,
+		//Stored form of a replicated revision, which keeps its own id
+		metric_put_serialize,
+		metric_put_write,
+		metric_put_revlog_write,
+		metric_get,
+		metric_get_revlog_read,
+		metric_get_body_read,
+		metric_get_decode,
+		metric_merge,
+		metric_json_parse,
+		metric_json_serialize,
+		metric_server_request,
+
+		metric_count_
+	};
+
+	enum counter_e
+	{
+		counter_put_conflicts,
+		counter_get_misses,
+		counter_json_parse_bytes,
+		counter_json_serialize_bytes,
+		counter_server_errors,
+
+		counter_count_
+	};
+
+	/**
+		Buckets are log-linear: each power of two of nanoseconds is split
+		into 4 sub-buckets, which bounds the error of the percentiles by
+		25% while covering everything from 1ns to minutes.
+	  */
+	const size_t histogram_sub_buckets = 4;
+	const size_t histogram_buckets = 40*histogram_sub_buckets;
+
+	struct histogram_snapshot_t
+	{
+		const char *name_;
+		uint64_t count_, sum_ns_;
+		std::vector<uint64_t> buckets_;
+
+		//Upper bound of the bucket holding the given quantile, 0..1
+		SOFADB_PUBLIC uint64_t percentile(double q) const;
+		uint64_t mean() const { return count_ ? sum_ns_/count_ : 0; }
+	};
+
+	struct metrics_snapshot_t
+	{
+		std::vector<histogram_snapshot_t> histograms_;
+		std::vector<std::pair<const char*, uint64_t> > counters_;
+	};
+
+	/**
+		Every thread records into its own block of relaxed atomics, so
+		recording never contends. Snapshots sum the blocks of the live
+		threads and the totals left by the finished ones.
+	  */
+	SOFADB_PUBLIC void record_latency(metric_e metric, uint64_t ns);
+	SOFADB_PUBLIC void add_to_counter(counter_e counter, uint64_t val=1);
+
+	SOFADB_PUBLIC metrics_snapshot_t take_metrics_snapshot();
+	//{"histograms": {name: {"count", "mean", "p50", "p90", "p99",
+	//"p999"}}, "counters": {name: value}}, all times in nanoseconds
+	SOFADB_PUBLIC json_value metrics_to_json(const metrics_snapshot_t &snap);
+
+	class scoped_timer
+	{
+		metric_e metric_;
+		std::chrono::steady_clock::time_point start_;
+	public:
+		explicit scoped_timer(metric_e metric) :
+			metric_(metric), start_(std::chrono::steady_clock::now())
+		{
+		}
+		~scoped_timer()
+		{
+			record_latency(metric_, std::chrono::duration_cast<
+				std::chrono::nanoseconds>(std::chrono::steady_clock::now()-
+										  start_).count());
+		}
+	private:
+		scoped_timer(const scoped_timer&);
+		scoped_timer& operator = (const scoped_timer&);
+	};
+
+}; //namespace sofadb
+
+#endif //METRICS_H
@@ -1,17 +1,13 @@
 #include "native_json.h"
 #include "json_stream.h"
 #include "errors.h"
+#include "metrics.h"
 
 #include "native_json_helpers.h"
 #include "rapidjson/writer.h"
 #include "rapidjson/prettywriter.h"
 #include "rapidjson/reader.h"
-
-#define BOOST_KARMA_NUMERICS_LOOP_UNROLL 6
-#include <boost/spirit/include/karma.hpp>
-using namespace boost::spirit;
-using boost::spirit::karma::int_;
-using boost::spirit::karma::lit;
+#include "rapidjson/internal/itoa.h"
 
 using namespace sofadb;
 using namespace utils;
@@ -23,20 +19,14 @@ const json_value json_value::empty_val;
 
 std::string sofadb::int_to_string(int64_t in)
 {
-	char buffer[64];
-	char *ptr = buffer;
-	karma::generate(ptr, int_, in);
-	*ptr = '\0';
-	return std::string(buffer, ptr-buffer);
+	char buffer[24];
+	return std::string(buffer, internal::i64toa(in, buffer));
 }
 
 void sofadb::append_int_to_string(int64_t in, jstring_t &out)
 {
-	char buffer[64];
-	char *ptr = buffer;
-	karma::generate(ptr, int_, in);
-	*ptr = '\0';
-	out.append(buffer, ptr);
+	char buffer[24];
+	out.append(buffer, internal::i64toa(in, buffer));
 }
 
 bool sofadb::operator < (const bignum_t &l, const bignum_t &r)
@@ -190,20 +180,18 @@ struct rapid_read_handler
 		advance(json_value(b));
 	}
 
+	void Int64(int64_t i)
+	{
+		advance(json_value(i));
+	}
+	void Double(double d)
+	{
+		advance(json_value(d));
+	}
+	//The reader only reports integers that don't fit into int64 here
 	void BigNum(const char *str, size_t length)
 	{
-		std::string digits(str, length);
-		if (digits.find_first_of("eE.")!=jstring_t::npos)
-		{
-			double val=0;
-			if (sscanf(digits.c_str(), "%lf", &val) == EOF)
-				throw std::bad_exception();
-			advance(json_value(val));
-		} else
-		{
-			json_value v(bignum_t(std::move(digits)));
-			advance(v.normalize_int());
-		}
+		advance(json_value(bignum_t(jstring_t(str, length))));
 	}
 
 	void String(const char* str, size_t length, bool copy)
@@ -250,17 +238,13 @@ struct rapid_read_handler
 	}
 };
 
-template<class Stream, unsigned Flags>
-	json_value parse_from_stream(Stream &istr)
+template<unsigned Flags, class Stream, class Handler>
+	void parse_with_handler(Stream &istr, Handler &hndl)
 {
 	char alloc_buf[8192];
 	MemoryPoolAllocator<> alloc(alloc_buf, 8192);
 	Reader reader(&alloc);
 
-	json_value res;
-	rapid_read_handler hndl;
-	hndl.values_.push_back(&res);
-
 	reader.Parse<Flags>(istr, hndl);
 	if (reader.HasParseError())
 	{
@@ -288,13 +272,29 @@ template<class Stream, unsigned Flags>
 				<< "Near: " << str << std::endl
 				<< "      " << pos_marker << "^(here)";
 	}
+}
 
+template<class Stream, unsigned Flags>
+	json_value parse_from_stream(Stream &istr)
+{
+	json_value res;
+	rapid_read_handler hndl;
+	hndl.values_.push_back(&res);
+
+	parse_with_handler<Flags>(istr, hndl);
 	return std::move(res);
 }
 
 json_value sofadb::string_to_json(const jstring_t &str)
 {
-	BufReadStream istr((char*)str.data(), str.size());
+	return string_to_json(str.data(), str.size());
+}
+
+json_value sofadb::string_to_json(const char *data, size_t len)
+{
+	scoped_timer timer(metric_json_parse);
+	add_to_counter(counter_json_parse_bytes, len);
+	BufReadStream istr((char*)data, len);
 	return parse_from_stream<BufReadStream, 0>(istr);
 }
 
@@ -304,6 +304,354 @@ json_value sofadb::json_from_stream(std::istream &val)
 	return parse_from_stream<StdStreamReadStream, kParseIgnoreTrailing>(istr);
 }
 
+json_path_t sofadb::split_json_path(const jstring_t &dotted)
+{
+	json_path_t res;
+	if (dotted.empty())
+		return res;
+
+	size_t start=0;
+	while(true)
+	{
+		size_t pos=dotted.find('.', start);
+		if (pos==jstring_t::npos)
+		{
+			res.push_back(dotted.substr(start));
+			break;
+		}
+		res.push_back(dotted.substr(start, pos-start));
+		start=pos+1;
+	}
+	return res;
+}
+
+struct query_done_t {};
+
+/**
+	SAX handler that tracks the position in the document and only
+	materializes values at the requested paths. Each open container
+	keeps the list of paths that can still match inside it, containers
+	that no path goes through are skipped by counting nesting levels.
+  */
+struct query_read_handler
+{
+	struct frame_t
+	{
+		bool in_map_;
+		bool expect_key_;
+		size_t index_;
+		//Paths that go through this container
+		std::vector<size_t> live_;
+		//Paths that go through the next value (for maps)
+		std::vector<size_t> next_;
+	};
+
+	const std::vector<json_path_t> &paths_;
+	std::vector<json_value> &res_;
+	std::vector<bool> &found_;
+	size_t remaining_;
+
+	std::vector<frame_t> frames_;
+	size_t skip_depth_;
+
+	rapid_read_handler capture_;
+	size_t capture_depth_;
+
+	query_read_handler(const std::vector<json_path_t> &paths,
+					   std::vector<json_value> &res,
+					   std::vector<bool> &found) :
+		paths_(paths), res_(res), found_(found), remaining_(paths.size()),
+		skip_depth_(), capture_depth_()
+	{
+	}
+
+	//Selects the paths that go through the value that is about to be
+	//reported. Returns the path that ends exactly at it (if any).
+	size_t select(std::vector<size_t> &next)
+	{
+		next.clear();
+		if (frames_.empty())
+		{
+			for(size_t f=0;f<paths_.size();++f)
+				next.push_back(f);
+		} else
+		{
+			frame_t &top=frames_.back();
+			if (top.in_map_)
+				next.swap(top.next_);
+			else
+			{
+				const size_t depth=frames_.size()-1;
+				jstring_t idx=int_to_string(top.index_);
+				for(auto i=top.live_.begin();i!=top.live_.end();++i)
+					if (paths_[*i][depth]==idx)
+						next.push_back(*i);
+			}
+		}
+
+		size_t exact=size_t(-1);
+		for(auto i=next.begin();i!=next.end();++i)
+			if (paths_[*i].size()==frames_.size() && !found_[*i])
+			{
+				exact=*i;
+				break;
+			}
+		return exact;
+	}
+
+	void value_done()
+	{
+		if (frames_.empty())
+			return;
+		frame_t &top=frames_.back();
+		if (top.in_map_)
+			top.expect_key_=true;
+		else
+			++top.index_;
+	}
+
+	void mark_found(size_t idx)
+	{
+		found_[idx]=true;
+		--remaining_;
+	}
+
+	void check_done()
+	{
+		if (!remaining_)
+			throw query_done_t();
+	}
+
+	template<class T> void scalar(T &&val)
+	{
+		if (capture_depth_)
+		{
+			capture_.advance(std::move(val));
+			return;
+		}
+		if (skip_depth_)
+			return;
+
+		std::vector<size_t> next;
+		size_t exact=select(next);
+		if (exact!=size_t(-1))
+		{
+			res_[exact]=std::move(val);
+			mark_found(exact);
+		}
+		value_done();
+		check_done();
+	}
+
+	void start(bool is_map)
+	{
+		if (capture_depth_)
+		{
+			++capture_depth_;
+			if (is_map)
+				capture_.StartObject();
+			else
+				capture_.StartArray();
+			return;
+		}
+		if (skip_depth_)
+		{
+			++skip_depth_;
+			return;
+		}
+
+		std::vector<size_t> next;
+		size_t exact=select(next);
+		if (exact!=size_t(-1))
+		{
+			//Materialize the whole subtree
+			capture_=rapid_read_handler();
+			capture_.values_.push_back(&res_[exact]);
+			capture_depth_=1;
+			mark_found(exact);
+			if (is_map)
+				capture_.StartObject();
+			else
+				capture_.StartArray();
+			return;
+		}
+		if (next.empty())
+		{
+			skip_depth_=1;
+			return;
+		}
+
+		frame_t fr;
+		fr.in_map_=is_map;
+		fr.expect_key_=is_map;
+		fr.index_=0;
+		fr.live_.swap(next);
+		frames_.push_back(std::move(fr));
+	}
+
+	void end(bool is_map)
+	{
+		if (capture_depth_)
+		{
+			if (is_map)
+				capture_.EndObject(0);
+			else
+				capture_.EndArray(0);
+			if (--capture_depth_)
+				return;
+			value_done();
+			check_done();
+			return;
+		}
+		if (skip_depth_)
+		{
+			if (--skip_depth_==0)
+				value_done();
+			return;
+		}
+		frames_.pop_back();
+		value_done();
+	}
+
+	void Null()
+	{
+		scalar(json_value());
+	}
+	void Bool(bool b)
+	{
+		scalar(json_value(b));
+	}
+	void Int64(int64_t i)
+	{
+		scalar(json_value(i));
+	}
+	void Double(double d)
+	{
+		scalar(json_value(d));
+	}
+	void BigNum(const char *str, size_t length)
+	{
+		scalar(json_value(bignum_t(jstring_t(str, length))));
+	}
+
+	void String(const char* str, size_t length, bool copy)
+	{
+		if (capture_depth_)
+		{
+			capture_.String(str, length, copy);
+			return;
+		}
+		if (skip_depth_)
+			return;
+
+		frame_t &top=frames_.back();
+		if (top.in_map_ && top.expect_key_)
+		{
+			top.expect_key_=false;
+			const size_t depth=frames_.size()-1;
+			top.next_.clear();
+			for(auto i=top.live_.begin();i!=top.live_.end();++i)
+			{
+				const jstring_t &comp=paths_[*i][depth];
+				if (comp.size()==length &&
+						memcmp(comp.data(), str, length)==0)
+					top.next_.push_back(*i);
+			}
+			return;
+		}
+		scalar(json_value(jstring_t(str, length)));
+	}
+
+	void StartObject()
+	{
+		start(true);
+	}
+	void EndObject(SizeType memberCount)
+	{
+		end(true);
+	}
+	void StartArray()
+	{
+		start(false);
+	}
+	void EndArray(SizeType elementCount)
+	{
+		end(false);
+	}
+};
+
+size_t sofadb::query_json(const char *data, size_t len,
+						  const std::vector<json_path_t> &paths,
+						  std::vector<json_value> &res,
+						  std::vector<bool> *found)
+{
+	res.clear();
+	res.resize(paths.size());
+	std::vector<bool> found_paths(paths.size());
+
+	if (!paths.empty())
+	{
+		query_read_handler hndl(paths, res, found_paths);
+		BufReadStream istr(const_cast<char*>(data), len);
+		try
+		{
+			parse_with_handler<0>(istr, hndl);
+		} catch(const query_done_t &)
+		{
+			//Everything is found, the rest of the document is not needed
+		}
+	}
+
+	//Paths inside other requested paths are resolved from the
+	//materialized values.
+	size_t res_count=0;
+	for(size_t f=0;f<paths.size();++f)
+	{
+		if (found_paths[f])
+		{
+			++res_count;
+			continue;
+		}
+		for(size_t k=0;k<paths.size();++k)
+		{
+			if (k==f || !found_paths[k] || paths[k].size()>paths[f].size() ||
+					!std::equal(paths[k].begin(), paths[k].end(),
+								paths[f].begin()))
+				continue;
+
+			const json_value *cur=&res[k];
+			for(size_t p=paths[k].size();cur && p<paths[f].size();++p)
+			{
+				const jstring_t &comp=paths[f][p];
+				if (cur->type()==submap_d)
+				{
+					auto pos=cur->get_submap().find(comp);
+					cur=pos==cur->get_submap().end()? 0 : &pos->second;
+				} else if (cur->type()==sublist_d &&
+						   !comp.empty() && comp.find_first_not_of(
+							   "0123456789")==jstring_t::npos &&
+						   size_t(atoll(comp.c_str())) <
+								cur->get_sublist().size())
+				{
+					cur=&cur->get_sublist()[atoll(comp.c_str())];
+				} else
+					cur=0;
+			}
+			if (cur)
+			{
+				res[f]=*cur;
+				found_paths[f]=true;
+				++res_count;
+			}
+			break;
+		}
+	}
+
+	if (found)
+		found->swap(found_paths);
+	return res_count;
+}
+
 template<class Writer> struct rapid_json_printer
 {
 	Writer &writer_;
@@ -359,6 +707,8 @@ template<class Writer> struct rapid_json_printer
 void sofadb::json_to_string(jstring_t &append_to,
 							const json_value &val, bool pretty)
 {
+	scoped_timer timer(metric_json_serialize);
+	const size_t start_size=append_to.size();
 	char buf[8192];
 	MemoryPoolAllocator<> alloc(buf, 8192);
 	StringWriteStream stream(append_to);
@@ -375,20 +725,52 @@ void sofadb::json_to_string(jstring_t &append_to,
 		val.apply_visitor(vis);
 	}
 	alloc.Clear();
+	add_to_counter(counter_json_serialize_bytes, append_to.size()-start_size);
 }
 
-template <class Writer> class str_json_stream : public json_stream
+//Buffers the output and passes it to the sink in pieces
+class SinkWriteStream
 {
-	jstring_t &str_;
-	StringWriteStream write_stream_;
+	json_sink_t *sink_;
+	size_t ln_;
+	char buf_[4096];
+public:
+	typedef char Ch;
+
+	SinkWriteStream(json_sink_t *sink) : sink_(sink), ln_()
+	{
+	}
+
+	void Put(char c)
+	{
+		if (ln_==sizeof(buf_))
+			Flush();
+		buf_[ln_++]=c;
+	}
+
+	void Flush()
+	{
+		if (ln_)
+			sink_->append(buf_, ln_);
+		ln_=0;
+	}
+};
+
+template <class Writer, class Stream=StringWriteStream>
+	class str_json_stream : public json_stream
+{
+	Stream write_stream_;
 	Writer writer_;
 public:
-	str_json_stream(jstring_t &str) :
-		str_(str), write_stream_(str), writer_(write_stream_)
+	template<class Target> str_json_stream(Target &target) :
+		write_stream_(target), writer_(write_stream_)
 	{
 	}
 
-	virtual ~str_json_stream() {}
+	virtual ~str_json_stream()
+	{
+		write_stream_.Flush();
+	}
 
 	virtual void write_null()
 	{
@@ -462,3 +844,144 @@ std::auto_ptr<json_stream> sofadb::make_stream(jstring_t &append_to,
 		return std::auto_ptr<json_stream>(s);
 	}
 }
+
+std::auto_ptr<json_stream> sofadb::make_sink_stream(json_sink_t *sink)
+{
+	json_stream *s=new str_json_stream< Writer<SinkWriteStream>,
+			SinkWriteStream >(sink);
+	return std::auto_ptr<json_stream>(s);
+}
+
+class tee_json_stream : public json_stream
+{
+	json_stream *first_, *second_;
+
+	struct printer
+	{
+		json_stream &str_;
+		printer(json_stream &str) : str_(str) {}
+
+		void operator()()
+		{
+			str_.write_null();
+		}
+		void operator()(bool b)
+		{
+			str_.write_bool(b);
+		}
+		void operator()(int64_t i)
+		{
+			str_.write_int(i);
+		}
+		void operator()(double d)
+		{
+			str_.write_double(d);
+		}
+		void operator()(const jstring_t &s)
+		{
+			str_.write_string(s.data(), s.length());
+		}
+		void operator()(const bignum_t &b)
+		{
+			str_.write_digits(b.digits_.data(), b.digits_.length());
+		}
+		void operator()(const submap_t &map)
+		{
+			str_.start_map();
+			for(auto i=map.begin(), iend=map.end();i!=iend;++i)
+			{
+				str_.write_string(i->first.data(), i->first.length());
+				i->second.apply_visitor(*this);
+			}
+			str_.end_map();
+		}
+		void operator()(const sublist_t &lst)
+		{
+			str_.start_list();
+			for(auto i = lst.begin(), iend=lst.end(); i!=iend; ++i)
+				i->apply_visitor(*this);
+			str_.end_list();
+		}
+		void operator()(const graft_t &lst)
+		{
+			lst.grafted().apply_visitor(*this);
+		}
+	};
+public:
+	tee_json_stream(json_stream *first, json_stream *second) :
+		first_(first), second_(second)
+	{
+	}
+
+	virtual void write_null()
+	{
+		first_->write_null();
+		second_->write_null();
+	}
+
+	virtual void write_bool(bool val)
+	{
+		first_->write_bool(val);
+		second_->write_bool(val);
+	}
+
+	virtual void write_int(int64_t i)
+	{
+		first_->write_int(i);
+		second_->write_int(i);
+	}
+
+	virtual void write_double(double d)
+	{
+		first_->write_double(d);
+		second_->write_double(d);
+	}
+
+	virtual void write_string(const char *str, size_t ln)
+	{
+		first_->write_string(str, ln);
+		second_->write_string(str, ln);
+	}
+
+	virtual void write_digits(const char *str, size_t ln)
+	{
+		first_->write_digits(str, ln);
+		second_->write_digits(str, ln);
+	}
+
+	virtual void start_map()
+	{
+		first_->start_map();
+		second_->start_map();
+	}
+
+	virtual void end_map()
+	{
+		first_->end_map();
+		second_->end_map();
+	}
+
+	virtual void start_list()
+	{
+		first_->start_list();
+		second_->start_list();
+	}
+
+	virtual void end_list()
+	{
+		first_->end_list();
+		second_->end_list();
+	}
+
+	virtual void write_json(const json_value &val)
+	{
+		printer p(*this);
+		val.apply_visitor(p);
+	}
+};
+
+std::auto_ptr<json_stream> sofadb::make_tee_stream(json_stream *first,
+												   json_stream *second)
+{
+	return std::auto_ptr<json_stream>(new tee_json_stream(first, second));
+}
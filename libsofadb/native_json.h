@@ -288,11 +288,39 @@ namespace sofadb {
 
 	SOFADB_PUBLIC json_value json_from_stream(std::istream &val);
 	SOFADB_PUBLIC json_value string_to_json(const jstring_t &val);
+	SOFADB_PUBLIC json_value string_to_json(const char *data, size_t len);
 	inline std::ostream& operator << (std::ostream &str, const json_value &val)
 	{
 		return str << json_to_string(val, false);
 	}
 
+	typedef std::vector<jstring_t> json_path_t;
+	//Splits "a.b.0" into its components
+	SOFADB_PUBLIC json_path_t split_json_path(const jstring_t &dotted);
+
+	/**
+		Extracts the values at the given paths from the JSON text without
+		building the whole tree. Path components match map keys or list
+		indices, an empty path selects the whole document. Subtrees that
+		are not on any of the paths are skipped and parsing stops once
+		all the paths are found, so errors after that point go unnoticed.
+		Returns the number of found paths, missing values are left nil
+		and are flagged in 'found'.
+	  */
+	SOFADB_PUBLIC size_t query_json(const char *data, size_t len,
+		const std::vector<json_path_t> &paths,
+		std::vector<json_value> &res, std::vector<bool> *found=0);
+	inline bool query_json(const jstring_t &json, const json_path_t &path,
+						   json_value *res)
+	{
+		std::vector<json_path_t> paths(1, path);
+		std::vector<json_value> vals;
+		if (!query_json(json.data(), json.size(), paths, vals))
+			return false;
+		*res = std::move(vals.at(0));
+		return true;
+	}
+
 	SOFADB_PUBLIC bool operator < (const json_value &l, const json_value &r);
 	inline bool operator > (const json_value &l, const json_value &r)
 	{
@@ -111,8 +111,12 @@ namespace utils {
 		{
 		}
 
-		char Peek() const { return *current_; }
-		char Take() { char c = *current_; Read(); return c; }
+		//The buffer doesn't have to be null-terminated
+		char Peek() const
+		{
+			return current_ < bufferLast_ ? *current_ : '\0';
+		}
+		char Take() { char c = Peek(); Read(); return c; }
 		size_t Tell() const { return (current_ - buffer_); }
 
 		std::string GetSubSequence(size_t pos, size_t ln) const
@@ -0,0 +1,231 @@
+#ifndef PUBLISHED_MAP_H
+#define PUBLISHED_MAP_H
+
+#include <stdint.h>
+#include <atomic>
+#include <deque>
+#include <boost/functional/hash.hpp>
+
+namespace utils {
+
+	/**
+		Hash map for read-mostly data. Lookups never lock or wait, writers
+		must be serialized by the caller.
+
+		Published entries are immutable: erase() only marks them, and a
+		full table is rebuilt from copies of the live entries while the
+		old one is retired. Readers register in one of two epochs, the
+		values of the erased entries and the retired tables are released
+		by the writers once the readers of the epoch that could still
+		see them are gone. It suits data that changes rarely.
+	  */
+	template<class K, class V, class Hash=boost::hash<K> > class published_map
+	{
+		struct node_t
+		{
+			const K key_;
+			//Reset once the entry is erased and no reader can see it
+			V value_;
+			std::atomic<bool> erased_;
+			node_t *const next_;
+
+			node_t(const K &key, const V &value, node_t *next) :
+				key_(key), value_(value), erased_(false), next_(next) {}
+		};
+
+		struct table_t
+		{
+			const size_t mask_;
+			std::atomic<node_t*> *const buckets_;
+			//Nodes in the chains, including the erased ones
+			size_t nodes_;
+
+			explicit table_t(size_t size) : mask_(size-1),
+				buckets_(new std::atomic<node_t*>[size]), nodes_()
+			{
+				for(size_t f=0;f<size;++f)
+					buckets_[f].store(0, std::memory_order_relaxed);
+			}
+			~table_t()
+			{
+				for(size_t f=0;f<=mask_;++f)
+					for(node_t *n=buckets_[f].load(); n;)
+					{
+						node_t *next=n->next_;
+						delete n;
+						n=next;
+					}
+				delete [] buckets_;
+			}
+		};
+
+		//An erased entry or a retired table, with the epoch it was
+		//retired in
+		struct retired_t
+		{
+			uint64_t epoch_;
+			node_t *node_;
+			table_t *table_;
+		};
+
+		//Readers in a section hold the counter of the epoch they
+		//started in
+		class read_section
+		{
+			const published_map &map_;
+			size_t slot_;
+		public:
+			read_section(const published_map &map) : map_(map)
+			{
+				for(;;)
+				{
+					const uint64_t epoch=map_.epoch_.load();
+					slot_=epoch%2;
+					map_.readers_[slot_].fetch_add(1);
+					//The writer may have moved on before the counter
+					//was taken
+					if (map_.epoch_.load()==epoch)
+						break;
+					map_.readers_[slot_].fetch_sub(1);
+				}
+			}
+			~read_section()
+			{
+				map_.readers_[slot_].fetch_sub(1, std::memory_order_release);
+			}
+		};
+
+		std::atomic<table_t*> table_;
+		std::atomic<uint64_t> epoch_;
+		mutable std::atomic<size_t> readers_[2];
+		std::deque<retired_t> retired_;
+		size_t live_;
+		Hash hash_;
+	public:
+		published_map() : table_(new table_t(16)), epoch_(0), live_()
+		{
+			readers_[0].store(0);
+			readers_[1].store(0);
+		}
+		~published_map()
+		{
+			delete table_.load();
+			for(auto i=retired_.begin(), iend=retired_.end(); i!=iend; ++i)
+				delete i->table_;
+		}
+
+		bool find(const K &key, V &res) const
+		{
+			read_section section(*this);
+			const table_t *table=table_.load(std::memory_order_acquire);
+			for(const node_t *n=table->buckets_[hash_(key) & table->mask_].
+					load(std::memory_order_acquire); n; n=n->next_)
+				if (!n->erased_.load(std::memory_order_acquire) &&
+						n->key_==key)
+				{
+					res=n->value_;
+					return true;
+				}
+			return false;
+		}
+
+		//Writers only. The key must not be present.
+		void insert(const K &key, const V &value)
+		{
+			table_t *table=table_.load(std::memory_order_relaxed);
+			if (table->nodes_>=(table->mask_+1)*2)
+				table=grow(table);
+			push(table, key, value);
+			++live_;
+			collect();
+		}
+
+		//Writers only
+		bool erase(const K &key)
+		{
+			table_t *table=table_.load(std::memory_order_relaxed);
+			for(node_t *n=table->buckets_[hash_(key) & table->mask_].
+					load(std::memory_order_relaxed); n; n=n->next_)
+				if (!n->erased_.load(std::memory_order_relaxed) &&
+						n->key_==key)
+				{
+					n->erased_.store(true, std::memory_order_release);
+					--live_;
+					retire(n, 0);
+					collect();
+					return true;
+				}
+			return false;
+		}
+
+		/**
+			Writers only. Releases what the readers can no longer see,
+			insert() and erase() do it too. An entry takes two calls
+			without readers in the way after its erasure.
+		  */
+		void collect()
+		{
+			if (retired_.empty())
+				return;
+			//The counter of the next epoch is the one of the previous
+			//epoch, its readers must be gone before it's reused
+			uint64_t epoch=epoch_.load();
+			if (readers_[(epoch+1)%2].load()==0)
+				epoch_.store(++epoch);
+			//The readers that started before the retirement were in its
+			//epoch or the one before
+			while(!retired_.empty() && retired_.front().epoch_+2<=epoch)
+			{
+				const retired_t &r=retired_.front();
+				if (r.node_)
+					r.node_->value_=V();
+				delete r.table_;
+				retired_.pop_front();
+			}
+		}
+
+		size_t size() const { return live_; }
+	private:
+		published_map(const published_map&);
+		published_map& operator = (const published_map&);
+
+		void push(table_t *table, const K &key, const V &value)
+		{
+			std::atomic<node_t*> &head=table->buckets_[hash_(key) &
+													   table->mask_];
+			//The node is complete before it's reachable
+			head.store(new node_t(key, value,
+				head.load(std::memory_order_relaxed)),
+				std::memory_order_release);
+			++table->nodes_;
+		}
+
+		table_t* grow(table_t *old)
+		{
+			size_t size=16;
+			while(size<live_)
+				size*=2;
+			table_t *table=new table_t(size*2);
+			for(size_t f=0;f<=old->mask_;++f)
+				for(node_t *n=old->buckets_[f].load(
+						std::memory_order_relaxed); n; n=n->next_)
+					if (!n->erased_.load(std::memory_order_relaxed))
+						push(table, n->key_, n->value_);
+			table_.store(table, std::memory_order_release);
+			retire(0, old);
+			return table;
+		}
+
+		void retire(node_t *node, table_t *table)
+		{
+			retired_t r;
+			r.epoch_=epoch_.load();
+			r.node_=node;
+			r.table_=table;
+			retired_.push_back(r);
+		}
+	};
+
+}; //namespace utils
+
+#endif //PUBLISHED_MAP_H
@@ -0,0 +1,195 @@
+#include "purger.h"
+#include "engine.h"
+#include "storage_backend.h"
+#include <algorithm>
+
+using namespace sofadb;
+
+//Bounds of a single write batch
+static const size_t purge_batch_keys = 10000;
+static const uint64_t purge_batch_bytes = 4*1024*1024;
+//Delays before retrying a failed purge
+static const int min_retry_sec = 1;
+static const int max_retry_sec = 60;
+
+jstring_t database_purger::purge_marker_key(const jstring_t &name)
+{
+	//Database names can't be empty, so this can't be a database's key
+	return SD_SYSTEM_DB "/" DB_SEPARATOR "purge" DB_SEPARATOR+name;
+}
+
+std::vector<jstring_t> database_purger::find_pending(
+	storage_backend_t *backend)
+{
+	const jstring_t prefix=purge_marker_key("");
+	std::vector<jstring_t> res;
+	std::auto_ptr<storage_iterator_t> it=backend->iterate();
+	for(it->seek(prefix); it->valid(); it->next())
+	{
+		const jstring_t key=it->key();
+		if (key.compare(0, prefix.size(), prefix)!=0)
+			break;
+		res.push_back(key.substr(prefix.size()));
+	}
+	return res;
+}
+
+database_purger::database_purger(storage_backend_ptr_t backend,
+								 uint64_t bytes_per_sec) :
+	backend_(backend), bytes_per_sec_(bytes_per_sec), stop_(false)
+{
+	thread_=std::thread([this]{ run(); });
+}
+
+database_purger::~database_purger()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		stop_=true;
+	}
+	wakeup_.notify_all();
+	idle_.notify_all();
+	thread_.join();
+}
+
+void database_purger::enqueue(const jstring_t &name, database_ptr db)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	if (!pending_.insert(name).second)
+		return;
+	entry_t entry;
+	entry.name_=name;
+	entry.db_=db;
+	queue_.push_back(entry);
+	wakeup_.notify_all();
+}
+
+bool database_purger::is_pending(const jstring_t &name)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	return pending_.count(name)!=0;
+}
+
+void database_purger::wait_idle()
+{
+	std::unique_lock<std::mutex> lock(mutex_);
+	idle_.wait(lock, [this]{ return pending_.empty() || stop_; });
+}
+
+void database_purger::run()
+{
+	std::chrono::seconds backoff(min_retry_sec);
+	for(;;)
+	{
+		entry_t entry;
+		{
+			std::unique_lock<std::mutex> lock(mutex_);
+			wakeup_.wait(lock, [this]{ return stop_ || !queue_.empty(); });
+			if (stop_)
+				return;
+			entry=queue_.front();
+		}
+
+		bool done=false, failed=false;
+		try
+		{
+			done=purge(entry);
+		} catch(const std::exception &ex)
+		{
+			LOG(ERROR) << "Purge of the database " << entry.name_
+					   << " failed, retrying in " << backoff.count()
+					   << "s: " << ex.what();
+			failed=true;
+		}
+
+		std::unique_lock<std::mutex> lock(mutex_);
+		if (failed)
+		{
+			//The purge resumes from what is left of the ranges, the
+			//others get their turn meanwhile
+			queue_.pop_front();
+			queue_.push_back(entry);
+			wakeup_.wait_for(lock, backoff, [this]{ return bool(stop_); });
+			backoff=std::min(backoff*2, std::chrono::seconds(max_retry_sec));
+			continue;
+		}
+		if (!done)
+			return; //Stopped, resumed from the marker by the next engine
+		backoff=std::chrono::seconds(min_retry_sec);
+		queue_.pop_front();
+		pending_.erase(entry.name_);
+		idle_.notify_all();
+	}
+}
+
+bool database_purger::purge(const entry_t &entry)
+{
+	//A compaction of the closed database stops at its next batch, its
+	//last writes must land before the range is deleted
+	while(entry.db_ && entry.db_->compact_running())
+	{
+		if (stop_)
+			return false;
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	}
+
+	io_throttle_t throttle(bytes_per_sec_);
+	static const char *spaces[]={SD_DATA_DB, SD_SEQ_DB, SD_VIEW_DB,
+		SD_INDEX_DB, SD_ATTACHMENT_DB, SD_SYSTEM_DB};
+	size_t removed=0;
+	for(size_t f=0;f<sizeof(spaces)/sizeof(spaces[0]);++f)
+	{
+		const jstring_t prefix=database_key_prefix(spaces[f], entry.name_);
+		jstring_t limit=prefix;
+		limit[limit.size()-1]++;
+		//Writes of the handles that were in flight when the database
+		//was closed may land behind the first pass
+		for(size_t cur=1;cur;)
+		{
+			cur=delete_range(prefix, limit, throttle);
+			removed+=cur;
+			if (stop_)
+				return false;
+		}
+		backend_->compact_range(prefix, limit);
+	}
+
+	backend_->remove(purge_marker_key(entry.name_), true);
+	VLOG_MACRO(1) << "Purged the database " << entry.name_ << ", "
+				  << removed << " keys" << std::endl;
+	return true;
+}
+
+size_t database_purger::delete_range(const jstring_t &prefix,
+	const jstring_t &limit, io_throttle_t &throttle)
+{
+	size_t res=0;
+	uint64_t bytes=0;
+	pending_map_t batch;
+	std::auto_ptr<storage_iterator_t> it=backend_->iterate();
+	for(it->seek(prefix); it->valid(); it->next())
+	{
+		const jstring_t key=it->key();
+		if (key.compare(limit)>=0)
+			break;
+		bytes+=key.size()+it->value().size();
+		batch[key].removed_=true;
+		if (batch.size()>=purge_batch_keys || bytes>=purge_batch_bytes)
+		{
+			backend_->write(batch, false);
+			throttle.consume(bytes);
+			res+=batch.size();
+			batch.clear();
+			bytes=0;
+			if (stop_)
+				return res;
+		}
+	}
+	if (!batch.empty())
+	{
+		backend_->write(batch, false);
+		throttle.consume(bytes);
+		res+=batch.size();
+	}
+	return res;
+}
@@ -0,0 +1,75 @@
+#ifndef PURGER_H
+#define PURGER_H
+
+#include "common.h"
+#include "database.h"
+#include "compaction.h"
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <set>
+#include <thread>
+
+namespace sofadb {
+	typedef boost::shared_ptr<Database> database_ptr;
+	class storage_backend_t;
+	typedef boost::shared_ptr<storage_backend_t> storage_backend_ptr_t;
+
+	/**
+		Deletes the key ranges of dropped databases in the background.
+		Keys are removed in bounded write batches paced by an I/O budget,
+		so a big database doesn't monopolize the write path, and each
+		range is compacted once it's empty.
+
+		The purge of a database is recorded under purge_marker_key() in
+		the same write that removes its dbinfo, the marker is dropped
+		when the purge is finished. Unfinished purges are resumed by
+		the next engine opening the store, failed ones are retried
+		with a growing delay.
+	  */
+	class database_purger
+	{
+		struct entry_t
+		{
+			jstring_t name_;
+			//The last handle, it can still be compacting
+			database_ptr db_;
+		};
+
+		storage_backend_ptr_t backend_;
+		uint64_t bytes_per_sec_;
+
+		std::mutex mutex_;
+		std::condition_variable wakeup_, idle_;
+		std::deque<entry_t> queue_;
+		std::set<jstring_t> pending_;
+		std::atomic<bool> stop_;
+		std::thread thread_;
+	public:
+		database_purger(storage_backend_ptr_t backend, uint64_t bytes_per_sec);
+		//Stops between two batches, the rest is done on the next start
+		~database_purger();
+
+		static jstring_t purge_marker_key(const jstring_t &name);
+		//Finds the purges left unfinished by the previous run
+		static std::vector<jstring_t> find_pending(
+			storage_backend_t *backend);
+
+		void enqueue(const jstring_t &name, database_ptr db);
+		bool is_pending(const jstring_t &name);
+		void wait_idle();
+	private:
+		database_purger(const database_purger&);
+		database_purger& operator = (const database_purger&);
+
+		void run();
+		//Returns false if it has been stopped halfway
+		bool purge(const entry_t &entry);
+		//Returns the number of removed keys
+		size_t delete_range(const jstring_t &prefix, const jstring_t &limit,
+							io_throttle_t &throttle);
+	};
+
+}; //namespace sofadb
+
+#endif //PURGER_H
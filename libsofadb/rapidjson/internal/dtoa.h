@@ -0,0 +1,203 @@
+#ifndef RAPIDJSON_INTERNAL_DTOA_H_
+#define RAPIDJSON_INTERNAL_DTOA_H_
+
+#include "itoa.h"
+#include "diyfp.h"
+#include <cstring>	// memmove()
+
+namespace rapidjson {
+namespace internal {
+
+// Grisu2 double-to-string conversion. The output is the shortest decimal
+// string that parses back to the same double in the vast majority of cases
+// and always round-trips, unlike "%.17g" which pads with noise digits.
+
+inline void GrisuRound(char* buffer, int len, uint64_t delta, uint64_t rest, uint64_t ten_kappa, uint64_t wp_w) {
+	while (rest < wp_w && delta - rest >= ten_kappa &&
+		   (rest + ten_kappa < wp_w ||	// closer
+			wp_w - rest > rest + ten_kappa - wp_w)) {
+		buffer[len - 1]--;
+		rest += ten_kappa;
+	}
+}
+
+inline int CountDecimalDigit32(uint32_t n) {
+	// Simple pure C++ implementation was faster than __builtin_clz version in this situation.
+	if (n < 10) return 1;
+	if (n < 100) return 2;
+	if (n < 1000) return 3;
+	if (n < 10000) return 4;
+	if (n < 100000) return 5;
+	if (n < 1000000) return 6;
+	if (n < 10000000) return 7;
+	if (n < 100000000) return 8;
+	// Will not reach 10 digits in DigitGen()
+	return 9;
+}
+
+inline void DigitGen(const DiyFp& W, const DiyFp& Mp, uint64_t delta, char* buffer, int* len, int* K) {
+	const uint64_t* kPow10 = GetPow10Lut();
+	const DiyFp one(static_cast<uint64_t>(1) << -Mp.e, Mp.e);
+	const DiyFp wp_w = Mp - W;
+	uint32_t p1 = static_cast<uint32_t>(Mp.f >> -one.e);
+	uint64_t p2 = Mp.f & (one.f - 1);
+	int kappa = CountDecimalDigit32(p1); // kappa in [0, 9]
+	*len = 0;
+
+	while (kappa > 0) {
+		uint32_t d = 0;
+		switch (kappa) {
+			case  9: d = p1 /  100000000; p1 %=  100000000; break;
+			case  8: d = p1 /   10000000; p1 %=   10000000; break;
+			case  7: d = p1 /    1000000; p1 %=    1000000; break;
+			case  6: d = p1 /     100000; p1 %=     100000; break;
+			case  5: d = p1 /      10000; p1 %=      10000; break;
+			case  4: d = p1 /       1000; p1 %=       1000; break;
+			case  3: d = p1 /        100; p1 %=        100; break;
+			case  2: d = p1 /         10; p1 %=         10; break;
+			case  1: d = p1;              p1 =           0; break;
+			default:;
+		}
+		if (d || *len)
+			buffer[(*len)++] = static_cast<char>('0' + static_cast<char>(d));
+		kappa--;
+		uint64_t tmp = (static_cast<uint64_t>(p1) << -one.e) + p2;
+		if (tmp <= delta) {
+			*K += kappa;
+			GrisuRound(buffer, *len, delta, tmp, kPow10[kappa] << -one.e, wp_w.f);
+			return;
+		}
+	}
+
+	// kappa = 0
+	for (;;) {
+		p2 *= 10;
+		delta *= 10;
+		char d = static_cast<char>(p2 >> -one.e);
+		if (d || *len)
+			buffer[(*len)++] = static_cast<char>('0' + d);
+		p2 &= one.f - 1;
+		kappa--;
+		if (p2 < delta) {
+			*K += kappa;
+			int index = -kappa;
+			GrisuRound(buffer, *len, delta, p2, one.f, wp_w.f * (index < 20 ? kPow10[index] : 0));
+			return;
+		}
+	}
+}
+
+//! Produces the digits of a positive finite \c value and its decimal
+//! exponent: value ~= buffer[0..length) * 10^K.
+inline void Grisu2(double value, char* buffer, int* length, int* K) {
+	const DiyFp v(value);
+	DiyFp w_m, w_p;
+	v.NormalizedBoundaries(&w_m, &w_p);
+
+	const DiyFp c_mk = GetCachedPower(w_p.e, K);
+	const DiyFp W = v.Normalize() * c_mk;
+	DiyFp Wp = w_p * c_mk;
+	DiyFp Wm = w_m * c_mk;
+	Wm.f++;
+	Wp.f--;
+	DigitGen(W, Wp, Wp.f - Wm.f, buffer, length, K);
+}
+
+inline char* WriteExponent(int K, char* buffer) {
+	if (K < 0) {
+		*buffer++ = '-';
+		K = -K;
+	}
+
+	if (K >= 100) {
+		*buffer++ = static_cast<char>('0' + static_cast<char>(K / 100));
+		K %= 100;
+		const char* d = GetDigitsLut() + K * 2;
+		*buffer++ = d[0];
+		*buffer++ = d[1];
+	}
+	else if (K >= 10) {
+		const char* d = GetDigitsLut() + K * 2;
+		*buffer++ = d[0];
+		*buffer++ = d[1];
+	}
+	else
+		*buffer++ = static_cast<char>('0' + static_cast<char>(K));
+
+	return buffer;
+}
+
+//! Lays out Grisu2 digits as a JSON number that always reads back as a
+//! double (integral values keep a ".0").
+inline char* Prettify(char* buffer, int length, int k) {
+	const int kk = length + k;	// 10^(kk-1) <= v < 10^kk
+
+	if (0 <= k && kk <= 21) {
+		// 1234e7 -> 12340000000.0
+		for (int i = length; i < kk; i++)
+			buffer[i] = '0';
+		buffer[kk] = '.';
+		buffer[kk + 1] = '0';
+		return &buffer[kk + 2];
+	}
+	else if (0 < kk && kk <= 21) {
+		// 1234e-2 -> 12.34
+		std::memmove(&buffer[kk + 1], &buffer[kk], static_cast<size_t>(length - kk));
+		buffer[kk] = '.';
+		return &buffer[length + 1];
+	}
+	else if (-6 < kk && kk <= 0) {
+		// 1234e-6 -> 0.001234
+		const int offset = 2 - kk;
+		std::memmove(&buffer[offset], &buffer[0], static_cast<size_t>(length));
+		buffer[0] = '0';
+		buffer[1] = '.';
+		for (int i = 2; i < offset; i++)
+			buffer[i] = '0';
+		return &buffer[length + offset];
+	}
+	else if (length == 1) {
+		// 1e30
+		buffer[1] = 'e';
+		return WriteExponent(kk - 1, &buffer[2]);
+	}
+	else {
+		// 1234e30 -> 1.234e33
+		std::memmove(&buffer[2], &buffer[1], static_cast<size_t>(length - 1));
+		buffer[1] = '.';
+		buffer[length + 1] = 'e';
+		return WriteExponent(kk - 1, &buffer[0 + length + 2]);
+	}
+}
+
+//! Writes a finite \c value to \c buffer (at least 25 characters), returns
+//! the end of the output.
+inline char* dtoa(double value, char* buffer) {
+	const DiyFp raw(value);
+	union {
+		double d;
+		uint64_t u64;
+	} u = { value };
+	const bool negative = (u.u64 >> 63) != 0;
+
+	if (negative) {
+		*buffer++ = '-';
+		value = -value;
+	}
+
+	if (raw.f == 0) {
+		buffer[0] = '0';
+		buffer[1] = '.';
+		buffer[2] = '0';
+		return &buffer[3];
+	}
+
+	int length, K;
+	Grisu2(value, buffer, &length, &K);
+	return Prettify(buffer, length, K);
+}
+
+} // namespace internal
+} // namespace rapidjson
+
+#endif // RAPIDJSON_INTERNAL_DTOA_H_
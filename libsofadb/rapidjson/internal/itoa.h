@@ -0,0 +1,99 @@
+#ifndef RAPIDJSON_INTERNAL_ITOA_H_
+#define RAPIDJSON_INTERNAL_ITOA_H_
+
+namespace rapidjson {
+namespace internal {
+
+//! Two-character decimal representations of 0..99.
+inline const char* GetDigitsLut() {
+	static const char cDigitsLut[200] = {
+		'0','0','0','1','0','2','0','3','0','4','0','5','0','6','0','7','0','8','0','9',
+		'1','0','1','1','1','2','1','3','1','4','1','5','1','6','1','7','1','8','1','9',
+		'2','0','2','1','2','2','2','3','2','4','2','5','2','6','2','7','2','8','2','9',
+		'3','0','3','1','3','2','3','3','3','4','3','5','3','6','3','7','3','8','3','9',
+		'4','0','4','1','4','2','4','3','4','4','4','5','4','6','4','7','4','8','4','9',
+		'5','0','5','1','5','2','5','3','5','4','5','5','5','6','5','7','5','8','5','9',
+		'6','0','6','1','6','2','6','3','6','4','6','5','6','6','6','7','6','8','6','9',
+		'7','0','7','1','7','2','7','3','7','4','7','5','7','6','7','7','7','8','7','9',
+		'8','0','8','1','8','2','8','3','8','4','8','5','8','6','8','7','8','8','8','9',
+		'9','0','9','1','9','2','9','3','9','4','9','5','9','6','9','7','9','8','9','9'
+	};
+	return cDigitsLut;
+}
+
+//! Powers of ten that fit into uint64_t (10^0...10^19).
+inline const uint64_t* GetPow10Lut() {
+	static const uint64_t cPow10[20] = {
+		1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL, 1000000ULL,
+		10000000ULL, 100000000ULL, 1000000000ULL, 10000000000ULL,
+		100000000000ULL, 1000000000000ULL, 10000000000000ULL,
+		100000000000000ULL, 1000000000000000ULL, 10000000000000000ULL,
+		100000000000000000ULL, 1000000000000000000ULL,
+		10000000000000000000ULL
+	};
+	return cPow10;
+}
+
+//! Number of decimal digits in \c value (at least 1).
+/*! Estimates log10 from the bit length and corrects it with a single
+	table comparison, so there is no per-digit loop.
+*/
+inline int CountDecimalDigit64(uint64_t value) {
+	value |= 1;
+#if defined(__GNUC__)
+	const int bits = 64 - __builtin_clzll(value);
+#else
+	int bits = 0;
+	for (uint64_t v = value; v; v >>= 1)
+		++bits;
+#endif
+	const int t = (bits * 1233) >> 12;
+	return t + 1 - (value < GetPow10Lut()[t] ? 1 : 0);
+}
+
+//! Writes \c value in decimal to \c buffer, returns the end of the output.
+/*! The length is known up front, so the digits are emitted backwards two
+	at a time from the lookup table. \c buffer must hold 20 characters.
+*/
+inline char* u64toa(uint64_t value, char* buffer) {
+	const char* lut = GetDigitsLut();
+	char* end = buffer + CountDecimalDigit64(value);
+	char* p = end;
+	while (value >= 100) {
+		const unsigned i = static_cast<unsigned>(value % 100) << 1;
+		value /= 100;
+		*--p = lut[i + 1];
+		*--p = lut[i];
+	}
+	if (value < 10)
+		*--p = static_cast<char>('0' + value);
+	else {
+		const unsigned i = static_cast<unsigned>(value) << 1;
+		*--p = lut[i + 1];
+		*--p = lut[i];
+	}
+	return end;
+}
+
+//! Signed variant of u64toa(), \c buffer must hold 21 characters.
+inline char* i64toa(int64_t value, char* buffer) {
+	uint64_t u = static_cast<uint64_t>(value);
+	if (value < 0) {
+		*buffer++ = '-';
+		u = ~u + 1;
+	}
+	return u64toa(u, buffer);
+}
+
+inline char* u32toa(unsigned value, char* buffer) {
+	return u64toa(value, buffer);
+}
+
+inline char* i32toa(int value, char* buffer) {
+	return i64toa(value, buffer);
+}
+
+} // namespace internal
+} // namespace rapidjson
+
+#endif // RAPIDJSON_INTERNAL_ITOA_H_
@@ -0,0 +1,48 @@
+#ifndef RAPIDJSON_INTERNAL_STRTOD_H_
+#define RAPIDJSON_INTERNAL_STRTOD_H_
+
+namespace rapidjson {
+namespace internal {
+
+//! Powers of ten that are exactly representable as doubles (10^0...10^22).
+inline double ExactPow10(int n) {
+	static const double e[] = {
+		1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+		1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+	};
+	RAPIDJSON_ASSERT(n >= 0 && n <= 22);
+	return e[n];
+}
+
+//! Clinger's fast path for significand * 10^exp.
+/*! When the significand fits into 53 bits and the power of ten is exact,
+	a single IEEE multiplication or division is correctly rounded. Returns
+	false if the value needs a full conversion (e.g. strtod()).
+*/
+inline bool StrtodFastPath(uint64_t significand, int exp, double* result) {
+	const uint64_t kMaxExact = static_cast<uint64_t>(1) << 53;
+	if (significand > kMaxExact)
+		return false;
+
+	if (exp > 22 && exp <= 22 + 15) {
+		// 123e30 == 123000000000e22 as long as the significand stays exact
+		while (exp > 22) {
+			significand *= 10;
+			if (significand > kMaxExact)
+				return false;
+			--exp;
+		}
+	}
+
+	if (exp < -22 || exp > 22)
+		return false;
+
+	const double d = static_cast<double>(significand);
+	*result = exp < 0 ? d / ExactPow10(-exp) : d * ExactPow10(exp);
+	return true;
+}
+
+} // namespace internal
+} // namespace rapidjson
+
+#endif // RAPIDJSON_INTERNAL_STRTOD_H_
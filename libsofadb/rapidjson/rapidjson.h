@@ -23,6 +23,10 @@ typedef unsigned __int64 uint64_t;
 #endif
 #endif // RAPIDJSON_NO_INT64TYPEDEF
 
+//! Construct a 64-bit literal from a pair of 32-bit halves.
+#define RAPIDJSON_UINT64_C2(high32, low32) \
+	((static_cast<uint64_t>(high32) << 32) | static_cast<uint64_t>(low32))
+
 ///////////////////////////////////////////////////////////////////////////////
 // RAPIDJSON_ENDIAN
 #define RAPIDJSON_LITTLEENDIAN	0	//!< Little endian machine
@@ -7,7 +7,9 @@
 #include "rapidjson.h"
 #include "internal/pow10.h"
 #include "internal/stack.h"
+#include "internal/strtod.h"
 #include <csetjmp>
+#include <cstdlib>	// strtod()
 
 #ifdef RAPIDJSON_SSE42
 #include <nmmintrin.h>
@@ -48,6 +50,7 @@ concept Handler {
 	void Int64(int64_t i);
 	void Uint64(uint64_t i);
 	void Double(double d);
+	void BigNum(const Ch* digits, SizeType length); // Integers beyond int64
 	void String(const Ch* str, SizeType length, bool copy);
 	void StartObject();
 	void EndObject(SizeType memberCount);
@@ -75,6 +78,7 @@ struct BaseReaderHandler {
 	void Int64(int64_t i) { Default(); }
 	void Uint64(uint64_t i) { Default(); }
 	void Double(double d) { Default(); }
+	void BigNum(const Ch* digits, SizeType length) { Default(); }
 	void String(const Ch* str, SizeType length, bool copy) { Default(); }
 	void StartObject() { Default(); }
 	void EndObject(SizeType memberCount) { Default(); }
@@ -612,20 +616,105 @@ private:
 //		stream = s; // restore stream
 	}
 #else
+	// Parse number and generate Int64, Double or BigNum event.
+	// The significand is accumulated while lexing; the raw text is only
+	// kept for numbers that need a slow conversion or don't fit into int64.
 	template<unsigned parseFlags, typename Stream, typename Handler>
 	void ParseNumber(Stream& s, Handler& handler) {
+		static const int kMaxSignificantDigits = 19; // 10^19 < 2^64
 		StackStream stackStream(stack_);
-		while (true)
-		{
-			char ch=s.Peek();
-			if (ch >= '0' && ch <= '9' || ch=='E' || ch=='e' ||
-					ch=='.' || ch=='-' || ch=='+')
+
+		bool minus = false;
+		if (s.Peek() == '-') {
+			minus = true;
+			stackStream.Put(s.Take());
+		}
+
+		// Parse int: zero / ( digit1-9 *DIGIT )
+		uint64_t significand = 0;
+		int significantDigits = 0;
+		bool truncated = false;
+		if (s.Peek() == '0')
+			stackStream.Put(s.Take());
+		else if (s.Peek() >= '1' && s.Peek() <= '9') {
+			while (s.Peek() >= '0' && s.Peek() <= '9') {
+				if (significantDigits < kMaxSignificantDigits) {
+					significand = significand * 10 + (s.Peek() - '0');
+					++significantDigits;
+				} else
+					truncated = true;
 				stackStream.Put(s.Take());
-			else
-				break;
+			}
+		}
+		else
+			RAPIDJSON_PARSE_ERROR("Expect a value here.", s.Tell());
+
+		// Parse frac = decimal-point 1*DIGIT
+		bool useDouble = false;
+		int expFrac = 0;
+		if (s.Peek() == '.') {
+			useDouble = true;
+			stackStream.Put(s.Take());
+			if (!(s.Peek() >= '0' && s.Peek() <= '9'))
+				RAPIDJSON_PARSE_ERROR("At least one digit in fraction part", s.Tell());
+
+			while (s.Peek() >= '0' && s.Peek() <= '9') {
+				if (significantDigits < kMaxSignificantDigits) {
+					significand = significand * 10 + (s.Peek() - '0');
+					if (significand != 0) // Leading zeros are not significant
+						++significantDigits;
+					--expFrac;
+				} else
+					truncated = true;
+				stackStream.Put(s.Take());
+			}
+		}
+
+		// Parse exp = e [ minus / plus ] 1*DIGIT
+		int exp = 0;
+		if (s.Peek() == 'e' || s.Peek() == 'E') {
+			useDouble = true;
+			stackStream.Put(s.Take());
+
+			bool expMinus = false;
+			if (s.Peek() == '+')
+				stackStream.Put(s.Take());
+			else if (s.Peek() == '-') {
+				expMinus = true;
+				stackStream.Put(s.Take());
+			}
+
+			if (!(s.Peek() >= '0' && s.Peek() <= '9'))
+				RAPIDJSON_PARSE_ERROR("At least one digit in exponent", s.Tell());
+			while (s.Peek() >= '0' && s.Peek() <= '9') {
+				if (exp < 100000) // Saturate, strtod() handles the rest
+					exp = exp * 10 + (s.Peek() - '0');
+				stackStream.Put(s.Take());
+			}
+			if (expMinus)
+				exp = -exp;
+		}
+
+		stackStream.Put('\0');
+		const Ch* str = stack_.template Pop<Ch>(stackStream.length_);
+		const SizeType length = stackStream.length_ - 1;
+
+		if (!useDouble) {
+			const uint64_t kMaxPositive = RAPIDJSON_UINT64_C2(0x7FFFFFFF, 0xFFFFFFFF);
+			if (!truncated && significand <= kMaxPositive + (minus ? 1 : 0)) {
+				handler.Int64(minus ? static_cast<int64_t>(~significand + 1)
+									: static_cast<int64_t>(significand));
+			} else
+				handler.BigNum(str, length);
+			return;
+		}
+
+		double d;
+		if (truncated || !internal::StrtodFastPath(significand, exp + expFrac, &d)) {
+			handler.Double(strtod(str, 0));
+			return;
 		}
-		stackStream.Put(0);
-		handler.BigNum(stack_.template Pop<Ch>(stackStream.length_), stackStream.length_ - 1);
+		handler.Double(minus ? -d : d);
 	}
 #endif //DO_PARSE_NUM
 
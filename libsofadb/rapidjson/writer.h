@@ -4,6 +4,7 @@
 #include "rapidjson.h"
 #include "internal/stack.h"
 #include "internal/strfunc.h"
+#include "internal/dtoa.h"
 #include <cstdio>	// snprintf() or _sprintf_s()
 #include <new>		// placement new
 
@@ -117,60 +118,47 @@ protected:
 	}
 
 	void WriteInt(int i) {
-		if (i < 0) {
-			stream_.Put('-');
-			i = -i;
-		}
-		WriteUint((unsigned)i);
+		char buffer[11];
+		WriteBuffer(buffer, internal::i32toa(i, buffer));
 	}
 
 	void WriteUint(unsigned u) {
 		char buffer[10];
-		char *p = buffer;
-		do {
-			*p++ = (u % 10) + '0';
-			u /= 10;
-		} while (u > 0);
-
-		do {
-			--p;
-			stream_.Put(*p);
-		} while (p != buffer);
+		WriteBuffer(buffer, internal::u32toa(u, buffer));
 	}
 
 	void WriteInt64(int64_t i64) {
-		if (i64 < 0) {
-			stream_.Put('-');
-			i64 = -i64;
-		}
-		WriteUint64((uint64_t)i64);
+		char buffer[21];
+		WriteBuffer(buffer, internal::i64toa(i64, buffer));
 	}
 
 	void WriteUint64(uint64_t u64) {
 		char buffer[20];
-		char *p = buffer;
-		do {
-			*p++ = char(u64 % 10) + '0';
-			u64 /= 10;
-		} while (u64 > 0);
-
-		do {
-			--p;
-			stream_.Put(*p);
-		} while (p != buffer);
+		WriteBuffer(buffer, internal::u64toa(u64, buffer));
 	}
 
-	//! \todo Optimization with custom double-to-string converter.
+	//! Shortest round-trip representation via Grisu2.
 	void WriteDouble(double d) {
 		char buffer[100];
+		char *end;
+		if (d - d == 0) {
+			end = internal::dtoa(d, buffer);
+		} else {
+			// NaN and infinities have no JSON form; keep the old output.
 #if _MSC_VER
-		int ret = sprintf_s(buffer, sizeof(buffer), "%.20g", d);
+			int ret = sprintf_s(buffer, sizeof(buffer), "%.20g", d);
 #else
-		int ret = snprintf(buffer, sizeof(buffer), "%.20g", d);
+			int ret = snprintf(buffer, sizeof(buffer), "%.20g", d);
 #endif
-		RAPIDJSON_ASSERT(ret >= 1);
-		for (int i = 0; i < ret; i++)
-			stream_.Put(buffer[i]);
+			RAPIDJSON_ASSERT(ret >= 1);
+			end = buffer + ret;
+		}
+		WriteBuffer(buffer, end);
+	}
+
+	void WriteBuffer(const char *begin, const char *end) {
+		for (const char *p = begin; p != end; ++p)
+			stream_.Put(*p);
 	}
 
 	void WriteString(const Ch* str, SizeType length)  {
@@ -0,0 +1,102 @@
+#include "replication.h"
+#include "errors.h"
+
+using namespace sofadb;
+
+std::vector<revs_diff_t> sofadb::revs_diff_from_json(const json_value &req)
+{
+	std::vector<revs_diff_t> res;
+	const submap_t &map=req.get_submap();
+	res.reserve(map.size());
+	for(auto i=map.begin(), iend=map.end(); i!=iend; ++i)
+	{
+		res.push_back(revs_diff_t());
+		res.back().id_=i->first;
+		const sublist_t &revs=i->second.get_sublist();
+		for(auto r=revs.begin(), rend=revs.end(); r!=rend; ++r)
+			res.back().revs_.push_back(revision_num_t(r->get_str()));
+	}
+	return res;
+}
+
+json_value sofadb::revisions_to_json(const revision_list_t &revs)
+{
+	json_value res(sublist_d);
+	for(auto i=revs.begin(), iend=revs.end(); i!=iend; ++i)
+		res.get_sublist().push_back(json_value(i->full_string()));
+	return res;
+}
+
+json_value sofadb::revs_diff_to_json(const std::vector<revs_diff_t> &entries)
+{
+	json_value res(submap_d);
+	for(auto i=entries.begin(), iend=entries.end(); i!=iend; ++i)
+	{
+		if (i->missing_.empty())
+			continue;
+		json_value &entry=res[i->id_];
+		entry=json_value(submap_d);
+		entry["missing"]=revisions_to_json(i->missing_);
+		if (!i->possible_ancestors_.empty())
+			entry["possible_ancestors"]=
+					revisions_to_json(i->possible_ancestors_);
+	}
+	return res;
+}
+
+foreign_doc_t sofadb::foreign_doc_from_json(const json_value &doc)
+{
+	foreign_doc_t res;
+	res.content_=json_value(submap_d);
+	submap_t &content=res.content_.get_submap();
+
+	const json_value *revisions=0;
+	const submap_t &map=doc.get_submap();
+	for(auto i=map.begin(), iend=map.end(); i!=iend; ++i)
+	{
+		if (i->first.empty() || i->first[0]!='_')
+			content.insert(content.end(), *i);
+		else if (i->first=="_id")
+			res.id_=i->second.get_str();
+		else if (i->first=="_rev")
+			res.rev_=revision_num_t(i->second.get_str());
+		else if (i->first=="_deleted")
+			res.deleted_=i->second.get_bool();
+		else if (i->first=="_revisions")
+			revisions=&i->second;
+	}
+	if (res.id_.empty() || res.rev_.empty())
+		err(result_code_t::sError) << "Replicated documents need _id and _rev";
+
+	if (revisions)
+	{
+		int64_t num=revisions->get_submap().at("start").get_int();
+		const sublist_t &ids=revisions->get_submap().at("ids").get_sublist();
+		if (ids.empty() || num!=res.rev_.num() ||
+				ids.front().get_str()!=res.rev_.uniq())
+			err(result_code_t::sError) << "_revisions of " << res.id_
+									   << " don't match its _rev";
+		for(auto i=ids.begin()+1, iend=ids.end(); i!=iend && --num>0; ++i)
+			res.history_.push_back(revision_num_t(num, i->get_str()));
+	}
+	return res;
+}
+
+json_value sofadb::foreign_doc_to_json(const foreign_doc_t &doc)
+{
+	json_value res(doc.content_.type()==submap_d ? doc.content_ :
+				   json_value(submap_d));
+	res["_id"]=json_value(doc.id_);
+	res["_rev"]=json_value(doc.rev_.full_string());
+	if (doc.deleted_)
+		res["_deleted"]=json_value(true);
+
+	json_value revisions(submap_d);
+	revisions["start"]=json_value(int64_t(doc.rev_.num()));
+	sublist_t &ids=revisions["ids"].as_sublist();
+	ids.push_back(json_value(doc.rev_.uniq()));
+	for(auto i=doc.history_.begin(), iend=doc.history_.end(); i!=iend; ++i)
+		ids.push_back(json_value(i->uniq()));
+	res["_revisions"]=std::move(revisions);
+	return res;
+}
@@ -0,0 +1,36 @@
+#ifndef REPLICATION_H
+#define REPLICATION_H
+
+#include "common.h"
+#include "native_json.h"
+#include "database.h"
+
+namespace sofadb {
+
+	/**
+		Conversions between the replication structures and the CouchDB
+		wire format.
+
+		revs_diff requests are {"id": ["rev", ...], ...} and responses are
+		{"id": {"missing": [...], "possible_ancestors": [...]}, ...} with
+		only the documents that miss something.
+
+		Replicated documents carry their metadata in the reserved fields:
+		_id, _rev, _deleted and _revisions = {"start": N, "ids": [...]}
+		where "ids" are the hashes of the revision and its ancestors,
+		starting with the revision itself.
+	  */
+	SOFADB_PUBLIC std::vector<revs_diff_t> revs_diff_from_json(
+		const json_value &req);
+	SOFADB_PUBLIC json_value revs_diff_to_json(
+		const std::vector<revs_diff_t> &entries);
+
+	//["rev", ...] as in _conflicts and revs_diff entries
+	SOFADB_PUBLIC json_value revisions_to_json(const revision_list_t &revs);
+
+	SOFADB_PUBLIC foreign_doc_t foreign_doc_from_json(const json_value &doc);
+	SOFADB_PUBLIC json_value foreign_doc_to_json(const foreign_doc_t &doc);
+
+}; //namespace sofadb
+
+#endif //REPLICATION_H
@@ -0,0 +1,264 @@
+#include "replicator.h"
+#include "replication.h"
+#include "storage_interface.h"
+#include "blocking_queue.h"
+#include "errors.h"
+#include <thread>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <algorithm>
+
+using namespace sofadb;
+using namespace utils;
+
+feed_source_t::feed_source_t(const jstring_t &filename) :
+	filename_(filename), reader_(filename, dump_ndjson)
+{
+}
+
+void feed_source_t::changes(uint64_t since, size_t limit,
+							std::vector<change_t> &res)
+{
+	std::vector<json_path_t> paths;
+	paths.push_back(json_path_t(1, "_id"));
+	paths.push_back(json_path_t(1, "_rev"));
+
+	reader_.seek(since);
+	const char *elem;
+	size_t len;
+	std::vector<json_value> vals;
+	for(size_t f=0; f<limit && reader_.next(&elem, &len); ++f)
+	{
+		//Only the metadata is extracted here, the fetchers parse the rest
+		vals.clear();
+		if (query_json(elem, len, paths, vals)!=2)
+			err(result_code_t::sError) << "No _id or _rev in " << filename_
+									   << " at " << reader_.position();
+		change_t change;
+		change.seq_=reader_.position();
+		change.id_=vals[0].get_str();
+		change.revs_.push_back(revision_num_t(vals[1].get_str()));
+
+		std::lock_guard<std::mutex> lock(mutex_);
+		pending_[std::make_pair(change.id_, vals[1].get_str())]=
+				std::make_pair(elem, len);
+		res.push_back(std::move(change));
+	}
+}
+
+void feed_source_t::fetch(const std::vector<revs_diff_t> &missing,
+						  std::vector<foreign_doc_t> &res)
+{
+	std::vector<std::pair<const char*, size_t> > texts;
+	for(auto i=missing.begin(), iend=missing.end(); i!=iend; ++i)
+	{
+		//The target has the other revisions, they are just dropped
+		texts.clear();
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			for(auto r=i->revs_.begin(), rend=i->revs_.end(); r!=rend; ++r)
+			{
+				const bool wanted=std::find(i->missing_.begin(),
+					i->missing_.end(), *r)!=i->missing_.end();
+				auto pos=pending_.find(std::make_pair(i->id_,
+													  r->full_string()));
+				if (pos==pending_.end())
+				{
+					if (wanted)
+						err(result_code_t::sNotFound) << "Revision " << *r
+							<< " of " << i->id_ << " is not in the feed";
+					continue;
+				}
+				if (wanted)
+					texts.push_back(pos->second);
+				pending_.erase(pos);
+			}
+		}
+		for(auto t=texts.begin(), tend=texts.end(); t!=tend; ++t)
+			res.push_back(foreign_doc_from_json(
+				string_to_json(t->first, t->second)));
+	}
+}
+
+namespace {
+	struct replication_batch_t
+	{
+		size_t num_;
+		uint64_t last_seq_;
+		size_t changes_;
+		std::vector<revs_diff_t> diff_;
+		std::vector<foreign_doc_t> docs_;
+	};
+}
+
+replicator_t::replicator_t(DbEngine &engine, database_ptr target,
+	source_ptr_t source, const replication_options_t &opts) :
+	engine_(engine), target_(target), source_(source), opts_(opts)
+{
+	if (!opts_.batch_size_)
+		opts_.batch_size_=1;
+	if (!opts_.fetchers_)
+		opts_.fetchers_=1;
+	if (!opts_.queue_depth_)
+		opts_.queue_depth_=1;
+
+	//Progress is tracked per the source
+	checkpoint_key_=jstring_t(SD_SYSTEM_DB)+"/"+target_->name()+
+			DB_SEPARATOR+"replication"+DB_SEPARATOR+source_->id();
+}
+
+uint64_t replicator_t::checkpoint()
+{
+	jstring_t saved;
+	if (!engine_.create_storage(false)->try_get(checkpoint_key_, &saved))
+		return 0;
+	return string_to_json(saved)["seq"].get_int();
+}
+
+replication_stats_t replicator_t::run()
+{
+	replication_stats_t stats;
+	stats.start_seq_=stats.last_seq_=checkpoint();
+
+	blocking_queue<replication_batch_t> to_diff(opts_.queue_depth_);
+	blocking_queue<replication_batch_t> to_fetch(opts_.queue_depth_);
+	blocking_queue<replication_batch_t> to_write(opts_.queue_depth_);
+
+	//Fetchers wait when they get queue_depth_ batches ahead of the
+	//writer, so the batches waiting to be reordered stay bounded
+	std::mutex order_mutex;
+	std::condition_variable order_cond;
+	size_t next_num=0;
+	bool aborted=false;
+
+	std::exception_ptr failure;
+	std::mutex failure_mutex;
+	auto guarded=[&](std::function<void()> fn)
+	{
+		try
+		{
+			fn();
+		} catch(...)
+		{
+			{
+				std::lock_guard<std::mutex> lock(failure_mutex);
+				if (!failure)
+					failure=std::current_exception();
+			}
+			to_diff.close();
+			to_fetch.close();
+			to_write.close();
+			std::lock_guard<std::mutex> lock(order_mutex);
+			aborted=true;
+			order_cond.notify_all();
+		}
+	};
+
+	std::thread differ([&]{
+		guarded([&]{
+			storage_ptr_t stg=engine_.create_storage(false);
+			replication_batch_t batch;
+			while(to_diff.pop(batch))
+			{
+				target_->revs_diff(stg.get(), batch.diff_);
+				if (!to_fetch.push(std::move(batch)))
+					break;
+			}
+		});
+		to_fetch.close();
+	});
+
+	std::vector<std::thread> fetchers;
+	for(size_t f=0;f<opts_.fetchers_;++f)
+		fetchers.push_back(std::thread([&]{
+			guarded([&]{
+				replication_batch_t batch;
+				while(to_fetch.pop(batch))
+				{
+					source_->fetch(batch.diff_, batch.docs_);
+					{
+						std::unique_lock<std::mutex> lock(order_mutex);
+						order_cond.wait(lock, [&]{ return aborted ||
+							batch.num_<next_num+opts_.queue_depth_; });
+						if (aborted)
+							break;
+					}
+					if (!to_write.push(std::move(batch)))
+						break;
+				}
+			});
+		}));
+
+	//Batches are fetched concurrently and may arrive out of order, the
+	//writer applies them in the order of the source
+	std::thread writer([&]{
+		guarded([&]{
+			batch_storage_ptr_t stg=engine_.create_batch_storage();
+			std::map<size_t, replication_batch_t> reorder;
+			replication_batch_t batch;
+			while(to_write.pop(batch))
+			{
+				reorder[batch.num_]=std::move(batch);
+				//Only this thread changes next_num
+				for(auto pos=reorder.find(next_num); pos!=reorder.end();
+					pos=reorder.find(next_num))
+				{
+					replication_batch_t &cur=pos->second;
+					for(auto i=cur.diff_.begin(); i!=cur.diff_.end(); ++i)
+						stats.missing_revs_+=i->missing_.size();
+
+					json_value cp(submap_d);
+					cp["seq"]=json_value(int64_t(cur.last_seq_));
+					stg->put(checkpoint_key_, json_to_string(cp));
+					stats.written_revs_+=target_->bulk_put_replicated(
+								stg.get(), cur.docs_, opts_.sync_);
+
+					stats.changes_+=cur.changes_;
+					stats.last_seq_=cur.last_seq_;
+					++stats.batches_;
+					reorder.erase(pos);
+
+					std::lock_guard<std::mutex> lock(order_mutex);
+					++next_num;
+					order_cond.notify_all();
+				}
+			}
+		});
+	});
+
+	guarded([&]{
+		uint64_t since=stats.start_seq_;
+		for(size_t num=0;;++num)
+		{
+			std::vector<change_t> changes;
+			source_->changes(since, opts_.batch_size_, changes);
+			if (changes.empty())
+				break;
+
+			replication_batch_t batch;
+			batch.num_=num;
+			batch.last_seq_=since=changes.back().seq_;
+			batch.changes_=changes.size();
+			batch.diff_.resize(changes.size());
+			for(size_t f=0;f<changes.size();++f)
+			{
+				batch.diff_[f].id_=std::move(changes[f].id_);
+				batch.diff_[f].revs_=std::move(changes[f].revs_);
+			}
+			if (!to_diff.push(std::move(batch)))
+				break;
+		}
+	});
+	to_diff.close();
+
+	differ.join();
+	for(auto i=fetchers.begin(), iend=fetchers.end(); i!=iend; ++i)
+		i->join();
+	to_write.close();
+	writer.join();
+
+	if (failure)
+		std::rethrow_exception(failure);
+	return stats;
+}
@@ -0,0 +1,135 @@
+#ifndef REPLICATOR_H
+#define REPLICATOR_H
+
+#include "common.h"
+#include "database.h"
+#include "engine.h"
+#include "dump_reader.h"
+#include <map>
+#include <mutex>
+
+namespace sofadb {
+
+	struct change_t
+	{
+		uint64_t seq_;
+		jstring_t id_;
+		//Leaf revisions of the document
+		revision_list_t revs_;
+	};
+
+	/**
+		The database being pulled from. changes() is called from a single
+		thread, fetch() is called concurrently by the fetcher threads.
+	  */
+	class replication_source_t
+	{
+	public:
+		virtual ~replication_source_t() {}
+
+		//Identifies the source in the checkpoint key
+		virtual jstring_t id() const = 0;
+
+		//Appends up to 'limit' changes after 'since', no changes means
+		//the end of the feed
+		virtual void changes(uint64_t since, size_t limit,
+							 std::vector<change_t> &res) = 0;
+
+		//Reads the missing revisions of the documents with their history.
+		//Every change of the batch is passed, the ones with nothing
+		//missing too, so the source can forget them.
+		virtual void fetch(const std::vector<revs_diff_t> &missing,
+						   std::vector<foreign_doc_t> &res) = 0;
+	};
+	typedef boost::shared_ptr<replication_source_t> source_ptr_t;
+
+	/**
+		Stand-in source reading a file with one replicated document per
+		line (the format of bulk_docs with new_edits=false). The sequence
+		of a change is the offset of the line's end. Lines are split by
+		changes() and parsed by the fetchers.
+	  */
+	class feed_source_t : public replication_source_t
+	{
+		jstring_t filename_;
+		dump_reader reader_;
+		std::mutex mutex_;
+		//Texts of the changes that haven't been fetched yet
+		std::map<std::pair<jstring_t, jstring_t>,
+			std::pair<const char*, size_t> > pending_;
+	public:
+		SOFADB_PUBLIC feed_source_t(const jstring_t &filename);
+
+		virtual jstring_t id() const { return "file:"+filename_; }
+		SOFADB_PUBLIC virtual void changes(uint64_t since, size_t limit,
+										   std::vector<change_t> &res);
+		SOFADB_PUBLIC virtual void fetch(
+			const std::vector<revs_diff_t> &missing,
+			std::vector<foreign_doc_t> &res);
+
+		//Changes read from the feed that fetch() hasn't seen yet
+		size_t unfetched()
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			return pending_.size();
+		}
+	};
+
+	struct replication_options_t
+	{
+		//Changes per batch
+		size_t batch_size_;
+		//Number of parallel fetchers
+		size_t fetchers_;
+		//Batches in flight between two stages
+		size_t queue_depth_;
+		bool sync_;
+
+		replication_options_t() : batch_size_(100), fetchers_(4),
+			queue_depth_(4), sync_(false) {}
+	};
+
+	struct replication_stats_t
+	{
+		uint64_t start_seq_, last_seq_;
+		size_t changes_, missing_revs_, written_revs_, batches_;
+
+		replication_stats_t() : start_seq_(), last_seq_(), changes_(),
+			missing_revs_(), written_revs_(), batches_() {}
+	};
+
+	/**
+		Pulls the changes from a source into a database. The work is a
+		pipeline of stages connected by bounded queues:
+		- the changes reader reads batches of changes from the source
+		- the diff stage finds the missing revisions with revs_diff
+		- the fetchers read the missing revisions in parallel
+		- the writer puts them in the original order with
+		  bulk_put_replicated
+
+		Each batch is committed together with the last source sequence
+		of the batch, so a restarted replication continues after the
+		last committed batch.
+	  */
+	class replicator_t
+	{
+		DbEngine &engine_;
+		database_ptr target_;
+		source_ptr_t source_;
+		replication_options_t opts_;
+		jstring_t checkpoint_key_;
+	public:
+		SOFADB_PUBLIC replicator_t(DbEngine &engine, database_ptr target,
+			source_ptr_t source,
+			const replication_options_t &opts=replication_options_t());
+
+		//Replicates everything up to the end of the source's changes
+		SOFADB_PUBLIC replication_stats_t run();
+
+		//Sequence the next run starts after
+		SOFADB_PUBLIC uint64_t checkpoint();
+	};
+
+}; //namespace sofadb
+
+#endif //REPLICATOR_H
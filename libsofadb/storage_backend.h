@@ -0,0 +1,74 @@
+#ifndef STORAGE_BACKEND_H
+#define STORAGE_BACKEND_H
+
+#include "common.h"
+#include "engine.h"
+#include "storage_interface.h"
+#include <map>
+
+namespace sofadb {
+
+	struct pending_write_t
+	{
+		bool removed_;
+		jstring_t value_;
+	};
+	typedef std::map<jstring_t, pending_write_t> pending_map_t;
+
+	//Backends derive their snapshots from it
+	class snapshot_t
+	{
+	public:
+		virtual ~snapshot_t() {}
+	};
+
+	/**
+		The ordered key-value store under an engine. The storages handed
+		out by the engine and the maintenance of the engine go through it,
+		so that the engine doesn't depend on the kind of the store.
+	  */
+	class storage_backend_t
+	{
+	public:
+		virtual ~storage_backend_t() {}
+
+		virtual bool get(const jstring_t &key, jstring_t *res,
+						 snapshot_t *snap=0)=0;
+		virtual void put(const jstring_t &key, const jstring_t &val,
+						 bool sync)=0;
+		virtual void remove(const jstring_t &key, bool sync)=0;
+		//Applies all the writes at once, readers see all of them or none
+		virtual void write(const pending_map_t &writes, bool sync)=0;
+		virtual std::auto_ptr<storage_iterator_t> iterate(
+			snapshot_t *snap=0)=0;
+
+		virtual snapshot_t* snapshot()=0;
+		virtual void release_snapshot(snapshot_t *snap)=0;
+
+		//Reclaims the space of the removed and overwritten keys of
+		//the range [start, limit)
+		virtual void compact_range(const jstring_t &start,
+								   const jstring_t &limit)=0;
+		virtual uint64_t approximate_size(const jstring_t &start,
+										  const jstring_t &limit)=0;
+		//Reads the range into the caches, up to 'max_bytes'. Returns the
+		//number of the bytes read.
+		virtual uint64_t warm_range(const jstring_t &start,
+			const jstring_t &limit, uint64_t max_bytes)=0;
+		//Fills the store-level part of the stats, the levels are left
+		//empty if the store has none
+		virtual void get_stats(engine_stats_t &res)=0;
+	};
+
+	typedef boost::shared_ptr<storage_backend_t> storage_backend_ptr_t;
+
+	storage_backend_ptr_t make_leveldb_backend(const jstring_t &filename,
+											   bool temporary);
+	storage_backend_ptr_t make_memory_backend();
+	//The store is a directory of segment files
+	storage_backend_ptr_t make_log_backend(const jstring_t &dir,
+		bool temporary, const storage_options_t &opts);
+
+}; //namespace sofadb
+
+#endif //STORAGE_BACKEND_H
@@ -2,6 +2,8 @@
 #define STORAGE_INTERFACE
 
 #include "common.h"
+#include <memory>
+#include <functional>
 /*
  ReadOptions opts;
  WriteOptions wo;
@@ -14,6 +16,26 @@ namespace sofadb {
 	class Database;
 	class snapshot_t;
 
+	/**
+		Ordered cursor over the keys of a storage, follows the semantics
+		of leveldb::Iterator.
+	  */
+	class storage_iterator_t
+	{
+	public:
+		virtual ~storage_iterator_t() {}
+
+		virtual bool valid() const = 0;
+		//Positions at the first key that is not less than 'key'
+		virtual void seek(const jstring_t &key) = 0;
+		virtual void seek_to_last() = 0;
+		virtual void next() = 0;
+		virtual void prev() = 0;
+
+		virtual jstring_t key() const = 0;
+		virtual jstring_t value() const = 0;
+	};
+
 	class storage_t
 	{
 	public:
@@ -22,9 +44,18 @@ namespace sofadb {
 		virtual bool try_get(const jstring_t &key, jstring_t *res,
 							 snapshot_t *snap=0)=0;
 		virtual void put(const jstring_t &key, const jstring_t &val)=0;
+		virtual void remove(const jstring_t &key)=0;
+
+		//Batch iterators see the pending writes of the batch
+		virtual std::auto_ptr<storage_iterator_t> iterate()=0;
 
 		virtual snapshot_t* snapshot() = 0;
 		virtual void release_snapshot(snapshot_t*) = 0;
+
+		//Calls 'fn' once the writes made so far are visible to other
+		//readers: right away for direct storages, after the next commit
+		//for batches. A batch dropped without committing calls it too.
+		virtual void on_commit(const std::function<void ()> &fn) = 0;
 	};
 
 	class batch_storage_t : public storage_t
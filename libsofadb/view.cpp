@@ -0,0 +1,643 @@
+#include "view.h"
+#include "database.h"
+#include "json_key.h"
+#include "binary_json.h"
+#include "errors.h"
+#include <string.h>
+#include <stdlib.h>
+
+using namespace sofadb;
+
+static void append_row_num(jstring_t &out, uint32_t num)
+{
+	for(int f=0;f<4;++f)
+		out.push_back(static_cast<char>(num >> (24-8*f)));
+}
+
+//Default target number of rows in a reduce group
+static const size_t default_group_rows = 512;
+
+static bool starts_with(const jstring_t &str, const jstring_t &prefix)
+{
+	return str.compare(0, prefix.size(), prefix)==0;
+}
+
+void reduce_partial_t::add(double val)
+{
+	if (!count_ || val<min_)
+		min_=val;
+	if (!count_ || val>max_)
+		max_=val;
+	++count_;
+	sum_+=val;
+	sumsqr_+=val*val;
+}
+
+void reduce_partial_t::combine(const reduce_partial_t &other)
+{
+	if (!other.count_)
+		return;
+	if (!count_ || other.min_<min_)
+		min_=other.min_;
+	if (!count_ || other.max_>max_)
+		max_=other.max_;
+	count_+=other.count_;
+	sum_+=other.sum_;
+	sumsqr_+=other.sumsqr_;
+}
+
+json_value reduce_partial_t::result(builtin_reduce_e reduce) const
+{
+	switch(reduce)
+	{
+		case reduce_count:
+			return json_value(int64_t(count_));
+		case reduce_sum:
+			return json_value(sum_);
+		case reduce_stats:
+		{
+			json_value res(submap_d);
+			res["sum"]=json_value(sum_);
+			res["count"]=json_value(int64_t(count_));
+			res["min"]=json_value(min_);
+			res["max"]=json_value(max_);
+			res["sumsqr"]=json_value(sumsqr_);
+			return std::move(res);
+		}
+		default:
+			return json_value();
+	}
+}
+
+static jstring_t encode_partial(const reduce_partial_t &partial)
+{
+	char buf[40];
+	memcpy(buf, &partial.count_, 8);
+	memcpy(buf+8, &partial.sum_, 8);
+	memcpy(buf+16, &partial.sumsqr_, 8);
+	memcpy(buf+24, &partial.min_, 8);
+	memcpy(buf+32, &partial.max_, 8);
+	return jstring_t(buf, sizeof(buf));
+}
+
+static reduce_partial_t decode_partial(const jstring_t &str)
+{
+	if (str.size()!=40)
+		err(result_code_t::sError) << "Corrupted reduce group";
+	reduce_partial_t res;
+	memcpy(&res.count_, str.data(), 8);
+	memcpy(&res.sum_, str.data()+8, 8);
+	memcpy(&res.sumsqr_, str.data()+16, 8);
+	memcpy(&res.min_, str.data()+24, 8);
+	memcpy(&res.max_, str.data()+32, 8);
+	return res;
+}
+
+struct View::group_t
+{
+	//First row of the group without the rows prefix, empty for the
+	//first group
+	jstring_t first_;
+	//First row of the next group
+	jstring_t next_;
+	bool has_next_;
+	reduce_partial_t partial_;
+
+	group_t() : has_next_() {}
+};
+
+View::View(database_ptr db, const jstring_t &name, map_function_t map,
+		   builtin_reduce_e reduce, const jstring_t &version) :
+	db_(db), name_(name), version_(version), map_(map), reduce_(reduce),
+	collation_(collate_native), group_rows_(default_group_rows)
+{
+	if (name_.empty() || name_.find(DB_SEPARATOR)!=jstring_t::npos)
+		err(result_code_t::sError) << "Invalid view name: " << name_;
+
+	prefix_.reserve(db_->name().size()+name_.size()+16);
+	prefix_.append(SD_VIEW_DB"/");
+	prefix_.append(db_->name());
+	prefix_.append(DB_SEPARATOR);
+	prefix_.append(name_);
+	prefix_.append(DB_SEPARATOR);
+}
+
+bool View::read_state(storage_t *ifc, uint64_t *seq)
+{
+	*seq=0;
+	jstring_t state;
+	if (!ifc->try_get(prefix_+'s', &state))
+		return true;
+
+	json_value js=string_to_json(state);
+	if (js["version"].get_str()!=version_)
+		return false;
+	//The groups are maintained only for views with a reduce
+	const submap_t &map=js.get_submap();
+	auto reduce=map.find("reduce");
+	if ((reduce==map.end() ? 0 : reduce->second.get_int())!=reduce_)
+		return false;
+	auto collation=map.find("collation");
+	if ((collation==map.end() ? 0 : collation->second.get_int())!=collation_)
+		return false;
+	*seq=js["seq"].get_int();
+	return true;
+}
+
+uint64_t View::indexed_seq(storage_t *ifc)
+{
+	uint64_t seq;
+	return read_state(ifc, &seq) ? seq : 0;
+}
+
+void View::save_state(storage_t *ifc, uint64_t seq)
+{
+	json_value state(submap_d);
+	state["seq"]=json_value(int64_t(seq));
+	state["version"]=json_value(version_);
+	state["reduce"]=json_value(int64_t(reduce_));
+	state["collation"]=json_value(int64_t(collation_));
+	ifc->put(prefix_+'s', json_to_string(state));
+}
+
+void View::clear(batch_storage_t *ifc, size_t commit_every)
+{
+	std::auto_ptr<storage_iterator_t> it=ifc->iterate();
+	size_t pending=0;
+	for(it->seek(prefix_); it->valid(); it->next())
+	{
+		const jstring_t key=it->key();
+		if (key.compare(0, prefix_.size(), prefix_)!=0)
+			break;
+		ifc->remove(key);
+		if (++pending>=commit_every)
+		{
+			ifc->commit(false);
+			pending=0;
+		}
+	}
+	ifc->commit(false);
+}
+
+void View::index_document(storage_t *ifc, const jstring_t &id)
+{
+	const jstring_t rows=prefix_+'r';
+	const jstring_t back_key=prefix_+'b'+id;
+
+	//Drop the rows emitted by the previous revision
+	jstring_t old;
+	const bool had_rows=ifc->try_get(back_key, &old);
+	if (had_rows)
+	{
+		json_value old_rows=binary_to_json(old);
+		const sublist_t &lst=old_rows.get_sublist();
+		for(auto i=lst.begin(), iend=lst.end(); i!=iend; ++i)
+		{
+			const jstring_t row_key=rows+i->get_str();
+			double val=0;
+			if (reduce_!=reduce_none && reduce_!=reduce_count)
+			{
+				jstring_t old_val;
+				if (ifc->try_get(row_key, &old_val))
+					val=reduced_value(binary_to_json(old_val), id);
+			}
+			ifc->remove(row_key);
+			if (reduce_!=reduce_none)
+				remove_reduced_row(ifc, i->get_str(), val);
+		}
+	}
+
+	json_value doc;
+	revision_t rev;
+	json_value emitted(sublist_d);
+	if (db_->get(ifc, id, 0, &doc, &rev) && !rev.deleted_)
+	{
+		//Rows are ordered by the key, then by the document id and then
+		//by the emission order
+		const jstring_t enc_id=json_to_key(json_value(id));
+		uint32_t num=0;
+		map_(id, doc, [&](const json_value &key, const json_value &value)
+		{
+			jstring_t row;
+			json_to_key(row, key, collation_);
+			row.append(enc_id);
+			append_row_num(row, num++);
+
+			const double reduced=reduced_value(value, id);
+			jstring_t val;
+			json_to_binary(val, value);
+			ifc->put(rows+row, val);
+			if (reduce_!=reduce_none)
+				add_reduced_row(ifc, row, reduced);
+			emitted.get_sublist().push_back(json_value(std::move(row)));
+		});
+	}
+
+	if (!emitted.get_sublist().empty())
+	{
+		jstring_t back;
+		json_to_binary(back, emitted);
+		ifc->put(back_key, back);
+	} else if (had_rows)
+		ifc->remove(back_key);
+}
+
+uint64_t View::update(batch_storage_t *ifc, size_t commit_every)
+{
+	std::lock_guard<std::mutex> lock(update_mutex_);
+
+	uint64_t seq;
+	if (!read_state(ifc, &seq))
+	{
+		//The map function has changed, start from scratch
+		clear(ifc, commit_every);
+		seq=0;
+		save_state(ifc, seq);
+		ifc->commit(false);
+	}
+
+	size_t pending=0;
+	db_->changes_since(ifc, seq,
+		[&](uint64_t change_seq, const jstring_t &id) -> bool
+	{
+		index_document(ifc, id);
+		seq=change_seq;
+		if (++pending>=commit_every)
+		{
+			save_state(ifc, seq);
+			ifc->commit(false);
+			pending=0;
+		}
+		return true;
+	});
+
+	if (pending)
+	{
+		save_state(ifc, seq);
+		ifc->commit(false);
+	}
+	return seq;
+}
+
+void View::row_bounds(const view_query_t &query,
+					  jstring_t *lower, jstring_t *upper)
+{
+	const jstring_t rows=prefix_+'r';
+	//Rows with the same key differ in the id suffix which always starts
+	//with a string tag, so key+0xFF is past all of them.
+	const char past_key='\xFF';
+
+	//Bounds are [lower, upper)
+	*lower=rows;
+	*upper=prefix_+char('r'+1);
+	const json_value *low_key=query.descending_ ?
+		(query.has_end_key_ ? &query.end_key_ : 0) :
+		(query.has_start_key_ ? &query.start_key_ : 0);
+	const json_value *high_key=query.descending_ ?
+		(query.has_start_key_ ? &query.start_key_ : 0) :
+		(query.has_end_key_ ? &query.end_key_ : 0);
+	if (low_key)
+	{
+		json_to_key(*lower, *low_key, collation_);
+		if (query.descending_ && !query.inclusive_end_)
+			lower->push_back(past_key);
+	}
+	if (high_key)
+	{
+		*upper=rows;
+		json_to_key(*upper, *high_key, collation_);
+		if (query.descending_ || query.inclusive_end_)
+			upper->push_back(past_key);
+	}
+}
+
+void View::query(storage_t *ifc, const view_query_t &query,
+				 std::vector<view_row_t> &res)
+{
+	const jstring_t rows=prefix_+'r';
+	jstring_t lower, upper;
+	row_bounds(query, &lower, &upper);
+
+	std::auto_ptr<storage_iterator_t> it=ifc->iterate();
+	if (query.descending_)
+	{
+		it->seek(upper);
+		if (it->valid())
+			it->prev();
+		else
+			it->seek_to_last();
+	} else
+		it->seek(lower);
+
+	size_t skip=query.skip_;
+	for(; it->valid() && res.size()<query.limit_;
+		query.descending_ ? it->prev() : it->next())
+	{
+		const jstring_t key=it->key();
+		if (key<lower || !(key<upper))
+			break;
+		if (skip)
+		{
+			--skip;
+			continue;
+		}
+
+		view_row_t row;
+		const char *data=key.data()+rows.size();
+		size_t len=key.size()-rows.size();
+		size_t consumed=key_to_json(data, len, row.key_);
+		json_value id;
+		key_to_json(data+consumed, len-consumed, id);
+		row.id_=std::move(id.get_str());
+		row.value_=binary_to_json(it->value());
+		res.push_back(std::move(row));
+	}
+}
+
+double View::reduced_value(const json_value &val, const jstring_t &id)
+{
+	if (reduce_==reduce_none || reduce_==reduce_count)
+		return 0;
+
+	switch(val.type())
+	{
+		case int_d:
+			return double(val.get_int());
+		case double_d:
+			return val.get_double();
+		case big_int_d:
+			return strtod(val.get_big_int().digits_.c_str(), 0);
+		case graft_d:
+			return reduced_value(val.get_graft().grafted(), id);
+		default:
+			err(result_code_t::sError) << "View " << name_ << " reduces "
+				"numbers only, document " << id << " emitted a non-number";
+	}
+	return 0;
+}
+
+bool View::find_group(storage_t *ifc, const jstring_t &row, group_t &grp)
+{
+	const jstring_t groups=prefix_+'g';
+	const jstring_t target=groups+row;
+
+	std::auto_ptr<storage_iterator_t> it=ifc->iterate();
+	it->seek(target);
+	if (!it->valid())
+		it->seek_to_last();
+	else if (it->key()!=target)
+		it->prev();
+	if (!it->valid() || !starts_with(it->key(), groups))
+		return false;
+
+	grp.first_=it->key().substr(groups.size());
+	grp.partial_=decode_partial(it->value());
+	it->next();
+	grp.has_next_=it->valid() && starts_with(it->key(), groups);
+	if (grp.has_next_)
+		grp.next_=it->key().substr(groups.size());
+	return true;
+}
+
+void View::save_group(storage_t *ifc, const group_t &grp)
+{
+	ifc->put(prefix_+'g'+grp.first_, encode_partial(grp.partial_));
+}
+
+void View::scan_group(storage_t *ifc, const group_t &grp,
+					  std::vector<std::pair<jstring_t, double> > &res)
+{
+	const jstring_t rows=prefix_+'r';
+	const jstring_t end=grp.has_next_ ? rows+grp.next_ : prefix_+char('r'+1);
+
+	std::auto_ptr<storage_iterator_t> it=ifc->iterate();
+	for(it->seek(rows+grp.first_); it->valid(); it->next())
+	{
+		const jstring_t key=it->key();
+		if (!(key<end))
+			break;
+		const double val=reduce_==reduce_count ? 0 :
+			reduced_value(binary_to_json(it->value()), jstring_t());
+		res.push_back(std::make_pair(key.substr(rows.size()), val));
+	}
+}
+
+void View::add_reduced_row(storage_t *ifc, const jstring_t &row, double val)
+{
+	group_t grp;
+	find_group(ifc, row, grp); //The first group is created on demand
+	grp.partial_.add(val);
+	if (grp.partial_.count_<=2*group_rows_)
+	{
+		save_group(ifc, grp);
+		return;
+	}
+
+	//Split the group in halves, the partials are recomputed from the
+	//rows so that the float sums don't drift
+	std::vector<std::pair<jstring_t, double> > rows;
+	scan_group(ifc, grp, rows);
+	const size_t mid=rows.size()/2;
+
+	group_t upper;
+	upper.first_=rows.at(mid).first;
+	grp.partial_=reduce_partial_t();
+	for(size_t f=0;f<rows.size();++f)
+		(f<mid ? grp : upper).partial_.add(rows[f].second);
+	save_group(ifc, grp);
+	save_group(ifc, upper);
+}
+
+void View::remove_reduced_row(storage_t *ifc, const jstring_t &row,
+							  double val)
+{
+	group_t grp;
+	if (!find_group(ifc, row, grp))
+		return;
+
+	reduce_partial_t &part=grp.partial_;
+	if (part.count_<=1)
+		part=reduce_partial_t();
+	else if (reduce_==reduce_stats && (val<=part.min_ || val>=part.max_))
+	{
+		//Min and max can't be subtracted, recompute them from the rows
+		//(the removed row is already gone)
+		std::vector<std::pair<jstring_t, double> > rows;
+		scan_group(ifc, grp, rows);
+		part=reduce_partial_t();
+		for(auto i=rows.begin(), iend=rows.end(); i!=iend; ++i)
+			part.add(i->second);
+	} else
+	{
+		--part.count_;
+		part.sum_-=val;
+		part.sumsqr_-=val*val;
+	}
+
+	if (grp.first_.empty() || part.count_>group_rows_/4)
+	{
+		save_group(ifc, grp);
+		return;
+	}
+
+	//Merge a small group into the preceding one
+	const jstring_t groups=prefix_+'g';
+	std::auto_ptr<storage_iterator_t> it=ifc->iterate();
+	it->seek(groups+grp.first_);
+	it->prev();
+	if (!it->valid() || !starts_with(it->key(), groups))
+	{
+		save_group(ifc, grp);
+		return;
+	}
+	reduce_partial_t prev=decode_partial(it->value());
+	if (prev.count_+part.count_>2*group_rows_)
+	{
+		save_group(ifc, grp);
+		return;
+	}
+	prev.combine(part);
+	ifc->put(it->key(), encode_partial(prev));
+	ifc->remove(groups+grp.first_);
+}
+
+reduce_partial_t View::reduce_range(storage_t *ifc, const jstring_t &lower,
+									const jstring_t &upper)
+{
+	const jstring_t rows=prefix_+'r';
+	const jstring_t groups=prefix_+'g';
+	const jstring_t rows_end=prefix_+char('r'+1);
+	reduce_partial_t res;
+
+	auto add_rows=[&](const jstring_t &from, const jstring_t &to)
+	{
+		std::auto_ptr<storage_iterator_t> it=ifc->iterate();
+		for(it->seek(from); it->valid(); it->next())
+		{
+			const jstring_t key=it->key();
+			if (!(key<to))
+				break;
+			res.add(reduce_==reduce_count ? 0 :
+				reduced_value(binary_to_json(it->value()), jstring_t()));
+		}
+	};
+
+	//The first group that starts inside the range
+	std::auto_ptr<storage_iterator_t> it=ifc->iterate();
+	it->seek(groups+lower.substr(rows.size()));
+	if (!it->valid() || !starts_with(it->key(), groups))
+	{
+		add_rows(lower, upper);
+		return res;
+	}
+
+	//Rows before it belong to a group that is only partially covered
+	jstring_t group_start=rows+it->key().substr(groups.size());
+	if (!(group_start<upper))
+	{
+		add_rows(lower, upper);
+		return res;
+	}
+	add_rows(lower, group_start);
+
+	while(true)
+	{
+		const reduce_partial_t part=decode_partial(it->value());
+		it->next();
+		const bool has_next=it->valid() && starts_with(it->key(), groups);
+		const jstring_t group_end=has_next ?
+			rows+it->key().substr(groups.size()) : rows_end;
+
+		if (group_end>upper)
+		{
+			add_rows(group_start, upper);
+			break;
+		}
+		res.combine(part);
+		if (!has_next)
+			break;
+		group_start=group_end;
+	}
+	return res;
+}
+
+json_value View::reduce(storage_t *ifc, const view_query_t &query)
+{
+	if (reduce_==reduce_none)
+		err(result_code_t::sError) << "View " << name_ << " has no reduce";
+
+	jstring_t lower, upper;
+	row_bounds(query, &lower, &upper);
+	return reduce_range(ifc, lower, upper).result(reduce_);
+}
+
+void View::reduce_groups(storage_t *ifc, const view_query_t &query,
+						 size_t group_level, std::vector<view_row_t> &res)
+{
+	if (group_level==0)
+	{
+		if (!query.skip_ && query.limit_)
+		{
+			view_row_t row;
+			row.value_=reduce(ifc, query);
+			res.push_back(std::move(row));
+		}
+		return;
+	}
+	if (reduce_==reduce_none)
+		err(result_code_t::sError) << "View " << name_ << " has no reduce";
+
+	const jstring_t rows=prefix_+'r';
+	jstring_t lower, upper;
+	row_bounds(query, &lower, &upper);
+
+	size_t skip=query.skip_;
+	jstring_t cur=query.descending_ ? upper : lower;
+	while(res.size()<query.limit_)
+	{
+		//Find the next row in the iteration order
+		std::auto_ptr<storage_iterator_t> it=ifc->iterate();
+		it->seek(cur);
+		if (query.descending_)
+		{
+			if (it->valid())
+				it->prev();
+			else
+				it->seek_to_last();
+		}
+		if (!it->valid())
+			break;
+		const jstring_t key=it->key();
+		if (key<lower || !(key<upper))
+			break;
+
+		view_row_t row;
+		key_to_json(key.data()+rows.size(), key.size()-rows.size(),
+					row.key_);
+
+		//All rows of the group share the encoded prefix. For lists that
+		//are truncated it's the encoding of the truncated list without
+		//its terminator, shorter lists are grouped by the exact key.
+		jstring_t group_start=rows;
+		if (row.key_.type()==sublist_d && group_level!=group_exact &&
+				row.key_.get_sublist().size()>=group_level)
+		{
+			row.key_.get_sublist().resize(group_level);
+			json_to_key(group_start, row.key_, collation_);
+			group_start.resize(group_start.size()-1);
+		} else
+			json_to_key(group_start, row.key_, collation_);
+		const jstring_t group_end=group_start+'\xFF';
+
+		if (skip)
+			--skip;
+		else
+		{
+			row.value_=reduce_range(ifc,
+				group_start<lower ? lower : group_start,
+				group_end<upper ? group_end : upper).result(reduce_);
+			res.push_back(std::move(row));
+		}
+		cur=query.descending_ ? group_start : group_end;
+	}
+}
@@ -0,0 +1,188 @@
+#ifndef VIEW_H
+#define VIEW_H
+
+#include "common.h"
+#include "native_json.h"
+#include "storage_interface.h"
+#include "json_key.h"
+#include <functional>
+#include <mutex>
+
+namespace sofadb {
+	class Database;
+	typedef boost::shared_ptr<Database> database_ptr;
+
+	typedef std::function<void (const json_value &key,
+								const json_value &value)> emit_function_t;
+	//Called for every live document, emits any number of rows
+	typedef std::function<void (const jstring_t &id, const json_value &doc,
+								const emit_function_t &emit)> map_function_t;
+
+	struct view_row_t
+	{
+		json_value key_;
+		jstring_t id_;
+		json_value value_;
+	};
+
+	/**
+		Key range query. Like in CouchDB, the start key is the upper
+		bound for descending queries.
+	  */
+	struct view_query_t
+	{
+		json_value start_key_, end_key_;
+		bool has_start_key_, has_end_key_;
+		bool inclusive_end_;
+		bool descending_;
+		size_t skip_, limit_;
+
+		view_query_t() : has_start_key_(), has_end_key_(),
+			inclusive_end_(true), descending_(), skip_(), limit_(size_t(-1))
+		{
+		}
+
+		void set_start_key(const json_value &key)
+		{
+			start_key_=key;
+			has_start_key_=true;
+		}
+		void set_end_key(const json_value &key)
+		{
+			end_key_=key;
+			has_end_key_=true;
+		}
+	};
+
+	//CouchDB built-in reduce functions
+	enum builtin_reduce_e
+	{
+		reduce_none,
+		reduce_count,
+		reduce_sum,
+		reduce_stats,
+	};
+
+	//group_level value to group by the full key (CouchDB's group=true)
+	const size_t group_exact = size_t(-1);
+
+	/**
+		Reduction of a set of rows. All built-in reduces are derived from
+		it, and partials of adjacent row ranges can be combined.
+	  */
+	struct reduce_partial_t
+	{
+		uint64_t count_;
+		double sum_, sumsqr_, min_, max_;
+
+		reduce_partial_t() : count_(), sum_(), sumsqr_(), min_(), max_() {}
+
+		SOFADB_PUBLIC void add(double val);
+		SOFADB_PUBLIC void combine(const reduce_partial_t &other);
+		SOFADB_PUBLIC json_value result(builtin_reduce_e reduce) const;
+	};
+
+	/**
+		Map view over a database. The index is kept in the SD_VIEW_DB
+		prefix:
+		- view/r + key + id + n -> value, rows ordered by the collation
+		  of json_to_key, native or CouchDB's
+		- view/b + id -> rows emitted by the document, used to drop them
+		  when the document changes
+		- view/g + first row -> reduce_partial_t of a group of adjacent
+		  rows, present only for views with a reduce
+		- view/s -> {"seq": last indexed sequence, "version": version}
+
+		update() feeds documents changed since the last indexed sequence
+		to the map function, so the cost of an update is proportional to
+		the number of changes. Changing the version discards the index.
+
+		Each row belongs to the group with the closest preceding first
+		row (the first group starts at the empty key). Row updates adjust
+		the partial of their group, groups are split when they grow past
+		twice the group size and merged into the preceding group when
+		they shrink below a quarter of it. A range reduce combines the
+		partials of the groups inside the range and reads only the rows
+		of the groups at its edges.
+	  */
+	class View
+	{
+		database_ptr db_;
+		jstring_t name_, version_;
+		map_function_t map_;
+		builtin_reduce_e reduce_;
+		key_collation_e collation_;
+		size_t group_rows_;
+		jstring_t prefix_;
+		std::mutex update_mutex_;
+	public:
+		SOFADB_PUBLIC View(database_ptr db, const jstring_t &name,
+						   map_function_t map,
+						   builtin_reduce_e reduce=reduce_none,
+						   const jstring_t &version=jstring_t());
+
+		//Target number of rows in a reduce group
+		void set_group_rows(size_t rows) { group_rows_=rows ? rows : 1; }
+		//Key order of the rows, changing it discards the index
+		void set_collation(key_collation_e collation)
+		{
+			collation_=collation;
+		}
+
+		/**
+			Brings the index up to date. Changes are committed every
+			'commit_every' documents together with the indexed sequence,
+			so an interrupted update continues from the last commit.
+			Returns the indexed sequence.
+		  */
+		SOFADB_PUBLIC uint64_t update(batch_storage_t *ifc,
+									  size_t commit_every=1000);
+		SOFADB_PUBLIC uint64_t indexed_seq(storage_t *ifc);
+
+		//Reads rows from the index as is, call update() to refresh it
+		SOFADB_PUBLIC void query(storage_t *ifc, const view_query_t &query,
+								 std::vector<view_row_t> &res);
+
+		//Reduces all rows in the range into a single value
+		SOFADB_PUBLIC json_value reduce(storage_t *ifc,
+										const view_query_t &query);
+		/**
+			Reduces rows grouped by the first 'group_level' elements of
+			their keys (keys that are not lists are grouped as a whole).
+			Skip and limit apply to the groups, the rows have the group
+			keys and no ids.
+		  */
+		SOFADB_PUBLIC void reduce_groups(storage_t *ifc,
+										 const view_query_t &query,
+										 size_t group_level,
+										 std::vector<view_row_t> &res);
+
+		const jstring_t& name() const { return name_; }
+	private:
+		struct group_t;
+
+		bool read_state(storage_t *ifc, uint64_t *seq);
+		void save_state(storage_t *ifc, uint64_t seq);
+		void clear(batch_storage_t *ifc, size_t commit_every);
+		void index_document(storage_t *ifc, const jstring_t &id);
+		void row_bounds(const view_query_t &query,
+						jstring_t *lower, jstring_t *upper);
+
+		double reduced_value(const json_value &val, const jstring_t &id);
+		bool find_group(storage_t *ifc, const jstring_t &row, group_t &grp);
+		void save_group(storage_t *ifc, const group_t &grp);
+		void scan_group(storage_t *ifc, const group_t &grp,
+						std::vector<std::pair<jstring_t, double> > &rows);
+		void add_reduced_row(storage_t *ifc, const jstring_t &row,
+							 double val);
+		void remove_reduced_row(storage_t *ifc, const jstring_t &row,
+								double val);
+		reduce_partial_t reduce_range(storage_t *ifc, const jstring_t &lower,
+									  const jstring_t &upper);
+	};
+
+	typedef boost::shared_ptr<View> view_ptr;
+
+}; //namespace sofadb
+
+#endif //VIEW_H
@@ -0,0 +1,192 @@
+#include "common.h"
+#include "engine.h"
+#include "errors.h"
+#include "database.h"
+#include "replication.h"
+#include "replicator.h"
+#include "server_common.h"
+#include <gflags/gflags.h>
+#include <scope_guard.h>
+#include <boost/lexical_cast.hpp>
+
+#include <iostream>
+#include <mutex>
+
+using boost::asio::local::stream_protocol;
+using namespace sofadb;
+
+DEFINE_string(socket_dir, "/tmp", "Server socket path");
+DEFINE_string(socket_name, "", "Server socket name");
+DEFINE_string(source_file, "", "Database file of the source server");
+DEFINE_string(source_db, "", "Source database");
+DEFINE_string(feed, "", "Pull from a file of replicated documents instead");
+DEFINE_int32(batch_size, 100, "Number of changes per batch");
+DEFINE_int32(fetchers, 4, "Number of parallel fetchers");
+DEFINE_int32(queue_depth, 4, "Batches in flight between the stages");
+DEFINE_bool(sync, false, "Sync every batch to the disk");
+
+/**
+	Pulls from a SofaDB server over the local socket protocol. Each
+	fetcher borrows its own connection so the requests are pipelined
+	across the connections.
+  */
+class socket_source_t : public replication_source_t
+{
+	jstring_t socket_file_, db_file_, db_name_;
+	boost::asio::io_service io_service_;
+	std::mutex mutex_;
+	std::vector<socket_ptr_t> idle_;
+public:
+	socket_source_t(const jstring_t &socket_file, const jstring_t &db_file,
+					const jstring_t &db_name) :
+		socket_file_(socket_file), db_file_(db_file), db_name_(db_name)
+	{
+	}
+
+	virtual ~socket_source_t()
+	{
+		//Let the server end the sessions
+		for(auto i=idle_.begin(), iend=idle_.end(); i!=iend; ++i)
+		{
+			try
+			{
+				write_str(*i, "FIN");
+				write_str(*i, db_name_);
+			} catch(const std::exception &)
+			{
+			}
+		}
+	}
+
+	virtual jstring_t id() const
+	{
+		return "socket:"+socket_file_+":"+db_file_+":"+db_name_;
+	}
+
+	virtual void changes(uint64_t since, size_t limit,
+						 std::vector<change_t> &res)
+	{
+		socket_ptr_t sock=borrow();
+		write_str(sock, "CHANGES");
+		write_str(sock, db_name_);
+		write_str(sock, boost::lexical_cast<std::string>(since));
+		write_uint32(sock, limit);
+		json_value changes=string_to_json(read_str(sock));
+		give_back(sock);
+
+		const sublist_t &lst=changes.get_sublist();
+		for(auto i=lst.begin(), iend=lst.end(); i!=iend; ++i)
+		{
+			const sublist_t &item=i->get_sublist();
+			change_t change;
+			change.seq_=item.at(0).get_int();
+			change.id_=item.at(1).get_str();
+			const sublist_t &revs=item.at(2).get_sublist();
+			for(auto r=revs.begin(), rend=revs.end(); r!=rend; ++r)
+				change.revs_.push_back(revision_num_t(r->get_str()));
+			res.push_back(std::move(change));
+		}
+	}
+
+	virtual void fetch(const std::vector<revs_diff_t> &missing,
+					   std::vector<foreign_doc_t> &res)
+	{
+		json_value req(submap_d);
+		for(auto i=missing.begin(), iend=missing.end(); i!=iend; ++i)
+		{
+			json_value &revs=req[i->id_];
+			revs=json_value(sublist_d);
+			for(auto r=i->missing_.begin(); r!=i->missing_.end(); ++r)
+				revs.get_sublist().push_back(json_value(r->full_string()));
+		}
+
+		socket_ptr_t sock=borrow();
+		write_str(sock, "BULK_GET");
+		write_str(sock, db_name_);
+		write_str(sock, json_to_string(req));
+		json_value docs=string_to_json(read_str(sock));
+		give_back(sock);
+
+		const sublist_t &lst=docs.get_sublist();
+		for(auto i=lst.begin(), iend=lst.end(); i!=iend; ++i)
+			res.push_back(foreign_doc_from_json(*i));
+	}
+
+private:
+	socket_ptr_t borrow()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			if (!idle_.empty())
+			{
+				socket_ptr_t res=idle_.back();
+				idle_.pop_back();
+				return res;
+			}
+		}
+		socket_ptr_t res(new stream_protocol::socket(io_service_));
+		res->connect(stream_protocol::endpoint(socket_file_));
+		write_str(res, db_file_);
+		return res;
+	}
+
+	//Connections that failed mid-request are not returned
+	void give_back(socket_ptr_t sock)
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		idle_.push_back(sock);
+	}
+};
+
+int main(int argc, char **argv)
+{
+	ON_BLOCK_EXIT(&google::ShutDownCommandLineFlags);
+	google::SetUsageMessage("Usage: sofa_replicate [options] <engine path> "
+							"<database>");
+	google::ParseCommandLineFlags(&argc, &argv, true);
+	if (argc!=3 || (FLAGS_feed.empty() &&
+					(FLAGS_source_file.empty() || FLAGS_source_db.empty())))
+	{
+		std::cerr << google::ProgramUsage() << std::endl;
+		return 1;
+	}
+
+	std::string socket_file = FLAGS_socket_dir;
+	if (!socket_file.empty() && socket_file.at(socket_file.length()-1)!='/')
+		socket_file.append(1, '/');
+	if (FLAGS_socket_name.empty())
+		socket_file.append("=").append(int_to_string(getuid()));
+	else
+		socket_file.append(FLAGS_socket_name);
+
+	try
+	{
+		DbEngine engine(argv[1], false);
+		database_ptr db=engine.create_a_database(argv[2]);
+
+		source_ptr_t source;
+		if (!FLAGS_feed.empty())
+			source.reset(new feed_source_t(FLAGS_feed));
+		else
+			source.reset(new socket_source_t(socket_file, FLAGS_source_file,
+											 FLAGS_source_db));
+
+		replication_options_t opts;
+		opts.batch_size_=FLAGS_batch_size>0 ? FLAGS_batch_size : 1;
+		opts.fetchers_=FLAGS_fetchers>0 ? FLAGS_fetchers : 1;
+		opts.queue_depth_=FLAGS_queue_depth>0 ? FLAGS_queue_depth : 1;
+		opts.sync_=FLAGS_sync;
+
+		replicator_t replicator(engine, db, source, opts);
+		replication_stats_t stats=replicator.run();
+		std::cerr << "Replicated " << stats.changes_ << " changes ("
+				  << stats.written_revs_ << " new revisions) from seq "
+				  << stats.start_seq_ << " to " << stats.last_seq_
+				  << std::endl;
+	} catch(const std::exception &ex)
+	{
+		std::cerr << ex.what() << std::endl;
+		return 2;
+	}
+	return 0;
+}
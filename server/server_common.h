@@ -10,6 +10,7 @@ namespace sofadb {
 		GET_BODY = 2,
 		GET_REVINFO = 4,
 		GET_REVLOG = 8,
+		GET_CONFLICTS = 16,
 	};
 
 	using boost::asio::local::stream_protocol;
@@ -3,6 +3,9 @@
 #include "errors.h"
 #include "database.h"
 #include "server_common.h"
+#include "replication.h"
+#include "storage_interface.h"
+#include "metrics.h"
 #include <gflags/gflags.h>
 #include <scope_guard.h>
 
@@ -11,6 +14,9 @@
 #define BOOST_HAS_RVALUE_REFS
 
 #include <iostream>
+#include <sstream>
+#include <string.h>
+#include <boost/lexical_cast.hpp>
 
 using boost::asio::local::stream_protocol;
 using namespace sofadb;
@@ -20,6 +26,12 @@ typedef boost::shared_ptr<stream_protocol::socket> socket_ptr_t;
 DEFINE_string(socket_dir, "/tmp", "Listen socket path");
 DEFINE_string(socket_name, "", "Listen socket name");
 DEFINE_int32(socket_backlog, 10, "Maximum socket backlog");
+DEFINE_bool(preload_databases, false,
+			"Open the database handles in the background on engine start");
+DEFINE_bool(warm_up, false, "Read the ranges used by the previous run "
+			"into the caches on engine start");
+DEFINE_string(preopen, "",
+			  "Comma-separated database files opened before accepting");
 
 struct engine_registry
 {
@@ -28,6 +40,35 @@ struct engine_registry
 };
 typedef boost::shared_ptr<engine_registry> registry_ptr;
 
+//Database files named "memory:..." are kept in memory only, the ones
+//named "log:<dir>" are stored in append-only segments in <dir>
+static const char memory_engine_prefix[]="memory:";
+static const char log_engine_prefix[]="log:";
+
+static bool has_prefix(const std::string &name, const char *prefix)
+{
+	return name.compare(0, strlen(prefix), prefix)==0;
+}
+
+static engine_ptr open_engine(const std::string &dbfile)
+{
+	storage_options_t opts;
+	opts.preload_databases_=FLAGS_preload_databases;
+	opts.warm_up_=FLAGS_warm_up;
+	if (has_prefix(dbfile, memory_engine_prefix))
+	{
+		opts.kind_=storage_memory;
+		return engine_ptr(new DbEngine(dbfile, false, opts));
+	}
+	if (has_prefix(dbfile, log_engine_prefix))
+	{
+		opts.kind_=storage_log;
+		return engine_ptr(new DbEngine(
+			dbfile.substr(strlen(log_engine_prefix)), false, opts));
+	}
+	return engine_ptr(new DbEngine(dbfile, false, opts));
+}
+
 void do_document_get(database_ptr db, engine_ptr engine, socket_ptr_t sock)
 {
 	uint32_t params = read_uint32(sock);
@@ -45,7 +86,7 @@ void do_document_get(database_ptr db, engine_ptr engine, socket_ptr_t sock)
 					 rnum.empty() ? 0 : &rnum,
 					 params & GET_BODY ? &content : 0,
 					 params & GET_REVINFO ? &rev_res : 0,
-					 params & GET_REVLOG ? &rev_log : 0);
+					 params & (GET_REVLOG|GET_CONFLICTS) ? &rev_log : 0);
 	if (!res)
 	{
 		write_uint32(sock, 0);
@@ -58,6 +99,17 @@ void do_document_get(database_ptr db, engine_ptr engine, socket_ptr_t sock)
 			write_str(sock, rev_res.rev_.full_string());
 		if (params & GET_REVLOG)
 			write_str(sock, json_to_string(rev_log));
+		if (params & GET_CONFLICTS)
+		{
+			//The way CouchDB reports them with conflicts=true
+			doc_conflicts_t conflicts;
+			Database::conflicts_from_revlog(rev_log, conflicts);
+			json_value res(submap_d);
+			res["_conflicts"]=revisions_to_json(conflicts.conflicts_);
+			res["_deleted_conflicts"]=revisions_to_json(
+						conflicts.deleted_conflicts_);
+			write_str(sock, json_to_string(res));
+		}
 	}
 }
 
@@ -76,6 +128,100 @@ void do_command_put(database_ptr db, engine_ptr engine, socket_ptr_t sock)
 	write_str(sock, res.assigned_rev_.full_string());
 }
 
+void do_command_revs_diff(database_ptr db, engine_ptr engine,
+						  socket_ptr_t sock)
+{
+	std::vector<revs_diff_t> entries=revs_diff_from_json(
+				string_to_json(read_str(sock)));
+	db->revs_diff(engine->create_storage(false).get(), entries);
+	write_str(sock, json_to_string(revs_diff_to_json(entries)));
+}
+
+void do_command_bulk_docs(database_ptr db, engine_ptr engine,
+						  socket_ptr_t sock)
+{
+	//Only the replicator's new_edits=false form is supported
+	json_value docs=string_to_json(read_str(sock));
+	std::vector<foreign_doc_t> foreign;
+	const sublist_t &lst=docs.get_sublist();
+	foreign.reserve(lst.size());
+	for(auto i=lst.begin(), iend=lst.end(); i!=iend; ++i)
+		foreign.push_back(foreign_doc_from_json(*i));
+
+	size_t written=db->bulk_put_replicated(
+				engine->create_batch_storage().get(), foreign, false);
+	write_uint32(sock, written);
+}
+
+void do_command_changes(database_ptr db, engine_ptr engine, socket_ptr_t sock)
+{
+	uint64_t since=boost::lexical_cast<uint64_t>(read_str(sock));
+	uint32_t limit=read_uint32(sock);
+
+	//[[seq, id, [leaf revisions]], ...]
+	storage_ptr_t stg=engine->create_storage(false);
+	json_value res(sublist_d);
+	sublist_t &lst=res.get_sublist();
+	db->changes_since(stg.get(), since, [&](uint64_t seq, const jstring_t &id)
+	{
+		if (lst.size()>=limit)
+			return false;
+		revision_list_t leaves;
+		if (!db->get_leaves(stg.get(), id, leaves))
+			return true;
+		json_value change(sublist_d);
+		change.get_sublist().push_back(json_value(int64_t(seq)));
+		change.get_sublist().push_back(json_value(id));
+		json_value &revs=*change.get_sublist().insert(
+					change.get_sublist().end(), json_value(sublist_d));
+		for(auto i=leaves.begin(), iend=leaves.end(); i!=iend; ++i)
+			revs.get_sublist().push_back(json_value(i->full_string()));
+		lst.push_back(std::move(change));
+		return lst.size()<limit;
+	});
+	write_str(sock, json_to_string(res));
+}
+
+void do_command_conflicts(database_ptr db, engine_ptr engine,
+						  socket_ptr_t sock)
+{
+	jstring_t start_id=read_str(sock);
+	uint32_t limit=read_uint32(sock);
+
+	//[[id, [conflicts]], ...]
+	json_value res(sublist_d);
+	sublist_t &lst=res.get_sublist();
+	db->conflicted_docs(engine->create_storage(false).get(), start_id,
+		[&](const jstring_t &id, const revision_list_t &conflicts)
+	{
+		if (lst.size()>=limit)
+			return false;
+		json_value entry(sublist_d);
+		entry.get_sublist().push_back(json_value(id));
+		entry.get_sublist().push_back(revisions_to_json(conflicts));
+		lst.push_back(std::move(entry));
+		return lst.size()<limit;
+	});
+	write_str(sock, json_to_string(res));
+}
+
+void do_command_bulk_get(database_ptr db, engine_ptr engine, socket_ptr_t sock)
+{
+	//The request is a revs_diff response, missing revisions are skipped
+	std::vector<revs_diff_t> req=revs_diff_from_json(
+				string_to_json(read_str(sock)));
+	storage_ptr_t stg=engine->create_storage(false);
+	json_value res(sublist_d);
+	for(auto i=req.begin(), iend=req.end(); i!=iend; ++i)
+		for(auto r=i->revs_.begin(), rend=i->revs_.end(); r!=rend; ++r)
+		{
+			foreign_doc_t doc;
+			if (db->get_replicated(stg.get(), i->id_, *r, doc))
+				res.get_sublist().push_back(foreign_doc_to_json(doc));
+		}
+	write_str(sock, json_to_string(res));
+}
+
 void session(registry_ptr registry, socket_ptr_t sock)
 {
 	try
@@ -88,7 +234,7 @@ void session(registry_ptr registry, socket_ptr_t sock)
 			guard_t g(registry->lock_);
 			engine_ptr &ptr=registry->engines_[dbfile];
 			if (!ptr)
-				ptr.reset(new DbEngine(dbfile, false));
+				ptr=open_engine(dbfile);
 
 			engine=ptr;
 		}
@@ -99,17 +245,69 @@ void session(registry_ptr registry, socket_ptr_t sock)
 		{
 			std::string command = read_str(sock);
 			std::string dbname = read_str(sock);
+			if (command == "STATS")
+			{
+				//Process-wide, the database name is ignored
+				write_str(sock, json_to_string(
+					metrics_to_json(take_metrics_snapshot())));
+				continue;
+			} else if (command == "ENGINE_STATS")
+			{
+				write_str(sock, json_to_string(
+					engine_stats_to_json(engine->get_stats())));
+				continue;
+			}
 			if (dbname.empty())
 				err(result_code_t::sError) << "Empty database";
+			if (command == "DELETE_DB")
+			{
+				engine->delete_database(dbname);
+				if (dbname==last_db_name)
+				{
+					last_db.reset();
+					last_db_name.clear();
+				}
+				write_uint32(sock, 1);
+				continue;
+			}
 
-			database_ptr db=(dbname==last_db_name)?
-						last_db : engine->create_a_database(dbname);
+			if (dbname!=last_db_name || !last_db || last_db->closed())
+			{
+				last_db=engine->create_a_database(dbname);
+				last_db_name=dbname;
+			}
+			database_ptr db=last_db;
+			scoped_timer timer(metric_server_request);
 			if (command=="GET")
 			{
 				do_document_get(db, engine, sock);
 			} else if (command == "PUT")
 			{
 				do_command_put(db, engine, sock);
+			} else if (command == "REVS_DIFF")
+			{
+				do_command_revs_diff(db, engine, sock);
+			} else if (command == "BULK_DOCS")
+			{
+				do_command_bulk_docs(db, engine, sock);
+			} else if (command == "CHANGES")
+			{
+				do_command_changes(db, engine, sock);
+			} else if (command == "CONFLICTS")
+			{
+				do_command_conflicts(db, engine, sock);
+			} else if (command == "BULK_GET")
+			{
+				do_command_bulk_get(db, engine, sock);
+			} else if (command == "COMPACT")
+			{
+				compaction_stats_t stats=engine->compact(db);
+				json_value res(submap_d);
+				res["completed"]=json_value(stats.completed_);
+				res["revisions_pruned"]=json_value(
+					int64_t(stats.revisions_pruned_));
+				res["bytes_pruned"]=json_value(int64_t(stats.bytes_pruned_));
+				write_str(sock, json_to_string(res));
 			} else if (command == "FIN")
 			{
 				break;
@@ -118,6 +316,7 @@ void session(registry_ptr registry, socket_ptr_t sock)
 		}
 	} catch (std::exception& e)
 	{
+		add_to_counter(counter_server_errors);
 		std::cerr << "Exception in thread: " << e.what() << "\n";
 	}
 }
@@ -147,6 +346,14 @@ int main(int argc, char **argv)
 	acceptor.listen(FLAGS_socket_backlog);
 
 	registry_ptr registry(new engine_registry());
+	//The engines preload in the background, so the first sessions
+	//don't pay for opening them
+	std::istringstream preopen(FLAGS_preopen);
+	std::string dbfile;
+	while(std::getline(preopen, dbfile, ','))
+		if (!dbfile.empty())
+			registry->engines_[dbfile]=open_engine(dbfile);
+
 	while(true)
 	{
 		socket_ptr_t sock(new stream_protocol::socket(io_service));
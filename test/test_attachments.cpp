@@ -0,0 +1,119 @@
+#include <boost/test/unit_test.hpp>
+#include "engine.h"
+#include "database.h"
+#include "attachment.h"
+#include "storage_interface.h"
+#include "errors.h"
+
+using namespace sofadb;
+
+static size_t count_keys(storage_t *stg, const jstring_t &prefix)
+{
+	size_t res=0;
+	std::auto_ptr<storage_iterator_t> it=stg->iterate();
+	for(it->seek(prefix); it->valid(); it->next())
+	{
+		if (it->key().compare(0, prefix.size(), prefix)!=0)
+			break;
+		++res;
+	}
+	return res;
+}
+
+static jstring_t read_all(attachment_reader *reader)
+{
+	jstring_t res, piece;
+	while(reader->next(piece))
+	{
+		BOOST_REQUIRE(!piece.empty());
+		res.append(piece);
+	}
+	return res;
+}
+
+BOOST_AUTO_TEST_CASE(test_compressible_types)
+{
+	BOOST_REQUIRE(is_compressible_type("text/plain"));
+	BOOST_REQUIRE(is_compressible_type("Text/HTML; charset=utf-8"));
+	BOOST_REQUIRE(is_compressible_type("application/json"));
+	BOOST_REQUIRE(is_compressible_type("application/xml"));
+	BOOST_REQUIRE(is_compressible_type("application/javascript"));
+	BOOST_REQUIRE(!is_compressible_type("application/octet-stream"));
+	BOOST_REQUIRE(!is_compressible_type("image/png"));
+}
+
+BOOST_AUTO_TEST_CASE(test_attachments)
+{
+	jstring_t templ("/tmp/sofa_XXXXXX");
+	if (!mkdtemp(&templ[0]))
+		throw std::bad_exception();
+	DbEngine engine(templ, true);
+	database_ptr ptr=engine.create_a_database("test");
+	storage_ptr_t stg=engine.create_storage(false);
+
+	//A few chunks of text, written in pieces that don't align with them
+	jstring_t text;
+	for(int f=0;text.size()<3*attachment_chunk_size;++f)
+		text+="Line "+int_to_string(f)+" of a compressible attachment\n";
+	std::auto_ptr<attachment_writer> writer=ptr->create_attachment(
+		stg.get(), "log.txt", "text/plain");
+	for(size_t pos=0;pos<text.size();pos+=1000)
+		writer->write(text.substr(pos, 1000));
+	attachment_vector_t atts;
+	atts.push_back(writer->finish());
+	BOOST_REQUIRE(atts[0].compressed_);
+	BOOST_REQUIRE_EQUAL(atts[0].length_, text.size());
+	BOOST_REQUIRE(atts[0].encoded_length_<text.size());
+
+	//Binary content is stored as is, in chunks
+	jstring_t blob(attachment_chunk_size+10, '\0');
+	for(size_t f=0;f<blob.size();++f)
+		blob[f]=char(f*7919);
+	writer=ptr->create_attachment(stg.get(), "blob", "image/png");
+	writer->write(blob);
+	atts.push_back(writer->finish());
+	BOOST_REQUIRE(!atts[1].compressed_);
+	BOOST_REQUIRE_EQUAL(atts[1].encoded_length_, blob.size());
+
+	put_result_t res=ptr->put(stg.get(), "d1", revision_num_t::empty_revision,
+							  string_to_json("{\"a\" : 1}"), false, &atts);
+	BOOST_REQUIRE_EQUAL(res.code_, UPDATE_OK);
+	//Attachments are a part of the revision
+	put_result_t plain=ptr->put(stg.get(), "d2",
+		revision_num_t::empty_revision, string_to_json("{\"a\" : 1}"));
+	BOOST_REQUIRE(res.assigned_rev_!=plain.assigned_rev_);
+
+	json_value content;
+	revision_t rev;
+	BOOST_REQUIRE(ptr->get(stg.get(), "d1", 0, &content, &rev));
+	BOOST_REQUIRE_EQUAL(content, string_to_json("{\"a\" : 1}"));
+	BOOST_REQUIRE_EQUAL(rev.atts_.size(), 2);
+	BOOST_REQUIRE_EQUAL(rev.atts_[0].name_, "log.txt");
+	BOOST_REQUIRE_EQUAL(rev.atts_[0].content_type_, "text/plain");
+	BOOST_REQUIRE(memcmp(rev.atts_[0].md5_, atts[0].md5_, 16)==0);
+	BOOST_REQUIRE(ptr->get(stg.get(), "d2", 0, 0, &rev));
+	BOOST_REQUIRE(rev.atts_.empty());
+
+	BOOST_REQUIRE(read_all(ptr->open_attachment(stg.get(), atts[0]).get())
+				  ==text);
+	BOOST_REQUIRE(read_all(ptr->open_attachment(stg.get(), atts[1]).get())
+				  ==blob);
+	std::auto_ptr<attachment_reader> raw=ptr->open_attachment(
+		stg.get(), atts[0], false);
+	BOOST_REQUIRE(raw->encoded());
+	BOOST_REQUIRE_EQUAL(read_all(raw.get()).size(), atts[0].encoded_length_);
+
+	//The same content is stored once
+	const jstring_t prefix=jstring_t(SD_ATTACHMENT_DB)+"/test"+DB_SEPARATOR;
+	const size_t keys=count_keys(stg.get(), prefix);
+	writer=ptr->create_attachment(stg.get(), "copy.txt", "text/plain");
+	writer->write(text);
+	inline_attachment_t copy=writer->finish();
+	BOOST_REQUIRE(memcmp(copy.md5_, atts[0].md5_, 16)==0);
+	BOOST_REQUIRE_EQUAL(count_keys(stg.get(), prefix), keys);
+	BOOST_REQUIRE(read_all(ptr->open_attachment(stg.get(), copy).get())==text);
+
+	inline_attachment_t missing;
+	BOOST_CHECK_THROW(ptr->open_attachment(stg.get(), missing),
+					  sofa_exception);
+}
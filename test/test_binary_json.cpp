@@ -0,0 +1,178 @@
+#include <boost/test/unit_test.hpp>
+#include "binary_json.h"
+#include "engine.h"
+#include "database.h"
+#include "errors.h"
+#include "json_stream.h"
+#include <openssl/evp.h>
+#include <boost/format.hpp>
+
+using namespace sofadb;
+
+static json_value bin_roundtrip(const json_value &val)
+{
+	jstring_t bin;
+	json_to_binary(bin, val);
+	BOOST_REQUIRE(is_binary_json(bin));
+	json_value res=binary_to_json(bin);
+	BOOST_REQUIRE_EQUAL(res, val);
+	return res;
+}
+
+BOOST_AUTO_TEST_CASE(test_binary_roundtrip)
+{
+	bin_roundtrip(string_to_json("{}"));
+	bin_roundtrip(string_to_json("[[], {}, [[]]]"));
+	bin_roundtrip(string_to_json("{\"H\" : \"w\", \"this\" : "
+		"[\"is\", {\"a\" : \"test\"}], \"n\" : null, \"t\" : true, "
+		"\"f\" : false, \"d\" : -23123.125, \"e\" : \"\", "
+		"\"ints\" : [0, -1, 127, -128, 128, 32767, -32769, 2147483648, "
+		"-9223372036854775808, 9223372036854775807], "
+		"\"big\" : 233452340523409580923485092348523309850234950923450}"));
+
+	json_value with_graft(submap_d);
+	json_value grafted(jstring_t("world"));
+	with_graft["hello"].as_graft() = graft_t(&grafted);
+	BOOST_REQUIRE_EQUAL(binary_to_json(
+		[&](){ jstring_t b; json_to_binary(b, with_graft); return b; }()),
+		string_to_json("{\"hello\" : \"world\"}"));
+}
+
+BOOST_AUTO_TEST_CASE(test_tee_stream)
+{
+	json_value val=string_to_json("{\"a\" : [1, -2.5, null, true], "
+		"\"b\" : {\"c\" : \"d\"}, \"big\" : 12345678901234567890123}");
+	jstring_t text, bin;
+	{
+		std::auto_ptr<json_stream> text_str=make_stream(text);
+		std::auto_ptr<json_stream> bin_str=make_binary_stream(bin);
+		std::auto_ptr<json_stream> tee=make_tee_stream(text_str.get(),
+													   bin_str.get());
+		tee->start_list();
+		tee->write_string(jstring_t("x"));
+		tee->write_json(val);
+		tee->end_list();
+	}
+	const json_value expected=string_to_json("[\"x\", "+
+											 json_to_string(val)+"]");
+	BOOST_REQUIRE_EQUAL(text, json_to_string(expected));
+	BOOST_REQUIRE_EQUAL(binary_to_json(bin), expected);
+}
+
+BOOST_AUTO_TEST_CASE(test_binary_skip)
+{
+	json_value val=string_to_json("[{\"a\" : [1, 2, {\"b\" : \"c\"}]}, "
+								  "\"x\", 1.5, [true]]");
+	jstring_t bin;
+	json_to_binary(bin, val);
+
+	binary_reader reader(bin.data(), bin.size());
+	BOOST_REQUIRE_EQUAL(reader.enter(), 4);
+	BOOST_REQUIRE_EQUAL(reader.peek_type(), submap_d);
+	reader.skip();
+	BOOST_REQUIRE_EQUAL(reader.read_string(), "x");
+	reader.skip();
+	BOOST_REQUIRE_EQUAL(reader.read(), string_to_json("[true]"));
+	BOOST_REQUIRE(reader.at_end());
+
+	//Truncated buffers must be detected
+	try {
+		binary_to_json(bin.substr(0, bin.size()-3));
+		BOOST_FAIL("No exception");
+	} catch(const sofa_exception &ex)
+	{
+		BOOST_REQUIRE_EQUAL(ex.err().code(), result_code_t::sError);
+	}
+
+	//So must counts that don't fit the payload. The outer list's
+	//count follows the marker and the tag.
+	jstring_t bad=bin;
+	bad.replace(2, 4, "\xff\xff\xff\x7f", 4);
+	BOOST_REQUIRE_THROW(binary_to_json(bad), sofa_exception);
+}
+
+BOOST_AUTO_TEST_CASE(test_binary_storage_compat)
+{
+	jstring_t templ("/tmp/sofa_XXXXXX");
+	if (!mkdtemp(&templ[0]))
+		throw std::bad_exception();
+	DbEngine engine(templ, true);
+	database_ptr ptr=engine.create_a_database("test");
+	storage_ptr_t stg=engine.create_storage(false);
+
+	//Revisions are still computed over the canonical JSON text
+	json_value js=string_to_json("{\"Hello\" : \"world\"}");
+	revision_num_t rev=ptr->put(stg.get(), "doc", revision_num_t(),
+								js).assigned_rev_;
+	BOOST_REQUIRE_EQUAL(rev.full_string(),
+						"1-6f4cc66e47961832a031631919eab221");
+
+	jstring_t stored;
+	BOOST_REQUIRE(stg->try_get(ptr->make_path("doc")+rev.full_string(),
+							   &stored));
+	BOOST_REQUIRE(is_binary_json(stored));
+
+	json_value v1; revision_t r1;
+	BOOST_REQUIRE(ptr->get(stg.get(), "doc", 0, &v1, &r1));
+	BOOST_REQUIRE_EQUAL(v1, js);
+	BOOST_REQUIRE(!r1.deleted_);
+	BOOST_REQUIRE(r1.previous_rev_.empty());
+
+	//Documents written as JSON text are still readable
+	stg->put(ptr->make_path("doc")+rev.full_string(),
+			 "[false,\"\",null,{\"Hello\":\"legacy\"}]");
+	json_value v2;
+	BOOST_REQUIRE(ptr->get(stg.get(), "doc", &rev, &v2));
+	BOOST_REQUIRE_EQUAL(v2, string_to_json("{\"Hello\" : \"legacy\"}"));
+}
+
+BOOST_AUTO_TEST_CASE(test_revision_hash)
+{
+	jstring_t templ("/tmp/sofa_XXXXXX");
+	if (!mkdtemp(&templ[0]))
+		throw std::bad_exception();
+
+	//Large enough for the hash to be fed in many pieces
+	json_value js(submap_d);
+	for(int f=0;f<2000;++f)
+		js["field"+int_to_string(f)]=json_value("value "+int_to_string(f));
+	revision_num_t md5_rev, fast_rev;
+	{
+		DbEngine engine(templ, false);
+		database_ptr compat=engine.create_a_database("compat");
+		database_ptr fast=engine.create_a_database("fast",
+												   revision_hash_blake2b);
+		BOOST_REQUIRE_EQUAL(fast->revision_hash(), revision_hash_blake2b);
+		storage_ptr_t stg=engine.create_storage(false);
+
+		md5_rev=compat->put(stg.get(), "doc", revision_num_t(),
+							js).assigned_rev_;
+		jstring_t body;
+		make_stream(body)->write_json(string_to_json(
+			"[false, \"\", null, "+json_to_string(js)+"]"));
+		unsigned char digest[EVP_MAX_MD_SIZE];
+		unsigned int digest_ln=0;
+		BOOST_REQUIRE(EVP_Digest(body.data(), body.size(), digest,
+								 &digest_ln, EVP_md5(), 0));
+		jstring_t expected;
+		for(unsigned int f=0;f<digest_ln;++f)
+			expected+=boost::str(boost::format("%02x") % int(digest[f]));
+		BOOST_REQUIRE_EQUAL(md5_rev.uniq(), expected);
+
+		fast_rev=fast->put(stg.get(), "doc", revision_num_t(),
+						   js).assigned_rev_;
+		BOOST_REQUIRE_EQUAL(fast_rev.num(), 1);
+		BOOST_REQUIRE_EQUAL(fast_rev.uniq().size(), 32);
+		BOOST_REQUIRE(fast_rev!=md5_rev);
+	}
+
+	//The hash is a property of the database
+	DbEngine engine(templ, true);
+	database_ptr fast=engine.create_a_database("fast");
+	BOOST_REQUIRE_EQUAL(fast->revision_hash(), revision_hash_blake2b);
+	BOOST_REQUIRE_EQUAL(engine.create_a_database("compat")->revision_hash(),
+						revision_hash_md5);
+	storage_ptr_t stg=engine.create_storage(false);
+	BOOST_REQUIRE_EQUAL(fast->put(stg.get(), "doc2", revision_num_t(),
+								  js).assigned_rev_.uniq(), fast_rev.uniq());
+}
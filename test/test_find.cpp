@@ -0,0 +1,160 @@
+#include <boost/test/unit_test.hpp>
+#include "engine.h"
+#include "database.h"
+#include "field_index.h"
+#include "errors.h"
+
+using namespace sofadb;
+
+#define POSTS "{\"type\" : \"post\", \"created_at\" : {\"$exists\" : true}}"
+#define COMMENTS "{\"type\" : \"comment\", \"created_at\" : {\"$gt\" : null}}"
+
+static std::vector<jstring_t> found_ids(database_ptr db, storage_t *stg,
+	const char *selector, find_plan_t *plan=0, size_t limit=100)
+{
+	std::vector<std::pair<jstring_t, json_value> > docs;
+	db->find(stg, string_to_json(selector), limit, docs, plan);
+	std::vector<jstring_t> res;
+	for(auto i=docs.begin(), iend=docs.end(); i!=iend; ++i)
+		res.push_back(i->first);
+	return res;
+}
+
+BOOST_AUTO_TEST_CASE(test_selector_matches)
+{
+	selector_t sel(string_to_json("{\"type\" : \"track\", "
+		"\"metadata.year\" : {\"$gte\" : 1990, \"$lt\" : 2000}, "
+		"\"$and\" : [{\"tags\" : {\"$exists\" : false}}]}"));
+	BOOST_REQUIRE_EQUAL(sel.conditions().size(), 4);
+
+	BOOST_REQUIRE(sel.matches(string_to_json(
+		"{\"type\" : \"track\", \"metadata\" : {\"year\" : 1990}}")));
+	BOOST_REQUIRE(!sel.matches(string_to_json(
+		"{\"type\" : \"track\", \"metadata\" : {\"year\" : 2000}}")));
+	BOOST_REQUIRE(!sel.matches(string_to_json(
+		"{\"type\" : \"album\", \"metadata\" : {\"year\" : 1995}}")));
+	BOOST_REQUIRE(!sel.matches(string_to_json(
+		"{\"type\" : \"track\", \"metadata\" : {\"year\" : 1995}, "
+		"\"tags\" : []}")));
+	BOOST_REQUIRE(!sel.matches(string_to_json("{\"type\" : \"track\"}")));
+
+	BOOST_CHECK_THROW(selector_t(string_to_json("{\"a\" : {\"$in\" : []}}")),
+					  sofa_exception);
+	BOOST_CHECK_THROW(selector_t(string_to_json("[]")), sofa_exception);
+}
+
+BOOST_AUTO_TEST_CASE(test_field_index_find)
+{
+	jstring_t templ("/tmp/sofa_XXXXXX");
+	if (!mkdtemp(&templ[0]))
+		throw std::bad_exception();
+	DbEngine engine(templ, true);
+	database_ptr ptr=engine.create_a_database("test");
+	storage_ptr_t stg=engine.create_storage(false);
+
+	const char *docs[][2]={
+		{"d1", "{\"type\" : \"post\", \"created_at\" : 30, "
+			   "\"metadata\" : {\"track_id\" : \"t3\"}}"},
+		{"d2", "{\"type\" : \"post\", \"created_at\" : 10}"},
+		{"d3", "{\"type\" : \"comment\", \"created_at\" : 20, "
+			   "\"metadata\" : {\"track_id\" : \"t1\"}}"},
+		{"d4", "{\"type\" : \"post\", \"created_at\" : 20}"},
+		{"d5", "{\"type\" : \"post\"}"},
+	};
+	std::map<jstring_t, revision_num_t> revs;
+	for(size_t f=0;f<5;++f)
+		revs[docs[f][0]]=ptr->put(stg.get(), docs[f][0], revision_num_t(),
+			string_to_json(docs[f][1])).assigned_rev_;
+
+	//Without indexes everything is a full scan
+	find_plan_t plan;
+	std::vector<jstring_t> ids=found_ids(ptr, stg.get(),
+		"{\"type\" : \"post\", \"created_at\" : {\"$gt\" : 10}}", &plan);
+	BOOST_REQUIRE(plan.index_.empty());
+	BOOST_REQUIRE(ids==std::vector<jstring_t>({"d1", "d4"}));
+
+	//Existing documents are indexed on creation
+	ptr->create_index(stg.get(), "by_type", {"type", "created_at"});
+	ptr->create_index(stg.get(), "by_track", {"metadata.track_id"});
+	ptr->create_index(stg.get(), "by_type", {"type", "created_at"});
+	BOOST_CHECK_THROW(ptr->create_index(stg.get(), "by_type", {"type"}),
+					  sofa_exception);
+	BOOST_REQUIRE_EQUAL(ptr->indexes().size(), 2);
+
+	//Results come in the index order
+	ids=found_ids(ptr, stg.get(),
+		"{\"type\" : \"post\", \"created_at\" : {\"$gt\" : 10}}", &plan);
+	BOOST_REQUIRE_EQUAL(plan.index_, "by_type");
+	BOOST_REQUIRE_EQUAL(plan.eq_fields_, 1);
+	BOOST_REQUIRE(plan.range_);
+	BOOST_REQUIRE(ids==std::vector<jstring_t>({"d4", "d1"}));
+
+	ids=found_ids(ptr, stg.get(),
+		"{\"type\" : \"post\", \"created_at\" : {\"$lte\" : 20}}", &plan);
+	BOOST_REQUIRE(ids==std::vector<jstring_t>({"d2", "d4"}));
+
+	//The index lacks documents without 'created_at'
+	ids=found_ids(ptr, stg.get(), "{\"type\" : \"post\"}", &plan);
+	BOOST_REQUIRE(plan.index_.empty());
+	BOOST_REQUIRE(ids==std::vector<jstring_t>({"d1", "d2", "d4", "d5"}));
+	ids=found_ids(ptr, stg.get(), POSTS, &plan);
+	BOOST_REQUIRE_EQUAL(plan.index_, "by_type");
+	BOOST_REQUIRE(!plan.range_);
+	BOOST_REQUIRE(ids==std::vector<jstring_t>({"d2", "d4", "d1"}));
+
+	ids=found_ids(ptr, stg.get(),
+		"{\"type\" : \"post\", \"created_at\" : 20}", &plan);
+	BOOST_REQUIRE_EQUAL(plan.eq_fields_, 2);
+	BOOST_REQUIRE(ids==std::vector<jstring_t>({"d4"}));
+
+	ids=found_ids(ptr, stg.get(), "{\"metadata.track_id\" : \"t1\"}", &plan);
+	BOOST_REQUIRE_EQUAL(plan.index_, "by_track");
+	BOOST_REQUIRE(ids==std::vector<jstring_t>({"d3"}));
+
+	//A range on the first field only
+	ids=found_ids(ptr, stg.get(), "{\"type\" : {\"$lt\" : \"post\"}, "
+				  "\"created_at\" : {\"$exists\" : true}}", &plan);
+	BOOST_REQUIRE_EQUAL(plan.index_, "by_type");
+	BOOST_REQUIRE(ids==std::vector<jstring_t>({"d3"}));
+
+	ids=found_ids(ptr, stg.get(), POSTS, &plan, 2);
+	BOOST_REQUIRE(ids==std::vector<jstring_t>({"d2", "d4"}));
+
+	//Updates replace the entries, batches see their own writes
+	batch_storage_ptr_t batch=engine.create_batch_storage();
+	revs["d2"]=ptr->put(batch.get(), "d2", revs["d2"], string_to_json(
+		"{\"type\" : \"comment\", \"created_at\" : 10}")).assigned_rev_;
+	ptr->put(batch.get(), "d6", revision_num_t(), string_to_json(
+		"{\"type\" : \"post\", \"created_at\" : 15}"));
+	ids=found_ids(ptr, batch.get(), POSTS);
+	BOOST_REQUIRE(ids==std::vector<jstring_t>({"d6", "d4", "d1"}));
+	ids=found_ids(ptr, stg.get(), POSTS);
+	BOOST_REQUIRE(ids==std::vector<jstring_t>({"d2", "d4", "d1"}));
+	batch->commit(false);
+	ids=found_ids(ptr, stg.get(), COMMENTS);
+	BOOST_REQUIRE(ids==std::vector<jstring_t>({"d2", "d3"}));
+
+	//Documents losing a field drop out of the index
+	ptr->put(stg.get(), "d3", revs["d3"], string_to_json(
+		"{\"type\" : \"comment\"}"));
+	ids=found_ids(ptr, stg.get(), "{\"metadata.track_id\" : \"t1\"}");
+	BOOST_REQUIRE(ids.empty());
+
+	//Definitions are reloaded with the database
+	{
+		DbEngine reopened(templ, false);
+		database_ptr db=reopened.create_a_database("test");
+		BOOST_REQUIRE_EQUAL(db->indexes().size(), 2);
+		storage_ptr_t st=reopened.create_storage(false);
+		ids=found_ids(db, st.get(), POSTS, &plan);
+		BOOST_REQUIRE_EQUAL(plan.index_, "by_type");
+		BOOST_REQUIRE(ids==std::vector<jstring_t>({"d6", "d4", "d1"}));
+
+		db->drop_index(st.get(), "by_type");
+		ids=found_ids(db, st.get(), POSTS, &plan);
+		BOOST_REQUIRE(plan.index_.empty());
+		BOOST_REQUIRE(ids==std::vector<jstring_t>({"d1", "d4", "d6"}));
+		BOOST_CHECK_THROW(db->drop_index(st.get(), "by_type"),
+						  sofa_exception);
+	}
+}
@@ -135,3 +135,128 @@ BOOST_AUTO_TEST_CASE(test_json_bugz)
 		BOOST_REQUIRE_EQUAL(ex.err().code(), result_code_t::sWrongRevision);
 	}
 }
+
+BOOST_AUTO_TEST_CASE(test_number_formatting)
+{
+	BOOST_REQUIRE_EQUAL(int_to_string(0), "0");
+	BOOST_REQUIRE_EQUAL(int_to_string(-1), "-1");
+	BOOST_REQUIRE_EQUAL(int_to_string(INT64_MAX), "9223372036854775807");
+	BOOST_REQUIRE_EQUAL(int_to_string(INT64_MIN), "-9223372036854775808");
+
+	jstring_t appended("1-");
+	append_int_to_string(1234567890, appended);
+	BOOST_REQUIRE_EQUAL(appended, "1-1234567890");
+
+	json_value nums(sublist_d);
+	nums.get_sublist().push_back(json_value(0.1));
+	nums.get_sublist().push_back(json_value(23123.123));
+	nums.get_sublist().push_back(json_value(-2.0));
+	nums.get_sublist().push_back(json_value(1e-7));
+	nums.get_sublist().push_back(json_value(1.5e300));
+	nums.get_sublist().push_back(json_value(int64_t(-42)));
+	BOOST_REQUIRE_EQUAL(json_to_string(nums),
+						"[0.1,23123.123,-2.0,1e-7,1.5e300,-42]");
+
+	//Doubles must survive the round-trip bit-exactly and stay doubles
+	const double samples[] = {0.0, 1.0, 1.0/3, 5e-324,
+							  1.7976931348623157e308, 123456.789e-20};
+	for(size_t f=0;f<sizeof(samples)/sizeof(samples[0]);++f)
+	{
+		json_value lst(sublist_d);
+		lst.get_sublist().push_back(json_value(samples[f]));
+		json_value res=string_to_json(json_to_string(lst));
+		BOOST_REQUIRE(res.get_sublist().at(0).is_double());
+		BOOST_REQUIRE_EQUAL(res.get_sublist().at(0).get_double(), samples[f]);
+	}
+}
+
+BOOST_AUTO_TEST_CASE(test_number_parsing)
+{
+	json_value v=string_to_json("[0, -0, 42, -42, 9223372036854775807, "
+		"-9223372036854775808, 9223372036854775808, -9223372036854775809, "
+		"12345678901234567890123, 0.5, -1.25e2, 1E3, 0.000123, "
+		"2.2250738585072014e-308, 1.7976931348623157e308, "
+		"0.30000000000000004, 123456789012345678901234.5e-10]");
+	const sublist_t &l=v.get_sublist();
+
+	BOOST_REQUIRE_EQUAL(l.at(0).get_int(), 0);
+	BOOST_REQUIRE_EQUAL(l.at(1).get_int(), 0);
+	BOOST_REQUIRE_EQUAL(l.at(2).get_int(), 42);
+	BOOST_REQUIRE_EQUAL(l.at(3).get_int(), -42);
+	BOOST_REQUIRE_EQUAL(l.at(4).get_int(), INT64_MAX);
+	BOOST_REQUIRE_EQUAL(l.at(5).get_int(), INT64_MIN);
+
+	//Only out-of-range integers become bignums
+	BOOST_REQUIRE_EQUAL(l.at(6).get_big_int().digits_, "9223372036854775808");
+	BOOST_REQUIRE_EQUAL(l.at(7).get_big_int().digits_, "-9223372036854775809");
+	BOOST_REQUIRE_EQUAL(l.at(8).get_big_int().digits_,
+						"12345678901234567890123");
+
+	const char *doubles[] = {"0.5", "-1.25e2", "1E3", "0.000123",
+		"2.2250738585072014e-308", "1.7976931348623157e308",
+		"0.30000000000000004", "123456789012345678901234.5e-10"};
+	for(size_t f=0;f<sizeof(doubles)/sizeof(doubles[0]);++f)
+	{
+		BOOST_REQUIRE(l.at(9+f).is_double());
+		BOOST_REQUIRE_EQUAL(l.at(9+f).get_double(), strtod(doubles[f], 0));
+	}
+
+	const char *invalid[] = {"[1.]", "[-]", "[1e]", "[.5]", "[+1]", "[1e+]"};
+	for(size_t f=0;f<sizeof(invalid)/sizeof(invalid[0]);++f)
+	{
+		try {
+			string_to_json(invalid[f]);
+			BOOST_FAIL("No exception");
+		} catch(const sofa_exception &ex)
+		{
+			BOOST_REQUIRE_EQUAL(ex.err().code(),
+								result_code_t::sWrongRevision);
+		}
+	}
+}
+
+BOOST_AUTO_TEST_CASE(test_json_query)
+{
+	const jstring_t doc="{\"skipped\" : {\"deep\" : [1, {\"x\" : \"y\"}]}, "
+		"\"metadata\" : {\"track_id\" : \"TR123\", \"tags\" : [\"a\", "
+		"{\"b\" : 2}], \"len\" : 1.5}, \"n\" : null, \"top\" : 42}";
+
+	json_value v;
+	BOOST_REQUIRE(query_json(doc, split_json_path("metadata.track_id"), &v));
+	BOOST_REQUIRE_EQUAL(v.get_str(), "TR123");
+	BOOST_REQUIRE(query_json(doc, split_json_path("metadata.tags.1"), &v));
+	BOOST_REQUIRE_EQUAL(v, string_to_json("{\"b\" : 2}"));
+	BOOST_REQUIRE(query_json(doc, split_json_path("n"), &v));
+	BOOST_REQUIRE(v.is_nil());
+	BOOST_REQUIRE(query_json(doc, split_json_path(""), &v));
+	BOOST_REQUIRE_EQUAL(v, string_to_json(doc));
+	BOOST_REQUIRE(!query_json(doc, split_json_path("metadata.nope"), &v));
+	BOOST_REQUIRE(!query_json(doc, split_json_path("top.deeper"), &v));
+
+	std::vector<json_path_t> paths;
+	paths.push_back(split_json_path("top"));
+	paths.push_back(split_json_path("metadata"));
+	paths.push_back(split_json_path("metadata.tags.1.b"));
+	paths.push_back(split_json_path("missing"));
+	std::vector<json_value> res;
+	std::vector<bool> found;
+	BOOST_REQUIRE_EQUAL(query_json(doc.data(), doc.size(), paths, res,
+								   &found), 3);
+	BOOST_REQUIRE_EQUAL(res.at(0).get_int(), 42);
+	BOOST_REQUIRE_EQUAL(res.at(1)["len"].get_double(), 1.5);
+	BOOST_REQUIRE_EQUAL(res.at(2).get_int(), 2);
+	BOOST_REQUIRE(!found.at(3));
+
+	//Parsing stops as soon as everything is found, so the broken tail
+	//of this buffer is never looked at.
+	const char broken[]="{\"id\" : \"first\", \"rest\" : [1, 2, }";
+	BOOST_REQUIRE(query_json(jstring_t(broken), split_json_path("id"), &v));
+	BOOST_REQUIRE_EQUAL(v.get_str(), "first");
+	try {
+		query_json(jstring_t(broken), split_json_path("absent"), &v);
+		BOOST_FAIL("No exception");
+	} catch(const sofa_exception &ex)
+	{
+		BOOST_REQUIRE_EQUAL(ex.err().code(), result_code_t::sWrongRevision);
+	}
+}
@@ -0,0 +1,464 @@
+#include <boost/test/unit_test.hpp>
+#include <fstream>
+#include "engine.h"
+#include "database.h"
+#include "replication.h"
+#include "replicator.h"
+#include "conflict.h"
+#include "storage_interface.h"
+#include "errors.h"
+
+using namespace sofadb;
+
+static foreign_doc_t foreign(const char *json)
+{
+	return foreign_doc_from_json(string_to_json(json));
+}
+
+BOOST_AUTO_TEST_CASE(test_foreign_doc_json)
+{
+	const char *json="{\"_id\" : \"d1\", \"_rev\" : \"3-ccc\", "
+		"\"_revisions\" : {\"start\" : 3, \"ids\" : [\"ccc\", \"bbb\", \"aaa\"]},"
+		" \"v\" : 3}";
+	foreign_doc_t doc=foreign(json);
+	BOOST_REQUIRE_EQUAL(doc.id_, "d1");
+	BOOST_REQUIRE_EQUAL(doc.rev_, revision_num_t("3-ccc"));
+	BOOST_REQUIRE(doc.history_==revision_list_t(
+		{revision_num_t("2-bbb"), revision_num_t("1-aaa")}));
+	BOOST_REQUIRE_EQUAL(doc.content_, string_to_json("{\"v\" : 3}"));
+	BOOST_REQUIRE_EQUAL(foreign_doc_to_json(doc), string_to_json(json));
+
+	BOOST_CHECK_THROW(foreign("{\"_id\" : \"d1\", \"_rev\" : \"3-ccc\", "
+		"\"_revisions\" : {\"start\" : 2, \"ids\" : [\"ccc\"]}}"),
+		sofa_exception);
+	BOOST_CHECK_THROW(foreign("{\"_id\" : \"d1\"}"), sofa_exception);
+}
+
+BOOST_AUTO_TEST_CASE(test_replicated_writes)
+{
+	jstring_t templ("/tmp/sofa_XXXXXX");
+	if (!mkdtemp(&templ[0]))
+		throw std::bad_exception();
+	DbEngine engine(templ, true);
+	database_ptr ptr=engine.create_a_database("test");
+	storage_ptr_t stg=engine.create_storage(false);
+
+	std::vector<revs_diff_t> diff=revs_diff_from_json(string_to_json(
+		"{\"d1\" : [\"3-ccc\"], \"d2\" : [\"1-xyz\"]}"));
+	ptr->revs_diff(stg.get(), diff);
+	BOOST_REQUIRE_EQUAL(revs_diff_to_json(diff), string_to_json(
+		"{\"d1\" : {\"missing\" : [\"3-ccc\"]}, "
+		"\"d2\" : {\"missing\" : [\"1-xyz\"]}}"));
+
+	//New documents get their history as unavailable revisions
+	std::vector<foreign_doc_t> docs;
+	docs.push_back(foreign("{\"_id\" : \"d1\", \"_rev\" : \"3-ccc\", "
+		"\"_revisions\" : {\"start\" : 3, \"ids\" : [\"ccc\", \"bbb\", \"aaa\"]},"
+		" \"v\" : 3}"));
+	docs.push_back(foreign("{\"_id\" : \"d2\", \"_rev\" : \"1-xyz\"}"));
+	batch_storage_ptr_t batch=engine.create_batch_storage();
+	BOOST_REQUIRE_EQUAL(ptr->bulk_put_replicated(batch.get(), docs, false), 2);
+	BOOST_REQUIRE_EQUAL(ptr->bulk_put_replicated(batch.get(), docs, false), 0);
+	BOOST_REQUIRE_EQUAL(ptr->update_seq(), 2);
+
+	json_value content, log;
+	revision_t rev;
+	BOOST_REQUIRE(ptr->get(stg.get(), "d1", 0, &content, &rev, &log));
+	BOOST_REQUIRE_EQUAL(rev.rev_, revision_num_t("3-ccc"));
+	BOOST_REQUIRE_EQUAL(rev.previous_rev_, revision_num_t("2-bbb"));
+	BOOST_REQUIRE_EQUAL(content, string_to_json("{\"v\" : 3}"));
+	BOOST_REQUIRE_EQUAL(log, string_to_json("[[], [], [1, \"aaa\", false, "
+		"false], [2, \"bbb\", false, false], [3, \"ccc\", true, false]]"));
+
+	diff=revs_diff_from_json(string_to_json(
+		"{\"d1\" : [\"2-bbb\", \"3-ccc\", \"4-ddd\"], \"d2\" : [\"1-xyz\"]}"));
+	ptr->revs_diff(stg.get(), diff);
+	BOOST_REQUIRE_EQUAL(revs_diff_to_json(diff), string_to_json(
+		"{\"d1\" : {\"missing\" : [\"4-ddd\"], "
+		"\"possible_ancestors\" : [\"3-ccc\"]}}"));
+
+	//Continuation of the winning branch
+	put_result_t res=ptr->put_replicated(stg.get(), foreign(
+		"{\"_id\" : \"d1\", \"_rev\" : \"4-ddd\", \"_revisions\" : "
+		"{\"start\" : 4, \"ids\" : [\"ddd\", \"ccc\", \"bbb\", \"aaa\"]}}"));
+	BOOST_REQUIRE_EQUAL(res.code_, UPDATE_OK);
+	BOOST_REQUIRE_EQUAL(revlog_wrapper(res.rev_log_).top_rev_id(),
+						revision_num_t("4-ddd"));
+
+	//A losing branch, and then its continuation that wins
+	res=ptr->put_replicated(stg.get(), foreign(
+		"{\"_id\" : \"d1\", \"_rev\" : \"3-bbx\", \"_revisions\" : "
+		"{\"start\" : 3, \"ids\" : [\"bbx\", \"bbb\", \"aaa\"]}}"));
+	BOOST_REQUIRE_EQUAL(res.code_, UPDATE_CONFLICT_LOST);
+	BOOST_REQUIRE_EQUAL(revlog_wrapper(res.rev_log_).get_conflicts().size(), 1);
+
+	res=ptr->put_replicated(stg.get(), foreign(
+		"{\"_id\" : \"d1\", \"_rev\" : \"4-bbx\", \"_revisions\" : "
+		"{\"start\" : 4, \"ids\" : [\"bbx\", \"bbx\", \"bbb\", \"aaa\"]}, "
+		"\"v\" : 4}"));
+	BOOST_REQUIRE_EQUAL(res.code_, UPDATE_CONFLICT_WON);
+	BOOST_REQUIRE_EQUAL(res.rev_log_.get_sublist().at(0),
+						string_to_json("[\"4-ddd\"]"));
+
+	//Deleted losers are kept apart
+	res=ptr->put_replicated(stg.get(), foreign(
+		"{\"_id\" : \"d1\", \"_rev\" : \"2-zzz\", \"_deleted\" : true, "
+		"\"_revisions\" : {\"start\" : 2, \"ids\" : [\"zzz\", \"aaa\"]}}"));
+	BOOST_REQUIRE_EQUAL(res.code_, UPDATE_CONFLICT_LOST);
+	BOOST_REQUIRE_EQUAL(res.rev_log_.get_sublist().at(1),
+						string_to_json("[\"2-zzz\"]"));
+
+	BOOST_REQUIRE(ptr->get(stg.get(), "d1", 0, &content, &rev));
+	BOOST_REQUIRE_EQUAL(rev.rev_, revision_num_t("4-bbx"));
+	BOOST_REQUIRE_EQUAL(content, string_to_json("{\"v\" : 4}"));
+	revision_num_t loser("4-ddd");
+	BOOST_REQUIRE(ptr->get(stg.get(), "d1", &loser, &content, &rev));
+	BOOST_REQUIRE_EQUAL(rev.previous_rev_, revision_num_t("3-ccc"));
+
+	//Deleting the winner hands the document to the live conflict
+	res=ptr->put_replicated(stg.get(), foreign(
+		"{\"_id\" : \"d1\", \"_rev\" : \"5-eee\", \"_deleted\" : true, "
+		"\"_revisions\" : {\"start\" : 5, \"ids\" : [\"eee\", \"bbx\", "
+		"\"bbx\", \"bbb\", \"aaa\"]}}"));
+	BOOST_REQUIRE_EQUAL(res.code_, UPDATE_CONFLICT_LOST);
+	BOOST_REQUIRE_EQUAL(revlog_wrapper(res.rev_log_).top_rev_id(),
+						revision_num_t("4-ddd"));
+	BOOST_REQUIRE_EQUAL(res.rev_log_.get_sublist().at(0), string_to_json("[]"));
+	BOOST_REQUIRE_EQUAL(res.rev_log_.get_sublist().at(1),
+						string_to_json("[\"2-zzz\", \"5-eee\"]"));
+	BOOST_REQUIRE(ptr->get(stg.get(), "d1", 0, &content, &rev));
+	BOOST_REQUIRE_EQUAL(rev.rev_, revision_num_t("4-ddd"));
+	BOOST_REQUIRE(!rev.deleted_);
+}
+
+BOOST_AUTO_TEST_CASE(test_conflict_set)
+{
+	const char *h1="0123456789abcdef0123456789abcdef";
+	const char *h2="fedcba9876543210fedcba9876543210";
+	conflict_set_t set(string_to_json((jstring_t("[\"2-")+h2+"\", \"3-x\", "
+		"\"2-"+h1+"\", \"1-ABCDEF0123456789ABCDEF0123456789\"]").c_str()
+		).get_sublist());
+	BOOST_REQUIRE_EQUAL(set.size(), 4);
+	BOOST_REQUIRE(set.contains(revision_num_t(jstring_t("2-")+h1)));
+	BOOST_REQUIRE(!set.contains(revision_num_t(jstring_t("3-")+h1)));
+	//Uppercase ids are not packed, but still found
+	BOOST_REQUIRE(set.contains(
+		revision_num_t("1-ABCDEF0123456789ABCDEF0123456789")));
+
+	conflict_set_t other(revision_list_t({revision_num_t("3-x"),
+		revision_num_t(jstring_t("4-")+h1)}));
+	set.merge(other);
+	BOOST_REQUIRE_EQUAL(set.size(), 5);
+	BOOST_REQUIRE(set.remove(revision_num_t("3-x")));
+	BOOST_REQUIRE(!set.remove(revision_num_t("3-x")));
+	set.insert(revision_num_t(jstring_t("2-")+h1));
+
+	//Packed revisions go first, in the (number, hash) order
+	sublist_t stored;
+	set.store(stored);
+	BOOST_REQUIRE_EQUAL(json_value(stored), string_to_json((jstring_t(
+		"[\"2-")+h1+"\", \"2-"+h2+"\", \"4-"+h1+"\", "
+		"\"1-ABCDEF0123456789ABCDEF0123456789\"]").c_str()));
+	BOOST_REQUIRE(conflict_set_t(stored).revisions()==set.revisions());
+}
+
+BOOST_AUTO_TEST_CASE(test_batched_conflict_merge)
+{
+	json_value log;
+	revlog_wrapper w(log);
+	w.init();
+	w.add_rev_info(revision_num_t("1-aaa"), true, false);
+	w.add_rev_info(revision_num_t("2-bbb"), true, false);
+
+	resolver(&log).merge_batch(
+		revision_list_t({revision_num_t("2-abc"), revision_num_t("2-ccc"),
+						 revision_num_t("2-ccc")}),
+		revision_list_t({revision_num_t("3-ddd")}));
+	//A live revision wins over a newer deleted one
+	BOOST_REQUIRE_EQUAL(w.top_rev_id(), revision_num_t("2-abc"));
+	BOOST_REQUIRE(!w.top_quad()[3].get_bool());
+	BOOST_REQUIRE_EQUAL(log.get_sublist().at(0),
+		string_to_json("[\"2-bbb\", \"2-ccc\"]"));
+	BOOST_REQUIRE_EQUAL(log.get_sublist().at(1),
+		string_to_json("[\"3-ddd\"]"));
+
+	//Merging the same batch again changes nothing
+	json_value copy=log;
+	resolver(&log).merge_batch(
+		revision_list_t({revision_num_t("2-abc"), revision_num_t("2-ccc")}),
+		revision_list_t());
+	BOOST_REQUIRE_EQUAL(log, copy);
+
+	//Deleted revisions compete only when every leaf is deleted
+	json_value dead_log;
+	revlog_wrapper dw(dead_log);
+	dw.init();
+	dw.add_rev_info(revision_num_t("1-aaa"), true, false);
+	dw.add_rev_info(revision_num_t("2-bbb"), true, true);
+	resolver(&dead_log).merge_batch(revision_list_t(), revision_list_t(
+		{revision_num_t("2-abc"), revision_num_t("3-ddd")}));
+	BOOST_REQUIRE_EQUAL(dw.top_rev_id(), revision_num_t("3-ddd"));
+	BOOST_REQUIRE(dw.top_quad()[3].get_bool());
+	BOOST_REQUIRE_EQUAL(dead_log.get_sublist().at(0), string_to_json("[]"));
+	BOOST_REQUIRE_EQUAL(dead_log.get_sublist().at(1),
+		string_to_json("[\"2-abc\", \"2-bbb\"]"));
+	//A live revision takes over from the deleted ones
+	resolver(&dead_log).merge_batch(revision_list_t(
+		{revision_num_t("2-ccc")}), revision_list_t());
+	BOOST_REQUIRE_EQUAL(dw.top_rev_id(), revision_num_t("2-ccc"));
+	BOOST_REQUIRE(!dw.top_quad()[3].get_bool());
+	BOOST_REQUIRE_EQUAL(dead_log.get_sublist().at(1),
+		string_to_json("[\"2-abc\", \"2-bbb\", \"3-ddd\"]"));
+
+	//Revisions of one document written together
+	jstring_t templ("/tmp/sofa_XXXXXX");
+	if (!mkdtemp(&templ[0]))
+		throw std::bad_exception();
+	DbEngine engine(templ, true);
+	database_ptr ptr=engine.create_a_database("test");
+	std::vector<foreign_doc_t> docs;
+	docs.push_back(foreign("{\"_id\" : \"d1\", \"_rev\" : \"2-bbb\", "
+		"\"_revisions\" : {\"start\" : 2, \"ids\" : [\"bbb\", \"aaa\"]}}"));
+	docs.push_back(foreign("{\"_id\" : \"d2\", \"_rev\" : \"1-xyz\"}"));
+	docs.push_back(foreign("{\"_id\" : \"d1\", \"_rev\" : \"2-bbc\", "
+		"\"_revisions\" : {\"start\" : 2, \"ids\" : [\"bbc\", \"aaa\"]}}"));
+	docs.push_back(foreign("{\"_id\" : \"d1\", \"_rev\" : \"3-ccc\", "
+		"\"_revisions\" : {\"start\" : 3, \"ids\" : [\"ccc\", \"bbc\", "
+		"\"aaa\"]}, \"v\" : 3}"));
+	docs.push_back(foreign("{\"_id\" : \"d1\", \"_rev\" : \"2-bbc\", "
+		"\"_revisions\" : {\"start\" : 2, \"ids\" : [\"bbc\", \"aaa\"]}}"));
+	batch_storage_ptr_t batch=engine.create_batch_storage();
+	BOOST_REQUIRE_EQUAL(ptr->bulk_put_replicated(batch.get(), docs, false), 4);
+	//One change per document
+	BOOST_REQUIRE_EQUAL(ptr->update_seq(), 2);
+
+	storage_ptr_t stg=engine.create_storage(false);
+	json_value content;
+	revision_t rev;
+	BOOST_REQUIRE(ptr->get(stg.get(), "d1", 0, &content, &rev, &log));
+	BOOST_REQUIRE_EQUAL(rev.rev_, revision_num_t("3-ccc"));
+	BOOST_REQUIRE_EQUAL(content, string_to_json("{\"v\" : 3}"));
+	//The superseded 2-bbc is not a conflict
+	BOOST_REQUIRE_EQUAL(log.get_sublist().at(0),
+						string_to_json("[\"2-bbb\"]"));
+}
+
+BOOST_AUTO_TEST_CASE(test_conflicts_index)
+{
+	jstring_t templ("/tmp/sofa_XXXXXX");
+	if (!mkdtemp(&templ[0]))
+		throw std::bad_exception();
+	DbEngine engine(templ, true);
+	database_ptr ptr=engine.create_a_database("test");
+	storage_ptr_t stg=engine.create_storage(false);
+
+	ptr->put_replicated(stg.get(), foreign("{\"_id\" : \"d1\", "
+		"\"_rev\" : \"2-bbb\", \"_revisions\" : {\"start\" : 2, "
+		"\"ids\" : [\"bbb\", \"aaa\"]}}"));
+	ptr->put_replicated(stg.get(), foreign("{\"_id\" : \"d2\", "
+		"\"_rev\" : \"1-xyz\"}"));
+	ptr->put_replicated(stg.get(), foreign("{\"_id\" : \"d1\", "
+		"\"_rev\" : \"2-bbc\", \"_revisions\" : {\"start\" : 2, "
+		"\"ids\" : [\"bbc\", \"aaa\"]}}"));
+	ptr->put_replicated(stg.get(), foreign("{\"_id\" : \"d1\", "
+		"\"_rev\" : \"2-bbz\", \"_deleted\" : true, \"_revisions\" : "
+		"{\"start\" : 2, \"ids\" : [\"bbz\", \"aaa\"]}}"));
+	//A conflict made by a merging put
+	put_result_t res=ptr->put(stg.get(), "d2", revision_num_t("1-old"),
+							  string_to_json("{}"), true);
+
+	doc_conflicts_t conflicts;
+	BOOST_REQUIRE(!ptr->get_conflicts(stg.get(), "d3", conflicts));
+	BOOST_REQUIRE(ptr->get_conflicts(stg.get(), "d1", conflicts));
+	BOOST_REQUIRE_EQUAL(conflicts.winner_, revision_num_t("2-bbb"));
+	BOOST_REQUIRE(!conflicts.deleted_);
+	BOOST_REQUIRE(conflicts.conflicts_==revision_list_t(
+		{revision_num_t("2-bbc")}));
+	BOOST_REQUIRE(conflicts.deleted_conflicts_==revision_list_t(
+		{revision_num_t("2-bbz")}));
+
+	std::vector<std::pair<jstring_t, revision_list_t> > found;
+	auto collect=[&](const jstring_t &id, const revision_list_t &revs)
+	{
+		found.push_back(std::make_pair(id, revs));
+		return true;
+	};
+	ptr->conflicted_docs(stg.get(), "", collect);
+	BOOST_REQUIRE_EQUAL(found.size(), 2);
+	BOOST_REQUIRE_EQUAL(found[0].first, "d1");
+	BOOST_REQUIRE(found[0].second==conflicts.conflicts_);
+	BOOST_REQUIRE_EQUAL(found[1].first, "d2");
+	BOOST_REQUIRE_EQUAL(found[1].second.size(), 1);
+
+	//Resolving the conflict drops the document from the index
+	ptr->put_replicated(stg.get(), foreign("{\"_id\" : \"d1\", "
+		"\"_rev\" : \"3-bbb\", \"_revisions\" : {\"start\" : 3, "
+		"\"ids\" : [\"bbb\", \"bbb\", \"aaa\"]}}"));
+	ptr->put_replicated(stg.get(), foreign("{\"_id\" : \"d1\", "
+		"\"_rev\" : \"3-ccc\", \"_deleted\" : true, \"_revisions\" : "
+		"{\"start\" : 3, \"ids\" : [\"ccc\", \"bbc\", \"aaa\"]}}"));
+	found.clear();
+	ptr->conflicted_docs(stg.get(), "", collect);
+	BOOST_REQUIRE_EQUAL(found.size(), 1);
+	BOOST_REQUIRE_EQUAL(found[0].first, "d2");
+}
+
+//Serves another database the way the server's CHANGES and BULK_GET do
+class database_source_t : public replication_source_t
+{
+	DbEngine &engine_;
+	database_ptr db_;
+public:
+	database_source_t(DbEngine &engine, database_ptr db) :
+		engine_(engine), db_(db)
+	{
+	}
+
+	virtual jstring_t id() const { return "test:"+db_->name(); }
+
+	virtual void changes(uint64_t since, size_t limit,
+						 std::vector<change_t> &res)
+	{
+		storage_ptr_t stg=engine_.create_storage(false);
+		size_t count=0;
+		db_->changes_since(stg.get(), since,
+						   [&](uint64_t seq, const jstring_t &id)
+		{
+			change_t change;
+			change.seq_=seq;
+			change.id_=id;
+			db_->get_leaves(stg.get(), id, change.revs_);
+			res.push_back(change);
+			return ++count<limit;
+		});
+	}
+
+	virtual void fetch(const std::vector<revs_diff_t> &missing,
+					   std::vector<foreign_doc_t> &res)
+	{
+		storage_ptr_t stg=engine_.create_storage(false);
+		for(auto i=missing.begin(), iend=missing.end(); i!=iend; ++i)
+			for(auto r=i->missing_.begin(); r!=i->missing_.end(); ++r)
+			{
+				//Called on the fetcher threads, so no assertions here
+				res.push_back(foreign_doc_t());
+				if (!db_->get_replicated(stg.get(), i->id_, *r, res.back()))
+					throw std::runtime_error("Missing revision");
+			}
+	}
+};
+
+BOOST_AUTO_TEST_CASE(test_pull_replication)
+{
+	jstring_t templ("/tmp/sofa_XXXXXX");
+	if (!mkdtemp(&templ[0]))
+		throw std::bad_exception();
+	DbEngine engine(templ, true);
+	database_ptr source=engine.create_a_database("source");
+	database_ptr target=engine.create_a_database("target");
+	storage_ptr_t stg=engine.create_storage(false);
+
+	std::map<jstring_t, revision_num_t> revs;
+	for(int f=0;f<50;++f)
+	{
+		const jstring_t id="doc"+int_to_string(f%20);
+		json_value doc(submap_d);
+		doc["n"]=json_value(int64_t(f));
+		revs[id]=source->put(stg.get(), id, revs[id], doc).assigned_rev_;
+	}
+	//A conflict travels with its own branch
+	source->put(stg.get(), "doc0", revision_num_t("1-zzz"),
+				string_to_json("{\"branch\" : true}"), true);
+
+	replication_options_t opts;
+	opts.batch_size_=3;
+	opts.fetchers_=3;
+	opts.queue_depth_=2;
+	source_ptr_t src(new database_source_t(engine, source));
+	replicator_t replicator(engine, target, src, opts);
+	replication_stats_t stats=replicator.run();
+	BOOST_REQUIRE_EQUAL(stats.changes_, 20);
+	BOOST_REQUIRE_EQUAL(stats.written_revs_, 21);
+	BOOST_REQUIRE_EQUAL(stats.last_seq_, source->update_seq());
+	BOOST_REQUIRE_EQUAL(replicator.checkpoint(), source->update_seq());
+
+	for(int f=0;f<20;++f)
+	{
+		const jstring_t id="doc"+int_to_string(f);
+		json_value src_doc, dst_doc, src_log, dst_log;
+		revision_t src_rev, dst_rev;
+		BOOST_REQUIRE(source->get(stg.get(), id, 0, &src_doc, &src_rev));
+		BOOST_REQUIRE(target->get(stg.get(), id, 0, &dst_doc, &dst_rev));
+		BOOST_REQUIRE_EQUAL(src_doc, dst_doc);
+		BOOST_REQUIRE_EQUAL(src_rev.rev_, dst_rev.rev_);
+		BOOST_REQUIRE_EQUAL(src_rev.previous_rev_, dst_rev.previous_rev_);
+
+		revision_list_t src_leaves, dst_leaves;
+		source->get_leaves(stg.get(), id, src_leaves);
+		target->get_leaves(stg.get(), id, dst_leaves);
+		BOOST_REQUIRE(src_leaves==dst_leaves);
+	}
+
+	//Nothing to do until the source changes
+	stats=replicator.run();
+	BOOST_REQUIRE_EQUAL(stats.changes_, 0);
+	revs["doc5"]=source->put(stg.get(), "doc5", revs["doc5"],
+		string_to_json("{\"n\" : 100}")).assigned_rev_;
+	stats=replicator.run();
+	BOOST_REQUIRE_EQUAL(stats.changes_, 1);
+	BOOST_REQUIRE_EQUAL(stats.written_revs_, 1);
+	json_value doc;
+	BOOST_REQUIRE(target->get(stg.get(), "doc5", 0, &doc));
+	BOOST_REQUIRE_EQUAL(doc, string_to_json("{\"n\" : 100}"));
+}
+
+BOOST_AUTO_TEST_CASE(test_feed_replication)
+{
+	jstring_t templ("/tmp/sofa_XXXXXX");
+	if (!mkdtemp(&templ[0]))
+		throw std::bad_exception();
+	const jstring_t feed=templ+"/feed.json";
+	{
+		std::ofstream out(feed.c_str());
+		for(int f=0;f<30;++f)
+			out << "{\"_id\" : \"d" << f << "\", \"_rev\" : \"2-b" << f
+				<< "\", \"_revisions\" : {\"start\" : 2, \"ids\" : [\"b"
+				<< f << "\", \"a" << f << "\"]}, \"n\" : " << f << "}\n";
+	}
+
+	DbEngine engine(templ, true);
+	database_ptr target=engine.create_a_database("target");
+	replication_options_t opts;
+	opts.batch_size_=4;
+	replicator_t replicator(engine, target,
+		source_ptr_t(new feed_source_t(feed)), opts);
+	replication_stats_t stats=replicator.run();
+	BOOST_REQUIRE_EQUAL(stats.changes_, 30);
+	BOOST_REQUIRE_EQUAL(stats.written_revs_, 30);
+	BOOST_REQUIRE_EQUAL(stats.batches_, 8);
+
+	storage_ptr_t stg=engine.create_storage(false);
+	json_value doc;
+	revision_t rev;
+	BOOST_REQUIRE(target->get(stg.get(), "d17", 0, &doc, &rev));
+	BOOST_REQUIRE_EQUAL(doc, string_to_json("{\"n\" : 17}"));
+	BOOST_REQUIRE_EQUAL(rev.previous_rev_, revision_num_t("1-a17"));
+
+	//The checkpoint is the end of the feed
+	stats=replicator.run();
+	BOOST_REQUIRE_EQUAL(stats.changes_, 0);
+	BOOST_REQUIRE_EQUAL(stats.start_seq_, stats.last_seq_);
+
+	//A feed the target is up to date with leaves nothing behind
+	const jstring_t copy=templ+"/copy.json";
+	{
+		std::ifstream in(feed.c_str());
+		std::ofstream out(copy.c_str());
+		out << in.rdbuf();
+	}
+	boost::shared_ptr<feed_source_t> again(new feed_source_t(copy));
+	stats=replicator_t(engine, target, again, opts).run();
+	BOOST_REQUIRE_EQUAL(stats.changes_, 30);
+	BOOST_REQUIRE_EQUAL(stats.written_revs_, 0);
+	BOOST_REQUIRE_EQUAL(again->unfetched(), 0);
+}
@@ -4,6 +4,10 @@
 
 #include "engine.h"
 #include "database.h"
+#include "metrics.h"
+#include <thread>
+#include <dirent.h>
+#include <fstream>
 using namespace sofadb;
 
 BOOST_AUTO_TEST_CASE(test_database_creation)
@@ -123,6 +127,36 @@ BOOST_AUTO_TEST_CASE(test_revlog)
 	BOOST_REQUIRE_EQUAL(first.at(2).get_bool(), false);
 }
 
+BOOST_AUTO_TEST_CASE(test_batch_storage)
+{
+	jstring_t templ("/tmp/sofa_XXXXXX");
+	if (!mkdtemp(&templ[0]))
+		throw std::bad_exception();
+	DbEngine engine(templ, true);
+	database_ptr ptr=engine.create_a_database("test");
+
+	json_value js=string_to_json("{\"Hello\" : \"world\"}");
+	storage_ptr_t stg=engine.create_storage(false);
+	batch_storage_ptr_t batch=engine.create_batch_storage();
+
+	//The second put must see the revlog written by the first one
+	revision_num_t rev=ptr->put(batch.get(), "Hello",
+								revision_num_t(), js).assigned_rev_;
+	rev=ptr->put(batch.get(), "Hello", rev, js).assigned_rev_;
+	json_value res; revision_t r;
+	BOOST_REQUIRE(!ptr->get(stg.get(), "Hello", 0, &res));
+
+	batch->commit(false);
+	BOOST_REQUIRE(ptr->get(stg.get(), "Hello", 0, &res, &r));
+	BOOST_REQUIRE_EQUAL(r.rev_, rev);
+	BOOST_REQUIRE_EQUAL(res, js);
+
+	//The batch is reusable after a commit
+	ptr->put(batch.get(), "Second", revision_num_t(), js);
+	batch->commit(false);
+	BOOST_REQUIRE(ptr->get(stg.get(), "Second", 0, &res));
+}
+
 BOOST_AUTO_TEST_CASE(test_bench)
 {
 	jstring_t templ("/tmp/sofa_XXXXXX");
@@ -143,3 +177,540 @@ BOOST_AUTO_TEST_CASE(test_bench)
 		ptr->put(stg.get(), id+int_to_string(f), revision_num_t(), js);
 	}
 }
+
+BOOST_AUTO_TEST_CASE(test_batch_iterator)
+{
+	jstring_t templ("/tmp/sofa_XXXXXX");
+	if (!mkdtemp(&templ[0]))
+		throw std::bad_exception();
+	DbEngine engine(templ, true);
+	storage_ptr_t stg=engine.create_storage(false);
+	batch_storage_ptr_t batch=engine.create_batch_storage();
+
+	//Random committed and pending writes checked against a model
+	std::map<jstring_t, jstring_t> model;
+	srand(42);
+	for(int round=0;round<20;++round)
+	{
+		for(int f=0;f<50;++f)
+		{
+			jstring_t key="k"+int_to_string(rand()%100);
+			if (rand()%3==0)
+			{
+				batch->remove(key);
+				model.erase(key);
+			} else
+			{
+				jstring_t val=int_to_string(rand());
+				batch->put(key, val);
+				model[key]=val;
+			}
+		}
+
+		//Forward with a direction change in the middle
+		std::auto_ptr<storage_iterator_t> it=batch->iterate();
+		it->seek("k");
+		auto pos=model.begin();
+		for(; pos!=model.end(); ++pos, it->next())
+		{
+			BOOST_REQUIRE(it->valid());
+			BOOST_REQUIRE_EQUAL(it->key(), pos->first);
+			BOOST_REQUIRE_EQUAL(it->value(), pos->second);
+			if (pos!=model.begin() && rand()%5==0)
+			{
+				it->prev();
+				BOOST_REQUIRE_EQUAL(it->key(), std::prev(pos)->first);
+				it->next();
+			}
+		}
+		BOOST_REQUIRE(!it->valid());
+
+		//Backward
+		it->seek_to_last();
+		for(auto rpos=model.rbegin(); rpos!=model.rend(); ++rpos, it->prev())
+		{
+			BOOST_REQUIRE(it->valid());
+			BOOST_REQUIRE_EQUAL(it->key(), rpos->first);
+		}
+		BOOST_REQUIRE(!it->valid());
+
+		//The iterator survives a commit under it
+		it->seek("k");
+		if (round%2)
+		{
+			batch->commit(false);
+			for(auto pos=model.begin(); pos!=model.end(); ++pos, it->next())
+			{
+				BOOST_REQUIRE(it->valid());
+				BOOST_REQUIRE_EQUAL(it->key(), pos->first);
+			}
+			BOOST_REQUIRE(!it->valid());
+		}
+	}
+}
+
+static uint64_t metric_count(const metrics_snapshot_t &snap, metric_e metric)
+{
+	return snap.histograms_.at(metric).count_;
+}
+
+BOOST_AUTO_TEST_CASE(test_metrics)
+{
+	const metrics_snapshot_t before=take_metrics_snapshot();
+	for(uint64_t f=1;f<=1000;++f)
+		record_latency(metric_server_request, f*1000);
+	//Counts of finished threads are kept
+	std::thread([]{ record_latency(metric_server_request, 5); }).join();
+
+	const metrics_snapshot_t after=take_metrics_snapshot();
+	histogram_snapshot_t hist=after.histograms_[metric_server_request];
+	const histogram_snapshot_t &old=before.histograms_[metric_server_request];
+	BOOST_REQUIRE_EQUAL(hist.count_-old.count_, 1001);
+	for(size_t f=0;f<hist.buckets_.size();++f)
+		hist.buckets_[f]-=old.buckets_[f];
+	hist.count_-=old.count_;
+	//Percentiles are within the 25% bucket error
+	BOOST_REQUIRE(hist.percentile(0.5)>=500000);
+	BOOST_REQUIRE(hist.percentile(0.5)<=625000);
+	BOOST_REQUIRE(hist.percentile(0.99)>=990000);
+	BOOST_REQUIRE(hist.percentile(0.99)<=1250000);
+
+	jstring_t templ("/tmp/sofa_XXXXXX");
+	if (!mkdtemp(&templ[0]))
+		throw std::bad_exception();
+	DbEngine engine(templ, true);
+	database_ptr ptr=engine.create_a_database("test");
+	storage_ptr_t stg=engine.create_storage(false);
+
+	const metrics_snapshot_t start=take_metrics_snapshot();
+	json_value js=string_to_json("{\"Hello\" : \"world\"}");
+	revision_num_t rev=ptr->put(stg.get(), "doc", revision_num_t(),
+								js).assigned_rev_;
+	ptr->put(stg.get(), "doc", revision_num_t(), js); //Conflict
+	json_value res;
+	BOOST_REQUIRE(ptr->get(stg.get(), "doc", 0, &res));
+	BOOST_REQUIRE(!ptr->get(stg.get(), "missing", 0, &res));
+
+	const metrics_snapshot_t end=take_metrics_snapshot();
+	BOOST_REQUIRE_EQUAL(metric_count(end, metric_put)-
+						metric_count(start, metric_put), 2);
+	BOOST_REQUIRE_EQUAL(metric_count(end, metric_put_encode)-
+						metric_count(start, metric_put_encode), 1);
+	BOOST_REQUIRE_EQUAL(metric_count(end, metric_put_serialize)-
+						metric_count(start, metric_put_serialize), 0);
+	//The body and the revlog are timed apart
+	BOOST_REQUIRE_EQUAL(metric_count(end, metric_put_write)-
+						metric_count(start, metric_put_write), 1);
+	BOOST_REQUIRE_EQUAL(metric_count(end, metric_put_revlog_write)-
+						metric_count(start, metric_put_revlog_write), 1);
+	BOOST_REQUIRE_EQUAL(metric_count(end, metric_get)-
+						metric_count(start, metric_get), 2);
+	BOOST_REQUIRE_EQUAL(metric_count(end, metric_get_decode)-
+						metric_count(start, metric_get_decode), 1);
+	BOOST_REQUIRE_EQUAL(end.counters_[counter_put_conflicts].second-
+						start.counters_[counter_put_conflicts].second, 1);
+	BOOST_REQUIRE_EQUAL(end.counters_[counter_get_misses].second-
+						start.counters_[counter_get_misses].second, 1);
+
+	json_value js_stats=metrics_to_json(end);
+	BOOST_REQUIRE(js_stats["histograms"]["put"]["count"].get_int()>=2);
+}
+
+BOOST_AUTO_TEST_CASE(test_engine_stats)
+{
+	jstring_t templ("/tmp/sofa_XXXXXX");
+	if (!mkdtemp(&templ[0]))
+		throw std::bad_exception();
+	DbEngine engine(templ, true);
+	database_ptr first=engine.create_a_database("first");
+	engine.create_a_database("second");
+	storage_ptr_t stg=engine.create_storage(false);
+
+	json_value js=string_to_json("{\"Hello\" : \"world\"}");
+	for(int f=0;f<100;++f)
+		first->put(stg.get(), "doc"+int_to_string(f), revision_num_t(), js);
+
+	BOOST_REQUIRE_EQUAL(database_key_prefix(SD_DATA_DB, "first"),
+						first->make_path("").substr(0, 14));
+	BOOST_REQUIRE_EQUAL(database_key_prefix(SD_SEQ_DB, "first"), "_seq/first!");
+
+	engine_stats_t stats=engine.get_stats();
+	BOOST_REQUIRE_EQUAL(stats.levels_.size(), 7);
+	BOOST_REQUIRE_EQUAL(stats.databases_.size(), 2);
+	BOOST_REQUIRE(stats.databases_["first"].data_>0);
+	BOOST_REQUIRE(stats.databases_["first"].seq_>0);
+	BOOST_REQUIRE(stats.databases_["first"].total()>
+				  stats.databases_["second"].total());
+	BOOST_REQUIRE(stats.block_cache_capacity_>0);
+
+	json_value js_stats=engine_stats_to_json(stats);
+	BOOST_REQUIRE_EQUAL(js_stats["levels"].get_sublist().size(), 7);
+	BOOST_REQUIRE(js_stats["databases"]["first"]["total"].get_int()>0);
+}
+
+BOOST_AUTO_TEST_CASE(test_compaction)
+{
+	jstring_t templ("/tmp/sofa_XXXXXX");
+	if (!mkdtemp(&templ[0]))
+		throw std::bad_exception();
+	DbEngine engine(templ, true);
+	database_ptr ptr=engine.create_a_database("test");
+	storage_ptr_t stg=engine.create_storage(false);
+
+	revision_list_t revs;
+	revision_num_t cur;
+	for(int f=0;f<5;++f)
+	{
+		json_value js(submap_d);
+		js["version"]=json_value(int64_t(f));
+		cur=ptr->put(stg.get(), "doc", cur, js).assigned_rev_;
+		revs.push_back(cur);
+	}
+	//A conflicting branch from the second revision
+	json_value js(submap_d);
+	js["branch"]=json_value(true);
+	revision_num_t branch=ptr->put(stg.get(), "doc", revs[1], js,
+								   true).assigned_rev_;
+
+	compaction_options_t opts;
+	opts.max_bytes_per_sec_=0;
+	compaction_stats_t stats=engine.compact(ptr, opts);
+	BOOST_REQUIRE(stats.completed_);
+	BOOST_REQUIRE_EQUAL(stats.docs_, 1);
+	BOOST_REQUIRE_EQUAL(stats.revisions_pruned_, 4);
+	BOOST_REQUIRE(!ptr->compact_running());
+	BOOST_REQUIRE(!ptr->get_info()["compact_running"].get_bool());
+
+	//The leaves are intact, the rest only keep their place in history
+	json_value res;
+	BOOST_REQUIRE(ptr->get(stg.get(), "doc", &revs[4], &res));
+	BOOST_REQUIRE_EQUAL(res["version"].get_int(), 4);
+	BOOST_REQUIRE(ptr->get(stg.get(), "doc", &branch, &res));
+	for(int f=0;f<4;++f)
+		BOOST_REQUIRE(!ptr->get(stg.get(), "doc", &revs[f], &res));
+
+	foreign_doc_t doc;
+	BOOST_REQUIRE(ptr->get_replicated(stg.get(), "doc", revs[4], doc));
+	BOOST_REQUIRE_EQUAL(doc.history_.size(), 4);
+	BOOST_REQUIRE_EQUAL(doc.history_[3], revs[0]);
+	BOOST_REQUIRE(ptr->get_replicated(stg.get(), "doc", branch, doc));
+	BOOST_REQUIRE_EQUAL(doc.history_.size(), 2);
+
+	//Nothing is left to prune, and a stopped compaction is incomplete
+	BOOST_REQUIRE_EQUAL(engine.compact(ptr, opts).revisions_pruned_, 0);
+	BOOST_REQUIRE(!engine.compact(ptr, opts, []{ return true; }).completed_);
+	BOOST_REQUIRE(!ptr->compact_running());
+}
+
+BOOST_AUTO_TEST_CASE(test_quiet_window)
+{
+	compaction_options_t opts;
+	opts.window_start_hour_=2;
+	opts.window_end_hour_=6;
+	BOOST_REQUIRE(!is_in_quiet_window(opts, 1));
+	BOOST_REQUIRE(is_in_quiet_window(opts, 2));
+	BOOST_REQUIRE(!is_in_quiet_window(opts, 6));
+
+	opts.window_start_hour_=22;
+	BOOST_REQUIRE(is_in_quiet_window(opts, 23));
+	BOOST_REQUIRE(is_in_quiet_window(opts, 0));
+	BOOST_REQUIRE(!is_in_quiet_window(opts, 12));
+
+	opts.window_end_hour_=22;
+	BOOST_REQUIRE(is_in_quiet_window(opts, 12));
+
+	//The scheduler compacts in the background and stops with the engine
+	jstring_t templ("/tmp/sofa_XXXXXX");
+	if (!mkdtemp(&templ[0]))
+		throw std::bad_exception();
+	DbEngine engine(templ, true);
+	database_ptr ptr=engine.create_a_database("test");
+	storage_ptr_t stg=engine.create_storage(false);
+	revision_num_t cur=ptr->put(stg.get(), "doc", revision_num_t(),
+								string_to_json("{}")).assigned_rev_;
+	revision_num_t first=cur;
+	cur=ptr->put(stg.get(), "doc", cur, string_to_json("{}")).assigned_rev_;
+
+	opts.max_bytes_per_sec_=0;
+	engine.schedule_compaction(opts);
+	json_value res;
+	for(int f=0;f<1000 && ptr->get(stg.get(), "doc", &first, &res);++f)
+		std::this_thread::sleep_for(std::chrono::milliseconds(5));
+	BOOST_REQUIRE(!ptr->get(stg.get(), "doc", &first, &res));
+}
+
+static size_t count_keys(storage_t *stg, const jstring_t &prefix)
+{
+	size_t res=0;
+	std::auto_ptr<storage_iterator_t> it=stg->iterate();
+	for(it->seek(prefix); it->valid() &&
+		it->key().compare(0, prefix.size(), prefix)==0; it->next())
+		++res;
+	return res;
+}
+
+BOOST_AUTO_TEST_CASE(test_delete_database)
+{
+	jstring_t templ("/tmp/sofa_XXXXXX");
+	if (!mkdtemp(&templ[0]))
+		throw std::bad_exception();
+	DbEngine engine(templ, true);
+	storage_ptr_t stg=engine.create_storage(false);
+	database_ptr doomed=engine.create_a_database("doomed");
+	database_ptr kept=engine.create_a_database("kept");
+	json_value js=string_to_json("{\"Hello\" : \"world\"}");
+	for(int f=0;f<50;++f)
+	{
+		doomed->put(stg.get(), "doc"+int_to_string(f), revision_num_t(), js);
+		kept->put(stg.get(), "doc"+int_to_string(f), revision_num_t(), js);
+	}
+	std::vector<jstring_t> fields(1, "Hello");
+	doomed->create_index(stg.get(), "by_hello", fields);
+	//Its definition key looks like a dbinfo record
+	kept->create_index(stg.get(), "dbinfo", fields);
+
+	engine.delete_database("doomed");
+	BOOST_REQUIRE_THROW(doomed->put(stg.get(), "late", revision_num_t(), js),
+						std::exception);
+	BOOST_REQUIRE_THROW(engine.delete_database("doomed"), std::exception);
+	BOOST_REQUIRE_THROW(engine.create_a_database("bad!name"), std::exception);
+	BOOST_REQUIRE(engine.database_names()==std::vector<jstring_t>(1, "kept"));
+
+	engine.wait_for_purges();
+	BOOST_REQUIRE(!engine.is_being_deleted("doomed"));
+	const char *spaces[]={SD_DATA_DB, SD_SEQ_DB, SD_INDEX_DB, SD_SYSTEM_DB};
+	for(size_t f=0;f<4;++f)
+	{
+		BOOST_REQUIRE_EQUAL(count_keys(stg.get(),
+			database_key_prefix(spaces[f], "doomed")), 0);
+		BOOST_REQUIRE(count_keys(stg.get(),
+			database_key_prefix(spaces[f], "kept"))>0 || f>1);
+	}
+
+	//Opening doesn't bring it back
+	BOOST_REQUIRE(!engine.open_database("doomed"));
+	BOOST_REQUIRE(engine.open_database("kept")==kept);
+	BOOST_REQUIRE(engine.database_names()==std::vector<jstring_t>(1, "kept"));
+
+	//The name can be reused once the data is gone
+	database_ptr reborn=engine.create_a_database("doomed");
+	json_value res;
+	BOOST_REQUIRE(!reborn->get(stg.get(), "doc1", 0, &res));
+	BOOST_REQUIRE_EQUAL(reborn->update_seq(), 0);
+	BOOST_REQUIRE(kept->get(stg.get(), "doc1", 0, &res));
+}
+
+BOOST_AUTO_TEST_CASE(test_resume_purge)
+{
+	jstring_t templ("/tmp/sofa_XXXXXX");
+	if (!mkdtemp(&templ[0]))
+		throw std::bad_exception();
+	json_value js=string_to_json("{\"Hello\" : \"world\"}");
+	{
+		//A purge interrupted right after the database was dropped
+		DbEngine engine(templ, false);
+		storage_ptr_t stg=engine.create_storage(false);
+		database_ptr ptr=engine.create_a_database("doomed");
+		ptr->put(stg.get(), "doc", revision_num_t(), js);
+		stg->remove(SD_SYSTEM_DB "/doomed" DB_SEPARATOR "dbinfo");
+		stg->put(database_purger::purge_marker_key("doomed"), "");
+	}
+
+	DbEngine engine(templ, true);
+	engine.wait_for_purges();
+	storage_ptr_t stg=engine.create_storage(false);
+	BOOST_REQUIRE_EQUAL(count_keys(stg.get(),
+		database_key_prefix(SD_DATA_DB, "doomed")), 0);
+	BOOST_REQUIRE_EQUAL(count_keys(stg.get(),
+		database_purger::purge_marker_key("")), 0);
+}
+
+BOOST_AUTO_TEST_CASE(test_memory_storage)
+{
+	DbEngine engine("", false, storage_memory);
+	storage_ptr_t stg=engine.create_storage(false);
+	stg->put("b", "1");
+	stg->put("a", "1");
+	stg->put("c", "1");
+
+	snapshot_t *snap=stg->snapshot();
+	stg->put("a", "2");
+	stg->remove("b");
+	jstring_t val;
+	BOOST_REQUIRE(stg->try_get("a", &val) && val=="2");
+	BOOST_REQUIRE(!stg->try_get("b", &val));
+	BOOST_REQUIRE(stg->try_get("a", &val, snap) && val=="1");
+	BOOST_REQUIRE(stg->try_get("b", &val, snap) && val=="1");
+	stg->release_snapshot(snap);
+
+	std::auto_ptr<storage_iterator_t> it=stg->iterate();
+	it->seek_to_last();
+	BOOST_REQUIRE(it->valid() && it->key()=="c");
+	it->prev();
+	BOOST_REQUIRE(it->valid() && it->key()=="a" && it->value()=="2");
+	it->prev();
+	BOOST_REQUIRE(!it->valid());
+	it.reset();
+
+	//Readers see the batches whole
+	std::atomic<bool> stop(false);
+	std::atomic<size_t> torn(0);
+	std::thread reader([&]{
+		while(!stop)
+		{
+			std::auto_ptr<storage_iterator_t> it=stg->iterate();
+			jstring_t x, y;
+			it->seek("x");
+			if (it->valid() && it->key()=="x")
+				x=it->value();
+			it->seek("y");
+			if (it->valid() && it->key()=="y")
+				y=it->value();
+			if (x!=y)
+				++torn;
+		}
+	});
+	batch_storage_ptr_t batch=engine.create_batch_storage();
+	for(int f=0;f<2000;++f)
+	{
+		batch->put("x", int_to_string(f));
+		batch->put("y", int_to_string(f));
+		batch->commit(false);
+	}
+	stop=true;
+	reader.join();
+	BOOST_REQUIRE_EQUAL(torn, 0);
+
+	//The database layer runs unchanged over it
+	database_ptr db=engine.create_a_database("cache");
+	json_value js=string_to_json("{\"Hello\" : \"world\"}");
+	for(int f=0;f<20;++f)
+		db->put(stg.get(), "doc"+int_to_string(f), revision_num_t(), js);
+	json_value res;
+	BOOST_REQUIRE(db->get(stg.get(), "doc7", 0, &res));
+	BOOST_REQUIRE(res==js);
+
+	engine.delete_database("cache");
+	engine.wait_for_purges();
+	BOOST_REQUIRE_EQUAL(count_keys(stg.get(),
+		database_key_prefix(SD_DATA_DB, "cache")), 0);
+	BOOST_REQUIRE(engine.get_stats().memtable_bytes_>0);
+}
+
+static size_t count_segments(const jstring_t &dir)
+{
+	size_t res=0;
+	if (DIR *d=opendir(dir.c_str()))
+	{
+		while(struct dirent *entry=readdir(d))
+			if (strstr(entry->d_name, ".log"))
+				++res;
+		closedir(d);
+	}
+	return res;
+}
+
+BOOST_AUTO_TEST_CASE(test_log_storage)
+{
+	jstring_t templ("/tmp/sofa_XXXXXX");
+	if (!mkdtemp(&templ[0]))
+		throw std::bad_exception();
+	storage_options_t opts(storage_log);
+	opts.segment_size_=4096;
+	opts.compaction_bytes_per_sec_=0;
+	opts.compaction_check_sec_=3600;
+	const jstring_t filler(100, 'x');
+	{
+		DbEngine engine(templ, false, opts);
+		storage_ptr_t stg=engine.create_storage(false);
+		for(int round=0;round<5;++round)
+			for(int f=0;f<100;++f)
+				stg->put("key"+int_to_string(f), filler+int_to_string(round));
+		for(int f=0;f<50;++f)
+			stg->remove("key"+int_to_string(f));
+
+		snapshot_t *snap=stg->snapshot();
+		stg->put("key99", "new");
+		jstring_t val;
+		BOOST_REQUIRE(stg->try_get("key99", &val, snap) &&
+					  val==filler+"4");
+		BOOST_REQUIRE(stg->try_get("key99", &val) && val=="new");
+		stg->release_snapshot(snap);
+		stg->put("key99", filler+"4");
+
+		//Mostly overwritten segments get rewritten into the active one
+		const size_t before=count_segments(templ);
+		database_ptr db=engine.create_a_database("log");
+		engine.compact(db);
+		for(int f=0;f<500 && count_segments(templ)>=before/2;++f)
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+		BOOST_REQUIRE(count_segments(templ)<before/2);
+	}
+
+	//A torn frame at the end is dropped
+	char name[32];
+	snprintf(name, sizeof(name), "/%08u.log", 1000000);
+	FILE *torn=fopen((templ+name).c_str(), "wb");
+	fwrite("garbage", 1, 7, torn);
+	fclose(torn);
+
+	//The index is rebuilt from the segments, the removals stay
+	DbEngine engine(templ, true, opts);
+	storage_ptr_t stg=engine.create_storage(false);
+	BOOST_REQUIRE_EQUAL(count_keys(stg.get(), "key"), 50);
+	jstring_t val;
+	BOOST_REQUIRE(!stg->try_get("key10", &val));
+	BOOST_REQUIRE(stg->try_get("key77", &val) && val==filler+"4");
+	stg->put("key10", "back");
+	BOOST_REQUIRE(stg->try_get("key10", &val) && val=="back");
+	BOOST_REQUIRE(engine.get_stats().raw_stats_.find("segment")!=
+				  jstring_t::npos);
+}
+
+BOOST_AUTO_TEST_CASE(test_fast_open)
+{
+	jstring_t templ("/tmp/sofa_XXXXXX");
+	if (!mkdtemp(&templ[0]))
+		throw std::bad_exception();
+	storage_options_t opts;
+	opts.warm_up_=true;
+	json_value js=string_to_json("{\"Hello\" : \"world\"}");
+	{
+		DbEngine engine(templ, false, opts);
+		storage_ptr_t stg=engine.create_storage(false);
+		const char *names[]={"first", "second", "third"};
+		for(int f=0;f<3;++f)
+		{
+			database_ptr db=engine.create_a_database(names[f]);
+			for(int doc=0;doc<=f;++doc)
+				db->put(stg.get(), "doc"+int_to_string(doc),
+						revision_num_t(), js);
+		}
+	}
+
+	//The ranges of all the handed out databases are saved
+	const jstring_t hot_file=templ+"/HOT_RANGES";
+	{
+		std::ifstream hot(hot_file.c_str());
+		int lines=0;
+		for(jstring_t line; std::getline(hot, line); ++lines) {}
+		BOOST_REQUIRE_EQUAL(lines, 3);
+	}
+
+	opts.preload_databases_=true;
+	{
+		DbEngine engine(templ, true, opts);
+		engine.wait_for_open();
+		BOOST_REQUIRE_EQUAL(engine.get_stats().open_databases_, 3);
+		BOOST_REQUIRE_EQUAL(
+			engine.create_a_database("third")->update_seq(), 3);
+		BOOST_REQUIRE_EQUAL(engine.database_names().size(), 3);
+
+		//Preloaded handles go away with their databases
+		engine.delete_database("first");
+		BOOST_REQUIRE_EQUAL(engine.get_stats().open_databases_, 2);
+		unlink(hot_file.c_str());
+	}
+	//Temporary engines don't save them
+	BOOST_REQUIRE(!std::ifstream(hot_file.c_str()));
+}
@@ -1,6 +1,12 @@
 #include <boost/test/unit_test.hpp>
 
 #include "errors.h"
+#include "dump_reader.h"
+#include "published_map.h"
+#include <boost/weak_ptr.hpp>
+#include <set>
+#include <thread>
+#include <fstream>
 using namespace sofadb;
 
 result_code_t checkOk()
@@ -49,3 +55,151 @@ BOOST_AUTO_TEST_CASE(test_error_func)
 
 	BOOST_REQUIRE_EQUAL(nonthrowing().code(), 400);
 }
+
+BOOST_AUTO_TEST_CASE(test_dump_reader)
+{
+	jstring_t templ("/tmp/sofa_dump_XXXXXX");
+	int fd=mkstemp(&templ[0]);
+	if (fd<0)
+		throw std::bad_exception();
+	close(fd);
+
+	{
+		std::ofstream out(templ.c_str());
+		out << " [ {\"a\": [1, 2, {\"b\": \"],}\"}]} ,\n"
+			   "\"str\\\\\", 12.5e3\t, [] , \"\\\"]\\\"\"]\n";
+	}
+
+	std::vector<jstring_t> elems;
+	{
+		dump_reader reader(templ);
+		const char *elem;
+		size_t len;
+		while(reader.next(&elem, &len))
+			elems.push_back(jstring_t(elem, len));
+		BOOST_REQUIRE(!reader.next(&elem, &len));
+	}
+
+	BOOST_REQUIRE_EQUAL(elems.size(), 5);
+	BOOST_REQUIRE_EQUAL(elems.at(0), "{\"a\": [1, 2, {\"b\": \"],}\"}]}");
+	BOOST_REQUIRE_EQUAL(elems.at(1), "\"str\\\\\"");
+	BOOST_REQUIRE_EQUAL(elems.at(2), "12.5e3");
+	BOOST_REQUIRE_EQUAL(elems.at(3), "[]");
+	BOOST_REQUIRE_EQUAL(elems.at(4), "\"\\\"]\\\"\"");
+
+	{
+		std::ofstream out(templ.c_str());
+		out << "[{\"a\": 1}";
+	}
+	dump_reader broken(templ);
+	const char *elem;
+	size_t len;
+	BOOST_CHECK_THROW(broken.next(&elem, &len), sofa_exception);
+	unlink(templ.c_str());
+}
+
+BOOST_AUTO_TEST_CASE(test_dump_reader_ndjson)
+{
+	jstring_t templ("/tmp/sofa_dump_XXXXXX");
+	int fd=mkstemp(&templ[0]);
+	if (fd<0)
+		throw std::bad_exception();
+	close(fd);
+
+	{
+		std::ofstream out(templ.c_str());
+		out << "{\"a\": 1}\r\n\n  {\"b\": \"[\"}\n{\"c\": 3}";
+	}
+
+	dump_reader reader(templ);
+	BOOST_REQUIRE_EQUAL(reader.format(), dump_ndjson);
+	const char *elem;
+	size_t len;
+	BOOST_REQUIRE(reader.next(&elem, &len));
+	BOOST_REQUIRE_EQUAL(jstring_t(elem, len), "{\"a\": 1}");
+	BOOST_REQUIRE(reader.next(&elem, &len));
+	BOOST_REQUIRE_EQUAL(jstring_t(elem, len), "{\"b\": \"[\"}");
+	const size_t checkpoint=reader.position();
+	BOOST_REQUIRE(reader.next(&elem, &len));
+	BOOST_REQUIRE_EQUAL(jstring_t(elem, len), "{\"c\": 3}");
+	BOOST_REQUIRE(!reader.next(&elem, &len));
+
+	reader.seek(checkpoint);
+	BOOST_REQUIRE(reader.next(&elem, &len));
+	BOOST_REQUIRE_EQUAL(jstring_t(elem, len), "{\"c\": 3}");
+
+	//Resuming an array dump continues after the separator
+	{
+		std::ofstream out(templ.c_str());
+		out << "[1, [2], 3]";
+	}
+	dump_reader arr(templ);
+	BOOST_REQUIRE(arr.next(&elem, &len));
+	BOOST_REQUIRE(arr.next(&elem, &len));
+	const size_t arr_checkpoint=arr.position();
+
+	dump_reader resumed(templ);
+	resumed.seek(arr_checkpoint);
+	BOOST_REQUIRE(resumed.next(&elem, &len));
+	BOOST_REQUIRE_EQUAL(jstring_t(elem, len), "3");
+	BOOST_REQUIRE(!resumed.next(&elem, &len));
+	unlink(templ.c_str());
+}
+
+BOOST_AUTO_TEST_CASE(test_published_map)
+{
+	utils::published_map<jstring_t, int> map;
+	int val=0;
+	BOOST_REQUIRE(!map.find("a", val));
+	map.insert("a", 1);
+	BOOST_REQUIRE(map.find("a", val) && val==1);
+	BOOST_REQUIRE(map.erase("a"));
+	BOOST_REQUIRE(!map.erase("a"));
+	BOOST_REQUIRE(!map.find("a", val));
+	map.insert("a", 2);
+	BOOST_REQUIRE(map.find("a", val) && val==2);
+
+	//Readers run through the table growth and the erasures
+	std::atomic<bool> done(false);
+	std::atomic<size_t> errors(0);
+	std::vector<std::thread> readers;
+	for(int t=0;t<4;++t)
+		readers.push_back(std::thread([&]{
+			while(!done)
+				for(int f=0;f<1000;++f)
+				{
+					int res=-1;
+					if (map.find("k"+int_to_string(f), res) && res!=f)
+						++errors;
+				}
+		}));
+	for(int f=0;f<1000;++f)
+	{
+		map.insert("k"+int_to_string(f), f);
+		if (f%3==0)
+			map.erase("k"+int_to_string(f/2));
+	}
+	done=true;
+	for(auto i=readers.begin(), iend=readers.end(); i!=iend; ++i)
+		i->join();
+	BOOST_REQUIRE_EQUAL(errors, 0);
+
+	std::set<int> erased;
+	for(int f=0;f<1000;f+=3)
+		erased.insert(f/2);
+	for(int f=0;f<1000;++f)
+		BOOST_REQUIRE_EQUAL(map.find("k"+int_to_string(f), val),
+							!erased.count(f));
+	BOOST_REQUIRE_EQUAL(map.size(), 1001-erased.size());
+
+	//Erased values are released once no reader can see them
+	utils::published_map<jstring_t, boost::shared_ptr<int> > owners;
+	boost::shared_ptr<int> owned(new int(1));
+	boost::weak_ptr<int> watch(owned);
+	owners.insert("a", owned);
+	owned.reset();
+	owners.erase("a");
+	BOOST_REQUIRE(!watch.expired());
+	owners.collect();
+	BOOST_REQUIRE(watch.expired());
+}
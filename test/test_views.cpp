@@ -0,0 +1,426 @@
+#include <boost/test/unit_test.hpp>
+#include "json_key.h"
+#include "engine.h"
+#include "database.h"
+#include "view.h"
+#include "errors.h"
+
+using namespace sofadb;
+
+BOOST_AUTO_TEST_CASE(test_json_key_order)
+{
+	//Sorted according to json_value::operator <
+	const char *sorted[]={
+		"null", "false", "true",
+		"-9223372036854775808", "-1", "0", "1", "255", "256",
+		"9223372036854775807",
+		"-1e300", "-1.5", "-0.5", "0.0", "1e-300", "0.5", "1.5", "1e300",
+		"\"\"", "\"\\u0000\"", "\"\\u0000\\u0000\"", "\"\\u0000a\"", "\"a\"",
+		"\"a\\u0000\"", "\"aa\"", "\"b\"", "\"\\u00ff\"",
+		"-100000000000000000000000", "-99999999999999999999",
+		"99999999999999999999", "100000000000000000000000",
+		"{}", "{\"A\" : 1}", "{\"a\" : 1}", "{\"a\" : 1, \"b\" : 1}",
+		"{\"a\" : 2}", "{\"b\" : null}",
+		"[]", "[null]", "[1]", "[1, 2]", "[1, [2]]", "[2]", "[\"a\"]", "[[]]",
+	};
+	const size_t count=sizeof(sorted)/sizeof(sorted[0]);
+
+	std::vector<json_value> vals;
+	std::vector<jstring_t> keys;
+	for(size_t f=0;f<count;++f)
+	{
+		vals.push_back(string_to_json(jstring_t("[")+sorted[f]+"]")
+					   .get_sublist().at(0));
+		keys.push_back(json_to_key(vals.back()));
+		BOOST_REQUIRE_EQUAL(key_to_json(keys.back()), vals.back());
+	}
+
+	for(size_t f=0;f<count;++f)
+		for(size_t g=0;g<count;++g)
+		{
+			BOOST_REQUIRE_EQUAL(vals[f]<vals[g], f<g);
+			BOOST_REQUIRE_EQUAL(keys[f]<keys[g], f<g);
+		}
+
+	//Negative zero is equal to zero, in-range bignums are ints
+	BOOST_REQUIRE_EQUAL(json_to_key(json_value(-0.0)),
+						json_to_key(json_value(0.0)));
+	BOOST_REQUIRE_EQUAL(json_to_key(json_value(bignum_t("-12"))),
+						json_to_key(json_value(int64_t(-12))));
+
+	//Keys are self-delimiting
+	jstring_t composite=json_to_key(string_to_json("[\"a\"]"));
+	json_to_key(composite, json_value(int64_t(42)));
+	json_value first;
+	size_t consumed=key_to_json(composite.data(), composite.size(), first);
+	BOOST_REQUIRE_EQUAL(first, string_to_json("[\"a\"]"));
+	BOOST_REQUIRE_EQUAL(key_to_json(composite.substr(consumed)),
+						json_value(int64_t(42)));
+
+	BOOST_CHECK_THROW(key_to_json(jstring_t("\x50" "abc")), sofa_exception);
+}
+
+BOOST_AUTO_TEST_CASE(test_json_key_couchdb_collation)
+{
+	//Sorted according to the CouchDB view collation
+	const char *sorted[]={
+		"null", "false", "true",
+		"-1e300", "-10000000000000000000000000", "-5", "-1.5", "0", "0.5",
+		"1", "2", "100000000000000000000", "1e300",
+		"\"\"", "\" \"", "\"_\"", "\"-\"", "\"$\"", "\"0\"", "\"9\"",
+		"\"a\"", "\"A\"", "\"ab\"", "\"aB\"", "\"Ab\"", "\"AB\"",
+		"\"b\"", "\"B\"", "\"ba\"", "\"\u00e9\"",
+		"[]", "[\"a\"]", "[\"b\"]", "[\"b\", \"c\"]", "[\"b\", \"c\", \"a\"]",
+		"[\"b\", \"d\"]", "[[]]", "[{}]",
+		"{}", "{\"a\" : 1}", "{\"a\" : 2}", "{\"A\" : 1}", "{\"b\" : 1}",
+	};
+	const size_t count=sizeof(sorted)/sizeof(sorted[0]);
+
+	std::vector<jstring_t> keys;
+	for(size_t f=0;f<count;++f)
+	{
+		json_value val=string_to_json(jstring_t("[")+sorted[f]+"]")
+				.get_sublist().at(0);
+		keys.push_back(json_to_key(val, collate_couchdb));
+		BOOST_REQUIRE_EQUAL(key_to_json(keys.back()), val);
+	}
+	for(size_t f=0;f<count;++f)
+		for(size_t g=0;g<count;++g)
+			BOOST_REQUIRE_EQUAL(keys[f]<keys[g], f<g);
+
+	//Types of equal numbers are kept
+	BOOST_REQUIRE_EQUAL(key_to_json(json_to_key(json_value(int64_t(3)),
+		collate_couchdb)).type(), int_d);
+	BOOST_REQUIRE(json_to_key(json_value(3.0), collate_couchdb) <
+				  json_to_key(json_value(int64_t(3)), collate_couchdb));
+	BOOST_REQUIRE(json_to_key(json_value(int64_t(3)), collate_couchdb) <
+				  json_to_key(json_value(3.5), collate_couchdb));
+}
+
+static void by_type(const jstring_t &, const json_value &doc,
+					const emit_function_t &emit)
+{
+	const submap_t &map=doc.get_submap();
+	auto type=map.find("type");
+	if (type!=map.end())
+		emit(type->second, map.find("n")->second);
+}
+
+static std::vector<jstring_t> row_ids(const std::vector<view_row_t> &rows)
+{
+	std::vector<jstring_t> res;
+	for(auto i=rows.begin(), iend=rows.end(); i!=iend; ++i)
+		res.push_back(i->id_);
+	return res;
+}
+
+BOOST_AUTO_TEST_CASE(test_view_update_and_query)
+{
+	jstring_t templ("/tmp/sofa_XXXXXX");
+	if (!mkdtemp(&templ[0]))
+		throw std::bad_exception();
+	DbEngine engine(templ, true);
+	database_ptr ptr=engine.create_a_database("test");
+	storage_ptr_t stg=engine.create_storage(false);
+
+	const char *docs[][2]={
+		{"d1", "{\"type\" : \"b\", \"n\" : 1}"},
+		{"d2", "{\"type\" : \"a\", \"n\" : 2}"},
+		{"d3", "{\"type\" : \"c\", \"n\" : 3}"},
+		{"d4", "{\"type\" : \"b\", \"n\" : 4}"},
+		{"d5", "{\"other\" : true}"},
+	};
+	std::map<jstring_t, revision_num_t> revs;
+	for(size_t f=0;f<5;++f)
+		revs[docs[f][0]]=ptr->put(stg.get(), docs[f][0], revision_num_t(),
+			string_to_json(docs[f][1])).assigned_rev_;
+	BOOST_REQUIRE_EQUAL(ptr->update_seq(), 5);
+
+	View view(ptr, "by_type", &by_type);
+	batch_storage_ptr_t batch=engine.create_batch_storage();
+	BOOST_REQUIRE_EQUAL(view.update(batch.get(), 2), 5);
+
+	std::vector<view_row_t> rows;
+	view.query(stg.get(), view_query_t(), rows);
+	BOOST_REQUIRE_EQUAL(rows.size(), 4);
+	BOOST_REQUIRE_EQUAL(rows[0].key_, json_value(jstring_t("a")));
+	BOOST_REQUIRE_EQUAL(rows[0].value_, json_value(int64_t(2)));
+	BOOST_REQUIRE(row_ids(rows)==std::vector<jstring_t>(
+		{"d2", "d1", "d4", "d3"}));
+
+	//Key ranges, inclusive_end, limit, skip and descending
+	view_query_t q;
+	q.set_start_key(json_value(jstring_t("b")));
+	rows.clear();
+	view.query(stg.get(), q, rows);
+	BOOST_REQUIRE(row_ids(rows)==std::vector<jstring_t>({"d1", "d4", "d3"}));
+
+	q.set_end_key(json_value(jstring_t("b")));
+	rows.clear();
+	view.query(stg.get(), q, rows);
+	BOOST_REQUIRE(row_ids(rows)==std::vector<jstring_t>({"d1", "d4"}));
+
+	q.inclusive_end_=false;
+	q.set_end_key(json_value(jstring_t("c")));
+	rows.clear();
+	view.query(stg.get(), q, rows);
+	BOOST_REQUIRE(row_ids(rows)==std::vector<jstring_t>({"d1", "d4"}));
+
+	view_query_t desc;
+	desc.descending_=true;
+	desc.set_start_key(json_value(jstring_t("b")));
+	rows.clear();
+	view.query(stg.get(), desc, rows);
+	BOOST_REQUIRE(row_ids(rows)==std::vector<jstring_t>({"d4", "d1", "d2"}));
+
+	desc.set_end_key(json_value(jstring_t("a")));
+	desc.inclusive_end_=false;
+	desc.skip_=1;
+	desc.limit_=5;
+	rows.clear();
+	view.query(stg.get(), desc, rows);
+	BOOST_REQUIRE(row_ids(rows)==std::vector<jstring_t>({"d1"}));
+
+	//Incremental update: d1 changes its key, d5 starts emitting
+	ptr->put(stg.get(), "d1", revs["d1"],
+			 string_to_json("{\"type\" : \"z\", \"n\" : 10}"));
+	ptr->put(stg.get(), "d5", revs["d5"],
+			 string_to_json("{\"type\" : \"a\", \"n\" : 5}"));
+	BOOST_REQUIRE_EQUAL(view.indexed_seq(stg.get()), 5);
+	BOOST_REQUIRE_EQUAL(view.update(batch.get()), 7);
+
+	rows.clear();
+	view.query(stg.get(), view_query_t(), rows);
+	BOOST_REQUIRE(row_ids(rows)==std::vector<jstring_t>(
+		{"d2", "d5", "d4", "d3", "d1"}));
+	BOOST_REQUIRE_EQUAL(rows.back().value_, json_value(int64_t(10)));
+
+	//Only the changed documents are reported
+	size_t changes=0;
+	ptr->changes_since(stg.get(), 5, [&](uint64_t, const jstring_t&) -> bool
+	{
+		++changes;
+		return true;
+	});
+	BOOST_REQUIRE_EQUAL(changes, 2);
+
+	//A new version of the map function rebuilds the index
+	View view2(ptr, "by_type", [](const jstring_t &id, const json_value&,
+								  const emit_function_t &emit)
+	{
+		emit(json_value(id), json_value());
+	}, reduce_none, "v2");
+	BOOST_REQUIRE_EQUAL(view2.indexed_seq(stg.get()), 0);
+	view2.update(batch.get());
+	rows.clear();
+	view2.query(stg.get(), view_query_t(), rows);
+	BOOST_REQUIRE(row_ids(rows)==std::vector<jstring_t>(
+		{"d1", "d2", "d3", "d4", "d5"}));
+}
+
+BOOST_AUTO_TEST_CASE(test_update_seq_recovery)
+{
+	jstring_t templ("/tmp/sofa_XXXXXX");
+	if (!mkdtemp(&templ[0]))
+		throw std::bad_exception();
+	{
+		DbEngine engine(templ, false);
+		database_ptr ptr=engine.create_a_database("test");
+		storage_ptr_t stg=engine.create_storage(false);
+		for(int f=0;f<300;++f)
+			ptr->put(stg.get(), "doc"+int_to_string(f), revision_num_t(),
+					 string_to_json("{}"));
+		engine.create_a_database("test2");
+	}
+	DbEngine engine(templ, true);
+	BOOST_REQUIRE_EQUAL(engine.create_a_database("test")->update_seq(), 300);
+	BOOST_REQUIRE_EQUAL(engine.create_a_database("test2")->update_seq(), 0);
+}
+
+BOOST_AUTO_TEST_CASE(test_view_waits_for_uncommitted_changes)
+{
+	jstring_t templ("/tmp/sofa_XXXXXX");
+	if (!mkdtemp(&templ[0]))
+		throw std::bad_exception();
+	DbEngine engine(templ, true);
+	database_ptr ptr=engine.create_a_database("test");
+	storage_ptr_t stg=engine.create_storage(false);
+
+	//The batch takes the first sequence but commits after the second
+	batch_storage_ptr_t open=engine.create_batch_storage();
+	ptr->put(open.get(), "d1", revision_num_t(),
+			 string_to_json("{\"type\" : \"a\", \"n\" : 1}"));
+	ptr->put(stg.get(), "d2", revision_num_t(),
+			 string_to_json("{\"type\" : \"b\", \"n\" : 2}"));
+
+	View view(ptr, "by_type", &by_type);
+	batch_storage_ptr_t batch=engine.create_batch_storage();
+	BOOST_REQUIRE_EQUAL(view.update(batch.get()), 0);
+
+	open->commit(false);
+	BOOST_REQUIRE_EQUAL(view.update(batch.get()), 2);
+	std::vector<view_row_t> rows;
+	view.query(stg.get(), view_query_t(), rows);
+	BOOST_REQUIRE(row_ids(rows)==std::vector<jstring_t>({"d1", "d2"}));
+
+	//An abandoned batch doesn't hold the feed back
+	{
+		batch_storage_ptr_t dropped=engine.create_batch_storage();
+		ptr->put(dropped.get(), "d3", revision_num_t(),
+				 string_to_json("{}"));
+	}
+	ptr->put(stg.get(), "d4", revision_num_t(), string_to_json("{}"));
+	BOOST_REQUIRE_EQUAL(view.update(batch.get()), 4);
+}
+
+static void by_pair(const jstring_t &, const json_value &doc,
+					const emit_function_t &emit)
+{
+	const submap_t &map=doc.get_submap();
+	auto key=map.find("k");
+	if (key!=map.end())
+		emit(key->second, map.find("v")->second);
+}
+
+static reduce_partial_t reduce_rows(const std::vector<view_row_t> &rows)
+{
+	reduce_partial_t res;
+	for(auto i=rows.begin(), iend=rows.end(); i!=iend; ++i)
+		res.add(i->value_.type()==int_d ? double(i->value_.get_int())
+										: i->value_.get_double());
+	return res;
+}
+
+BOOST_AUTO_TEST_CASE(test_view_reduce)
+{
+	jstring_t templ("/tmp/sofa_XXXXXX");
+	if (!mkdtemp(&templ[0]))
+		throw std::bad_exception();
+	DbEngine engine(templ, true);
+	database_ptr ptr=engine.create_a_database("test");
+	storage_ptr_t stg=engine.create_storage(false);
+	batch_storage_ptr_t batch=engine.create_batch_storage();
+
+	View view(ptr, "stats", &by_pair, reduce_stats);
+	//Tiny groups to exercise splits and merges
+	view.set_group_rows(4);
+
+	srand(7);
+	std::map<jstring_t, revision_num_t> revs;
+	for(int round=0;round<6;++round)
+	{
+		for(int f=0;f<60;++f)
+		{
+			jstring_t id="doc"+int_to_string(rand()%80);
+			json_value doc(submap_d);
+			//Some documents stop emitting
+			if (rand()%5)
+			{
+				json_value key(sublist_d);
+				key.get_sublist().push_back(json_value(int64_t(rand()%3)));
+				key.get_sublist().push_back(json_value(int64_t(rand()%5)));
+				doc["k"]=key;
+				doc["v"]=json_value(int64_t(rand()%100));
+			}
+			revs[id]=ptr->put(stg.get(), id, revs[id], doc).assigned_rev_;
+		}
+		view.update(batch.get(), 7);
+
+		std::vector<view_row_t> all;
+		view.query(stg.get(), view_query_t(), all);
+		reduce_partial_t expected=reduce_rows(all);
+		json_value total=view.reduce(stg.get(), view_query_t());
+		BOOST_REQUIRE_EQUAL(total["count"], json_value(int64_t(all.size())));
+		BOOST_REQUIRE_EQUAL(total["sum"], json_value(expected.sum_));
+		if (!all.empty())
+		{
+			BOOST_REQUIRE_EQUAL(total["min"], json_value(expected.min_));
+			BOOST_REQUIRE_EQUAL(total["max"], json_value(expected.max_));
+		}
+
+		//Random ranges
+		for(int f=0;f<20;++f)
+		{
+			view_query_t q;
+			json_value lo=string_to_json("[" + int_to_string(rand()%3) +
+										 "," + int_to_string(rand()%5) + "]");
+			json_value hi=string_to_json("[" + int_to_string(rand()%3) +
+										 "," + int_to_string(rand()%5) + "]");
+			if (hi<lo)
+				std::swap(lo, hi);
+			q.descending_=rand()%2;
+			q.set_start_key(q.descending_ ? hi : lo);
+			q.set_end_key(q.descending_ ? lo : hi);
+			q.inclusive_end_=rand()%2;
+
+			std::vector<view_row_t> rows;
+			view.query(stg.get(), q, rows);
+			reduce_partial_t exp=reduce_rows(rows);
+			json_value red=view.reduce(stg.get(), q);
+			BOOST_REQUIRE_EQUAL(red["count"], json_value(int64_t(exp.count_)));
+			BOOST_REQUIRE_EQUAL(red["sum"], json_value(exp.sum_));
+			if (exp.count_)
+				BOOST_REQUIRE_EQUAL(red["max"], json_value(exp.max_));
+		}
+
+		//Group levels against the rows grouped by hand
+		for(size_t level=1;level<=3;++level)
+		{
+			std::map<json_value, reduce_partial_t> groups;
+			for(auto i=all.begin(), iend=all.end(); i!=iend; ++i)
+			{
+				json_value key=i->key_;
+				if (key.get_sublist().size()>level)
+					key.get_sublist().resize(level);
+				groups[key].add(double(i->value_.get_int()));
+			}
+
+			std::vector<view_row_t> res;
+			view.reduce_groups(stg.get(), view_query_t(), level, res);
+			BOOST_REQUIRE_EQUAL(res.size(), groups.size());
+			auto pos=groups.begin();
+			for(size_t f=0;f<res.size();++f, ++pos)
+			{
+				BOOST_REQUIRE_EQUAL(res[f].key_, pos->first);
+				BOOST_REQUIRE_EQUAL(res[f].value_["count"],
+									json_value(int64_t(pos->second.count_)));
+				BOOST_REQUIRE_EQUAL(res[f].value_["sum"],
+									json_value(pos->second.sum_));
+			}
+
+			view_query_t desc;
+			desc.descending_=true;
+			desc.limit_=2;
+			res.clear();
+			view.reduce_groups(stg.get(), desc, level, res);
+			BOOST_REQUIRE_EQUAL(res.size(), std::min<size_t>(2, groups.size()));
+			if (!res.empty())
+				BOOST_REQUIRE_EQUAL(res[0].key_, groups.rbegin()->first);
+		}
+	}
+
+	//The rows are spread over many small groups
+	size_t groups=0;
+	const jstring_t group_prefix="_view/test!stats!g";
+	std::auto_ptr<storage_iterator_t> it=stg->iterate();
+	for(it->seek(group_prefix); it->valid() &&
+		it->key().compare(0, group_prefix.size(), group_prefix)==0; it->next())
+		++groups;
+	BOOST_REQUIRE_GT(groups, 5);
+
+	//Non-numeric values can't be summed
+	View bad(ptr, "bad", [](const jstring_t&, const json_value&,
+							const emit_function_t &emit)
+	{
+		emit(json_value(), json_value(jstring_t("x")));
+	}, reduce_sum);
+	BOOST_CHECK_THROW(bad.update(engine.create_batch_storage().get()),
+					  sofa_exception);
+
+	View counter(ptr, "count", &by_pair, reduce_count);
+	counter.update(batch.get());
+	std::vector<view_row_t> all;
+	counter.query(stg.get(), view_query_t(), all);
+	BOOST_REQUIRE_EQUAL(counter.reduce(stg.get(), view_query_t()),
+						json_value(int64_t(all.size())));
+}
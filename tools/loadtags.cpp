@@ -1,60 +1,151 @@
 #include <stdio.h>
-#include <fstream>
+#include <stdlib.h>
 #include <iostream>
+#include <thread>
+#include <exception>
+#include <functional>
+#include <mutex>
 #include "database.h"
 #include "engine.h"
+#include "errors.h"
+#include "dump_reader.h"
+#include "blocking_queue.h"
 
 using namespace sofadb;
+using namespace utils;
+
+//Raw element texts pointing into the mapped dump
+typedef std::vector<std::pair<const char*, size_t> > raw_chunk_t;
+typedef std::vector<std::pair<jstring_t, json_value> > doc_chunk_t;
+
+//Elements are handed to the parsers in chunks to keep the queue
+//overhead negligible compared to the parsing itself.
+static const size_t chunk_size = 256;
+
+static void parse_chunks(blocking_queue<raw_chunk_t> &in,
+						 blocking_queue<doc_chunk_t> &out)
+{
+	raw_chunk_t raw;
+	while(in.pop(raw))
+	{
+		doc_chunk_t docs;
+		docs.reserve(raw.size());
+		for(auto i=raw.begin(), iend=raw.end(); i!=iend; ++i)
+		{
+			json_value val=string_to_json(i->first, i->second);
+			jstring_t id=val["metadata"]["track_id"].as_str();
+			docs.push_back(std::make_pair(std::move(id), std::move(val)));
+		}
+		if (!out.push(std::move(docs)))
+			break;
+	}
+}
 
 int main(int argc, char **argv)
 {
-	if (argc!=3)
+	if (argc<3 || argc>5)
 	{
-		std::cerr << "Usage: loadtags <dumpfile> <database>" << std::endl;
+		std::cerr << "Usage: loadtags <dumpfile> <database> "
+					 "[threads] [batch_size]" << std::endl;
 		return 1;
 	}
 
 	jstring_t dump_file = argv[1];
+	size_t threads = argc>3 ? atoi(argv[3]) : std::thread::hardware_concurrency();
+	size_t batch_size = argc>4 ? atoi(argv[4]) : 1000;
+	if (!threads)
+		threads=1;
+	if (!batch_size)
+		batch_size=1;
 
 	DbEngine engine(argv[2], false);
 	database_ptr ptr=engine.create_a_database("tags");
 
-	std::ifstream stream(dump_file);
-	int ch=stream.get();
-	if (stream.eof() || ch!='[')
+	try
 	{
-		std::cerr << "Premature end of file" << std::endl;
-		return 2;
-	}
+		dump_reader reader(dump_file);
 
-	storage_ptr_t stg=engine.create_storage(false);
-
-//	json_value val=json_from_stream(stream);
-//	for(int f=0;f<20000;++f)
-//		ptr->put(stg.get(), "test"+int_to_string(f),
-//			 revision_num_t::empty_revision, json_value(), val);
-//	return 0;
-//	for(int f=0;f<1000;++f)
-//	{
-//		json_from_stream(stream);
-//		char ch=stream.get();
-//	}
-//	return 0;
-
-	while(true)
-	{
-		json_value val=json_from_stream(stream);
-		ptr->put(stg.get(), val["metadata"]["track_id"].as_str(),
-				 revision_num_t::empty_revision, val, false);
+		blocking_queue<raw_chunk_t> raw(threads*4);
+		blocking_queue<doc_chunk_t> parsed(threads*4);
 
-		char ch=stream.get();
-		if (ch == ']')
-			break;
-		if (stream.eof() || ch!=',')
+		std::exception_ptr failure;
+		std::mutex failure_mutex;
+		auto guarded=[&](std::function<void()> fn)
 		{
-			std::cerr << "Unexpected char " << ch << std::endl;
-			return 2;
-		}
+			try
+			{
+				fn();
+			} catch(...)
+			{
+				std::lock_guard<std::mutex> lock(failure_mutex);
+				if (!failure)
+					failure=std::current_exception();
+				raw.close();
+				parsed.close();
+			}
+		};
+
+		//The dump is split on this thread, parsed on the workers and
+		//written in batches by the single writer thread
+		std::vector<std::thread> parsers;
+		for(size_t f=0;f<threads;++f)
+			parsers.push_back(std::thread([&]{
+				guarded([&]{ parse_chunks(raw, parsed); });
+			}));
+
+		std::thread writer([&]{
+			guarded([&]{
+				batch_storage_ptr_t stg=engine.create_batch_storage();
+				size_t in_batch=0;
+				doc_chunk_t docs;
+				while(parsed.pop(docs))
+				{
+					for(auto i=docs.begin(), iend=docs.end(); i!=iend; ++i)
+					{
+						ptr->put(stg.get(), i->first,
+								 revision_num_t::empty_revision,
+								 i->second, false);
+						if (++in_batch>=batch_size)
+						{
+							stg->commit(false);
+							in_batch=0;
+						}
+					}
+				}
+				stg->commit(false);
+			});
+		});
+
+		guarded([&]{
+			raw_chunk_t chunk;
+			const char *elem;
+			size_t len;
+			while(reader.next(&elem, &len))
+			{
+				chunk.push_back(std::make_pair(elem, len));
+				if (chunk.size()>=chunk_size)
+				{
+					if (!raw.push(std::move(chunk)))
+						return;
+					chunk.clear();
+				}
+			}
+			if (!chunk.empty())
+				raw.push(std::move(chunk));
+		});
+		raw.close();
+
+		for(auto i=parsers.begin(), iend=parsers.end(); i!=iend; ++i)
+			i->join();
+		parsed.close();
+		writer.join();
+
+		if (failure)
+			std::rethrow_exception(failure);
+	} catch(const std::exception &ex)
+	{
+		std::cerr << ex.what() << std::endl;
+		return 2;
 	}
 
 	return 0;
@@ -0,0 +1,366 @@
+#include <stdio.h>
+#include <iostream>
+#include <thread>
+#include <chrono>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <map>
+#include <gflags/gflags.h>
+#include "database.h"
+#include "engine.h"
+#include "errors.h"
+#include "dump_reader.h"
+#include "blocking_queue.h"
+
+using namespace sofadb;
+using namespace utils;
+
+DEFINE_string(format, "auto", "Dump format: auto, array or ndjson");
+DEFINE_string(id_path, "_id", "Dotted JSON path of the document id");
+DEFINE_int32(threads, 0, "Number of parser threads, 0 - one per core");
+DEFINE_int32(batch_size, 1000, "Number of documents per write batch");
+DEFINE_bool(sync, false, "Sync every batch to the disk");
+DEFINE_bool(restart, false, "Ignore the saved checkpoint and start over");
+DEFINE_int32(report_interval, 5, "Seconds between progress reports");
+
+typedef std::chrono::steady_clock clock_type;
+
+struct raw_chunk_t
+{
+	size_t seq_;
+	//Element text and the dump offset right after it
+	std::vector<std::pair<const char*, size_t> > elems_;
+	std::vector<size_t> ends_;
+};
+
+struct doc_t
+{
+	jstring_t id_;
+	json_value content_;
+	size_t end_;
+};
+
+struct doc_chunk_t
+{
+	size_t seq_;
+	std::vector<doc_t> docs_;
+};
+
+//Elements are handed to the parsers in chunks to keep the queue
+//overhead negligible compared to the parsing itself.
+static const size_t chunk_size = 256;
+
+static jstring_t extract_id(const json_value &doc, const json_path_t &path,
+							size_t offset)
+{
+	const json_value *cur=&doc;
+	for(auto i=path.begin(), iend=path.end(); i!=iend; ++i)
+	{
+		if (cur->type()!=submap_d)
+			cur=0;
+		else
+		{
+			const submap_t &map=cur->get_submap();
+			auto pos=map.find(*i);
+			cur = pos==map.end() ? 0 : &pos->second;
+		}
+		if (!cur)
+			err(result_code_t::sError) << "No '" << FLAGS_id_path
+				<< "' in the document ending at " << offset;
+	}
+
+	if (cur->type()==string_d)
+		return cur->get_str();
+	if (cur->type()==int_d)
+		return int_to_string(cur->get_int());
+	err(result_code_t::sError) << "The id of the document ending at "
+							   << offset << " is not a string";
+	return jstring_t();
+}
+
+static void parse_chunks(blocking_queue<raw_chunk_t> &in,
+						 blocking_queue<doc_chunk_t> &out,
+						 const json_path_t &id_path)
+{
+	raw_chunk_t raw;
+	while(in.pop(raw))
+	{
+		doc_chunk_t chunk;
+		chunk.seq_=raw.seq_;
+		chunk.docs_.resize(raw.elems_.size());
+		for(size_t f=0;f<raw.elems_.size();++f)
+		{
+			doc_t &doc=chunk.docs_[f];
+			doc.content_=string_to_json(raw.elems_[f].first,
+										raw.elems_[f].second);
+			doc.id_=extract_id(doc.content_, id_path, raw.ends_[f]);
+			doc.end_=raw.ends_[f];
+		}
+		if (!out.push(std::move(chunk)))
+			break;
+	}
+}
+
+/**
+	Applies parsed documents in the dump order and commits them in
+	batches. The checkpoint is written into the same batch as the
+	documents, so after a crash the import resumes exactly after the
+	last committed document.
+  */
+class import_writer
+{
+	DbEngine &engine_;
+	database_ptr db_;
+	jstring_t checkpoint_key_;
+	size_t dump_size_;
+
+	batch_storage_ptr_t stg_;
+	size_t in_batch_;
+	size_t last_end_;
+	clock_type::time_point batch_start_;
+
+	//Totals
+	size_t docs_, conflicts_;
+	clock_type::time_point start_;
+
+	//Since the last report
+	clock_type::time_point report_start_;
+	size_t report_docs_, report_offset_, report_batches_;
+	double latency_sum_, latency_max_;
+public:
+	import_writer(DbEngine &engine, database_ptr db,
+				  const jstring_t &checkpoint_key, size_t dump_size,
+				  size_t start_offset, size_t docs) :
+		engine_(engine), db_(db), checkpoint_key_(checkpoint_key),
+		dump_size_(dump_size), in_batch_(), last_end_(start_offset),
+		docs_(docs), conflicts_(), report_docs_(),
+		report_offset_(start_offset), report_batches_(),
+		latency_sum_(), latency_max_()
+	{
+		stg_=engine_.create_batch_storage();
+		start_=report_start_=batch_start_=clock_type::now();
+	}
+
+	void run(blocking_queue<doc_chunk_t> &in)
+	{
+		//Chunks are parsed concurrently and may arrive out of order
+		std::map<size_t, doc_chunk_t> reorder;
+		size_t next_seq=0;
+		doc_chunk_t chunk;
+		while(in.pop(chunk))
+		{
+			reorder[chunk.seq_]=std::move(chunk);
+			for(auto pos=reorder.find(next_seq); pos!=reorder.end();
+				pos=reorder.find(++next_seq))
+			{
+				apply(pos->second);
+				reorder.erase(pos);
+			}
+		}
+		if (in_batch_)
+			commit();
+		report(true);
+	}
+
+private:
+	void apply(const doc_chunk_t &chunk)
+	{
+		for(auto i=chunk.docs_.begin(), iend=chunk.docs_.end();i!=iend;++i)
+		{
+			if (!in_batch_)
+				batch_start_=clock_type::now();
+			put_result_t res=db_->put(stg_.get(), i->id_,
+				revision_num_t::empty_revision, i->content_);
+			if (res.code_!=UPDATE_OK)
+				++conflicts_;
+			last_end_=i->end_;
+			++docs_;
+			++report_docs_;
+			if (++in_batch_>=size_t(FLAGS_batch_size))
+				commit();
+		}
+	}
+
+	void commit()
+	{
+		json_value cp(submap_d);
+		cp["size"]=json_value(int64_t(dump_size_));
+		cp["offset"]=json_value(int64_t(last_end_));
+		cp["docs"]=json_value(int64_t(docs_));
+		stg_->put(checkpoint_key_, json_to_string(cp));
+		stg_->commit(FLAGS_sync);
+		in_batch_=0;
+
+		double latency=std::chrono::duration<double>(
+					clock_type::now()-batch_start_).count();
+		latency_sum_+=latency;
+		if (latency>latency_max_)
+			latency_max_=latency;
+		++report_batches_;
+		report(false);
+	}
+
+	void report(bool final)
+	{
+		clock_type::time_point now=clock_type::now();
+		double elapsed=std::chrono::duration<double>(
+					now-report_start_).count();
+		if (!final && elapsed<FLAGS_report_interval)
+			return;
+
+		char buf[256];
+		if (final)
+		{
+			double total=std::chrono::duration<double>(now-start_).count();
+			snprintf(buf, sizeof(buf), "Imported %zu docs (%zu conflicts) "
+					 "in %.1fs", docs_, conflicts_, total);
+		} else
+		{
+			const double mb=double(last_end_-report_offset_)/(1024*1024);
+			snprintf(buf, sizeof(buf), "%5.1f%%  %zu docs  %.0f docs/s  "
+					 "%.2f MB/s  batch avg %.1fms max %.1fms",
+					 dump_size_ ? 100.0*last_end_/dump_size_ : 100.0,
+					 docs_, report_docs_/elapsed, mb/elapsed,
+					 report_batches_ ? 1000*latency_sum_/report_batches_ : 0,
+					 1000*latency_max_);
+		}
+		std::cerr << buf << std::endl;
+
+		report_start_=now;
+		report_docs_=report_batches_=0;
+		report_offset_=last_end_;
+		latency_sum_=latency_max_=0;
+	}
+};
+
+int main(int argc, char **argv)
+{
+	google::SetUsageMessage("Usage: sofaimport [options] <dumpfile> "
+							"<engine path> <database>");
+	google::ParseCommandLineFlags(&argc, &argv, true);
+	if (argc!=4)
+	{
+		std::cerr << google::ProgramUsage() << std::endl;
+		return 1;
+	}
+
+	const jstring_t dump_file=argv[1];
+	size_t threads=FLAGS_threads>0 ? FLAGS_threads :
+									 std::thread::hardware_concurrency();
+	if (!threads)
+		threads=1;
+	if (FLAGS_batch_size<1)
+		FLAGS_batch_size=1;
+
+	dump_format_e format;
+	if (FLAGS_format=="auto")
+		format=dump_auto;
+	else if (FLAGS_format=="array")
+		format=dump_json_array;
+	else if (FLAGS_format=="ndjson")
+		format=dump_ndjson;
+	else
+	{
+		std::cerr << "Unknown format " << FLAGS_format << std::endl;
+		return 1;
+	}
+
+	try
+	{
+		DbEngine engine(argv[2], false);
+		database_ptr db=engine.create_a_database(argv[3]);
+		dump_reader reader(dump_file, format);
+
+		//Progress is tracked per the dump file
+		const jstring_t checkpoint_key=jstring_t(SD_SYSTEM_DB)+"/"+argv[3]+
+				DB_SEPARATOR+"import"+DB_SEPARATOR+dump_file;
+		size_t start_offset=0, start_docs=0;
+		jstring_t saved;
+		if (!FLAGS_restart && engine.create_storage(false)->try_get(
+				checkpoint_key, &saved))
+		{
+			json_value cp=string_to_json(saved);
+			if (size_t(cp["size"].get_int())!=reader.size())
+				err(result_code_t::sError) << dump_file << " has changed "
+					"since the last import, use --restart to start over";
+			start_offset=cp["offset"].get_int();
+			start_docs=cp["docs"].get_int();
+			reader.seek(start_offset);
+			std::cerr << "Resuming after " << start_docs << " docs at offset "
+					  << start_offset << std::endl;
+		}
+
+		const json_path_t id_path=split_json_path(FLAGS_id_path);
+		blocking_queue<raw_chunk_t> raw(threads*4);
+		blocking_queue<doc_chunk_t> parsed(threads*4);
+
+		std::exception_ptr failure;
+		std::mutex failure_mutex;
+		auto guarded=[&](std::function<void()> fn)
+		{
+			try
+			{
+				fn();
+			} catch(...)
+			{
+				std::lock_guard<std::mutex> lock(failure_mutex);
+				if (!failure)
+					failure=std::current_exception();
+				raw.close();
+				parsed.close();
+			}
+		};
+
+		//The dump is split on this thread, parsed on the workers and
+		//written in the original order by the writer thread
+		std::vector<std::thread> parsers;
+		for(size_t f=0;f<threads;++f)
+			parsers.push_back(std::thread([&]{
+				guarded([&]{ parse_chunks(raw, parsed, id_path); });
+			}));
+
+		import_writer writer(engine, db, checkpoint_key, reader.size(),
+							 start_offset, start_docs);
+		std::thread writer_thread([&]{
+			guarded([&]{ writer.run(parsed); });
+		});
+
+		guarded([&]{
+			raw_chunk_t chunk;
+			chunk.seq_=0;
+			const char *elem;
+			size_t len;
+			while(reader.next(&elem, &len))
+			{
+				chunk.elems_.push_back(std::make_pair(elem, len));
+				chunk.ends_.push_back(reader.position());
+				if (chunk.elems_.size()>=chunk_size)
+				{
+					const size_t seq=chunk.seq_;
+					if (!raw.push(std::move(chunk)))
+						return;
+					chunk=raw_chunk_t();
+					chunk.seq_=seq+1;
+				}
+			}
+			if (!chunk.elems_.empty())
+				raw.push(std::move(chunk));
+		});
+		raw.close();
+
+		for(auto i=parsers.begin(), iend=parsers.end(); i!=iend; ++i)
+			i->join();
+		parsed.close();
+		writer_thread.join();
+
+		if (failure)
+			std::rethrow_exception(failure);
+	} catch(const std::exception &ex)
+	{
+		std::cerr << ex.what() << std::endl;
+		return 2;
+	}
+
+	return 0;
+}